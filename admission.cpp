@@ -0,0 +1,258 @@
+#include "admission.h"
+
+#include <cstdlib>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+
+using namespace utils;
+
+static bool parseNumber(const std::string& text, uint32_t maximum, uint32_t& value)
+{
+    if (text.empty() || text.size() > 3 || text.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+
+    value = static_cast<uint32_t>(strtoul(text.c_str(), nullptr, 10));
+    return value <= maximum;
+}
+
+AddressFilter::AddressFilter(const std::string& whitelist)
+{
+    size_t start = 0;
+    while (start <= whitelist.size())
+    {
+        auto end = whitelist.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = whitelist.size();
+        }
+
+        auto entry = whitelist.substr(start, end - start);
+        auto separator = entry.find('/');
+        auto address = entry.substr(0, separator);
+
+        Range range { 0, 0 };
+        bool wildcard = false;
+        bool valid = true;
+
+        size_t octetStart = 0;
+        for (int32_t i = 0; i < 4 && valid; ++i)
+        {
+            auto octetEnd = address.find('.', octetStart);
+            if ((i < 3) == (octetEnd == std::string::npos))
+            {
+                valid = false;
+                break;
+            }
+
+            auto octet = address.substr(octetStart, i < 3 ? octetEnd - octetStart : std::string::npos);
+            range.network <<= 8;
+            range.mask <<= 8;
+
+            uint32_t value;
+            if (octet == "*")
+            {
+                wildcard = true;
+            }
+            else if (parseNumber(octet, 255, value))
+            {
+                range.network |= value;
+                range.mask |= 0xFF;
+            }
+            else
+            {
+                valid = false;
+            }
+
+            octetStart = octetEnd + 1;
+        }
+
+        if (valid && separator != std::string::npos)
+        {
+            uint32_t prefix = 0;
+            valid = !wildcard && parseNumber(entry.substr(separator + 1), 32, prefix);
+            range.mask = prefix == 0 ? 0 : ~uint32_t(0) << (32 - prefix);
+        }
+
+        if (!valid)
+        {
+            throw std::logic_error(stringops::format("Invalid whitelist entry: %s", entry));
+        }
+
+        range.network &= range.mask;
+        m_Ranges.push_back(range);
+        start = end + 1;
+    }
+}
+
+bool AddressFilter::allows(uint32_t address) const
+{
+    if (m_Ranges.empty())
+    {
+        return true;
+    }
+
+    for (auto& range : m_Ranges)
+    {
+        if ((address & range.mask) == range.network)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+AdmissionSlot::AdmissionSlot()
+: m_Control(nullptr)
+{
+}
+
+AdmissionSlot::AdmissionSlot(AdmissionControl* control)
+: m_Control(control)
+{
+}
+
+AdmissionSlot::AdmissionSlot(AdmissionSlot&& other)
+: m_Control(other.m_Control)
+{
+    other.m_Control = nullptr;
+}
+
+AdmissionSlot::~AdmissionSlot()
+{
+    release();
+}
+
+AdmissionSlot& AdmissionSlot::operator=(AdmissionSlot&& other)
+{
+    if (this != &other)
+    {
+        release();
+        std::swap(m_Control, other.m_Control);
+    }
+
+    return *this;
+}
+
+AdmissionSlot::operator bool() const
+{
+    return m_Control != nullptr;
+}
+
+void AdmissionSlot::release()
+{
+    if (m_Control)
+    {
+        m_Control->release();
+        m_Control = nullptr;
+    }
+}
+
+AdmissionControl::AdmissionControl(const AdmissionSettings& settings)
+: m_Settings(settings)
+{
+}
+
+void AdmissionControl::waitForSlot()
+{
+    if (m_Settings.policy != AdmissionPolicy::Queue || m_Settings.maxClients == 0)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_Stats.active >= m_Settings.maxClients)
+    {
+        ++m_Stats.queued;
+        m_SlotReleased.wait(lock, [this] () { return m_Stats.active < m_Settings.maxClients; });
+    }
+}
+
+AdmissionSlot AdmissionControl::admit(uint32_t address)
+{
+    char text[INET_ADDRSTRLEN];
+    in_addr peer;
+    peer.s_addr = htonl(address);
+
+    if (!m_Settings.whitelist.allows(address))
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            ++m_Stats.rejectedAddress;
+        }
+
+        LOG_WARN("Refused connection from %s, the address is not whitelisted", inet_ntop(AF_INET, &peer, text, sizeof(text)));
+        return AdmissionSlot();
+    }
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_Settings.maxClients > 0 && m_Stats.active >= m_Settings.maxClients)
+    {
+        if (m_Settings.policy == AdmissionPolicy::Reject)
+        {
+            ++m_Stats.rejectedLimit;
+            lock.unlock();
+
+            LOG_WARN("Refused connection from %s, %d clients are connected", inet_ntop(AF_INET, &peer, text, sizeof(text)), m_Settings.maxClients);
+            return AdmissionSlot();
+        }
+
+        m_SlotReleased.wait(lock, [this] () { return m_Stats.active < m_Settings.maxClients; });
+    }
+
+    ++m_Stats.active;
+    return AdmissionSlot(this);
+}
+
+void AdmissionControl::addTimeout(bool idle)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ++(idle ? m_Stats.idleTimeouts : m_Stats.commandTimeouts);
+}
+
+AdmissionStats AdmissionControl::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Stats;
+}
+
+void AdmissionControl::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        --m_Stats.active;
+    }
+
+    m_SlotReleased.notify_all();
+}
+
+void enableKeepAlive(int32_t fd)
+{
+    int32_t enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+    // probe after a minute without traffic, give up after three unanswered probes
+    int32_t idle = 60;
+    int32_t interval = 10;
+    int32_t count = 3;
+#if defined(TCP_KEEPIDLE)
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#elif defined(TCP_KEEPALIVE)
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));
+#endif
+#ifdef TCP_KEEPINTVL
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPCNT
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
@@ -0,0 +1,124 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <condition_variable>
+
+class AdmissionControl;
+
+// Precompiled list of allowed IPv4 addresses, an empty list allows every address
+// Entries are separated by commas, an entry is an address where any octet can be * (192.168.1.*)
+// or a CIDR range (192.168.1.0/24)
+class AddressFilter
+{
+public:
+    AddressFilter() = default;
+
+    // Throws when an entry is invalid
+    explicit AddressFilter(const std::string& whitelist);
+
+    // The address is in host byte order
+    bool allows(uint32_t address) const;
+
+private:
+    struct Range
+    {
+        uint32_t    network;
+        uint32_t    mask;
+    };
+
+    std::vector<Range>  m_Ranges;
+};
+
+enum class AdmissionPolicy
+{
+    Reject,
+    Queue
+};
+
+struct AdmissionSettings
+{
+    AddressFilter       whitelist;
+    uint32_t            maxClients = 64;
+    AdmissionPolicy     policy = AdmissionPolicy::Reject;
+    uint32_t            idleTimeout = 0;
+    uint32_t            commandTimeout = 60;
+};
+
+struct AdmissionStats
+{
+    uint64_t    active = 0;
+    uint64_t    rejectedAddress = 0;
+    uint64_t    rejectedLimit = 0;
+    uint64_t    queued = 0;
+    uint64_t    idleTimeouts = 0;
+    uint64_t    commandTimeouts = 0;
+};
+
+// Connection slot of an admitted client, the slot is free again when it is destroyed
+class AdmissionSlot
+{
+public:
+    AdmissionSlot();
+    AdmissionSlot(AdmissionSlot&& other);
+    ~AdmissionSlot();
+
+    AdmissionSlot& operator=(AdmissionSlot&& other);
+
+    AdmissionSlot(const AdmissionSlot&) = delete;
+    AdmissionSlot& operator=(const AdmissionSlot&) = delete;
+
+    explicit operator bool() const;
+
+    void release();
+
+private:
+    friend class AdmissionControl;
+    explicit AdmissionSlot(AdmissionControl* control);
+
+    AdmissionControl*   m_Control;
+};
+
+// Decides which connections are served: peers that are not whitelisted are refused and at most
+// maxClients connections are served at the same time. When the limit is reached new
+// connections are refused, or with the queue policy they wait in the listen backlog until a
+// client disconnects.
+class AdmissionControl
+{
+public:
+    explicit AdmissionControl(const AdmissionSettings& settings);
+
+    AdmissionControl(const AdmissionControl&) = delete;
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    // Called before accepting, blocks while all slots are taken and the policy is queue
+    void waitForSlot();
+
+    // Called for an accepted connection before anything is allocated for it
+    // Returns an empty slot when the connection has to be closed
+    AdmissionSlot admit(uint32_t address);
+
+    void addTimeout(bool idle);
+
+    AdmissionStats getStats() const;
+
+private:
+    friend class AdmissionSlot;
+
+    void release();
+
+    AdmissionSettings           m_Settings;
+
+    mutable std::mutex          m_Mutex;
+    std::condition_variable     m_SlotReleased;
+    AdmissionStats              m_Stats;
+};
+
+// Detects peers that disappeared without closing the connection (consoles that were switched
+// off or lost their wifi connection)
+void enableKeepAlive(int32_t fd);
+
+#endif
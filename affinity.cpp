@@ -0,0 +1,63 @@
+#include "affinity.h"
+
+#include <thread>
+#include <algorithm>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sched.h>
+typedef cpu_set_t CpuSet;
+#elif defined(__FreeBSD__)
+#include <pthread_np.h>
+#include <sys/param.h>
+#include <sys/cpuset.h>
+typedef cpuset_t CpuSet;
+#endif
+
+std::vector<int32_t> getAvailableCpus()
+{
+    std::vector<int32_t> cpus;
+
+#if defined(__linux__) || defined(__FreeBSD__)
+    CpuSet set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+    {
+        for (int32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+
+    if (cpus.empty())
+    {
+        for (uint32_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+        {
+            cpus.push_back(static_cast<int32_t>(cpu));
+        }
+    }
+
+    return cpus;
+}
+
+bool pinThreadToCpu(int32_t cpu)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return false;
+    }
+
+    CpuSet set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
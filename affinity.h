@@ -0,0 +1,15 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <vector>
+#include <cinttypes>
+
+// Cpus the process is allowed to run on in ascending order, all cores when the platform can
+// not tell
+std::vector<int32_t> getAvailableCpus();
+
+// Pins the calling thread to the cpu, threads it creates afterwards inherit the affinity
+// Returns false when the platform does not support pinning or the cpu is not available
+bool pinThreadToCpu(int32_t cpu);
+
+#endif
@@ -0,0 +1,461 @@
+#include "asynclog.h"
+
+#include <mutex>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+#include <syslog.h>
+
+#include "utils/stringops.h"
+
+using namespace utils;
+using namespace std::chrono;
+
+namespace asynclog
+{
+
+const uint32_t RateLimiter::s_Burst = 10;
+const int64_t RateLimiter::s_WindowMilliseconds = 1000;
+const size_t Message::MaxSize;
+
+namespace
+{
+
+struct RecordHeader
+{
+    int64_t     time;
+    uint32_t    size;
+    Level       level;
+};
+
+// Written by the owning thread, read by the log thread
+struct RingBuffer
+{
+    static const size_t Capacity = 64 * 1024;
+
+    RingBuffer()
+    : head(0)
+    , tail(0)
+    , dropped(0)
+    , closed(false)
+    {
+    }
+
+    void write(uint64_t position, const void* source, size_t size)
+    {
+        auto offset = static_cast<size_t>(position % Capacity);
+        auto first = std::min(size, Capacity - offset);
+        memcpy(&data[offset], source, first);
+        memcpy(&data[0], static_cast<const char*>(source) + first, size - first);
+    }
+
+    void read(uint64_t position, void* destination, size_t size) const
+    {
+        auto offset = static_cast<size_t>(position % Capacity);
+        auto first = std::min(size, Capacity - offset);
+        memcpy(destination, &data[offset], first);
+        memcpy(static_cast<char*>(destination) + first, &data[0], size - first);
+    }
+
+    std::array<char, Capacity>  data;
+    std::atomic<uint64_t>       head;
+    std::atomic<uint64_t>       tail;
+    std::atomic<uint64_t>       dropped;
+    std::atomic<bool>           closed;
+};
+
+struct Record
+{
+    int64_t         time;
+    Level           level;
+    std::string     text;
+};
+
+// The ring buffer is released by the log thread once it is drained
+struct ThreadBuffer
+{
+    ~ThreadBuffer()
+    {
+        if (buffer)
+        {
+            buffer->closed = true;
+        }
+    }
+
+    std::shared_ptr<RingBuffer> buffer;
+};
+
+thread_local ThreadBuffer t_Buffer;
+thread_local char t_Message[Message::MaxSize];
+
+int64_t currentTime()
+{
+    return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+const char* levelName(Level level)
+{
+    switch (level)
+    {
+    case Level::Debug:      return "DEBUG";
+    case Level::Info:       return "INFO";
+    case Level::Warning:    return "WARN";
+    case Level::Error:      return "ERROR";
+    case Level::Critical:   return "CRITICAL";
+    }
+
+    return "";
+}
+
+int syslogPriority(Level level)
+{
+    switch (level)
+    {
+    case Level::Debug:      return LOG_DEBUG;
+    case Level::Info:       return LOG_INFO;
+    case Level::Warning:    return LOG_WARNING;
+    case Level::Error:      return LOG_ERR;
+    case Level::Critical:   return LOG_CRIT;
+    }
+
+    return LOG_INFO;
+}
+
+class Logger
+{
+public:
+    Logger()
+    : m_Running(false)
+    , m_File(stdout)
+    , m_Syslog(false)
+    , m_Stop(false)
+    {
+    }
+
+    bool isRunning() const
+    {
+        return m_Running.load(std::memory_order_acquire);
+    }
+
+    void start(const std::string& target)
+    {
+        if (target == "syslog")
+        {
+            openlog("ps3netsrv++", LOG_PID, LOG_DAEMON);
+            m_Syslog = true;
+        }
+        else if (!target.empty())
+        {
+            m_File = fopen(target.c_str(), "a");
+            if (!m_File)
+            {
+                m_File = stdout;
+                throw std::runtime_error(stringops::format("Failed to open log file %s: %s", target, strerror(errno)));
+            }
+        }
+
+        m_Stop = false;
+        m_Thread = std::thread(&Logger::run, this);
+        m_Running = true;
+    }
+
+    void stop()
+    {
+        if (!m_Thread.joinable())
+        {
+            return;
+        }
+
+        // messages logged from now on are written directly
+        m_Running = false;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stop = true;
+        }
+
+        m_Condition.notify_one();
+        m_Thread.join();
+
+        std::lock_guard<std::mutex> lock(m_WriteMutex);
+        drain();
+
+        if (m_Syslog)
+        {
+            closelog();
+            m_Syslog = false;
+        }
+        else if (m_File != stdout)
+        {
+            fclose(m_File);
+            m_File = stdout;
+        }
+    }
+
+    void sync()
+    {
+        std::lock_guard<std::mutex> lock(m_WriteMutex);
+        drain();
+    }
+
+    void addBuffer(std::shared_ptr<RingBuffer> buffer)
+    {
+        std::lock_guard<std::mutex> lock(m_BuffersMutex);
+        m_Buffers.push_back(std::move(buffer));
+    }
+
+    void writeDirect(Level level, int64_t time, const char* text, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_WriteMutex);
+        output(level, time, text, size);
+        fflush(m_File);
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (!m_Stop)
+        {
+            m_Condition.wait_for(lock, milliseconds(20), [this] () { return m_Stop; });
+
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> writeLock(m_WriteMutex);
+                drain();
+            }
+            lock.lock();
+        }
+    }
+
+    // Collects the records of all threads and writes them in the order they were logged
+    void drain()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_BuffersMutex);
+            m_Draining = m_Buffers;
+        }
+
+        uint64_t dropped = 0;
+        for (auto& buffer : m_Draining)
+        {
+            auto head = buffer->head.load(std::memory_order_acquire);
+            auto tail = buffer->tail.load(std::memory_order_relaxed);
+            while (tail < head)
+            {
+                RecordHeader header;
+                buffer->read(tail, &header, sizeof(header));
+
+                Record record;
+                record.time = header.time;
+                record.level = header.level;
+                record.text.resize(header.size);
+                buffer->read(tail + sizeof(header), &record.text[0], header.size);
+                m_Records.push_back(std::move(record));
+
+                tail += sizeof(header) + header.size;
+            }
+
+            buffer->tail.store(tail, std::memory_order_release);
+            dropped += buffer->dropped.exchange(0);
+        }
+
+        std::stable_sort(m_Records.begin(), m_Records.end(), [] (const Record& lhs, const Record& rhs) {
+            return lhs.time < rhs.time;
+        });
+
+        for (auto& record : m_Records)
+        {
+            output(record.level, record.time, record.text.data(), record.text.size());
+        }
+
+        if (dropped > 0)
+        {
+            auto text = stringops::format("%d log messages dropped, the log buffer was full", dropped);
+            output(Level::Warning, currentTime(), text.data(), text.size());
+        }
+
+        if (!m_Records.empty() || dropped > 0)
+        {
+            fflush(m_File);
+        }
+
+        m_Records.clear();
+        m_Draining.clear();
+
+        std::lock_guard<std::mutex> lock(m_BuffersMutex);
+        m_Buffers.erase(std::remove_if(m_Buffers.begin(), m_Buffers.end(), [] (const std::shared_ptr<RingBuffer>& buffer) {
+            return buffer->closed && buffer->head == buffer->tail;
+        }), m_Buffers.end());
+    }
+
+    void output(Level level, int64_t time, const char* text, size_t size)
+    {
+        if (m_Syslog)
+        {
+            syslog(syslogPriority(level), "%.*s", static_cast<int>(size), text);
+            return;
+        }
+
+        auto seconds = static_cast<time_t>(time / 1000000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+
+        char timestamp[32];
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+        fprintf(m_File, "%s.%03d %s: %.*s\n", timestamp, static_cast<int>(time / 1000 % 1000), levelName(level), static_cast<int>(size), text);
+    }
+
+    std::atomic<bool>                           m_Running;
+
+    std::mutex                                  m_BuffersMutex;
+    std::vector<std::shared_ptr<RingBuffer>>    m_Buffers;
+
+    std::mutex                                  m_WriteMutex;
+    std::vector<std::shared_ptr<RingBuffer>>    m_Draining;
+    std::vector<Record>                         m_Records;
+    FILE*                                       m_File;
+    bool                                        m_Syslog;
+
+    std::mutex                                  m_Mutex;
+    std::condition_variable                     m_Condition;
+    bool                                        m_Stop;
+    std::thread                                 m_Thread;
+};
+
+// Never destroyed, threads can still log while the process exits
+Logger& getLogger()
+{
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+}
+
+bool RateLimiter::allow(uint32_t& suppressed)
+{
+    auto now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    auto windowStart = m_WindowStart.load(std::memory_order_relaxed);
+    if (now - windowStart >= s_WindowMilliseconds && m_WindowStart.compare_exchange_strong(windowStart, now))
+    {
+        m_Count = 0;
+    }
+
+    if (m_Count++ >= s_Burst)
+    {
+        ++m_Suppressed;
+        return false;
+    }
+
+    suppressed = m_Suppressed.exchange(0);
+    return true;
+}
+
+Message::Message()
+: m_Data(t_Message)
+, m_Size(0)
+{
+}
+
+void Message::append(const char* data, size_t size)
+{
+    size = std::min(size, MaxSize - m_Size);
+    memcpy(m_Data + m_Size, data, size);
+    m_Size += size;
+}
+
+void Message::append(int64_t value)
+{
+    char text[24];
+    append(text, snprintf(text, sizeof(text), "%" PRId64, value));
+}
+
+void Message::append(uint64_t value)
+{
+    char text[24];
+    append(text, snprintf(text, sizeof(text), "%" PRIu64, value));
+}
+
+void Message::append(double value)
+{
+    char text[32];
+    auto size = snprintf(text, sizeof(text), "%g", value);
+    append(text, std::min<size_t>(size, sizeof(text) - 1));
+}
+
+void appendFormat(Message& message, const char* format)
+{
+    for (; *format != '\0'; ++format)
+    {
+        if (*format == '%' && format[1] == '%')
+        {
+            ++format;
+        }
+
+        message.append(*format);
+    }
+}
+
+void submit(Level level, const Message& message)
+{
+    auto time = currentTime();
+
+    auto& logger = getLogger();
+    if (!logger.isRunning())
+    {
+        logger.writeDirect(level, time, message.data(), message.size());
+        return;
+    }
+
+    auto& buffer = t_Buffer.buffer;
+    if (!buffer)
+    {
+        buffer = std::make_shared<RingBuffer>();
+        logger.addBuffer(buffer);
+    }
+
+    RecordHeader header;
+    header.time = time;
+    header.size = static_cast<uint32_t>(message.size());
+    header.level = level;
+
+    auto size = sizeof(header) + message.size();
+    auto head = buffer->head.load(std::memory_order_relaxed);
+    if (RingBuffer::Capacity - (head - buffer->tail.load(std::memory_order_acquire)) < size)
+    {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    buffer->write(head, &header, sizeof(header));
+    buffer->write(head + sizeof(header), message.data(), message.size());
+    buffer->head.store(head + size, std::memory_order_release);
+}
+
+void start(const std::string& target)
+{
+    getLogger().start(target);
+}
+
+void stop()
+{
+    getLogger().stop();
+}
+
+void sync()
+{
+    if (getLogger().isRunning())
+    {
+        getLogger().sync();
+    }
+}
+
+}
@@ -0,0 +1,242 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cinttypes>
+#include <type_traits>
+
+// Messages below the minimum level are removed at compile time, their arguments are compiled
+// but never evaluated. Release builds (NDEBUG) leave out the debug messages.
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARNING   2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_CRITICAL  4
+
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Logging from the server threads never blocks: the message is formatted on the calling thread
+// into a fixed buffer and copied into a ring buffer owned by that thread, a background thread
+// drains the ring buffers to the console, a file or syslog. Messages that do not fit in a full
+// ring buffer are dropped and counted.
+namespace asynclog
+{
+
+enum class Level : uint8_t
+{
+    Debug = LOG_LEVEL_DEBUG,
+    Info = LOG_LEVEL_INFO,
+    Warning = LOG_LEVEL_WARNING,
+    Error = LOG_LEVEL_ERROR,
+    Critical = LOG_LEVEL_CRITICAL
+};
+
+// Every warning and error call site has its own limiter, a call site logs a burst of
+// messages per second, the rest is counted and reported with the next message that is logged
+class RateLimiter
+{
+public:
+    constexpr RateLimiter()
+    : m_WindowStart(0)
+    , m_Count(0)
+    , m_Suppressed(0)
+    {
+    }
+
+    bool allow(uint32_t& suppressed);
+
+private:
+    static const uint32_t s_Burst;
+    static const int64_t s_WindowMilliseconds;
+
+    std::atomic<int64_t>    m_WindowStart;
+    std::atomic<uint32_t>   m_Count;
+    std::atomic<uint32_t>   m_Suppressed;
+};
+
+// Fixed size message that is truncated when it gets too long, formatting does not allocate
+class Message
+{
+public:
+    static const size_t MaxSize = 2048;
+
+    Message();
+
+    void append(char c)
+    {
+        if (m_Size < MaxSize)
+        {
+            m_Data[m_Size++] = c;
+        }
+    }
+
+    void append(const char* data, size_t size);
+    void append(const char* text) { append(text, strlen(text)); }
+    void append(const std::string& text) { append(text.data(), text.size()); }
+    void append(int64_t value);
+    void append(uint64_t value);
+    void append(double value);
+
+    const char* data() const { return m_Data; }
+    size_t size() const { return m_Size; }
+
+private:
+    char*   m_Data;
+    size_t  m_Size;
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type appendValue(Message& message, T value)
+{
+    message.append(static_cast<int64_t>(value));
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type appendValue(Message& message, T value)
+{
+    message.append(static_cast<uint64_t>(value));
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type appendValue(Message& message, T value)
+{
+    message.append(static_cast<double>(value));
+}
+
+template <typename T>
+typename std::enable_if<std::is_enum<T>::value>::type appendValue(Message& message, T value)
+{
+    appendValue(message, static_cast<typename std::underlying_type<T>::type>(value));
+}
+
+inline void appendValue(Message& message, const char* value) { message.append(value ? value : "(null)"); }
+inline void appendValue(Message& message, const std::string& value) { message.append(value); }
+
+// Printf style format strings, every conversion (%d, %s, ...) prints the next argument
+// according to its type, the flags and width of the conversion are ignored
+void appendFormat(Message& message, const char* format);
+
+template <typename T, typename... Args>
+void appendFormat(Message& message, const char* format, const T& value, const Args&... args)
+{
+    for (; *format != '\0'; ++format)
+    {
+        if (*format != '%')
+        {
+            message.append(*format);
+            continue;
+        }
+
+        if (format[1] == '%')
+        {
+            message.append('%');
+            ++format;
+            continue;
+        }
+
+        ++format;
+        while (*format != '\0' && strchr("-+ #0123456789.hljztL", *format))
+        {
+            ++format;
+        }
+
+        appendValue(message, value);
+        appendFormat(message, *format == '\0' ? format : format + 1, args...);
+        return;
+    }
+}
+
+void submit(Level level, const Message& message);
+
+// Messages without arguments are logged as is
+inline void write(Level level, const char* text)
+{
+    Message message;
+    message.append(text);
+    submit(level, message);
+}
+
+template <typename... Args>
+void write(Level level, const char* format, const Args&... args)
+{
+    Message message;
+    appendFormat(message, format, args...);
+    submit(level, message);
+}
+
+template <typename... Args>
+void write(Level level, RateLimiter& limiter, const char* format, const Args&... args)
+{
+    uint32_t suppressed;
+    if (!limiter.allow(suppressed))
+    {
+        return;
+    }
+
+    Message message;
+    if (sizeof...(Args) == 0)
+    {
+        message.append(format);
+    }
+    else
+    {
+        appendFormat(message, format, args...);
+    }
+
+    if (suppressed > 0)
+    {
+        appendFormat(message, " (%d similar messages suppressed)", suppressed);
+    }
+
+    submit(level, message);
+}
+
+// Starts the background thread, messages logged before are written directly
+// The target is a file path, "syslog", or empty for the console
+// Throws when the log file can not be opened
+void start(const std::string& target);
+
+// Writes the pending messages and stops the background thread
+void stop();
+
+// Waits until the pending messages are written, for threads that log a lot at once and do
+// not serve clients
+void sync();
+
+}
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) asynclog::write(asynclog::Level::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { if (false) asynclog::write(asynclog::Level::Debug, __VA_ARGS__); } while (false)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) asynclog::write(asynclog::Level::Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { if (false) asynclog::write(asynclog::Level::Info, __VA_ARGS__); } while (false)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARNING
+#define LOG_WARN(...) do { static asynclog::RateLimiter logLimiter; asynclog::write(asynclog::Level::Warning, logLimiter, __VA_ARGS__); } while (false)
+#else
+#define LOG_WARN(...) do { if (false) asynclog::write(asynclog::Level::Warning, __VA_ARGS__); } while (false)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) do { static asynclog::RateLimiter logLimiter; asynclog::write(asynclog::Level::Error, logLimiter, __VA_ARGS__); } while (false)
+#else
+#define LOG_ERROR(...) do { if (false) asynclog::write(asynclog::Level::Error, __VA_ARGS__); } while (false)
+#endif
+
+#define LOG_CRITICAL(...) asynclog::write(asynclog::Level::Critical, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,238 @@
+#include "blockcache.h"
+
+#include <algorithm>
+
+#include "compat.h"
+#include "filecache.h"
+#include "storage.h"
+
+constexpr size_t BlockCache::BlockSize;
+constexpr size_t BlockCache::ShardCount;
+constexpr uint32_t BlockCache::PrefetchThreads;
+
+// The FIFO queue gets a quarter of the memory, keys are remembered for half as many
+// blocks as the cache holds (the proportions of the 2Q paper)
+BlockCache::BlockCache(StorageBackend& storage, size_t memoryLimit)
+: m_Storage(storage)
+, m_ShardLimit(std::max(memoryLimit / ShardCount, BlockSize))
+, m_RecentLimit(std::max(m_ShardLimit / 4, BlockSize))
+, m_GhostLimit(std::max<size_t>(m_ShardLimit / BlockSize / 2, 1))
+, m_NextReader(1)
+, m_Prefetcher(PrefetchThreads)
+{
+    for (size_t i = 0; i < ShardCount; ++i)
+    {
+        m_Shards.push_back(std::make_unique<Shard>());
+    }
+}
+
+BlockKey BlockCache::getKey(const OpenFile& file, uint64_t block)
+{
+    BlockKey key;
+    key.device      = file.getDevice();
+    key.inode       = file.getInode();
+    key.size        = file.getSize();
+    key.modifyTime  = file.getModifyTime();
+    key.block       = block;
+    return key;
+}
+
+uint64_t BlockCache::addReader()
+{
+    return m_NextReader++;
+}
+
+CachedBlock BlockCache::read(uint64_t reader, const OpenFile& file, uint64_t block)
+{
+    auto key = getKey(file, block);
+    auto& shard = getShard(key);
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto data = find(shard, reader, key, true);
+        if (data)
+        {
+            return data;
+        }
+    }
+
+    return load(shard, reader, file, key);
+}
+
+void BlockCache::prefetch(uint64_t reader, std::shared_ptr<OpenFile> file, uint64_t block)
+{
+    if (block * BlockSize >= file->getSize())
+    {
+        return;
+    }
+
+    m_Prefetcher.post([this, reader, file, block] () {
+        auto key = getKey(*file, block);
+        auto& shard = getShard(key);
+
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (find(shard, reader, key, false))
+            {
+                return;
+            }
+
+            ++shard.stats.prefetches;
+        }
+
+        load(shard, reader, *file, key);
+    });
+}
+
+BlockCacheStats BlockCache::getStats() const
+{
+    BlockCacheStats stats;
+    for (auto& shard : m_Shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        stats.hits          += shard->stats.hits;
+        stats.misses        += shard->stats.misses;
+        stats.promotions    += shard->stats.promotions;
+        stats.evictions     += shard->stats.evictions;
+        stats.prefetches    += shard->stats.prefetches;
+        stats.recentBytes   += shard->recentBytes;
+        stats.frequentBytes += shard->frequentBytes;
+    }
+
+    return stats;
+}
+
+BlockCache::Shard& BlockCache::getShard(const BlockKey& key)
+{
+    // consecutive blocks of a file end up in different shards
+    return *m_Shards[BlockKeyHash()(key) % ShardCount];
+}
+
+CachedBlock BlockCache::find(Shard& shard, uint64_t reader, const BlockKey& key, bool count)
+{
+    auto iter = shard.entries.find(key);
+    if (iter == shard.entries.end() || iter->second.queue == Queue::Ghost)
+    {
+        if (count)
+        {
+            ++shard.stats.misses;
+        }
+
+        return nullptr;
+    }
+
+    // a stream reading a block in small pieces is not a second use of the block
+    auto& entry = iter->second;
+    if (entry.queue == Queue::Frequent)
+    {
+        shard.frequent.splice(shard.frequent.begin(), shard.frequent, entry.position);
+    }
+    else if (entry.reader != reader)
+    {
+        shard.recent.erase(entry.position);
+        shard.recentBytes -= entry.data->size();
+        promote(shard, key, entry);
+    }
+
+    if (count)
+    {
+        ++shard.stats.hits;
+    }
+
+    return entry.data;
+}
+
+// The block is read without holding the lock, clients that miss the same block at the same
+// time read it both and the first one to finish inserts it
+CachedBlock BlockCache::load(Shard& shard, uint64_t reader, const OpenFile& file, const BlockKey& key)
+{
+    auto offset = key.block * BlockSize;
+    auto size = offset < file.getSize() ? static_cast<size_t>(std::min<uint64_t>(BlockSize, file.getSize() - offset)) : 0;
+
+    auto data = std::make_shared<std::vector<uint8_t>>(size);
+    auto bytesRead = m_Storage.read(file.getFd(), offset, data->data(), size);
+    if (bytesRead != size)
+    {
+        // failed reads are not cached
+        data->resize(bytesRead);
+        return data;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return insert(shard, reader, key, data);
+}
+
+CachedBlock BlockCache::insert(Shard& shard, uint64_t reader, const BlockKey& key, CachedBlock data)
+{
+    auto iter = shard.entries.find(key);
+    if (iter == shard.entries.end())
+    {
+        shard.recent.push_front(key);
+        shard.recentBytes += data->size();
+
+        Entry entry { data, Queue::Recent, reader, shard.recent.begin() };
+        shard.entries.emplace(key, entry);
+    }
+    else if (iter->second.queue == Queue::Ghost)
+    {
+        // used again after it left the FIFO queue
+        auto& entry = iter->second;
+        shard.ghosts.erase(entry.position);
+        entry.data = data;
+        promote(shard, key, entry);
+    }
+    else
+    {
+        return iter->second.data;
+    }
+
+    evict(shard);
+    return data;
+}
+
+// Moves an entry that was removed from its queue to the front of the frequent queue
+void BlockCache::promote(Shard& shard, const BlockKey& key, Entry& entry)
+{
+    shard.frequent.push_front(key);
+    shard.frequentBytes += entry.data->size();
+    ++shard.stats.promotions;
+
+    entry.queue = Queue::Frequent;
+    entry.position = shard.frequent.begin();
+}
+
+void BlockCache::evict(Shard& shard)
+{
+    while (shard.recentBytes + shard.frequentBytes > m_ShardLimit)
+    {
+        if (!shard.recent.empty() && (shard.recentBytes > m_RecentLimit || shard.frequent.empty()))
+        {
+            auto key = shard.recent.back();
+            shard.recent.pop_back();
+
+            auto& entry = shard.entries[key];
+            shard.recentBytes -= entry.data->size();
+            entry.data.reset();
+            entry.queue = Queue::Ghost;
+            shard.ghosts.push_front(key);
+            entry.position = shard.ghosts.begin();
+        }
+        else
+        {
+            auto key = shard.frequent.back();
+            shard.frequent.pop_back();
+
+            auto iter = shard.entries.find(key);
+            shard.frequentBytes -= iter->second.data->size();
+            shard.entries.erase(iter);
+        }
+
+        ++shard.stats.evictions;
+    }
+
+    while (shard.ghosts.size() > m_GhostLimit)
+    {
+        shard.entries.erase(shard.ghosts.back());
+        shard.ghosts.pop_back();
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cinttypes>
+#include <unordered_map>
+
+#include "threadpool.h"
+
+class OpenFile;
+class StorageBackend;
+
+// Identifies a block of a file version, a file that changes gets new keys
+struct BlockKey
+{
+    uint64_t    device;
+    uint64_t    inode;
+    uint64_t    size;
+    uint64_t    modifyTime;
+    uint64_t    block;
+
+    bool operator==(const BlockKey& other) const
+    {
+        return block == other.block && inode == other.inode && device == other.device && size == other.size && modifyTime == other.modifyTime;
+    }
+};
+
+struct BlockKeyHash
+{
+    size_t operator()(const BlockKey& key) const
+    {
+        uint64_t hash = key.inode * 0x9E3779B97F4A7C15ULL;
+        hash ^= key.block + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+        hash ^= key.device + key.modifyTime + (hash << 6) + (hash >> 2);
+        return static_cast<size_t>(hash);
+    }
+};
+
+typedef std::shared_ptr<const std::vector<uint8_t>> CachedBlock;
+
+struct BlockCacheStats
+{
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+    uint64_t    promotions = 0;
+    uint64_t    evictions = 0;
+    uint64_t    prefetches = 0;
+    uint64_t    recentBytes = 0;
+    uint64_t    frequentBytes = 0;
+};
+
+// Server wide cache of file blocks shared by all clients
+// Every shard is a 2Q cache: blocks read for the first time enter a small FIFO queue and are
+// forgotten when they leave it, only their keys are remembered for a while. A block that is
+// read again after its key was remembered, or that is read by another client while it is in
+// the FIFO queue, is hot and moves to the LRU queue that holds the largest part of the memory.
+// Streams that read everything once only cycle through the FIFO queue, so they can not evict
+// the data every console reads when booting a game.
+class BlockCache
+{
+public:
+    static constexpr size_t BlockSize = 256 * 1024;
+
+    BlockCache(StorageBackend& storage, size_t memoryLimit);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    static BlockKey getKey(const OpenFile& file, uint64_t block);
+
+    // Every client reads with its own reader id, repeated reads of one reader are not reuse
+    uint64_t addReader();
+
+    // Returns the block, it is read from storage when it is not cached
+    // The block is shorter than BlockSize at the end of the file, or when the read failed
+    CachedBlock read(uint64_t reader, const OpenFile& file, uint64_t block);
+
+    // Loads the block in the background unless it is cached already
+    void prefetch(uint64_t reader, std::shared_ptr<OpenFile> file, uint64_t block);
+
+    BlockCacheStats getStats() const;
+
+private:
+    enum class Queue
+    {
+        Recent,
+        Frequent,
+        Ghost
+    };
+
+    struct Entry
+    {
+        CachedBlock                     data;
+        Queue                           queue;
+        uint64_t                        reader;
+        std::list<BlockKey>::iterator   position;
+    };
+
+    struct Shard
+    {
+        std::mutex                                              mutex;
+        std::unordered_map<BlockKey, Entry, BlockKeyHash>       entries;
+        std::list<BlockKey>                                     recent;
+        std::list<BlockKey>                                     frequent;
+        std::list<BlockKey>                                     ghosts;
+        size_t                                                  recentBytes = 0;
+        size_t                                                  frequentBytes = 0;
+        BlockCacheStats                                         stats;
+    };
+
+    Shard& getShard(const BlockKey& key);
+    CachedBlock find(Shard& shard, uint64_t reader, const BlockKey& key, bool count);
+    CachedBlock load(Shard& shard, uint64_t reader, const OpenFile& file, const BlockKey& key);
+    CachedBlock insert(Shard& shard, uint64_t reader, const BlockKey& key, CachedBlock data);
+    void promote(Shard& shard, const BlockKey& key, Entry& entry);
+    void evict(Shard& shard);
+
+    static constexpr size_t ShardCount = 16;
+    static constexpr uint32_t PrefetchThreads = 2;
+
+    StorageBackend&                         m_Storage;
+    size_t                                  m_ShardLimit;
+    size_t                                  m_RecentLimit;
+    size_t                                  m_GhostLimit;
+    std::vector<std::unique_ptr<Shard>>     m_Shards;
+    std::atomic<uint64_t>                   m_NextReader;
+
+    // destroyed first, pending prefetches use the shards
+    ThreadPool                              m_Prefetcher;
+};
+
+#endif
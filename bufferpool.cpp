@@ -0,0 +1,260 @@
+#include "bufferpool.h"
+
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+
+using namespace utils;
+
+constexpr size_t BufferPool::MaxBufferSize;
+const std::array<size_t, BufferPool::SizeClassCount> BufferPool::s_SizeClasses = {{ 64 * 1024, 256 * 1024, 1024 * 1024, MaxBufferSize }};
+
+PooledBuffer::PooledBuffer()
+: m_Pool(nullptr)
+, m_Data(nullptr)
+, m_Size(0)
+{
+}
+
+PooledBuffer::PooledBuffer(BufferPool* pool, uint8_t* data, size_t size)
+: m_Pool(pool)
+, m_Data(data)
+, m_Size(size)
+{
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other)
+: m_Pool(other.m_Pool)
+, m_Data(other.m_Data)
+, m_Size(other.m_Size)
+{
+    other.m_Pool = nullptr;
+    other.m_Data = nullptr;
+    other.m_Size = 0;
+}
+
+PooledBuffer::~PooledBuffer()
+{
+    release();
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other)
+{
+    if (this != &other)
+    {
+        release();
+        std::swap(m_Pool, other.m_Pool);
+        std::swap(m_Data, other.m_Data);
+        std::swap(m_Size, other.m_Size);
+    }
+
+    return *this;
+}
+
+uint8_t* PooledBuffer::data() const
+{
+    return m_Data;
+}
+
+size_t PooledBuffer::size() const
+{
+    return m_Size;
+}
+
+bool PooledBuffer::isValid() const
+{
+    return m_Data != nullptr;
+}
+
+void PooledBuffer::release()
+{
+    if (m_Pool)
+    {
+        m_Pool->release(m_Data, m_Size);
+        m_Pool = nullptr;
+        m_Data = nullptr;
+        m_Size = 0;
+    }
+}
+
+BufferPool::BufferPool(size_t memoryLimit)
+{
+    if (memoryLimit < MaxBufferSize)
+    {
+        throw std::logic_error(stringops::format("Buffer pool memory limit must be at least %d bytes", MaxBufferSize));
+    }
+
+    m_Stats.memoryLimit = memoryLimit;
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto& buffers : m_FreeBuffers)
+    {
+        for (auto* buffer : buffers)
+        {
+            free(buffer);
+        }
+    }
+}
+
+PooledBuffer BufferPool::acquire(size_t size)
+{
+    return acquire(size, true);
+}
+
+PooledBuffer BufferPool::tryAcquire(size_t size)
+{
+    return acquire(size, false);
+}
+
+PooledBuffer BufferPool::acquire(size_t size, bool wait)
+{
+    if (size > MaxBufferSize)
+    {
+        throw std::logic_error(stringops::format("Requested buffer size is too large: %d", size));
+    }
+
+    auto sizeClass = getSizeClass(size);
+    auto bufferSize = s_SizeClasses[sizeClass];
+    uint8_t* buffer = nullptr;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    ++m_Stats.acquisitions;
+
+    while (!buffer)
+    {
+        auto& freeBuffers = m_FreeBuffers[sizeClass];
+        if (!freeBuffers.empty())
+        {
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            ++m_Stats.reuses;
+            break;
+        }
+
+        if (m_Stats.bytesAllocated + bufferSize > m_Stats.memoryLimit)
+        {
+            freeUnusedBuffers(m_Stats.bytesAllocated + bufferSize - m_Stats.memoryLimit);
+        }
+
+        if (m_Stats.bytesAllocated + bufferSize <= m_Stats.memoryLimit)
+        {
+            void* memory = nullptr;
+            if (posix_memalign(&memory, sysconf(_SC_PAGESIZE), bufferSize) != 0)
+            {
+                throw std::bad_alloc();
+            }
+
+            buffer = reinterpret_cast<uint8_t*>(memory);
+            m_Stats.bytesAllocated += bufferSize;
+            ++m_Stats.allocations;
+            break;
+        }
+
+        if (!wait)
+        {
+            return PooledBuffer();
+        }
+
+        ++m_Stats.waits;
+        m_BufferReleased.wait(lock);
+    }
+
+    m_Stats.bytesInUse += bufferSize;
+    m_Stats.highWaterMark = std::max(m_Stats.highWaterMark, m_Stats.bytesInUse);
+
+    return PooledBuffer(this, buffer, bufferSize);
+}
+
+void BufferPool::release(uint8_t* data, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_FreeBuffers[getSizeClass(size)].push_back(data);
+        m_Stats.bytesInUse -= size;
+    }
+
+    m_BufferReleased.notify_all();
+}
+
+bool BufferPool::tryReserve(size_t bytes, size_t held)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto bytesNeeded = m_Stats.bytesAllocated + m_Stats.bytesReserved + bytes;
+    if (bytesNeeded > m_Stats.memoryLimit)
+    {
+        freeUnusedBuffers(bytesNeeded - m_Stats.memoryLimit);
+    }
+
+    // a reservation larger than the limit would never succeed otherwise
+    bool idle = m_Stats.bytesInUse == 0 && m_Stats.bytesReserved == held;
+    if (m_Stats.bytesAllocated + m_Stats.bytesReserved + bytes > m_Stats.memoryLimit && !idle)
+    {
+        return false;
+    }
+
+    m_Stats.bytesReserved += bytes;
+    return true;
+}
+
+void BufferPool::reserve(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stats.bytesReserved += bytes;
+}
+
+void BufferPool::unreserve(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stats.bytesReserved -= bytes;
+}
+
+size_t BufferPool::getSizeClass(size_t size) const
+{
+    for (size_t i = 0; i < SizeClassCount; ++i)
+    {
+        if (size <= s_SizeClasses[i])
+        {
+            return i;
+        }
+    }
+
+    return SizeClassCount - 1;
+}
+
+void BufferPool::freeUnusedBuffers(size_t bytesNeeded)
+{
+    size_t bytesFreed = 0;
+    for (size_t i = 0; i < SizeClassCount && bytesFreed < bytesNeeded; ++i)
+    {
+        auto& buffers = m_FreeBuffers[i];
+        while (!buffers.empty() && bytesFreed < bytesNeeded)
+        {
+            free(buffers.back());
+            buffers.pop_back();
+            bytesFreed += s_SizeClasses[i];
+        }
+    }
+
+    m_Stats.bytesAllocated -= bytesFreed;
+}
+
+BufferPoolStats BufferPool::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Stats;
+}
+
+void BufferPool::logStats() const
+{
+    auto stats = getStats();
+    LOG_DEBUG("Buffer pool: %d KB in use, %d KB allocated, %d KB reserved, high water mark %d KB, limit %d KB (acquisitions %d, allocations %d, reuses %d, waits %d)",
+        stats.bytesInUse / 1024, stats.bytesAllocated / 1024, stats.bytesReserved / 1024, stats.highWaterMark / 1024, stats.memoryLimit / 1024,
+        stats.acquisitions, stats.allocations, stats.reuses, stats.waits);
+}
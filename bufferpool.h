@@ -0,0 +1,102 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <array>
+#include <mutex>
+#include <vector>
+#include <cinttypes>
+#include <condition_variable>
+
+class BufferPool;
+
+// Buffer borrowed from a BufferPool, it is returned to the pool on destruction
+class PooledBuffer
+{
+public:
+    PooledBuffer();
+    PooledBuffer(PooledBuffer&& other);
+    ~PooledBuffer();
+
+    PooledBuffer& operator=(PooledBuffer&& other);
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    uint8_t* data() const;
+    size_t size() const;
+    bool isValid() const;
+
+    void release();
+
+private:
+    friend class BufferPool;
+    PooledBuffer(BufferPool* pool, uint8_t* data, size_t size);
+
+    BufferPool*     m_Pool;
+    uint8_t*        m_Data;
+    size_t          m_Size;
+};
+
+struct BufferPoolStats
+{
+    uint64_t    acquisitions = 0;
+    uint64_t    allocations = 0;
+    uint64_t    reuses = 0;
+    uint64_t    waits = 0;
+    uint64_t    bytesInUse = 0;
+    uint64_t    bytesAllocated = 0;
+    uint64_t    bytesReserved = 0;
+    uint64_t    highWaterMark = 0;
+    uint64_t    memoryLimit = 0;
+};
+
+// Server wide pool of page aligned io buffers in a few size classes
+// The total amount of allocated memory is bounded, requests block until
+// other clients return their buffers when the limit is reached
+class BufferPool
+{
+public:
+    static constexpr size_t MaxBufferSize = 4 * 1024 * 1024;
+
+    explicit BufferPool(size_t memoryLimit);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns a buffer of at least size bytes (size can not exceed MaxBufferSize)
+    PooledBuffer acquire(size_t size);
+
+    // Returns an invalid buffer instead of blocking when the memory limit is reached
+    PooledBuffer tryAcquire(size_t size);
+
+    // Counts memory the caller allocated itself against the limit. tryReserve fails when the
+    // buffers and reservations reach the limit, unless nothing but the bytes the caller already
+    // holds is in use, reserve always succeeds. Buffer requests do not wait for reservations, so
+    // a thread holding reservations can acquire buffers without waiting for itself.
+    bool tryReserve(size_t bytes, size_t held = 0);
+    void reserve(size_t bytes);
+    void unreserve(size_t bytes);
+
+    BufferPoolStats getStats() const;
+    void logStats() const;
+
+private:
+    friend class PooledBuffer;
+
+    static constexpr size_t SizeClassCount = 4;
+
+    PooledBuffer acquire(size_t size, bool wait);
+    void release(uint8_t* data, size_t size);
+    size_t getSizeClass(size_t size) const;
+    void freeUnusedBuffers(size_t bytesNeeded);
+
+    static const std::array<size_t, SizeClassCount> s_SizeClasses;
+
+    mutable std::mutex                                      m_Mutex;
+    std::condition_variable                                 m_BufferReleased;
+    std::array<std::vector<uint8_t*>, SizeClassCount>       m_FreeBuffers;
+    BufferPoolStats                                         m_Stats;
+};
+
+#endif
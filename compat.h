@@ -0,0 +1,35 @@
+#ifndef COMPAT_H
+#define COMPAT_H
+
+#include <memory>
+#include <cinttypes>
+#include <arpa/inet.h>
+
+#ifndef __APPLE__
+inline uint64_t htonll(uint64_t val)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    return htonl(val >> 32) | ((uint64_t)htonl((uint32_t)val) << 32);
+#else
+    return val;
+#endif
+}
+#endif
+
+#ifndef __APPLE__
+inline uint64_t ntohll(uint64_t val)
+{
+    return htonll(val);
+}
+#endif
+
+namespace std
+{
+    template<typename T, typename ...Args>
+    std::unique_ptr<T> make_unique(Args&& ...args)
+    {
+        return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+    }
+}
+
+#endif
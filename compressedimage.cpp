@@ -0,0 +1,380 @@
+#include "compressedimage.h"
+
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "filecache.h"
+#include "storage.h"
+
+using namespace utils;
+
+std::atomic<uint64_t> CompressedImage::s_NextId(0);
+
+const size_t CompressedImageCache::s_MaxImages = 64;
+const uint32_t CompressedImageCache::s_MaxReadAheadChunks = 32;
+
+static const size_t s_HeaderSize = 24;
+static const size_t s_MinChunkSize = 64 * 1024;
+static const uint32_t s_IndexOffsetMask = 0x7FFFFFFF;
+static const uint32_t s_IndexFlag = 0x80000000;
+
+// CSO header, all numbers are little endian
+// magic "CISO", header size, uncompressed size, block size, version, index alignment shift
+static uint32_t readLittleEndian32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+}
+
+static uint64_t readLittleEndian64(const uint8_t* data)
+{
+    return readLittleEndian32(data) | (uint64_t(readLittleEndian32(data + 4)) << 32);
+}
+
+bool isCompressedImagePath(const std::string& path)
+{
+    static const char extension[] = ".cso";
+    auto length = sizeof(extension) - 1;
+
+    return path.size() > length && std::equal(path.end() - length, path.end(), extension, [] (char lhs, char rhs) {
+        return tolower(static_cast<unsigned char>(lhs)) == rhs;
+    });
+}
+
+CompressedImage::CompressedImage(StorageBackend& storage, std::shared_ptr<OpenFile> file)
+: m_Storage(storage)
+, m_File(std::move(file))
+, m_Id(s_NextId++)
+{
+    uint8_t header[s_HeaderSize];
+    if (m_Storage.read(m_File->getFd(), 0, header, sizeof(header)) != sizeof(header) || memcmp(header, "CISO", 4) != 0)
+    {
+        throw std::runtime_error("Not a CSO image");
+    }
+
+    m_Size          = readLittleEndian64(header + 8);
+    m_BlockSize     = readLittleEndian32(header + 16);
+    m_Version       = header[20];
+    m_Alignment     = header[21];
+
+    // version 2 marks lz4 blocks with the flag, which is not supported
+    if (m_BlockSize == 0 || (m_BlockSize & (m_BlockSize - 1)) != 0 || m_BlockSize > s_MinChunkSize || m_Version > 2 || m_Alignment > 31)
+    {
+        throw std::runtime_error(stringops::format("Unsupported CSO image (version %d, block size %d)", m_Version, m_BlockSize));
+    }
+
+    m_BlocksPerChunk = static_cast<uint32_t>(s_MinChunkSize / m_BlockSize);
+    m_BlockCount = (m_Size + m_BlockSize - 1) / m_BlockSize;
+    m_Index.resize(static_cast<size_t>(m_BlockCount + 1));
+
+    auto indexSize = m_Index.size() * sizeof(uint32_t);
+    if (m_Storage.read(m_File->getFd(), s_HeaderSize, m_Index.data(), indexSize) != indexSize)
+    {
+        throw std::runtime_error("CSO block index is truncated");
+    }
+
+    for (auto& entry : m_Index)
+    {
+        entry = readLittleEndian32(reinterpret_cast<const uint8_t*>(&entry));
+    }
+}
+
+uint64_t CompressedImage::getId() const
+{
+    return m_Id;
+}
+
+uint64_t CompressedImage::getSize() const
+{
+    return m_Size;
+}
+
+uint64_t CompressedImage::getModifyTime() const
+{
+    return m_File->getModifyTime();
+}
+
+size_t CompressedImage::getChunkSize() const
+{
+    return m_BlocksPerChunk * m_BlockSize;
+}
+
+const std::shared_ptr<OpenFile>& CompressedImage::getFile() const
+{
+    return m_File;
+}
+
+uint64_t CompressedImage::getBlockPosition(uint64_t block) const
+{
+    return uint64_t(m_Index[static_cast<size_t>(block)] & s_IndexOffsetMask) << m_Alignment;
+}
+
+void CompressedImage::decompress(uint64_t chunk, std::vector<uint8_t>& data) const
+{
+    auto firstBlock = chunk * m_BlocksPerChunk;
+    auto lastBlock = std::min<uint64_t>(firstBlock + m_BlocksPerChunk, m_BlockCount);
+    if (firstBlock >= lastBlock)
+    {
+        throw std::logic_error("Chunk is beyond the end of the image");
+    }
+
+    // the compressed blocks of the chunk are stored consecutively
+    auto start = getBlockPosition(firstBlock);
+    auto end = getBlockPosition(lastBlock);
+    if (end < start || end - start > 2 * s_MinChunkSize + m_BlocksPerChunk * (1ULL << m_Alignment))
+    {
+        throw std::runtime_error("Corrupt CSO block index");
+    }
+
+    std::vector<uint8_t> compressed(static_cast<size_t>(end - start));
+    if (m_Storage.read(m_File->getFd(), start, compressed.data(), compressed.size()) != compressed.size())
+    {
+        throw std::runtime_error("CSO image is truncated");
+    }
+
+    data.resize(static_cast<size_t>(std::min(m_Size, lastBlock * m_BlockSize) - firstBlock * m_BlockSize));
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -15) != Z_OK)
+    {
+        throw std::runtime_error("Failed to initialize zlib");
+    }
+
+    for (auto block = firstBlock; block < lastBlock; ++block)
+    {
+        auto* source = compressed.data() + (getBlockPosition(block) - start);
+        auto sourceSize = getBlockPosition(block + 1) - getBlockPosition(block);
+        auto* output = data.data() + (block - firstBlock) * m_BlockSize;
+        auto outputSize = static_cast<size_t>(std::min<uint64_t>(m_BlockSize, m_Size - block * m_BlockSize));
+
+        // version 1 flags blocks that are stored uncompressed, version 2 stores them with the full size
+        bool flagged = (m_Index[static_cast<size_t>(block)] & s_IndexFlag) != 0;
+        if ((m_Version < 2 && flagged) || (m_Version == 2 && !flagged && sourceSize >= m_BlockSize))
+        {
+            if (sourceSize < outputSize)
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error("Corrupt CSO block");
+            }
+
+            memcpy(output, source, outputSize);
+            continue;
+        }
+
+        if (m_Version == 2 && flagged)
+        {
+            inflateEnd(&stream);
+            throw std::runtime_error("LZ4 compressed CSO blocks are not supported");
+        }
+
+        inflateReset(&stream);
+        stream.next_in = source;
+        stream.avail_in = static_cast<uInt>(sourceSize);
+        stream.next_out = output;
+        stream.avail_out = static_cast<uInt>(outputSize);
+
+        // blocks padded for the alignment do not always end the deflate stream
+        auto result = inflate(&stream, Z_FINISH);
+        if (stream.avail_out != 0 || (result != Z_STREAM_END && result != Z_OK && result != Z_BUF_ERROR))
+        {
+            inflateEnd(&stream);
+            throw std::runtime_error("Corrupt CSO block");
+        }
+    }
+
+    inflateEnd(&stream);
+}
+
+CompressedImageCache::CompressedImageCache(StorageBackend& storage, uint32_t threadCount, size_t cacheSize)
+: m_Storage(storage)
+, m_CacheSize(cacheSize)
+, m_Workers(threadCount)
+{
+}
+
+std::shared_ptr<CompressedImage> CompressedImageCache::open(const std::string& path, const std::shared_ptr<OpenFile>& file)
+{
+    {
+        // the file cache returns a new open file when the file changed
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto iter = m_Images.find(path);
+        if (iter != m_Images.end() && iter->second->getFile() == file)
+        {
+            return iter->second;
+        }
+    }
+
+    std::shared_ptr<CompressedImage> image;
+    try
+    {
+        image = std::make_shared<CompressedImage>(m_Storage, file);
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR("%s: %s", path, e.what());
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Images.size() >= s_MaxImages && m_Images.find(path) == m_Images.end())
+    {
+        // images that are not read anymore go first, their chunks age out of the cache
+        auto iter = std::find_if(m_Images.begin(), m_Images.end(), [] (const std::pair<const std::string, std::shared_ptr<CompressedImage>>& entry) {
+            return entry.second.use_count() == 1;
+        });
+
+        m_Images.erase(iter == m_Images.end() ? m_Images.begin() : iter);
+    }
+
+    m_Images[path] = image;
+    return image;
+}
+
+size_t CompressedImageCache::read(const std::shared_ptr<CompressedImage>& image, uint64_t offset, uint8_t* data, size_t size, bool sequential)
+{
+    auto imageSize = image->getSize();
+    size = offset < imageSize ? static_cast<size_t>(std::min<uint64_t>(size, imageSize - offset)) : 0;
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    auto chunkSize = image->getChunkSize();
+    auto firstChunk = offset / chunkSize;
+    auto lastChunk = (offset + size - 1) / chunkSize;
+    auto chunkCount = (imageSize + chunkSize - 1) / chunkSize;
+
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    for (auto chunk = firstChunk; chunk <= lastChunk; ++chunk)
+    {
+        chunks.push_back(getChunk(image, chunk, false));
+    }
+
+    if (sequential)
+    {
+        auto readAheadEnd = std::min<uint64_t>(lastChunk + 1 + std::min<uint64_t>(std::max<uint64_t>(chunks.size(), 2), s_MaxReadAheadChunks), chunkCount);
+        for (auto chunk = lastChunk + 1; chunk < readAheadEnd; ++chunk)
+        {
+            getChunk(image, chunk, true);
+        }
+    }
+
+    size_t copied = 0;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        auto& chunk = chunks[i];
+        m_ChunkReady.wait(lock, [&chunk] () { return chunk->ready; });
+
+        if (!chunk->error.empty())
+        {
+            throw std::runtime_error(chunk->error);
+        }
+
+        auto chunkOffset = static_cast<size_t>((offset + copied) - (firstChunk + i) * chunkSize);
+        auto length = std::min(size - copied, chunk->data.size() - chunkOffset);
+        memcpy(data + copied, chunk->data.data() + chunkOffset, length);
+        copied += length;
+    }
+
+    return copied;
+}
+
+CompressedImageStats CompressedImageCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Stats;
+}
+
+// Returns the cached chunk, missing chunks are scheduled for decompression
+std::shared_ptr<CompressedImageCache::Chunk> CompressedImageCache::getChunk(const std::shared_ptr<CompressedImage>& image, uint64_t chunk, bool readAhead)
+{
+    Key key { image->getId(), chunk };
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto iter = m_Chunks.find(key);
+    if (iter != m_Chunks.end())
+    {
+        if (!readAhead)
+        {
+            ++m_Stats.hits;
+        }
+
+        m_Lru.splice(m_Lru.begin(), m_Lru, iter->second);
+        return iter->second->second;
+    }
+
+    ++(readAhead ? m_Stats.readAheads : m_Stats.misses);
+    auto entry = std::make_shared<Chunk>();
+    m_Lru.emplace_front(key, entry);
+    m_Chunks[key] = m_Lru.begin();
+
+    m_Workers.post([this, image, chunk, entry] () {
+        decompress(image, chunk, entry);
+    });
+
+    return entry;
+}
+
+void CompressedImageCache::decompress(std::shared_ptr<CompressedImage> image, uint64_t chunk, std::shared_ptr<Chunk> entry)
+{
+    std::vector<uint8_t> data;
+    std::string error;
+
+    try
+    {
+        image->decompress(chunk, data);
+    }
+    catch (std::exception& e)
+    {
+        error = e.what();
+        LOG_ERROR("Failed to decompress chunk %d of a CSO image: %s", chunk, error);
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    entry->data.swap(data);
+    entry->error = error;
+    entry->ready = true;
+
+    m_Stats.bytesDecompressed += entry->data.size();
+    m_Stats.cachedBytes += entry->data.size();
+
+    if (!error.empty())
+    {
+        // the next read tries again
+        auto iter = m_Chunks.find(Key { image->getId(), chunk });
+        if (iter != m_Chunks.end() && iter->second->second == entry)
+        {
+            m_Lru.erase(iter->second);
+            m_Chunks.erase(iter);
+        }
+    }
+
+    evict();
+    m_ChunkReady.notify_all();
+}
+
+void CompressedImageCache::evict()
+{
+    auto iter = m_Lru.end();
+    while (m_Stats.cachedBytes > m_CacheSize && iter != m_Lru.begin())
+    {
+        --iter;
+
+        // chunks that are being decompressed are not counted yet
+        if (!iter->second->ready)
+        {
+            continue;
+        }
+
+        m_Stats.cachedBytes -= iter->second->data.size();
+        m_Chunks.erase(iter->first);
+        iter = m_Lru.erase(iter);
+    }
+}
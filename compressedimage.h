@@ -0,0 +1,139 @@
+#ifndef COMPRESSED_IMAGE_H
+#define COMPRESSED_IMAGE_H
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "threadpool.h"
+
+class OpenFile;
+class StorageBackend;
+
+// Returns true if the name of the file is the name of a compressed image (.cso)
+bool isCompressedImagePath(const std::string& path);
+
+// Block compressed image (CSO) presented as the uncompressed image
+// The offset index of the blocks is loaded when the image is opened, consecutive blocks
+// are decompressed together in chunks.
+class CompressedImage
+{
+public:
+    // Throws if the file is not a supported compressed image
+    CompressedImage(StorageBackend& storage, std::shared_ptr<OpenFile> file);
+
+    CompressedImage(const CompressedImage&) = delete;
+    CompressedImage& operator=(const CompressedImage&) = delete;
+
+    uint64_t getId() const;
+    uint64_t getSize() const;
+    uint64_t getModifyTime() const;
+    size_t getChunkSize() const;
+    const std::shared_ptr<OpenFile>& getFile() const;
+
+    // Decompresses a chunk, throws if the compressed data is corrupt
+    void decompress(uint64_t chunk, std::vector<uint8_t>& data) const;
+
+private:
+    uint64_t getBlockPosition(uint64_t block) const;
+
+    static std::atomic<uint64_t> s_NextId;
+
+    StorageBackend&             m_Storage;
+    std::shared_ptr<OpenFile>   m_File;
+    uint64_t                    m_Id;
+    uint64_t                    m_Size;
+    uint32_t                    m_BlockSize;
+    uint32_t                    m_BlocksPerChunk;
+    uint32_t                    m_Alignment;
+    uint32_t                    m_Version;
+    uint64_t                    m_BlockCount;
+    std::vector<uint32_t>       m_Index;
+};
+
+struct CompressedImageStats
+{
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+    uint64_t    readAheads = 0;
+    uint64_t    bytesDecompressed = 0;
+    uint64_t    cachedBytes = 0;
+};
+
+// Decompresses the chunks of compressed images on worker threads and keeps the most recently
+// used chunks for all clients. The chunks of a read are decompressed in parallel, chunks that
+// follow a sequential read are decompressed before they are requested.
+class CompressedImageCache
+{
+public:
+    CompressedImageCache(StorageBackend& storage, uint32_t threadCount, size_t cacheSize);
+
+    CompressedImageCache(const CompressedImageCache&) = delete;
+    CompressedImageCache& operator=(const CompressedImageCache&) = delete;
+
+    // Returns nullptr if the file is not a supported compressed image
+    std::shared_ptr<CompressedImage> open(const std::string& path, const std::shared_ptr<OpenFile>& file);
+
+    // Copies the uncompressed data, returns the number of bytes copied (less at the end of the image)
+    // Throws if the compressed data can not be read
+    size_t read(const std::shared_ptr<CompressedImage>& image, uint64_t offset, uint8_t* data, size_t size, bool sequential);
+
+    CompressedImageStats getStats() const;
+
+private:
+    struct Chunk
+    {
+        std::vector<uint8_t>    data;
+        std::string             error;
+        bool                    ready = false;
+    };
+
+    struct Key
+    {
+        uint64_t image;
+        uint64_t chunk;
+
+        bool operator==(const Key& other) const
+        {
+            return image == other.image && chunk == other.chunk;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<uint64_t>()(key.image * 0x9E3779B97F4A7C15ULL ^ key.chunk);
+        }
+    };
+
+    typedef std::list<std::pair<Key, std::shared_ptr<Chunk>>> LruList;
+
+    std::shared_ptr<Chunk> getChunk(const std::shared_ptr<CompressedImage>& image, uint64_t chunk, bool readAhead);
+    void decompress(std::shared_ptr<CompressedImage> image, uint64_t chunk, std::shared_ptr<Chunk> entry);
+    void evict();
+
+    static const size_t s_MaxImages;
+    static const uint32_t s_MaxReadAheadChunks;
+
+    StorageBackend&                                             m_Storage;
+    size_t                                                      m_CacheSize;
+
+    mutable std::mutex                                          m_Mutex;
+    std::condition_variable                                     m_ChunkReady;
+    std::unordered_map<std::string, std::shared_ptr<CompressedImage>> m_Images;
+    std::unordered_map<Key, LruList::iterator, KeyHash>         m_Chunks;
+    LruList                                                     m_Lru;
+    CompressedImageStats                                        m_Stats;
+
+    // destroyed first, running jobs use the cache
+    ThreadPool                                                  m_Workers;
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "directorycache.h"
+
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "utils/fileoperations.h"
+
+#include "compat.h"
+#include "directorylisting.h"
+#include "filewatcher.h"
+#include "ps3protocol.h"
+
+using namespace utils;
+
+const std::chrono::seconds DirectoryCache::s_UnwatchedMaxAge(10);
+
+static uint64_t getModifyTime(const std::string& path)
+{
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0)
+    {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return info.st_mtimespec.tv_sec * 1000000000ull + info.st_mtimespec.tv_nsec;
+#else
+    return info.st_mtim.tv_sec * 1000000000ull + info.st_mtim.tv_nsec;
+#endif
+}
+
+DirectoryCache::DirectoryCache(FileWatcher& watcher, ThreadPool& threadPool, size_t maxDirectories)
+: m_Watcher(watcher)
+, m_ThreadPool(threadPool)
+, m_MaxDirectories(maxDirectories)
+{
+    m_Watcher.addListener([this] (const std::string& directory, const std::string& name) {
+        onChange(directory, name);
+    });
+}
+
+DirectoryCache::Contents DirectoryCache::getContents(const std::string& path)
+{
+    if (m_MaxDirectories == 0)
+    {
+        return readDirectory(path);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        auto iter = m_Entries.find(path);
+        if (iter != m_Entries.end())
+        {
+            if (isValid(path, iter->second))
+            {
+                ++m_Stats.hits;
+                m_Lru.splice(m_Lru.begin(), m_Lru, iter->second.lruPosition);
+                return iter->second.contents;
+            }
+
+            ++m_Stats.invalidations;
+            erase(iter);
+        }
+
+        ++m_Stats.misses;
+        ++m_Builds[path].builders;
+    }
+
+    // start watching before reading so changes made while reading are not missed
+    bool watched = m_Watcher.watch(path);
+    uint64_t modifyTime = watched ? 0 : getModifyTime(path);
+
+    Contents contents;
+    try
+    {
+        contents = readDirectory(path);
+    }
+    catch (...)
+    {
+        if (watched)
+        {
+            m_Watcher.unwatch(path);
+        }
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (--m_Builds[path].builders == 0)
+        {
+            m_Builds.erase(path);
+        }
+
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto buildIter = m_Builds.find(path);
+    bool changed = buildIter->second.changed;
+    if (--buildIter->second.builders == 0)
+    {
+        m_Builds.erase(buildIter);
+    }
+
+    if (changed)
+    {
+        if (watched)
+        {
+            m_Watcher.unwatch(path);
+        }
+
+        return contents;
+    }
+
+    auto iter = m_Entries.find(path);
+    if (iter != m_Entries.end())
+    {
+        erase(iter);
+    }
+
+    m_Lru.push_front(path);
+
+    Entry& entry = m_Entries[path];
+    entry.contents      = contents;
+    entry.lruPosition   = m_Lru.begin();
+    entry.watched       = watched;
+    entry.modifyTime    = modifyTime;
+    entry.created       = std::chrono::steady_clock::now();
+
+    while (m_Entries.size() > m_MaxDirectories)
+    {
+        ++m_Stats.evictions;
+        erase(m_Entries.find(m_Lru.back()));
+    }
+
+    return contents;
+}
+
+DirectoryCacheStats DirectoryCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    DirectoryCacheStats stats = m_Stats;
+    stats.cachedDirectories = m_Entries.size();
+    return stats;
+}
+
+bool DirectoryCache::isValid(const std::string& path, const Entry& entry) const
+{
+    if (entry.watched)
+    {
+        return true;
+    }
+
+    // file sizes can change without touching the directory, so unwatched entries also expire
+    return std::chrono::steady_clock::now() - entry.created < s_UnwatchedMaxAge
+        && getModifyTime(path) == entry.modifyTime;
+}
+
+void DirectoryCache::onChange(const std::string& directory, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (directory.empty())
+    {
+        m_Stats.invalidations += m_Entries.size();
+        for (auto& entry : m_Entries)
+        {
+            if (entry.second.watched)
+            {
+                m_Watcher.unwatch(entry.first);
+            }
+        }
+
+        m_Entries.clear();
+        m_Lru.clear();
+
+        for (auto& build : m_Builds)
+        {
+            build.second.changed = true;
+        }
+
+        return;
+    }
+
+    auto iter = m_Entries.find(directory);
+    if (iter != m_Entries.end())
+    {
+        ++m_Stats.invalidations;
+        erase(iter);
+    }
+
+    auto buildIter = m_Builds.find(directory);
+    if (buildIter != m_Builds.end())
+    {
+        buildIter->second.changed = true;
+    }
+
+    if (name.empty())
+    {
+        return;
+    }
+
+    // a removed or renamed subdirectory takes its cached subdirectories with it
+    auto prefix = fileops::combinePath(directory, name) + '/';
+    for (auto iter = m_Entries.begin(); iter != m_Entries.end();)
+    {
+        auto current = iter++;
+        if (current->first.compare(0, prefix.size(), prefix) == 0)
+        {
+            ++m_Stats.invalidations;
+            erase(current);
+        }
+    }
+}
+
+void DirectoryCache::erase(std::unordered_map<std::string, Entry>::iterator iter)
+{
+    if (iter->second.watched)
+    {
+        m_Watcher.unwatch(iter->first);
+    }
+
+    m_Lru.erase(iter->second.lruPosition);
+    m_Entries.erase(iter);
+}
+
+DirectoryCache::Contents DirectoryCache::readDirectory(const std::string& path)
+{
+    DirectoryListing listing(m_ThreadPool, path);
+
+    std::vector<ReadDirectoryDataReply> records;
+    records.reserve(listing.getCount());
+
+    for (size_t i = 0; i < listing.getCount(); ++i)
+    {
+        auto& entry = listing.getEntry(i);
+        if (!entry.isValid)
+        {
+            // removed since the directory was read
+            continue;
+        }
+
+        records.emplace_back();
+        auto& data = records.back();
+        data.isDirectory    = entry.isDirectory ? 1 : 0;
+        data.size           = data.isDirectory == 1 ? 0 : entry.size;
+        data.mtime          = entry.modifyTime;
+
+        memset(data.name, 0, sizeof(data.name));
+        memcpy(data.name, entry.name.c_str(), std::min(entry.name.size(), sizeof(data.name) - 1));
+    }
+
+    ReadDirectoryReply reply;
+    reply.size = static_cast<int64_t>(records.size());
+
+    auto contents = std::make_shared<std::vector<uint8_t>>(wire::size<ReadDirectoryReply>() + records.size() * wire::size<ReadDirectoryDataReply>());
+    wire::encodeArray(records.data(), records.size(), wire::encode(reply, contents->data()));
+
+    return contents;
+}
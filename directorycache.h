@@ -0,0 +1,79 @@
+#ifndef DIRECTORY_CACHE_H
+#define DIRECTORY_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <unordered_map>
+
+class FileWatcher;
+class ThreadPool;
+
+struct DirectoryCacheStats
+{
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+    uint64_t    invalidations = 0;
+    uint64_t    evictions = 0;
+    uint64_t    cachedDirectories = 0;
+};
+
+// Server wide cache of directory listings, stored as the serialized GetDirectoryContents reply
+// Entries of watched directories stay valid until the file watcher reports a change, entries
+// of directories that can not be watched are revalidated using the directory modification time.
+class DirectoryCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Contents;
+
+    DirectoryCache(FileWatcher& watcher, ThreadPool& threadPool, size_t maxDirectories);
+
+    DirectoryCache(const DirectoryCache&) = delete;
+    DirectoryCache& operator=(const DirectoryCache&) = delete;
+
+    // Returns the ReadDirectoryReply header followed by the ReadDirectoryDataReply
+    // records in network byte order, throws if the directory can not be read
+    Contents getContents(const std::string& path);
+
+    DirectoryCacheStats getStats() const;
+
+private:
+    struct Entry
+    {
+        Contents                                contents;
+        std::list<std::string>::iterator        lruPosition;
+        bool                                    watched;
+        uint64_t                                modifyTime;
+        std::chrono::steady_clock::time_point   created;
+    };
+
+    struct Build
+    {
+        uint32_t    builders = 0;
+        bool        changed = false;
+    };
+
+    bool isValid(const std::string& path, const Entry& entry) const;
+    void onChange(const std::string& directory, const std::string& name);
+    void erase(std::unordered_map<std::string, Entry>::iterator iter);
+
+    Contents readDirectory(const std::string& path);
+
+    static const std::chrono::seconds s_UnwatchedMaxAge;
+
+    FileWatcher&                            m_Watcher;
+    ThreadPool&                             m_ThreadPool;
+    size_t                                  m_MaxDirectories;
+
+    mutable std::mutex                      m_Mutex;
+    std::unordered_map<std::string, Entry>  m_Entries;
+    std::unordered_map<std::string, Build>  m_Builds;
+    std::list<std::string>                  m_Lru;
+    DirectoryCacheStats                     m_Stats;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#include "directorylisting.h"
+
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "threadpool.h"
+
+using namespace utils;
+
+const size_t DirectoryListing::s_BatchSize = 32;
+const size_t DirectoryListing::s_MaxBatchesAhead = 16;
+
+static uint64_t getMicroseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+static void resolveEntry(const std::string& path, DirectoryEntry& entry)
+{
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    // only request what is reported to the client, network file systems can skip the rest
+    struct statx info;
+    if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_ATIME, &info) == 0)
+    {
+        entry.isValid       = true;
+        entry.isDirectory   = S_ISDIR(info.stx_mode);
+        entry.size          = info.stx_size;
+        entry.modifyTime    = info.stx_mtime.tv_sec;
+        entry.createTime    = info.stx_ctime.tv_sec;
+        entry.accessTime    = info.stx_atime.tv_sec;
+    }
+#else
+    struct stat info;
+    if (::stat(path.c_str(), &info) == 0)
+    {
+        entry.isValid       = true;
+        entry.isDirectory   = S_ISDIR(info.st_mode);
+        entry.size          = info.st_size;
+        entry.modifyTime    = info.st_mtime;
+        entry.createTime    = info.st_ctime;
+        entry.accessTime    = info.st_atime;
+    }
+#endif
+}
+
+DirectoryListing::DirectoryListing(ThreadPool& threadPool, const std::string& path)
+: m_ThreadPool(threadPool)
+, m_State(std::make_shared<State>())
+{
+    DIR* handle = opendir(path.c_str());
+    if (!handle)
+    {
+        throw std::logic_error(stringops::format("Failed to open directory %s: %s", path, strerror(errno)));
+    }
+
+    while (auto* dirEntry = readdir(handle))
+    {
+        if (strcmp(dirEntry->d_name, ".") != 0 && strcmp(dirEntry->d_name, "..") != 0)
+        {
+            DirectoryEntry entry;
+            entry.name = dirEntry->d_name;
+            m_State->entries.push_back(std::move(entry));
+        }
+    }
+
+    closedir(handle);
+
+    m_State->path = path;
+    m_State->stats.entries = m_State->entries.size();
+    m_State->resolvedBatches.resize((m_State->entries.size() + s_BatchSize - 1) / s_BatchSize, false);
+
+    std::lock_guard<std::mutex> lock(m_State->mutex);
+    postBatches(m_ThreadPool.getThreadCount() - 1);
+}
+
+DirectoryListing::~DirectoryListing()
+{
+    std::lock_guard<std::mutex> lock(m_State->mutex);
+    m_State->cancelled = true;
+
+    // stat time the client did not have to wait for
+    auto& stats = m_State->stats;
+    auto hiddenMicroseconds = stats.statMicroseconds - std::min(stats.statMicroseconds, stats.waitMicroseconds);
+    LOG_DEBUG("Listing %s: %d of %d entries resolved, stat time %d ms, waited %d ms, hidden %d ms", m_State->path, stats.resolvedEntries, stats.entries, stats.statMicroseconds / 1000, stats.waitMicroseconds / 1000, hiddenMicroseconds / 1000);
+}
+
+const std::string& DirectoryListing::getPath() const
+{
+    return m_State->path;
+}
+
+size_t DirectoryListing::getCount() const
+{
+    return m_State->entries.size();
+}
+
+const DirectoryEntry& DirectoryListing::getEntry(size_t index)
+{
+    auto& state = *m_State;
+    if (index >= state.entries.size())
+    {
+        throw std::logic_error(stringops::format("Directory entry out of range: %d", index));
+    }
+
+    auto batch = index / s_BatchSize;
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    postBatches(batch + s_MaxBatchesAhead);
+
+    if (!state.resolvedBatches[batch])
+    {
+        auto start = std::chrono::steady_clock::now();
+        state.condition.wait(lock, [&state, batch] () { return state.resolvedBatches[batch]; });
+        state.stats.waitMicroseconds += getMicroseconds(std::chrono::steady_clock::now() - start);
+    }
+
+    return state.entries[index];
+}
+
+DirectoryListingStats DirectoryListing::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_State->mutex);
+    return m_State->stats;
+}
+
+void DirectoryListing::postBatches(size_t lastBatch)
+{
+    auto& state = *m_State;
+    while (state.postedBatches <= lastBatch && state.postedBatches < state.resolvedBatches.size())
+    {
+        auto sharedState = m_State;
+        auto batch = state.postedBatches++;
+        m_ThreadPool.post([sharedState, batch] () {
+            resolveBatch(sharedState, batch);
+        });
+    }
+}
+
+// Entries of a batch are only accessed by the listing after the batch is marked as resolved
+void DirectoryListing::resolveBatch(const std::shared_ptr<State>& state, size_t batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->cancelled)
+        {
+            return;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto first = batch * s_BatchSize;
+    auto last = std::min(first + s_BatchSize, state->entries.size());
+    for (auto i = first; i < last; ++i)
+    {
+        resolveEntry(state->path + '/' + state->entries[i].name, state->entries[i]);
+    }
+
+    auto duration = std::chrono::steady_clock::now() - start;
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->resolvedBatches[batch] = true;
+    state->stats.resolvedEntries += last - first;
+    state->stats.statMicroseconds += getMicroseconds(duration);
+    state->condition.notify_all();
+}
@@ -0,0 +1,78 @@
+#ifndef DIRECTORY_LISTING_H
+#define DIRECTORY_LISTING_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <condition_variable>
+
+class ThreadPool;
+
+struct DirectoryEntry
+{
+    std::string name;
+    bool        isValid = false;
+    bool        isDirectory = false;
+    uint64_t    size = 0;
+    uint64_t    modifyTime = 0;
+    uint64_t    createTime = 0;
+    uint64_t    accessTime = 0;
+};
+
+struct DirectoryListingStats
+{
+    uint64_t    entries = 0;
+    uint64_t    resolvedEntries = 0;
+    uint64_t    statMicroseconds = 0;
+    uint64_t    waitMicroseconds = 0;
+};
+
+// Entries of a directory in iteration order
+// The names are read when the listing is created, the metadata of the entries is resolved
+// in batches on the thread pool ahead of the entries that are requested. Batches that are
+// still running when the listing is destroyed complete in the background.
+class DirectoryListing
+{
+public:
+    // Throws if the directory can not be read
+    DirectoryListing(ThreadPool& threadPool, const std::string& path);
+    ~DirectoryListing();
+
+    DirectoryListing(const DirectoryListing&) = delete;
+    DirectoryListing& operator=(const DirectoryListing&) = delete;
+
+    const std::string& getPath() const;
+    size_t getCount() const;
+
+    // Blocks until the metadata of the entry is resolved, isValid is false if it could not be
+    const DirectoryEntry& getEntry(size_t index);
+
+    DirectoryListingStats getStats() const;
+
+private:
+    struct State
+    {
+        std::string                     path;
+        std::vector<DirectoryEntry>     entries;
+        std::vector<bool>               resolvedBatches;
+        size_t                          postedBatches = 0;
+        bool                            cancelled = false;
+        DirectoryListingStats           stats;
+
+        std::mutex                      mutex;
+        std::condition_variable         condition;
+    };
+
+    void postBatches(size_t lastBatch);
+    static void resolveBatch(const std::shared_ptr<State>& state, size_t batch);
+
+    static const size_t s_BatchSize;
+    static const size_t s_MaxBatchesAhead;
+
+    ThreadPool&                 m_ThreadPool;
+    std::shared_ptr<State>      m_State;
+};
+
+#endif
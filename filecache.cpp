@@ -0,0 +1,198 @@
+#include "filecache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "asynclog.h"
+#include "storage.h"
+
+const std::chrono::milliseconds FileCache::s_RevalidateInterval(1000);
+
+OpenFile::OpenFile(StorageBackend& storage, FileDescriptor&& fd, const struct stat& info, bool map)
+: m_Storage(storage)
+, m_Fd(std::move(fd))
+, m_Info(info)
+, m_Mapping(nullptr)
+{
+    if (map && m_Info.st_size > 0 && static_cast<uint64_t>(m_Info.st_size) <= SIZE_MAX)
+    {
+        void* mapping = mmap(nullptr, static_cast<size_t>(m_Info.st_size), PROT_READ, MAP_SHARED, m_Fd.get(), 0);
+        if (mapping == MAP_FAILED)
+        {
+            // e.g. a 32 bit address space that can not hold the image, reads use pread instead
+            LOG_DEBUG("Failed to map file (%d bytes)", m_Info.st_size);
+        }
+        else
+        {
+            m_Mapping = reinterpret_cast<uint8_t*>(mapping);
+        }
+    }
+
+    m_Storage.registerFile(m_Fd.get());
+}
+
+OpenFile::~OpenFile()
+{
+    m_Storage.unregisterFile(m_Fd.get());
+
+    if (m_Mapping)
+    {
+        munmap(m_Mapping, static_cast<size_t>(m_Info.st_size));
+    }
+}
+
+int32_t OpenFile::getFd() const
+{
+    return m_Fd.get();
+}
+
+uint64_t OpenFile::getSize() const
+{
+    return m_Info.st_size;
+}
+
+uint64_t OpenFile::getModifyTime() const
+{
+    return m_Info.st_mtime;
+}
+
+uint64_t OpenFile::getDevice() const
+{
+    return m_Info.st_dev;
+}
+
+uint64_t OpenFile::getInode() const
+{
+    return m_Info.st_ino;
+}
+
+const uint8_t* OpenFile::getMapping() const
+{
+    return m_Mapping;
+}
+
+bool OpenFile::isSameFile(const struct stat& info) const
+{
+    return info.st_ino == m_Info.st_ino
+        && info.st_dev == m_Info.st_dev
+        && info.st_size == m_Info.st_size
+        && info.st_mtime == m_Info.st_mtime;
+}
+
+FileCache::FileCache(StorageBackend& storage, size_t maxOpenFiles, bool mapFiles)
+: m_Storage(storage)
+, m_MaxOpenFiles(maxOpenFiles)
+, m_MapFiles(mapFiles)
+{
+}
+
+std::shared_ptr<OpenFile> FileCache::open(const std::string& path)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<OpenFile> cachedFile;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        auto iter = m_Entries.find(path);
+        if (iter != m_Entries.end())
+        {
+            auto& entry = iter->second;
+            if (now - entry.validated < s_RevalidateInterval)
+            {
+                ++m_Stats.hits;
+                m_Lru.splice(m_Lru.begin(), m_Lru, entry.lruPosition);
+                return entry.file;
+            }
+
+            cachedFile = entry.file;
+        }
+    }
+
+    // file system access happens unlocked, it can be slow on network file systems
+    struct stat info;
+    if (cachedFile && stat(path.c_str(), &info) == 0 && cachedFile->isSameFile(info))
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        ++m_Stats.hits;
+        auto iter = m_Entries.find(path);
+        if (iter != m_Entries.end() && iter->second.file == cachedFile)
+        {
+            iter->second.validated = now;
+            m_Lru.splice(m_Lru.begin(), m_Lru, iter->second.lruPosition);
+        }
+
+        return cachedFile;
+    }
+
+    auto file = openFile(path);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ++m_Stats.misses;
+
+    // clients that still use a replaced file keep their descriptor until they are done
+    auto iter = m_Entries.find(path);
+    if (iter != m_Entries.end())
+    {
+        if (cachedFile && iter->second.file == cachedFile)
+        {
+            ++m_Stats.invalidations;
+        }
+
+        m_Lru.erase(iter->second.lruPosition);
+        m_Entries.erase(iter);
+    }
+
+    if (!file)
+    {
+        return file;
+    }
+
+    m_Lru.push_front(path);
+
+    Entry entry;
+    entry.file = file;
+    entry.lruPosition = m_Lru.begin();
+    entry.validated = now;
+    m_Entries.emplace(path, std::move(entry));
+
+    evict();
+    return file;
+}
+
+FileCacheStats FileCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto stats = m_Stats;
+    stats.openFiles = m_Entries.size();
+    return stats;
+}
+
+std::shared_ptr<OpenFile> FileCache::openFile(const std::string& path)
+{
+    FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.isValid())
+    {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd.get(), &info) != 0)
+    {
+        return nullptr;
+    }
+
+    return std::make_shared<OpenFile>(m_Storage, std::move(fd), info, m_MapFiles);
+}
+
+void FileCache::evict()
+{
+    while (m_Entries.size() > m_MaxOpenFiles)
+    {
+        ++m_Stats.evictions;
+        m_Entries.erase(m_Lru.back());
+        m_Lru.pop_back();
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cinttypes>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#include "filedescriptor.h"
+
+class StorageBackend;
+
+// File opened for reading, shared by all clients that read it
+class OpenFile
+{
+public:
+    OpenFile(StorageBackend& storage, FileDescriptor&& fd, const struct stat& info, bool map);
+    ~OpenFile();
+
+    OpenFile(const OpenFile&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+
+    int32_t getFd() const;
+    uint64_t getSize() const;
+    uint64_t getModifyTime() const;
+    uint64_t getDevice() const;
+    uint64_t getInode() const;
+
+    // Read only mapping of the complete file, nullptr if the file is not mapped
+    const uint8_t* getMapping() const;
+
+    bool isSameFile(const struct stat& info) const;
+
+private:
+    StorageBackend& m_Storage;
+    FileDescriptor  m_Fd;
+    struct stat     m_Info;
+    uint8_t*        m_Mapping;
+};
+
+struct FileCacheStats
+{
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+    uint64_t    invalidations = 0;
+    uint64_t    evictions = 0;
+    uint64_t    openFiles = 0;
+};
+
+// Server wide cache of open file descriptors keyed by path
+// Cached entries are revalidated against the file system (inode, size and modification time)
+// when they were not checked recently, the least recently used entries are closed when
+// the descriptor limit is reached. Clients keep their file open as long as they use it.
+class FileCache
+{
+public:
+    FileCache(StorageBackend& storage, size_t maxOpenFiles, bool mapFiles);
+
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // Returns nullptr if the file can not be opened
+    std::shared_ptr<OpenFile> open(const std::string& path);
+
+    FileCacheStats getStats() const;
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<OpenFile>               file;
+        std::list<std::string>::iterator        lruPosition;
+        std::chrono::steady_clock::time_point   validated;
+    };
+
+    std::shared_ptr<OpenFile> openFile(const std::string& path);
+    void evict();
+
+    static const std::chrono::milliseconds s_RevalidateInterval;
+
+    StorageBackend&                         m_Storage;
+    size_t                                  m_MaxOpenFiles;
+    bool                                    m_MapFiles;
+
+    mutable std::mutex                      m_Mutex;
+    std::unordered_map<std::string, Entry>  m_Entries;
+    std::list<std::string>                  m_Lru;
+    FileCacheStats                          m_Stats;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef FILE_DESCRIPTOR_H
+#define FILE_DESCRIPTOR_H
+
+#include <cinttypes>
+#include <unistd.h>
+
+class FileDescriptor
+{
+public:
+    FileDescriptor()
+    : m_Fd(-1)
+    {
+    }
+
+    explicit FileDescriptor(int32_t fd)
+    : m_Fd(fd)
+    {
+    }
+
+    FileDescriptor(FileDescriptor&& other)
+    : m_Fd(other.m_Fd)
+    {
+        other.m_Fd = -1;
+    }
+
+    ~FileDescriptor()
+    {
+        close();
+    }
+
+    FileDescriptor& operator=(FileDescriptor&& other)
+    {
+        if (this != &other)
+        {
+            close();
+            m_Fd = other.m_Fd;
+            other.m_Fd = -1;
+        }
+
+        return *this;
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int32_t get() const
+    {
+        return m_Fd;
+    }
+
+    bool isValid() const
+    {
+        return m_Fd >= 0;
+    }
+
+    // Gives up ownership without closing the descriptor
+    int32_t release()
+    {
+        auto fd = m_Fd;
+        m_Fd = -1;
+        return fd;
+    }
+
+    void close()
+    {
+        if (m_Fd >= 0)
+        {
+            ::close(m_Fd);
+            m_Fd = -1;
+        }
+    }
+
+private:
+    int32_t m_Fd;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "filewatcher.h"
+
+#include <array>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "asynclog.h"
+
+#ifdef __linux__
+
+static const uint32_t s_WatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+FileWatcher::FileWatcher()
+: m_InotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+, m_WakeupFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (!m_InotifyFd.isValid() || !m_WakeupFd.isValid())
+    {
+        LOG_ERROR("Failed to initialize file watcher: %s", strerror(errno));
+        m_InotifyFd.close();
+        return;
+    }
+
+    m_Thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+    stop();
+}
+
+void FileWatcher::stop()
+{
+    if (m_Thread.joinable())
+    {
+        uint64_t value = 1;
+        if (::write(m_WakeupFd.get(), &value, sizeof(value)) == sizeof(value))
+        {
+            m_Thread.join();
+        }
+        else
+        {
+            m_Thread.detach();
+        }
+    }
+}
+
+bool FileWatcher::isSupported() const
+{
+    return m_InotifyFd.isValid();
+}
+
+bool FileWatcher::watch(const std::string& directory)
+{
+    if (!isSupported())
+    {
+        return false;
+    }
+
+    // the watch is registered before events of the new descriptor can be looked up
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // always ask the kernel, the path might refer to another directory by now
+    int32_t wd = inotify_add_watch(m_InotifyFd.get(), directory.c_str(), s_WatchMask);
+    if (wd < 0)
+    {
+        LOG_DEBUG("Failed to watch %s: %s", directory, strerror(errno));
+        return false;
+    }
+
+    auto& watch = m_WatchedDirectories.emplace(directory, Watch {-1, 0}).first->second;
+    ++watch.references;
+    if (watch.wd == wd)
+    {
+        return true;
+    }
+
+    if (watch.wd >= 0)
+    {
+        removePath(watch.wd, directory);
+    }
+
+    // the same directory can be watched using different paths
+    m_Watches[wd].push_back(directory);
+    watch.wd = wd;
+    return true;
+}
+
+void FileWatcher::unwatch(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto iter = m_WatchedDirectories.find(directory);
+    if (iter == m_WatchedDirectories.end() || --iter->second.references > 0)
+    {
+        return;
+    }
+
+    if (iter->second.wd >= 0)
+    {
+        removePath(iter->second.wd, directory);
+    }
+
+    m_WatchedDirectories.erase(iter);
+}
+
+// The kernel watch is removed with the last path using it
+void FileWatcher::removePath(int32_t wd, const std::string& directory)
+{
+    auto iter = m_Watches.find(wd);
+    if (iter == m_Watches.end())
+    {
+        return;
+    }
+
+    auto& paths = iter->second;
+    paths.erase(std::remove(paths.begin(), paths.end(), directory), paths.end());
+    if (paths.empty())
+    {
+        inotify_rm_watch(m_InotifyFd.get(), wd);
+        m_Watches.erase(iter);
+    }
+}
+
+void FileWatcher::run()
+{
+    // buffer suitably aligned for inotify_event structures
+    alignas(inotify_event) std::array<char, 64 * 1024> buffer;
+
+    std::array<pollfd, 2> fds;
+    fds[0].fd = m_InotifyFd.get();
+    fds[0].events = POLLIN;
+    fds[1].fd = m_WakeupFd.get();
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            LOG_ERROR("File watcher failed: %s", strerror(errno));
+            return;
+        }
+
+        if (fds[1].revents)
+        {
+            return;
+        }
+
+        ssize_t length = ::read(m_InotifyFd.get(), buffer.data(), buffer.size());
+        if (length <= 0)
+        {
+            continue;
+        }
+
+        for (char* pEvent = buffer.data(); pEvent < buffer.data() + length;)
+        {
+            auto* event = reinterpret_cast<inotify_event*>(pEvent);
+            pEvent += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                LOG_INFO("File watcher queue overflow, invalidating everything");
+                notify(std::string(), std::string());
+                continue;
+            }
+
+            std::vector<std::string> directories;
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                auto iter = m_Watches.find(event->wd);
+                if (iter == m_Watches.end())
+                {
+                    continue;
+                }
+
+                directories = iter->second;
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                {
+                    // the watch follows the inode, the path is no longer valid
+                    inotify_rm_watch(m_InotifyFd.get(), event->wd);
+                }
+
+                if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                {
+                    // the references stay until the callers unwatch, watching again adds a new watch
+                    for (auto& directory : iter->second)
+                    {
+                        m_WatchedDirectories[directory].wd = -1;
+                    }
+
+                    m_Watches.erase(iter);
+                }
+            }
+
+            for (auto& directory : directories)
+            {
+                notify(directory, event->len > 0 ? std::string(event->name) : std::string());
+            }
+        }
+    }
+}
+
+#else
+
+FileWatcher::FileWatcher()
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+}
+
+void FileWatcher::stop()
+{
+}
+
+bool FileWatcher::isSupported() const
+{
+    return false;
+}
+
+bool FileWatcher::watch(const std::string&)
+{
+    return false;
+}
+
+void FileWatcher::unwatch(const std::string&)
+{
+}
+
+void FileWatcher::removePath(int32_t, const std::string&)
+{
+}
+
+void FileWatcher::run()
+{
+}
+
+#endif
+
+void FileWatcher::addListener(Listener listener)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Listeners.push_back(std::move(listener));
+}
+
+void FileWatcher::notify(const std::string& directory, const std::string& name)
+{
+    std::vector<Listener> listeners;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        listeners = m_Listeners;
+    }
+
+    for (auto& listener : listeners)
+    {
+        listener(directory, name);
+    }
+}
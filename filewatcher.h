@@ -0,0 +1,63 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "filedescriptor.h"
+
+// Reports changes to the contents of watched directories (inotify on Linux)
+// Listeners are called from the watcher thread with the changed directory and the name
+// of the changed entry (empty if the directory itself changed). An empty directory
+// means events were lost and everything should be considered changed.
+class FileWatcher
+{
+public:
+    typedef std::function<void(const std::string& directory, const std::string& name)> Listener;
+
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    bool isSupported() const;
+
+    // Stops delivering events, listeners are no longer called when this returns
+    void stop();
+
+    void addListener(Listener listener);
+
+    // Returns false if the directory can not be watched, callers have to fall
+    // back to checking modification times in that case
+    // Every successful call has to be paired with a call to unwatch, the watch is removed
+    // when the last caller no longer needs it
+    bool watch(const std::string& directory);
+    void unwatch(const std::string& directory);
+
+private:
+    struct Watch
+    {
+        int32_t     wd;
+        uint32_t    references;
+    };
+
+    void run();
+    void notify(const std::string& directory, const std::string& name);
+    void removePath(int32_t wd, const std::string& directory);
+
+    FileDescriptor                                          m_InotifyFd;
+    FileDescriptor                                          m_WakeupFd;
+    std::thread                                             m_Thread;
+
+    std::mutex                                              m_Mutex;
+    std::vector<Listener>                                   m_Listeners;
+    std::unordered_map<int32_t, std::vector<std::string>>   m_Watches;
+    std::unordered_map<std::string, Watch>                  m_WatchedDirectories;
+};
+
+#endif
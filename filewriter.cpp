@@ -0,0 +1,300 @@
+#include "filewriter.h"
+
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "storage.h"
+#include "threadpool.h"
+
+using namespace utils;
+
+const size_t FileWriter::s_MaxQueuedBytes = 32 * 1024 * 1024;
+const uint64_t FileWriter::s_MinPreallocation = 8 * 1024 * 1024;
+const uint64_t FileWriter::s_MaxPreallocation = 256 * 1024 * 1024;
+const std::chrono::seconds FileWriter::s_SyncInterval(5);
+
+FileWriter::FileWriter(ThreadPool& threadPool, StorageBackend& storage, const std::string& path, SyncPolicy syncPolicy)
+: m_ThreadPool(threadPool)
+, m_Storage(storage)
+, m_Path(path)
+, m_SyncPolicy(syncPolicy)
+, m_Fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))
+, m_WriteOffset(0)
+, m_Allocated(0)
+, m_Preallocate(true)
+, m_LastSync(std::chrono::steady_clock::now())
+, m_WriteCalls(0)
+, m_QueuedBytes(0)
+, m_LastWriteSize(0)
+, m_Requests(0)
+, m_Writing(false)
+, m_Error(0)
+{
+    if (!m_Fd.isValid())
+    {
+        throw std::runtime_error(stringops::format("Failed to open %s for writing: %s", path, strerror(errno)));
+    }
+}
+
+FileWriter::~FileWriter()
+{
+    if (m_Fd.isValid())
+    {
+        close();
+    }
+}
+
+bool FileWriter::write(PooledBuffer buffer, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    if (m_Error != 0)
+    {
+        return false;
+    }
+
+    if (size > 0)
+    {
+        // bound the memory a single writer can hold on to
+        m_Condition.wait(lock, [this, size] () {
+            return m_QueuedBytes == 0 || m_QueuedBytes + size <= s_MaxQueuedBytes;
+        });
+
+        Segment segment;
+        segment.buffer = std::move(buffer);
+        segment.size = size;
+
+        m_Queue.push_back(std::move(segment));
+        m_QueuedBytes += size;
+        ++m_Requests;
+
+        if (!m_Writing)
+        {
+            m_Writing = true;
+            m_ThreadPool.post([this] () {
+                writeQueued();
+            });
+        }
+    }
+
+    // a write that is shorter than the previous one usually ends the file, so wait
+    // for it while the client can still be told about a failure
+    bool wait = m_SyncPolicy == SyncPolicy::Write || size < m_LastWriteSize;
+    m_LastWriteSize = size;
+
+    if (wait)
+    {
+        m_Condition.wait(lock, [this] () { return !m_Writing; });
+    }
+
+    return m_Error == 0;
+}
+
+bool FileWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Condition.wait(lock, [this] () { return !m_Writing; });
+    return m_Error == 0;
+}
+
+bool FileWriter::close()
+{
+    if (flush() && m_SyncPolicy == SyncPolicy::Close)
+    {
+        sync(true);
+    }
+
+    releasePreallocation();
+
+    if (::close(m_Fd.release()) != 0)
+    {
+        // network file systems report write errors on close
+        setError("close");
+    }
+
+    LOG_DEBUG("Wrote %s: %d bytes, %d requests in %d writes", m_Path, m_WriteOffset, m_Requests, m_WriteCalls);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Error == 0;
+}
+
+void FileWriter::writeQueued()
+{
+    for (;;)
+    {
+        std::deque<Segment> segments;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Queue.empty() || m_Error != 0)
+            {
+                // data queued after a failure is dropped, the failure is reported instead
+                m_Queue.clear();
+                m_QueuedBytes = 0;
+                m_Writing = false;
+                m_Condition.notify_all();
+                return;
+            }
+
+            segments.swap(m_Queue);
+        }
+
+        size_t bytes = 0;
+        for (auto& segment : segments)
+        {
+            bytes += segment.size;
+        }
+
+        if (writeSegments(segments))
+        {
+            if (m_SyncPolicy == SyncPolicy::Write
+             || (m_SyncPolicy == SyncPolicy::Periodic && std::chrono::steady_clock::now() - m_LastSync >= s_SyncInterval))
+            {
+                sync(false);
+            }
+        }
+
+        // return the buffers before waking up the client
+        segments.clear();
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_QueuedBytes -= std::min(bytes, m_QueuedBytes);
+        m_Condition.notify_all();
+    }
+}
+
+bool FileWriter::writeSegments(std::deque<Segment>& segments)
+{
+    std::vector<iovec> iov;
+    iov.reserve(segments.size());
+
+    uint64_t size = 0;
+    for (auto& segment : segments)
+    {
+        iovec vec;
+        vec.iov_base = segment.buffer.data();
+        vec.iov_len = segment.size;
+        iov.push_back(vec);
+        size += segment.size;
+    }
+
+    preallocate(m_WriteOffset + size);
+
+    size_t index = 0;
+    while (index < iov.size())
+    {
+        auto count = std::min<size_t>(iov.size() - index, IOV_MAX);
+        auto written = m_Storage.write(m_Fd.get(), m_WriteOffset, &iov[index], count);
+        if (written < 0)
+        {
+            setError("write");
+            return false;
+        }
+
+        ++m_WriteCalls;
+        m_WriteOffset += written;
+
+        // skip the buffers that were written completely, continue a partially written one
+        size_t remaining = written;
+        while (remaining > 0)
+        {
+            if (remaining >= iov[index].iov_len)
+            {
+                remaining -= iov[index].iov_len;
+                ++index;
+            }
+            else
+            {
+                iov[index].iov_base = static_cast<uint8_t*>(iov[index].iov_base) + remaining;
+                iov[index].iov_len -= remaining;
+                remaining = 0;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Files that are written in more than one go are preallocated in growing steps, so large
+// files end up in few extents. The space beyond the end of the file is released on close.
+void FileWriter::preallocate(uint64_t size)
+{
+#ifdef __linux__
+    if (!m_Preallocate || m_WriteOffset == 0 || size <= m_Allocated)
+    {
+        return;
+    }
+
+    auto offset = std::max(m_Allocated, m_WriteOffset);
+    auto length = std::max(std::min(std::max(offset, s_MinPreallocation), s_MaxPreallocation), size - offset);
+
+    if (fallocate(m_Fd.get(), FALLOC_FL_KEEP_SIZE, offset, length) != 0)
+    {
+        // unsupported by the file system or out of space, the write itself reports real problems
+        m_Preallocate = false;
+        return;
+    }
+
+    m_Allocated = offset + length;
+#else
+    (void) size;
+#endif
+}
+
+void FileWriter::releasePreallocation()
+{
+#ifdef __linux__
+    if (m_Allocated > m_WriteOffset)
+    {
+        // truncating to the current size frees the blocks beyond the end of the file
+        if (ftruncate(m_Fd.get(), m_WriteOffset) != 0)
+        {
+            LOG_DEBUG("Failed to release preallocated space of %s: %s", m_Path, strerror(errno));
+        }
+
+        m_Allocated = m_WriteOffset;
+    }
+#endif
+}
+
+bool FileWriter::sync(bool metadata)
+{
+    m_LastSync = std::chrono::steady_clock::now();
+
+#ifdef __linux__
+    auto result = metadata ? fsync(m_Fd.get()) : fdatasync(m_Fd.get());
+#else
+    auto result = fsync(m_Fd.get());
+    (void) metadata;
+#endif
+
+    if (result != 0)
+    {
+        setError("sync");
+        return false;
+    }
+
+    return true;
+}
+
+void FileWriter::setError(const char* operation)
+{
+    auto error = errno;
+    LOG_ERROR("Failed to %s %s: %s", operation, m_Path, strerror(error));
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (m_Error == 0)
+    {
+        m_Error = error;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cinttypes>
+#include <condition_variable>
+
+#include "bufferpool.h"
+#include "filedescriptor.h"
+
+class ThreadPool;
+class StorageBackend;
+
+enum class SyncPolicy
+{
+    Never,
+    Write,
+    Close,
+    Periodic
+};
+
+// Sequential writer that writes the data behind the back of the client
+// Queued buffers are written in order on the thread pool, everything that is queued when
+// a write starts is combined into a single pwritev. The file is preallocated ahead of the
+// written data. A failed write is reported by the next call that returns a status.
+class FileWriter
+{
+public:
+    // Throws if the file can not be created
+    FileWriter(ThreadPool& threadPool, StorageBackend& storage, const std::string& path, SyncPolicy syncPolicy);
+    ~FileWriter();
+
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    // Queues the first size bytes of the buffer, returns false if a write failed
+    bool write(PooledBuffer buffer, size_t size);
+
+    // Waits until all queued data is written, returns false if a write failed
+    bool flush();
+
+    // Flushes, synchronizes depending on the policy and closes the file, returns false if a write failed
+    bool close();
+
+private:
+    struct Segment
+    {
+        PooledBuffer    buffer;
+        size_t          size;
+    };
+
+    void writeQueued();
+    bool writeSegments(std::deque<Segment>& segments);
+    void preallocate(uint64_t size);
+    void releasePreallocation();
+    bool sync(bool metadata);
+    void setError(const char* operation);
+
+    static const size_t s_MaxQueuedBytes;
+    static const uint64_t s_MinPreallocation;
+    static const uint64_t s_MaxPreallocation;
+    static const std::chrono::seconds s_SyncInterval;
+
+    ThreadPool&                             m_ThreadPool;
+    StorageBackend&                         m_Storage;
+    std::string                             m_Path;
+    SyncPolicy                              m_SyncPolicy;
+    FileDescriptor                          m_Fd;
+
+    // only accessed by the running write job
+    uint64_t                                m_WriteOffset;
+    uint64_t                                m_Allocated;
+    bool                                    m_Preallocate;
+    std::chrono::steady_clock::time_point   m_LastSync;
+    uint64_t                                m_WriteCalls;
+
+    std::mutex                              m_Mutex;
+    std::condition_variable                 m_Condition;
+    std::deque<Segment>                     m_Queue;
+    size_t                                  m_QueuedBytes;
+    size_t                                  m_LastWriteSize;
+    uint64_t                                m_Requests;
+    bool                                    m_Writing;
+    int32_t                                 m_Error;
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include "ioscheduler.h"
+
+#include <limits>
+#include <algorithm>
+
+using namespace std::chrono;
+
+// metadata requests cost as much as a small read
+const uint64_t IoScheduler::s_MinimumCost = 4096;
+
+// slots are released by commands running on other threads, there is nothing to wait for
+const milliseconds IoScheduler::s_SlotRetry(1);
+
+IoGrant::IoGrant()
+: m_Scheduler(nullptr)
+{
+}
+
+IoGrant::IoGrant(IoScheduler* scheduler)
+: m_Scheduler(scheduler)
+{
+}
+
+IoGrant::IoGrant(IoGrant&& other)
+: m_Scheduler(other.m_Scheduler)
+{
+    other.m_Scheduler = nullptr;
+}
+
+IoGrant::~IoGrant()
+{
+    release();
+}
+
+IoGrant& IoGrant::operator=(IoGrant&& other)
+{
+    if (this != &other)
+    {
+        release();
+        std::swap(m_Scheduler, other.m_Scheduler);
+    }
+
+    return *this;
+}
+
+IoGrant::operator bool() const
+{
+    return m_Scheduler != nullptr;
+}
+
+void IoGrant::release()
+{
+    if (m_Scheduler)
+    {
+        m_Scheduler->release();
+        m_Scheduler = nullptr;
+    }
+}
+
+IoScheduler::IoScheduler(const IoSchedulerSettings& settings)
+: m_Settings(settings)
+, m_NextRefill(steady_clock::time_point::max())
+, m_VirtualTime(0)
+, m_Active(0)
+{
+    // interactive requests always have a slot of their own
+    m_Settings.maxActive = std::max(m_Settings.maxActive, 2u);
+}
+
+std::shared_ptr<IoClient> IoScheduler::addClient(const std::string& address)
+{
+    auto client = std::make_shared<IoClient>();
+    client->address = address;
+
+    auto iter = m_Settings.weights.find(address);
+    if (iter != m_Settings.weights.end())
+    {
+        client->weight = std::max(iter->second, 1u);
+    }
+
+    auto now = steady_clock::now();
+    client->bucket.rate = m_Settings.clientRate;
+    client->bucket.tokens = static_cast<double>(m_Settings.clientRate);
+    client->bucket.updated = now;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Clients.erase(std::remove_if(m_Clients.begin(), m_Clients.end(), [] (const std::weak_ptr<IoClient>& entry) {
+        return entry.expired();
+    }), m_Clients.end());
+    m_Clients.push_back(client);
+
+    if (m_Settings.addressRate > 0)
+    {
+        auto& entry = m_AddressBuckets[address];
+        client->addressBucket = entry.lock();
+        if (!client->addressBucket)
+        {
+            client->addressBucket = std::make_shared<IoTokenBucket>();
+            client->addressBucket->rate = m_Settings.addressRate;
+            client->addressBucket->tokens = static_cast<double>(m_Settings.addressRate);
+            client->addressBucket->updated = now;
+            entry = client->addressBucket;
+        }
+    }
+
+    return client;
+}
+
+IoGrant IoScheduler::acquire(IoClient& client, IoClass ioClass, uint64_t bytes)
+{
+    Request request;
+    request.client      = &client;
+    request.ioClass     = ioClass;
+    request.bytes       = bytes;
+    request.queued      = steady_clock::now();
+    request.throttled   = false;
+    request.granted     = false;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    // a client that was idle starts at the current virtual time, it can not claim the bandwidth it did not use
+    request.startTag = std::max(m_VirtualTime, client.finishTag);
+    client.finishTag = request.startTag + std::max(bytes, s_MinimumCost) / client.weight;
+
+    m_Queue.push_back(&request);
+    ++client.queued;
+    ++m_Stats.classes[static_cast<size_t>(ioClass)].queued;
+
+    dispatch(steady_clock::now());
+    while (!request.granted)
+    {
+        if (m_NextRefill == steady_clock::time_point::max())
+        {
+            m_Dispatched.wait(lock);
+        }
+        else
+        {
+            m_Dispatched.wait_until(lock, m_NextRefill);
+        }
+
+        dispatch(steady_clock::now());
+    }
+
+    return IoGrant(this);
+}
+
+IoGrant IoScheduler::tryAcquire(IoClient& client, IoClass ioClass, uint64_t bytes, steady_clock::time_point& retry)
+{
+    auto now = steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (!client.waiting)
+    {
+        client.waiting = true;
+        client.throttled = false;
+        client.waitingSince = now;
+    }
+
+    Request request;
+    request.client      = &client;
+    request.ioClass     = ioClass;
+    request.bytes       = bytes;
+    request.queued      = client.waitingSince;
+    request.throttled   = client.throttled;
+    request.granted     = false;
+
+    retry = steady_clock::time_point::max();
+    bool eligible = isEligible(request, now, retry);
+    client.throttled = request.throttled;
+
+    if (!eligible)
+    {
+        return IoGrant();
+    }
+
+    if (!hasSlot(ioClass))
+    {
+        retry = now + s_SlotRetry;
+        return IoGrant();
+    }
+
+    request.startTag = std::max(m_VirtualTime, client.finishTag);
+    client.finishTag = request.startTag + std::max(bytes, s_MinimumCost) / client.weight;
+    client.waiting = false;
+
+    // the request was never queued, grant takes it out of the queue statistics
+    ++client.queued;
+    ++m_Stats.classes[static_cast<size_t>(ioClass)].queued;
+    grant(request, now);
+
+    return IoGrant(this);
+}
+
+IoSchedulerStats IoScheduler::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto stats = m_Stats;
+    stats.active = m_Active;
+
+    for (auto& entry : m_Clients)
+    {
+        auto client = entry.lock();
+        if (!client)
+        {
+            continue;
+        }
+
+        IoClientStats clientStats;
+        clientStats.address             = client->address;
+        clientStats.weight              = client->weight;
+        clientStats.queued              = client->queued;
+        clientStats.requests            = client->requests;
+        clientStats.bytes               = client->bytes;
+        clientStats.waitMicroseconds    = client->waitMicroseconds;
+        stats.clients.push_back(clientStats);
+    }
+
+    return stats;
+}
+
+void IoScheduler::release()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    --m_Active;
+    dispatch(steady_clock::now());
+}
+
+// Starts waiting requests while there are free slots, interactive requests first and
+// within a class the request with the lowest start tag
+void IoScheduler::dispatch(steady_clock::time_point now)
+{
+    bool dispatched = false;
+    m_NextRefill = steady_clock::time_point::max();
+
+    while (m_Active < m_Settings.maxActive)
+    {
+        auto best = m_Queue.size();
+        for (size_t i = 0; i < m_Queue.size(); ++i)
+        {
+            auto& request = *m_Queue[i];
+            if (!hasSlot(request.ioClass))
+            {
+                continue;
+            }
+
+            if (best != m_Queue.size())
+            {
+                auto& current = *m_Queue[best];
+                if (request.ioClass > current.ioClass || (request.ioClass == current.ioClass && request.startTag >= current.startTag))
+                {
+                    continue;
+                }
+            }
+
+            if (isEligible(request, now, m_NextRefill))
+            {
+                best = i;
+            }
+        }
+
+        if (best == m_Queue.size())
+        {
+            break;
+        }
+
+        auto& request = *m_Queue[best];
+        m_Queue.erase(m_Queue.begin() + best);
+        grant(request, now);
+        dispatched = true;
+    }
+
+    if (dispatched)
+    {
+        m_Dispatched.notify_all();
+    }
+}
+
+// The last slot is reserved for interactive requests
+bool IoScheduler::hasSlot(IoClass ioClass) const
+{
+    return m_Active < m_Settings.maxActive && (ioClass != IoClass::Bulk || m_Active + 1 < m_Settings.maxActive);
+}
+
+// Refills the buckets of the request, the tokens may go negative so large requests are not
+// delayed forever, the debt is paid back before the client can start the next request
+// refill is lowered to the time the request becomes eligible when it is not
+bool IoScheduler::isEligible(Request& request, steady_clock::time_point now, steady_clock::time_point& refill)
+{
+    bool eligible = true;
+    for (auto* bucket : { &request.client->bucket, request.client->addressBucket.get() })
+    {
+        if (!bucket || bucket->rate == 0)
+        {
+            continue;
+        }
+
+        auto elapsed = duration_cast<duration<double>>(now - bucket->updated).count();
+        bucket->tokens = std::min(static_cast<double>(bucket->rate), bucket->tokens + elapsed * bucket->rate);
+        bucket->updated = now;
+
+        if (bucket->tokens < 0.0)
+        {
+            auto refilled = now + duration_cast<steady_clock::duration>(duration<double>(-bucket->tokens / bucket->rate));
+            refill = std::min(refill, refilled);
+            eligible = false;
+        }
+    }
+
+    if (!eligible && !request.throttled)
+    {
+        request.throttled = true;
+        ++m_Stats.throttled;
+    }
+
+    return eligible;
+}
+
+void IoScheduler::grant(Request& request, steady_clock::time_point now)
+{
+    request.granted = true;
+    ++m_Active;
+    m_VirtualTime = std::max(m_VirtualTime, request.startTag);
+
+    for (auto* bucket : { &request.client->bucket, request.client->addressBucket.get() })
+    {
+        if (bucket && bucket->rate > 0)
+        {
+            bucket->tokens -= request.bytes;
+        }
+    }
+
+    auto wait = static_cast<uint64_t>(duration_cast<microseconds>(now - request.queued).count());
+
+    auto& client = *request.client;
+    --client.queued;
+    ++client.requests;
+    client.bytes += request.bytes;
+    client.waitMicroseconds += wait;
+
+    auto& classStats = m_Stats.classes[static_cast<size_t>(request.ioClass)];
+    --classStats.queued;
+    ++classStats.requests;
+    classStats.bytes += request.bytes;
+    classStats.waitMicroseconds += wait;
+}
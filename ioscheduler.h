@@ -0,0 +1,173 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <unordered_map>
+#include <condition_variable>
+
+class IoScheduler;
+
+// Small requests a console waits on (metadata, short and sector reads) go before bulk transfers
+enum class IoClass
+{
+    Interactive,
+    Bulk
+};
+
+static constexpr size_t IoClassCount = 2;
+
+// Bandwidth cap shared by the requests charged to it, a rate of 0 is unlimited
+struct IoTokenBucket
+{
+    uint64_t                                rate = 0;
+    double                                  tokens = 0.0;
+    std::chrono::steady_clock::time_point   updated;
+};
+
+// Scheduling state of a connection, only accessed by the scheduler
+struct IoClient
+{
+    std::string                         address;
+    uint32_t                            weight = 1;
+    uint64_t                            finishTag = 0;
+    IoTokenBucket                       bucket;
+    std::shared_ptr<IoTokenBucket>      addressBucket;
+    uint32_t                            queued = 0;
+    uint64_t                            requests = 0;
+    uint64_t                            bytes = 0;
+    uint64_t                            waitMicroseconds = 0;
+
+    // request of the event engine that did not get started yet
+    bool                                    waiting = false;
+    bool                                    throttled = false;
+    std::chrono::steady_clock::time_point   waitingSince;
+};
+
+// Admission of a request, the next request can start when the grant is destroyed
+class IoGrant
+{
+public:
+    IoGrant();
+    IoGrant(IoGrant&& other);
+    ~IoGrant();
+
+    IoGrant& operator=(IoGrant&& other);
+
+    IoGrant(const IoGrant&) = delete;
+    IoGrant& operator=(const IoGrant&) = delete;
+
+    explicit operator bool() const;
+
+    void release();
+
+private:
+    friend class IoScheduler;
+    explicit IoGrant(IoScheduler* scheduler);
+
+    IoScheduler*    m_Scheduler;
+};
+
+struct IoClassStats
+{
+    uint64_t    queued = 0;
+    uint64_t    requests = 0;
+    uint64_t    bytes = 0;
+    uint64_t    waitMicroseconds = 0;
+};
+
+struct IoClientStats
+{
+    std::string address;
+    uint32_t    weight = 1;
+    uint64_t    queued = 0;
+    uint64_t    requests = 0;
+    uint64_t    bytes = 0;
+    uint64_t    waitMicroseconds = 0;
+};
+
+struct IoSchedulerStats
+{
+    std::array<IoClassStats, IoClassCount>  classes;
+    std::vector<IoClientStats>              clients;
+    uint64_t                                active = 0;
+    uint64_t                                throttled = 0;
+};
+
+struct IoSchedulerSettings
+{
+    uint32_t                                    maxActive = 8;
+    uint64_t                                    clientRate = 0;
+    uint64_t                                    addressRate = 0;
+    std::unordered_map<std::string, uint32_t>   weights;
+};
+
+// Server wide admission control for the disk and network work of commands
+// At most maxActive requests run at the same time, one of them is reserved for interactive
+// requests. Waiting requests of a class are started in start-time fair queuing order: every
+// client advances its own virtual clock by the requested bytes divided by its weight, so
+// clients receive bandwidth in proportion to their weights no matter how large their
+// requests are. Clients over their bandwidth cap wait until their token bucket refills.
+class IoScheduler
+{
+public:
+    explicit IoScheduler(const IoSchedulerSettings& settings);
+
+    IoScheduler(const IoScheduler&) = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    std::shared_ptr<IoClient> addClient(const std::string& address);
+
+    // Blocks until the request may start
+    IoGrant acquire(IoClient& client, IoClass ioClass, uint64_t bytes);
+
+    // For callers that must not block (the event engine): starts the request when the client
+    // is within its bandwidth caps and a slot is free, otherwise returns an empty grant and the
+    // time to try again. The request does not wait in the queue, so it is started without the
+    // fair queuing order of acquire.
+    IoGrant tryAcquire(IoClient& client, IoClass ioClass, uint64_t bytes, std::chrono::steady_clock::time_point& retry);
+
+    IoSchedulerStats getStats() const;
+
+private:
+    friend class IoGrant;
+
+    struct Request
+    {
+        IoClient*                               client;
+        IoClass                                 ioClass;
+        uint64_t                                bytes;
+        uint64_t                                startTag;
+        std::chrono::steady_clock::time_point   queued;
+        bool                                    throttled;
+        bool                                    granted;
+    };
+
+    void release();
+    void dispatch(std::chrono::steady_clock::time_point now);
+    bool hasSlot(IoClass ioClass) const;
+    bool isEligible(Request& request, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point& refill);
+    void grant(Request& request, std::chrono::steady_clock::time_point now);
+
+    static const uint64_t s_MinimumCost;
+    static const std::chrono::milliseconds s_SlotRetry;
+
+    IoSchedulerSettings                                             m_Settings;
+
+    mutable std::mutex                                              m_Mutex;
+    std::condition_variable                                         m_Dispatched;
+    std::vector<Request*>                                           m_Queue;
+    std::chrono::steady_clock::time_point                           m_NextRefill;
+    uint64_t                                                        m_VirtualTime;
+    uint64_t                                                        m_Active;
+    IoSchedulerStats                                                m_Stats;
+    std::vector<std::weak_ptr<IoClient>>                            m_Clients;
+    std::unordered_map<std::string, std::weak_ptr<IoTokenBucket>>   m_AddressBuckets;
+};
+
+#endif
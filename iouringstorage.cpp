@@ -0,0 +1,559 @@
+#include "iouringstorage.h"
+
+#ifdef HAVE_IO_URING
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+
+using namespace utils;
+
+const uint32_t IoUringStorage::s_Entries = 256;
+const uint32_t IoUringStorage::s_MaxFiles = 1024;
+const size_t IoUringStorage::s_PieceSize = 256 * 1024;
+const size_t IoUringStorage::s_BufferSize = 256 * 1024;
+const size_t IoUringStorage::s_BufferCount = 16;
+
+// user data of the request that stops the reaper
+static const uint64_t s_StopRequest = 0;
+
+static int32_t ioUringSetup(uint32_t entries, io_uring_params* params)
+{
+    return static_cast<int32_t>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int32_t ioUringEnter(int32_t fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags)
+{
+    return static_cast<int32_t>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int32_t ioUringRegister(int32_t fd, uint32_t opcode, const void* arg, uint32_t count)
+{
+    return static_cast<int32_t>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+IoUringStorage::IoUringStorage()
+: m_SqRing(MAP_FAILED)
+, m_SqRingSize(0)
+, m_CqRing(MAP_FAILED)
+, m_CqRingSize(0)
+, m_Sqes(nullptr)
+, m_SqesSize(0)
+, m_InFlight(0)
+, m_FilesRegistered(false)
+, m_BuffersRegistered(false)
+{
+    setupRing();
+
+    std::vector<int32_t> files(s_MaxFiles, -1);
+    m_FilesRegistered = ioUringRegister(m_Ring.get(), IORING_REGISTER_FILES, files.data(), files.size()) == 0;
+    for (uint32_t i = s_MaxFiles; m_FilesRegistered && i > 0; --i)
+    {
+        m_FreeSlots.push_back(i - 1);
+    }
+
+    registerBuffers();
+
+    m_Reaper = std::thread(&IoUringStorage::reap, this);
+
+    LOG_INFO("Using io_uring (%d entries, registered files: %s, registered buffers: %s)", m_SqEntries, m_FilesRegistered ? "yes" : "no", m_BuffersRegistered ? "yes" : "no");
+}
+
+IoUringStorage::~IoUringStorage()
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    sqe.user_data = s_StopRequest;
+    submit(&sqe, 1);
+
+    m_Reaper.join();
+    unmapRing();
+
+    for (auto* buffer : m_Buffers)
+    {
+        free(buffer);
+    }
+}
+
+const char* IoUringStorage::getName() const
+{
+    return "io_uring";
+}
+
+void IoUringStorage::registerFile(int32_t fd)
+{
+    std::lock_guard<std::mutex> lock(m_FilesMutex);
+    if (m_FreeSlots.empty())
+    {
+        return;
+    }
+
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = m_FreeSlots.back();
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+
+    if (ioUringRegister(m_Ring.get(), IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+    {
+        m_FileSlots[fd] = m_FreeSlots.back();
+        m_FreeSlots.pop_back();
+    }
+}
+
+// Called before the descriptor is closed, the registered file holds a reference to it
+void IoUringStorage::unregisterFile(int32_t fd)
+{
+    std::lock_guard<std::mutex> lock(m_FilesMutex);
+    auto iter = m_FileSlots.find(fd);
+    if (iter == m_FileSlots.end())
+    {
+        return;
+    }
+
+    int32_t none = -1;
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = iter->second;
+    update.fds = reinterpret_cast<uint64_t>(&none);
+    ioUringRegister(m_Ring.get(), IORING_REGISTER_FILES_UPDATE, &update, 1);
+
+    m_FreeSlots.push_back(iter->second);
+    m_FileSlots.erase(iter);
+}
+
+size_t IoUringStorage::read(int32_t fd, uint64_t offset, void* data, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    auto pieces = std::min<size_t>((size + s_PieceSize - 1) / s_PieceSize, m_SqEntries);
+    auto pieceSize = (size + pieces - 1) / pieces;
+
+    std::vector<Request> requests(pieces);
+    std::vector<Completion> completions(pieces);
+    for (size_t i = 0; i < pieces; ++i)
+    {
+        auto pieceOffset = i * pieceSize;
+        requests[i].opcode  = IORING_OP_READ;
+        requests[i].fd      = fd;
+        requests[i].offset  = offset + pieceOffset;
+        requests[i].address = reinterpret_cast<uint8_t*>(data) + pieceOffset;
+        requests[i].length  = static_cast<uint32_t>(std::min(pieceSize, size - pieceOffset));
+    }
+
+    execute(requests.data(), completions.data(), pieces);
+
+    size_t bytesRead = 0;
+    for (size_t i = 0; i < pieces; ++i)
+    {
+        if (completions[i].result < 0)
+        {
+            throw std::runtime_error(stringops::format("Failed to read file: %s", strerror(-completions[i].result)));
+        }
+
+        bytesRead += completions[i].result;
+        if (static_cast<uint32_t>(completions[i].result) < requests[i].length)
+        {
+            // end of the file, or an interrupted read that is completed synchronously
+            return bytesRead + m_Fallback.read(fd, offset + bytesRead, reinterpret_cast<uint8_t*>(data) + bytesRead, size - bytesRead);
+        }
+    }
+
+    return bytesRead;
+}
+
+ssize_t IoUringStorage::write(int32_t fd, uint64_t offset, const iovec* iov, size_t count)
+{
+    Request request;
+    request.opcode  = IORING_OP_WRITEV;
+    request.fd      = fd;
+    request.offset  = offset;
+    request.address = iov;
+    request.length  = static_cast<uint32_t>(count);
+
+    Completion completion;
+    execute(&request, &completion, 1);
+
+    if (completion.result < 0)
+    {
+        errno = -completion.result;
+        return -1;
+    }
+
+    return completion.result;
+}
+
+bool IoUringStorage::readAndSend(int32_t fd, uint64_t offset, size_t size, int32_t socket)
+{
+    if (size == 0)
+    {
+        return true;
+    }
+
+    std::vector<uint16_t> buffers;
+    if (acquireBuffers(buffers, (size + s_BufferSize - 1) / s_BufferSize) == 0)
+    {
+        return false;
+    }
+
+    try
+    {
+        // every round reads into all acquired buffers and sends them in order as one linked chain
+        while (size > 0)
+        {
+            std::vector<Request> requests;
+            for (size_t i = 0; i < buffers.size() && size > 0; ++i)
+            {
+                auto length = static_cast<uint32_t>(std::min(size, s_BufferSize));
+
+                Request read;
+                read.opcode         = m_BuffersRegistered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                read.fd             = fd;
+                read.offset         = offset;
+                read.address        = m_Buffers[buffers[i]];
+                read.length         = length;
+                read.bufferIndex    = m_BuffersRegistered ? buffers[i] : -1;
+                read.link           = true;
+                requests.push_back(read);
+
+                Request send;
+                send.opcode         = IORING_OP_SEND;
+                send.fd             = socket;
+                send.address        = m_Buffers[buffers[i]];
+                send.length         = length;
+                send.flags          = MSG_WAITALL | MSG_NOSIGNAL;
+                send.link           = true;
+                requests.push_back(send);
+
+                offset += length;
+                size -= length;
+            }
+
+            requests.back().link = false;
+
+            std::vector<Completion> completions(requests.size());
+            execute(requests.data(), completions.data(), requests.size());
+
+            // a short or failed request cancels the rest of the chain
+            for (size_t i = 0; i < requests.size(); ++i)
+            {
+                auto result = completions[i].result;
+                bool isRead = requests[i].opcode != IORING_OP_SEND;
+                if (result < 0)
+                {
+                    throw std::runtime_error(stringops::format("Failed to %s file data: %s", isRead ? "read" : "send", strerror(-result)));
+                }
+
+                if (static_cast<uint32_t>(result) < requests[i].length)
+                {
+                    throw std::logic_error(isRead ? "File is not ok for reading" : "Failed to send file data");
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        releaseBuffers(buffers);
+        throw;
+    }
+
+    releaseBuffers(buffers);
+    return true;
+}
+
+void IoUringStorage::setupRing()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    auto fd = ioUringSetup(s_Entries, &params);
+    if (fd < 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to setup io_uring: %s", strerror(errno)));
+    }
+
+    m_Ring = FileDescriptor(fd);
+    probeOperations();
+
+    m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_SqRingSize = m_CqRingSize = std::max(m_SqRingSize, m_CqRingSize);
+    }
+
+    m_SqRing = mmap(nullptr, m_SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_SqRing != MAP_FAILED)
+    {
+        m_CqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_SqRing : mmap(nullptr, m_CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+
+    m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (m_SqRing == MAP_FAILED || m_CqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        auto error = errno;
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, m_SqesSize);
+        }
+
+        unmapRing();
+        throw std::runtime_error(stringops::format("Failed to map io_uring: %s", strerror(error)));
+    }
+
+    m_Sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+    auto* sqRing = reinterpret_cast<uint8_t*>(m_SqRing);
+    m_SqHead    = reinterpret_cast<uint32_t*>(sqRing + params.sq_off.head);
+    m_SqTail    = reinterpret_cast<uint32_t*>(sqRing + params.sq_off.tail);
+    m_SqMask    = *reinterpret_cast<uint32_t*>(sqRing + params.sq_off.ring_mask);
+    m_SqArray   = reinterpret_cast<uint32_t*>(sqRing + params.sq_off.array);
+    m_SqEntries = params.sq_entries;
+
+    auto* cqRing = reinterpret_cast<uint8_t*>(m_CqRing);
+    m_CqHead    = reinterpret_cast<uint32_t*>(cqRing + params.cq_off.head);
+    m_CqTail    = reinterpret_cast<uint32_t*>(cqRing + params.cq_off.tail);
+    m_CqMask    = *reinterpret_cast<uint32_t*>(cqRing + params.cq_off.ring_mask);
+    m_Cqes      = reinterpret_cast<io_uring_cqe*>(cqRing + params.cq_off.cqes);
+    m_CqEntries = params.cq_entries;
+}
+
+// The ring can be set up on kernels that do not support every operation, the requests would fail
+void IoUringStorage::probeOperations()
+{
+    static const uint8_t operations[] = { IORING_OP_NOP, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITEV, IORING_OP_SEND };
+    static const uint32_t maxOperations = 256;
+
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + maxOperations * sizeof(io_uring_probe_op), 0);
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (ioUringRegister(m_Ring.get(), IORING_REGISTER_PROBE, probe, maxOperations) < 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to probe the io_uring operations: %s", strerror(errno)));
+    }
+
+    for (auto operation : operations)
+    {
+        if (operation > probe->last_op || (probe->ops[operation].flags & IO_URING_OP_SUPPORTED) == 0)
+        {
+            throw std::runtime_error(stringops::format("io_uring operation %d is not supported", static_cast<int32_t>(operation)));
+        }
+    }
+}
+
+void IoUringStorage::unmapRing()
+{
+    if (m_Sqes)
+    {
+        munmap(m_Sqes, m_SqesSize);
+        m_Sqes = nullptr;
+    }
+
+    if (m_CqRing != MAP_FAILED && m_CqRing != m_SqRing)
+    {
+        munmap(m_CqRing, m_CqRingSize);
+    }
+
+    if (m_SqRing != MAP_FAILED)
+    {
+        munmap(m_SqRing, m_SqRingSize);
+    }
+
+    m_SqRing = m_CqRing = MAP_FAILED;
+}
+
+// Registration pins the buffers once instead of on every request, it fails when the
+// memory lock limit is too low. The buffers are used unregistered in that case.
+void IoUringStorage::registerBuffers()
+{
+    std::vector<iovec> iov;
+    for (size_t i = 0; i < s_BufferCount; ++i)
+    {
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, 4096, s_BufferSize) != 0)
+        {
+            break;
+        }
+
+        m_Buffers.push_back(reinterpret_cast<uint8_t*>(buffer));
+        m_FreeBuffers.push_back(static_cast<uint16_t>(i));
+
+        iovec vec;
+        vec.iov_base = buffer;
+        vec.iov_len = s_BufferSize;
+        iov.push_back(vec);
+    }
+
+    m_BuffersRegistered = !iov.empty() && ioUringRegister(m_Ring.get(), IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+    if (!m_BuffersRegistered)
+    {
+        LOG_DEBUG("Failed to register io_uring buffers: %s", strerror(errno));
+    }
+}
+
+void IoUringStorage::execute(Request* requests, Completion* completions, size_t count)
+{
+    if (count > m_SqEntries)
+    {
+        throw std::logic_error(stringops::format("Too many io_uring requests: %d", count));
+    }
+
+    {
+        // never have more requests in flight than the completion queue can hold
+        std::unique_lock<std::mutex> lock(m_CompletionMutex);
+        m_CompletionCondition.wait(lock, [this, count] () { return m_InFlight + count <= m_CqEntries - 1; });
+        m_InFlight += count;
+    }
+
+    std::vector<io_uring_sqe> sqes(count);
+    {
+        std::lock_guard<std::mutex> lock(m_FilesMutex);
+        for (size_t i = 0; i < count; ++i)
+        {
+            prepare(requests[i], &completions[i], sqes[i]);
+        }
+    }
+
+    submit(sqes.data(), count);
+
+    std::unique_lock<std::mutex> lock(m_CompletionMutex);
+    m_CompletionCondition.wait(lock, [completions, count] () {
+        return std::all_of(completions, completions + count, [] (const Completion& completion) { return completion.done; });
+    });
+}
+
+void IoUringStorage::submit(io_uring_sqe* sqes, size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_SubmitMutex);
+
+    // the kernel consumes all entries during io_uring_enter, so the queue is empty here
+    auto tail = *m_SqTail;
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto index = (tail + i) & m_SqMask;
+        m_Sqes[index] = sqes[i];
+        m_SqArray[index] = index;
+    }
+
+    __atomic_store_n(m_SqTail, tail + static_cast<uint32_t>(count), __ATOMIC_RELEASE);
+
+    auto remaining = static_cast<uint32_t>(count);
+    while (remaining > 0)
+    {
+        auto submitted = ioUringEnter(m_Ring.get(), remaining, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            throw std::runtime_error(stringops::format("Failed to submit io_uring requests: %s", strerror(errno)));
+        }
+
+        remaining -= std::min<uint32_t>(remaining, submitted);
+    }
+}
+
+// Called with the files mutex locked
+void IoUringStorage::prepare(const Request& request, Completion* completion, io_uring_sqe& sqe)
+{
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode      = request.opcode;
+    sqe.fd          = request.fd;
+    sqe.off         = request.offset;
+    sqe.addr        = reinterpret_cast<uint64_t>(request.address);
+    sqe.len         = request.length;
+    sqe.msg_flags   = request.flags;
+    sqe.user_data   = reinterpret_cast<uint64_t>(completion);
+
+    if (request.bufferIndex >= 0)
+    {
+        sqe.buf_index = static_cast<uint16_t>(request.bufferIndex);
+    }
+
+    if (request.link)
+    {
+        sqe.flags |= IOSQE_IO_LINK;
+    }
+
+    if (request.opcode != IORING_OP_SEND)
+    {
+        auto iter = m_FileSlots.find(request.fd);
+        if (iter != m_FileSlots.end())
+        {
+            sqe.fd = iter->second;
+            sqe.flags |= IOSQE_FIXED_FILE;
+        }
+    }
+}
+
+void IoUringStorage::reap()
+{
+    bool stop = false;
+    while (!stop)
+    {
+        if (ioUringEnter(m_Ring.get(), 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            LOG_ERROR("Failed to wait for io_uring completions: %s", strerror(errno));
+            std::this_thread::yield();
+        }
+
+        std::lock_guard<std::mutex> lock(m_CompletionMutex);
+
+        auto head = *m_CqHead;
+        auto tail = __atomic_load_n(m_CqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            auto& cqe = m_Cqes[head & m_CqMask];
+            if (cqe.user_data == s_StopRequest)
+            {
+                stop = true;
+                continue;
+            }
+
+            auto* completion = reinterpret_cast<Completion*>(cqe.user_data);
+            completion->result = cqe.res;
+            completion->done = true;
+            --m_InFlight;
+        }
+
+        __atomic_store_n(m_CqHead, head, __ATOMIC_RELEASE);
+        m_CompletionCondition.notify_all();
+    }
+}
+
+size_t IoUringStorage::acquireBuffers(std::vector<uint16_t>& buffers, size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_BuffersMutex);
+    while (buffers.size() < count && !m_FreeBuffers.empty())
+    {
+        buffers.push_back(m_FreeBuffers.back());
+        m_FreeBuffers.pop_back();
+    }
+
+    return buffers.size();
+}
+
+void IoUringStorage::releaseBuffers(const std::vector<uint16_t>& buffers)
+{
+    std::lock_guard<std::mutex> lock(m_BuffersMutex);
+    m_FreeBuffers.insert(m_FreeBuffers.end(), buffers.begin(), buffers.end());
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef IO_URING_STORAGE_H
+#define IO_URING_STORAGE_H
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "storage.h"
+#include "filedescriptor.h"
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+// Storage backend that submits its requests to an io_uring
+// Large reads are split in pieces that are submitted together so the device works on them
+// in parallel. A single reaper thread collects the completions and wakes up the submitters.
+// Files of the file cache are registered with the ring, readAndSend links the reads into a set of
+// registered buffers to the sends on the socket so a complete request is a single submission.
+class IoUringStorage : public StorageBackend
+{
+public:
+    // Throws if the kernel does not support io_uring or one of the operations it uses
+    IoUringStorage();
+    ~IoUringStorage();
+
+    IoUringStorage(const IoUringStorage&) = delete;
+    IoUringStorage& operator=(const IoUringStorage&) = delete;
+
+    const char* getName() const override;
+
+    void registerFile(int32_t fd) override;
+    void unregisterFile(int32_t fd) override;
+
+    size_t read(int32_t fd, uint64_t offset, void* data, size_t size) override;
+    ssize_t write(int32_t fd, uint64_t offset, const iovec* iov, size_t count) override;
+    bool readAndSend(int32_t fd, uint64_t offset, size_t size, int32_t socket) override;
+
+private:
+    struct Request
+    {
+        uint8_t     opcode = 0;
+        int32_t     fd = -1;
+        uint64_t    offset = 0;
+        const void* address = nullptr;
+        uint32_t    length = 0;
+        uint32_t    flags = 0;
+        int32_t     bufferIndex = -1;
+        bool        link = false;
+    };
+
+    struct Completion
+    {
+        int32_t     result = 0;
+        bool        done = false;
+    };
+
+    void setupRing();
+    void probeOperations();
+    void unmapRing();
+    void registerBuffers();
+
+    // Submits the requests with a single system call and waits until all of them completed
+    void execute(Request* requests, Completion* completions, size_t count);
+    void submit(io_uring_sqe* sqes, size_t count);
+    void prepare(const Request& request, Completion* completion, io_uring_sqe& sqe);
+    void reap();
+
+    size_t acquireBuffers(std::vector<uint16_t>& buffers, size_t count);
+    void releaseBuffers(const std::vector<uint16_t>& buffers);
+
+    static const uint32_t s_Entries;
+    static const uint32_t s_MaxFiles;
+    static const size_t s_PieceSize;
+    static const size_t s_BufferSize;
+    static const size_t s_BufferCount;
+
+    PosixStorage                            m_Fallback;
+    FileDescriptor                          m_Ring;
+
+    void*                                   m_SqRing;
+    size_t                                  m_SqRingSize;
+    void*                                   m_CqRing;
+    size_t                                  m_CqRingSize;
+    io_uring_sqe*                           m_Sqes;
+    size_t                                  m_SqesSize;
+
+    uint32_t*                               m_SqHead;
+    uint32_t*                               m_SqTail;
+    uint32_t                                m_SqMask;
+    uint32_t*                               m_SqArray;
+    uint32_t                                m_SqEntries;
+    uint32_t*                               m_CqHead;
+    uint32_t*                               m_CqTail;
+    uint32_t                                m_CqMask;
+    io_uring_cqe*                           m_Cqes;
+    uint32_t                                m_CqEntries;
+
+    std::mutex                              m_SubmitMutex;
+
+    std::mutex                              m_CompletionMutex;
+    std::condition_variable                 m_CompletionCondition;
+    uint32_t                                m_InFlight;
+    std::thread                             m_Reaper;
+
+    std::mutex                              m_FilesMutex;
+    bool                                    m_FilesRegistered;
+    std::unordered_map<int32_t, int32_t>    m_FileSlots;
+    std::vector<int32_t>                    m_FreeSlots;
+
+    std::mutex                              m_BuffersMutex;
+    bool                                    m_BuffersRegistered;
+    std::vector<uint8_t*>                   m_Buffers;
+    std::vector<uint16_t>                   m_FreeBuffers;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+#include "memorystorage.h"
+
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+
+const char* MemoryStorage::getName() const
+{
+    return "memory";
+}
+
+void MemoryStorage::registerFile(int32_t fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return;
+    }
+
+    FileKey key;
+    key.device      = info.st_dev;
+    key.inode       = info.st_ino;
+    key.size        = info.st_size;
+    key.modifyTime  = info.st_mtime;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto iter = m_Loaded.find(key);
+        if (iter != m_Loaded.end())
+        {
+            m_Files[fd] = iter->second;
+            return;
+        }
+    }
+
+    auto contents = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(info.st_size));
+    if (m_Posix.read(fd, 0, contents->data(), contents->size()) != contents->size())
+    {
+        // changed while loading, the reads go to the file
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Loaded[key] = contents;
+    m_Files[fd] = contents;
+}
+
+void MemoryStorage::unregisterFile(int32_t fd)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Files.erase(fd);
+}
+
+size_t MemoryStorage::read(int32_t fd, uint64_t offset, void* data, size_t size)
+{
+    auto contents = find(fd);
+    if (!contents)
+    {
+        return m_Posix.read(fd, offset, data, size);
+    }
+
+    if (offset >= contents->size())
+    {
+        return 0;
+    }
+
+    size = static_cast<size_t>(std::min<uint64_t>(size, contents->size() - offset));
+    memcpy(data, contents->data() + offset, size);
+    return size;
+}
+
+ssize_t MemoryStorage::write(int32_t fd, uint64_t offset, const iovec* iov, size_t count)
+{
+    return m_Posix.write(fd, offset, iov, count);
+}
+
+MemoryStorage::Contents MemoryStorage::find(int32_t fd) const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto iter = m_Files.find(fd);
+    return iter == m_Files.end() ? Contents() : iter->second;
+}
@@ -0,0 +1,64 @@
+#ifndef MEMORY_STORAGE_H
+#define MEMORY_STORAGE_H
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "storage.h"
+
+// Keeps the contents of the registered (open) files in memory and serves the reads from there,
+// so file reads cost a copy instead of a system call. Files are loaded completely when they are
+// first opened and stay loaded, meant for data sets that fit in memory like the ones of the
+// handler benchmark. Writes and reads of other files go to the posix backend.
+class MemoryStorage : public StorageBackend
+{
+public:
+    MemoryStorage() = default;
+
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+
+    const char* getName() const override;
+
+    void registerFile(int32_t fd) override;
+    void unregisterFile(int32_t fd) override;
+
+    size_t read(int32_t fd, uint64_t offset, void* data, size_t size) override;
+    ssize_t write(int32_t fd, uint64_t offset, const iovec* iov, size_t count) override;
+
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Contents;
+
+    struct FileKey
+    {
+        uint64_t    device;
+        uint64_t    inode;
+        uint64_t    size;
+        uint64_t    modifyTime;
+
+        bool operator==(const FileKey& other) const
+        {
+            return device == other.device && inode == other.inode && size == other.size && modifyTime == other.modifyTime;
+        }
+    };
+
+    struct FileKeyHash
+    {
+        size_t operator()(const FileKey& key) const
+        {
+            return std::hash<uint64_t>()(key.inode ^ (key.device << 32) ^ (key.size << 16) ^ key.modifyTime);
+        }
+    };
+
+    Contents find(int32_t fd) const;
+
+    PosixStorage                                        m_Posix;
+
+    mutable std::mutex                                  m_Mutex;
+    std::unordered_map<int32_t, Contents>               m_Files;
+    std::unordered_map<FileKey, Contents, FileKeyHash>  m_Loaded;
+};
+
+#endif
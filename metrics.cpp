@@ -0,0 +1,364 @@
+#include "metrics.h"
+
+#include <algorithm>
+
+#include "readahead.h"
+#include "directorylisting.h"
+
+const size_t Metrics::s_MaxFiles = 256;
+
+static uint64_t getMicroseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+static size_t getBucket(uint64_t microseconds)
+{
+    size_t bucket = 0;
+    while (microseconds > 0 && bucket < HistogramBuckets - 1)
+    {
+        microseconds >>= 1;
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+// Only the owning thread writes, so a load and store is enough and cheaper than an atomic add
+static void add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static uint64_t get(const std::atomic<uint64_t>& counter)
+{
+    return counter.load(std::memory_order_relaxed);
+}
+
+CommandMeter::CommandMeter()
+: m_Phase(Phase::Total)
+{
+}
+
+void CommandMeter::start()
+{
+    m_Start = m_PhaseStart = std::chrono::steady_clock::now();
+    m_Phase = Phase::Total;
+    m_Sample = CommandSample();
+}
+
+CommandSample CommandMeter::finish(bool failed)
+{
+    switchPhase(Phase::Total);
+    m_Sample.microseconds[static_cast<size_t>(Phase::Total)] = getMicroseconds(m_PhaseStart - m_Start);
+    m_Sample.failed = failed;
+    return m_Sample;
+}
+
+Phase CommandMeter::switchPhase(Phase phase)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (m_Phase != Phase::Total)
+    {
+        m_Sample.microseconds[static_cast<size_t>(m_Phase)] += getMicroseconds(now - m_PhaseStart);
+    }
+
+    auto previous = m_Phase;
+    m_Phase = phase;
+    m_PhaseStart = now;
+    return previous;
+}
+
+void CommandMeter::addBytesSent(uint64_t bytes)
+{
+    m_Sample.bytesSent += bytes;
+}
+
+void CommandMeter::addBytesReceived(uint64_t bytes)
+{
+    m_Sample.bytesReceived += bytes;
+}
+
+void ClientMetrics::add(const CommandSample& sample)
+{
+    ::add(commands, 1);
+    ::add(errors, sample.failed ? 1 : 0);
+    ::add(bytesSent, sample.bytesSent);
+    ::add(bytesReceived, sample.bytesReceived);
+}
+
+void FileMetrics::addBytesSent(uint64_t bytes)
+{
+    bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+PhaseScope::PhaseScope(CommandMeter& meter, Phase phase)
+: m_Meter(meter)
+, m_Previous(meter.switchPhase(phase))
+{
+}
+
+PhaseScope::~PhaseScope()
+{
+    m_Meter.switchPhase(m_Previous);
+}
+
+namespace
+{
+
+struct CommandCounters
+{
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   errors;
+    std::atomic<uint64_t>   bytesSent;
+    std::atomic<uint64_t>   bytesReceived;
+    std::atomic<uint64_t>   microseconds[PhaseCount];
+    std::atomic<uint64_t>   histograms[PhaseCount][HistogramBuckets];
+};
+
+// Value initialization (new ThreadCounters()) zeroes all counters
+struct ThreadCounters
+{
+    CommandCounters         commands[CommandCodeCount];
+};
+
+void addCounters(CommandTotals& totals, const CommandCounters& counters)
+{
+    totals.count            += get(counters.count);
+    totals.errors           += get(counters.errors);
+    totals.bytesSent        += get(counters.bytesSent);
+    totals.bytesReceived    += get(counters.bytesReceived);
+
+    for (size_t phase = 0; phase < PhaseCount; ++phase)
+    {
+        totals.microseconds[phase] += get(counters.microseconds[phase]);
+        for (size_t bucket = 0; bucket < HistogramBuckets; ++bucket)
+        {
+            totals.histograms[phase][bucket] += get(counters.histograms[phase][bucket]);
+        }
+    }
+}
+
+}
+
+// Counters of the running threads and the totals of the threads that exited
+struct MetricsRegistry
+{
+    std::mutex                                      mutex;
+    std::vector<std::unique_ptr<ThreadCounters>>    threads;
+    std::array<CommandTotals, CommandCodeCount>     retired;
+
+    ThreadCounters* addThread()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.emplace_back(new ThreadCounters());
+        return threads.back().get();
+    }
+
+    void retireThread(ThreadCounters* counters)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = std::find_if(threads.begin(), threads.end(), [counters] (const std::unique_ptr<ThreadCounters>& thread) {
+            return thread.get() == counters;
+        });
+
+        if (iter != threads.end())
+        {
+            for (size_t i = 0; i < CommandCodeCount; ++i)
+            {
+                addCounters(retired[i], (*iter)->commands[i]);
+            }
+
+            threads.erase(iter);
+        }
+    }
+};
+
+namespace
+{
+
+// The registry is shared with the threads, so a thread can exit after the metrics are destroyed
+struct ThreadSlot
+{
+    std::shared_ptr<MetricsRegistry>    registry;
+    ThreadCounters*                     counters = nullptr;
+
+    ~ThreadSlot()
+    {
+        if (registry)
+        {
+            registry->retireThread(counters);
+        }
+    }
+};
+
+thread_local ThreadSlot t_Slot;
+
+}
+
+Metrics::Metrics()
+: m_Registry(std::make_shared<MetricsRegistry>())
+, m_ConnectionsTotal(0)
+, m_ReadAheadHits(0)
+, m_ReadAheadMisses(0)
+, m_ReadAheadBytesPrefetched(0)
+, m_ReadAheadBytesServed(0)
+, m_ListingEntries(0)
+, m_ListingResolvedEntries(0)
+, m_ListingStatMicroseconds(0)
+, m_ListingWaitMicroseconds(0)
+{
+}
+
+Metrics::~Metrics() = default;
+
+void Metrics::recordCommand(CommandCode code, const CommandSample& sample)
+{
+    auto index = commandIndex(static_cast<uint16_t>(code));
+    if (index < 0)
+    {
+        return;
+    }
+
+    auto& slot = t_Slot;
+    if (slot.registry != m_Registry)
+    {
+        if (slot.registry)
+        {
+            slot.registry->retireThread(slot.counters);
+        }
+
+        slot.registry = m_Registry;
+        slot.counters = m_Registry->addThread();
+    }
+
+    auto& counters = slot.counters->commands[index];
+    add(counters.count, 1);
+    add(counters.errors, sample.failed ? 1 : 0);
+    add(counters.bytesSent, sample.bytesSent);
+    add(counters.bytesReceived, sample.bytesReceived);
+
+    for (size_t phase = 0; phase < PhaseCount; ++phase)
+    {
+        add(counters.microseconds[phase], sample.microseconds[phase]);
+        add(counters.histograms[phase][getBucket(sample.microseconds[phase])], 1);
+    }
+}
+
+std::shared_ptr<ClientMetrics> Metrics::addClient(const std::string& address)
+{
+    auto client = std::make_shared<ClientMetrics>();
+    client->address = address;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Clients.erase(std::remove_if(m_Clients.begin(), m_Clients.end(), [] (const std::weak_ptr<ClientMetrics>& client) {
+        return client.expired();
+    }), m_Clients.end());
+
+    m_Clients.push_back(client);
+    ++m_ConnectionsTotal;
+    return client;
+}
+
+std::shared_ptr<FileMetrics> Metrics::openFile(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto iter = m_Files.find(path);
+    if (iter == m_Files.end())
+    {
+        if (m_Files.size() >= s_MaxFiles)
+        {
+            // forget the closed file that was served the least
+            auto victim = m_Files.end();
+            for (auto file = m_Files.begin(); file != m_Files.end(); ++file)
+            {
+                if (file->second.use_count() == 1 && (victim == m_Files.end() || get(file->second->bytesSent) < get(victim->second->bytesSent)))
+                {
+                    victim = file;
+                }
+            }
+
+            if (victim != m_Files.end())
+            {
+                m_Files.erase(victim);
+            }
+        }
+
+        iter = m_Files.emplace(path, std::make_shared<FileMetrics>()).first;
+    }
+
+    iter->second->opens.fetch_add(1, std::memory_order_relaxed);
+    return iter->second;
+}
+
+void Metrics::addReadAhead(const ReadAheadStats& stats)
+{
+    m_ReadAheadHits.fetch_add(stats.hits, std::memory_order_relaxed);
+    m_ReadAheadMisses.fetch_add(stats.misses, std::memory_order_relaxed);
+    m_ReadAheadBytesPrefetched.fetch_add(stats.bytesPrefetched, std::memory_order_relaxed);
+    m_ReadAheadBytesServed.fetch_add(stats.bytesServed, std::memory_order_relaxed);
+}
+
+void Metrics::addDirectoryListing(const DirectoryListingStats& stats)
+{
+    m_ListingEntries.fetch_add(stats.entries, std::memory_order_relaxed);
+    m_ListingResolvedEntries.fetch_add(stats.resolvedEntries, std::memory_order_relaxed);
+    m_ListingStatMicroseconds.fetch_add(stats.statMicroseconds, std::memory_order_relaxed);
+    m_ListingWaitMicroseconds.fetch_add(stats.waitMicroseconds, std::memory_order_relaxed);
+}
+
+MetricsSnapshot Metrics::getSnapshot() const
+{
+    MetricsSnapshot snapshot;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Registry->mutex);
+        snapshot.commands = m_Registry->retired;
+        for (auto& thread : m_Registry->threads)
+        {
+            for (size_t i = 0; i < CommandCodeCount; ++i)
+            {
+                addCounters(snapshot.commands[i], thread->commands[i]);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (auto& weakClient : m_Clients)
+        {
+            if (auto client = weakClient.lock())
+            {
+                ClientTotals totals;
+                totals.address          = client->address;
+                totals.commands         = get(client->commands);
+                totals.errors           = get(client->errors);
+                totals.bytesSent        = get(client->bytesSent);
+                totals.bytesReceived    = get(client->bytesReceived);
+                snapshot.clients.push_back(totals);
+            }
+        }
+
+        for (auto& file : m_Files)
+        {
+            FileTotals totals;
+            totals.path         = file.first;
+            totals.opens        = get(file.second->opens);
+            totals.bytesSent    = get(file.second->bytesSent);
+            snapshot.files.push_back(totals);
+        }
+
+        snapshot.connectionsTotal = m_ConnectionsTotal;
+    }
+
+    snapshot.readAheadHits              = get(m_ReadAheadHits);
+    snapshot.readAheadMisses            = get(m_ReadAheadMisses);
+    snapshot.readAheadBytesPrefetched   = get(m_ReadAheadBytesPrefetched);
+    snapshot.readAheadBytesServed       = get(m_ReadAheadBytesServed);
+    snapshot.listingEntries             = get(m_ListingEntries);
+    snapshot.listingResolvedEntries     = get(m_ListingResolvedEntries);
+    snapshot.listingStatMicroseconds    = get(m_ListingStatMicroseconds);
+    snapshot.listingWaitMicroseconds    = get(m_ListingWaitMicroseconds);
+    return snapshot;
+}
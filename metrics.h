@@ -0,0 +1,194 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <unordered_map>
+
+#include "ps3protocol.h"
+
+struct ReadAheadStats;
+struct DirectoryListingStats;
+struct MetricsRegistry;
+
+enum class Phase
+{
+    Total,
+    Disk,
+    Socket
+};
+
+static constexpr size_t PhaseCount = 3;
+
+// Latencies in power of two microsecond buckets, the last bucket has no upper bound
+static constexpr size_t HistogramBuckets = 24;
+
+// Measurements of a single command
+struct CommandSample
+{
+    std::array<uint64_t, PhaseCount>    microseconds {{0, 0, 0}};
+    uint64_t                            bytesSent = 0;
+    uint64_t                            bytesReceived = 0;
+    bool                                failed = false;
+};
+
+// Splits the time of the executing command into disk, socket and other time
+// Owned by a single client, switching phases is nesting safe so disk time never includes
+// the socket time of replies written from within a file system operation.
+class CommandMeter
+{
+public:
+    CommandMeter();
+
+    void start();
+    CommandSample finish(bool failed);
+
+    std::chrono::steady_clock::time_point getStart() const
+    {
+        return m_Start;
+    }
+
+    // Returns the previous phase, Phase::Total means the time is not attributed to disk or socket
+    Phase switchPhase(Phase phase);
+
+    void addBytesSent(uint64_t bytes);
+    void addBytesReceived(uint64_t bytes);
+
+private:
+    std::chrono::steady_clock::time_point   m_Start;
+    std::chrono::steady_clock::time_point   m_PhaseStart;
+    Phase                                   m_Phase;
+    CommandSample                           m_Sample;
+};
+
+class PhaseScope
+{
+public:
+    PhaseScope(CommandMeter& meter, Phase phase);
+    ~PhaseScope();
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+    CommandMeter&   m_Meter;
+    Phase           m_Previous;
+};
+
+// Counters of a connection, only written by the thread serving the client
+struct ClientMetrics
+{
+    void add(const CommandSample& sample);
+
+    std::string             address;
+    std::atomic<uint64_t>   commands {0};
+    std::atomic<uint64_t>   errors {0};
+    std::atomic<uint64_t>   bytesSent {0};
+    std::atomic<uint64_t>   bytesReceived {0};
+};
+
+// Counters of a file, shared by all clients reading it
+struct FileMetrics
+{
+    void addBytesSent(uint64_t bytes);
+
+    std::atomic<uint64_t>   opens {0};
+    std::atomic<uint64_t>   bytesSent {0};
+};
+
+struct CommandTotals
+{
+    uint64_t                                                        count = 0;
+    uint64_t                                                        errors = 0;
+    uint64_t                                                        bytesSent = 0;
+    uint64_t                                                        bytesReceived = 0;
+    std::array<uint64_t, PhaseCount>                                microseconds {{0, 0, 0}};
+    std::array<std::array<uint64_t, HistogramBuckets>, PhaseCount>  histograms {};
+};
+
+struct ClientTotals
+{
+    std::string     address;
+    uint64_t        commands = 0;
+    uint64_t        errors = 0;
+    uint64_t        bytesSent = 0;
+    uint64_t        bytesReceived = 0;
+};
+
+struct FileTotals
+{
+    std::string     path;
+    uint64_t        opens = 0;
+    uint64_t        bytesSent = 0;
+};
+
+struct MetricsSnapshot
+{
+    std::array<CommandTotals, CommandCodeCount> commands;
+    std::vector<ClientTotals>                   clients;
+    std::vector<FileTotals>                     files;
+    uint64_t                                    connectionsTotal = 0;
+    uint64_t                                    readAheadHits = 0;
+    uint64_t                                    readAheadMisses = 0;
+    uint64_t                                    readAheadBytesPrefetched = 0;
+    uint64_t                                    readAheadBytesServed = 0;
+    uint64_t                                    listingEntries = 0;
+    uint64_t                                    listingResolvedEntries = 0;
+    uint64_t                                    listingStatMicroseconds = 0;
+    uint64_t                                    listingWaitMicroseconds = 0;
+};
+
+// Server wide command metrics
+// Commands are recorded in counters owned by the recording thread, so the hot path does not
+// lock or share cache lines. The counters of a thread are merged when the thread exits.
+// Client and file counters are registered once per connection or open.
+class Metrics
+{
+public:
+    Metrics();
+    ~Metrics();
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void recordCommand(CommandCode code, const CommandSample& sample);
+
+    std::shared_ptr<ClientMetrics> addClient(const std::string& address);
+    std::shared_ptr<FileMetrics> openFile(const std::string& path);
+
+    // Read-ahead statistics are added when the file is closed
+    void addReadAhead(const ReadAheadStats& stats);
+
+    // Directory listing statistics are added when the listing is closed
+    void addDirectoryListing(const DirectoryListingStats& stats);
+
+    MetricsSnapshot getSnapshot() const;
+
+private:
+    static const size_t s_MaxFiles;
+
+    std::shared_ptr<MetricsRegistry>                                m_Registry;
+
+    mutable std::mutex                                              m_Mutex;
+    std::vector<std::weak_ptr<ClientMetrics>>                       m_Clients;
+    std::unordered_map<std::string, std::shared_ptr<FileMetrics>>   m_Files;
+    uint64_t                                                        m_ConnectionsTotal;
+
+    std::atomic<uint64_t>                                           m_ReadAheadHits;
+    std::atomic<uint64_t>                                           m_ReadAheadMisses;
+    std::atomic<uint64_t>                                           m_ReadAheadBytesPrefetched;
+    std::atomic<uint64_t>                                           m_ReadAheadBytesServed;
+
+    std::atomic<uint64_t>                                           m_ListingEntries;
+    std::atomic<uint64_t>                                           m_ListingResolvedEntries;
+    std::atomic<uint64_t>                                           m_ListingStatMicroseconds;
+    std::atomic<uint64_t>                                           m_ListingWaitMicroseconds;
+};
+
+#endif
@@ -0,0 +1,1098 @@
+#include "ps3client.h"
+
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "rawsector.h"
+
+using namespace utils;
+
+Ps3Client::Ps3Client(ServerContext& context, std::unique_ptr<Transport> transport, uint32_t listener)
+: m_Context(context)
+, m_BufferPool(context.getBufferPool(listener))
+, m_Transport(std::make_unique<MeteredTransport>(std::move(transport), m_Meter))
+, m_ClientMetrics(context.metrics.addClient(m_Transport->getAddress()))
+, m_TraceClient(context.trace ? context.trace->addClient() : 0)
+, m_IoClient(context.ioScheduler.addClient(m_Transport->getAddress()))
+, m_CompressedNextOffset(0)
+, m_CachedNextOffset(0)
+, m_CachePrefetchBlock(0)
+, m_CacheReader(context.blockCache ? context.blockCache->addReader() : 0)
+, m_ZeroCopy(true)
+, m_StorageSend(true)
+, m_DirectoryPosition(0)
+{
+}
+
+Ps3Client::~Ps3Client()
+{
+    closeReadFile();
+    closeDirectory();
+
+    if (m_Context.trace)
+    {
+        TraceRecord record;
+        record.client = m_TraceClient;
+        m_Context.trace->record(std::chrono::steady_clock::now(), record);
+    }
+}
+
+std::string Ps3Client::getAddress() const
+{
+    return m_Transport->getAddress();
+}
+
+void Ps3Client::openFileForReading()
+{
+    OpenFileReply reply;
+
+    try
+    {
+        closeReadFile();
+
+        const auto& path = readFilePath();
+
+        std::string directory;
+        VirtualIsoType type;
+        if (getVirtualIsoDirectory(directory, type))
+        {
+            {
+                PhaseScope scope(m_Meter, Phase::Disk);
+                m_VirtualIso = m_Context.virtualIsos->open(directory, type);
+            }
+
+            if (m_VirtualIso)
+            {
+                m_ReadFileMetrics = m_Context.metrics.openFile(path);
+
+                reply.size      = m_VirtualIso->getSize();
+                reply.mtime     = m_VirtualIso->getModifyTime();
+            }
+        }
+        else
+        {
+            PhaseScope scope(m_Meter, Phase::Disk);
+
+            // consoles keep asking for files that do not exist
+            if (m_Context.statCache.stat(path).exists)
+            {
+                m_ReadFile = m_Context.fileCache.open(path);
+            }
+
+            if (m_ReadFile && isCompressedImagePath(path))
+            {
+                m_CompressedImage = m_Context.compressedImages.open(path, m_ReadFile);
+                if (m_CompressedImage)
+                {
+                    // the compressed file is only read through the image
+                    m_ReadFile.reset();
+                }
+            }
+        }
+
+        if (m_CompressedImage)
+        {
+            m_ReadFileMetrics = m_Context.metrics.openFile(path);
+            m_CompressedNextOffset = 0;
+
+            reply.size      = m_CompressedImage->getSize();
+            reply.mtime     = m_CompressedImage->getModifyTime();
+        }
+
+        if (m_ReadFile)
+        {
+            m_ReadFileMetrics = m_Context.metrics.openFile(path);
+
+            reply.size      = m_ReadFile->getSize();
+            reply.mtime     = m_ReadFile->getModifyTime();
+
+            m_CachedNextOffset = 0;
+            m_CachePrefetchBlock = 0;
+
+            // the block cache prefetches the blocks of streams itself
+            if (m_Context.settings.readAheadWindow > 0 && !isBlockCached())
+            {
+                m_ReadAhead = std::make_unique<ReadAhead>(m_Context.ioThreads, m_BufferPool, *m_Context.storage, m_ReadFile->getFd(), m_ReadFile->getSize(), m_Context.settings.readAheadWindow);
+            }
+        }
+    }
+    catch (ConnectionTimeout&)
+    {
+        throw;
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR(e.what());
+    }
+
+    writeReply(reply);
+}
+
+void Ps3Client::getFileStats()
+{
+    FileReply reply;
+
+    try
+    {
+        const auto& path = readFilePath();
+
+        PhaseScope scope(m_Meter, Phase::Disk);
+
+        std::string directory;
+        VirtualIsoType type;
+        if (getVirtualIsoDirectory(directory, type))
+        {
+            auto image = m_Context.virtualIsos->open(directory, type);
+            if (!image)
+            {
+                throw std::logic_error(stringops::format("Failed to lay out an image of %s", directory));
+            }
+
+            reply.size          = image->getSize();
+            reply.atime         = image->getModifyTime();
+            reply.ctime         = image->getModifyTime();
+            reply.mtime         = image->getModifyTime();
+            reply.isDirectory   = 0;
+        }
+        else
+        {
+            auto status = m_Context.statCache.stat(path);
+            if (!status.exists)
+            {
+                throw std::logic_error(stringops::format("Failed to get file info: %s", path));
+            }
+
+            reply.size          = status.size;
+            reply.atime         = status.accessTime;
+            reply.ctime         = status.createTime;
+            reply.mtime         = status.modifyTime;
+            reply.isDirectory   = status.isDirectory ? 1 : 0;
+
+            if (!reply.isDirectory && isCompressedImagePath(path))
+            {
+                auto file = m_Context.fileCache.open(path);
+                auto image = file ? m_Context.compressedImages.open(path, file) : nullptr;
+                if (image)
+                {
+                    reply.size  = image->getSize();
+                }
+            }
+        }
+    }
+    catch (ConnectionTimeout&)
+    {
+        throw;
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR(e.what());
+        reply.size = -1;
+    }
+    
+    writeReply(reply);
+}
+
+void Ps3Client::readFile()
+{
+    throwOnBadReadFile();
+
+    // requests that bypass the buffered reads only update the read-ahead pattern once they were
+    // served, the buffered reads update it themselves
+    auto hintReadAhead = [this] () {
+        if (m_ReadAhead)
+        {
+            m_ReadAhead->hint(m_Command.offset, m_Command.count);
+        }
+    };
+
+    if (sendFileData(m_Command.offset, m_Command.count))
+    {
+        hintReadAhead();
+        return;
+    }
+
+    auto* mapping = m_ReadFile ? m_ReadFile->getMapping() : nullptr;
+    if (mapping)
+    {
+        throwOnBadReadFileStatus(m_Command.offset <= m_ReadFile->getSize() ? std::min<uint64_t>(m_Command.count, m_ReadFile->getSize() - m_Command.offset) : 0, m_Command.count);
+        m_Transport->write(mapping + m_Command.offset, m_Command.count);
+        hintReadAhead();
+        return;
+    }
+
+    if (sendStorageData(m_Command.offset, m_Command.count))
+    {
+        hintReadAhead();
+        return;
+    }
+
+    auto buffer = m_BufferPool.acquire(std::min(m_Command.count, m_BufferSize));
+
+    uint64_t offset = m_Command.offset;
+    uint32_t bytesToRead = m_Command.count;
+    while (bytesToRead > 0)
+    {
+        auto bufSize = m_BufferSize;
+        uint32_t size = std::min(bytesToRead, bufSize);
+        size_t prefetched = m_ReadAhead ? m_ReadAhead->read(offset, buffer.data(), size) : 0;
+        throwOnBadReadFileStatus(prefetched + readFromFile(offset + prefetched, buffer.data() + prefetched, size - prefetched), size);
+        m_Transport->write(buffer.data(), size);
+        offset += size;
+        bytesToRead -= size;
+    }
+}
+
+void Ps3Client::customReadFile()
+{
+    LOG_DEBUG(__FUNCTION__);
+
+    throwOnBadReadFile();
+    uint64_t offset = rawsector::SectorSize * uint64_t(m_Command.count);
+    uint32_t chunks = m_Command.offset >> 32;
+
+    if ((uint64_t(chunks) * m_ChunkSize) > m_BufferSize)
+    {
+        throw std::logic_error("Too many chunks requested");
+    }
+
+    auto buffer = m_BufferPool.acquire(static_cast<size_t>(std::min<uint64_t>(uint64_t(chunks) * rawsector::SectorSize, m_BufferSize)));
+
+    size_t outputSize = 0;
+    uint32_t sector = 0;
+
+    if (auto* mapping = m_ReadFile ? m_ReadFile->getMapping() : nullptr)
+    {
+        // sectors that are completely inside the file are compacted straight from the mapping
+        auto fileSize = m_ReadFile->getSize();
+        sector = offset < fileSize ? static_cast<uint32_t>(std::min<uint64_t>(chunks, (fileSize - offset) / rawsector::SectorSize)) : 0;
+        rawsector::extractUserData(mapping + offset, sector, buffer.data());
+        outputSize = sector * m_ChunkSize;
+        offset += sector * rawsector::SectorSize;
+    }
+
+    // the raw sectors are read in large batches, each batch is read right behind the
+    // user data extracted so far and compacted in place
+    while (sector < chunks)
+    {
+        uint8_t* pCurrent = buffer.data() + outputSize;
+        uint32_t batch = std::min<uint32_t>(chunks - sector, (buffer.size() - outputSize) / rawsector::SectorSize);
+
+        if (batch == 0)
+        {
+            // no room left for a complete raw sector, read the user data directly
+            batch = 1;
+            auto bytesRead = readFromFile(offset + rawsector::UserDataOffset, pCurrent, m_ChunkSize);
+            memset(pCurrent + bytesRead, 0, m_ChunkSize - bytesRead);
+        }
+        else
+        {
+            auto size = batch * rawsector::SectorSize;
+            auto bytesRead = readFromFile(offset, pCurrent, size);
+            memset(pCurrent + bytesRead, 0, size - bytesRead);
+            rawsector::extractUserData(pCurrent, batch, pCurrent);
+        }
+
+        outputSize += batch * m_ChunkSize;
+        offset += batch * rawsector::SectorSize;
+        sector += batch;
+    }
+
+    m_Transport->write(buffer.data(), chunks * m_ChunkSize);
+
+    LOG_DEBUG("%s done", __FUNCTION__);
+}
+
+void Ps3Client::readShortFile()
+{
+    throwOnBadReadFile();
+
+    if (m_Command.count > m_BufferSize)
+    {
+        throw std::logic_error("Short file size is larger then buffer size");
+    }
+    
+    uint32_t available = 0;
+    auto fileSize = getReadFileSize();
+    if (m_Command.offset < fileSize)
+    {
+        available = static_cast<uint32_t>(std::min<uint64_t>(m_Command.count, fileSize - m_Command.offset));
+    }
+
+    CountReply reply;
+    reply.count = available;
+    writeReply(reply);
+    if (!sendFileData(m_Command.offset, available))
+    {
+        auto buffer = m_BufferPool.acquire(available);
+        throwOnBadReadFileStatus(readFromFile(m_Command.offset, buffer.data(), available), available);
+        m_Transport->write(buffer.data(), available);
+    }
+}
+
+void Ps3Client::openFileForWriting()
+{
+    auto path = readFilePath();
+
+    // a failure of the previous file is reported here, its last writes were not waited for
+    // closing invalidates the cached stats of the previous path, so the new path is set after it
+    if (!closeWriteFile())
+    {
+        writeFailureReply();
+        return;
+    }
+
+    m_WritePath = path;
+
+    try
+    {
+        m_WriteFile = std::make_unique<FileWriter>(m_Context.writeThreads, *m_Context.storage, path, m_Context.settings.syncPolicy);
+        m_Context.statCache.invalidate(path);
+        writeSuccessReply();
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR(e.what());
+        writeFailureReply();
+    }
+}
+
+void Ps3Client::writeToFile()
+{
+    throwOnBadWriteFile();
+
+    if (m_Command.count > m_BufferSize)
+    {
+        throw std::logic_error("Data to write is larger then buffer size");
+    }
+    
+    auto buffer = m_BufferPool.acquire(m_Command.count);
+    m_Transport->read(buffer.data(), m_Command.count);
+
+    bool written;
+    {
+        PhaseScope scope(m_Meter, Phase::Disk);
+        written = m_WriteFile->write(std::move(buffer), m_Command.count);
+    }
+
+    if (written)
+    {
+        CountReply reply;
+        reply.count = m_Command.count;
+        writeReply(reply);
+    }
+    else
+    {
+        writeFailureReply();
+    }
+}
+
+void Ps3Client::deleteFile()
+{
+    filesystemOperation([this] () {
+        const auto& path = readFilePath();
+        fileops::deleteFile(path);
+        m_Context.statCache.invalidate(path);
+        writeSuccessReply();
+    });
+}
+
+void Ps3Client::openDirectory()
+{
+    LOG_DEBUG(__FUNCTION__);
+    
+    filesystemOperation([this] () {
+        closeDirectory();
+        m_Directory = std::make_unique<DirectoryListing>(m_Context.metadataThreads, readFilePath());
+        m_DirectoryPosition = 0;
+        writeSuccessReply();
+    });
+    
+    LOG_DEBUG("%s done", __FUNCTION__);
+}
+
+void Ps3Client::makeDirectory()
+{
+    filesystemOperation([this] () {
+        const auto& path = readFilePath();
+        fileops::createDirectory(path);
+        m_Context.statCache.invalidate(path);
+        writeSuccessReply();
+    });
+}
+
+void Ps3Client::removeDirectory()
+{
+    filesystemOperation([this] () {
+        const auto& path = readFilePath();
+        fileops::deleteDirectory(path);
+        m_Context.statCache.invalidate(path);
+        writeSuccessReply();
+    });
+}
+
+void Ps3Client::getDirectorySize()
+{
+    filesystemOperation([this] () {
+        auto path = readFilePath();
+
+        uint64_t size;
+        if (!m_Context.sizeIndex || !m_Context.sizeIndex->getSize(path, size))
+        {
+            size = fileops::calculateDirectorySize(path);
+        }
+
+        DirectorySizeReply reply;
+        reply.size = static_cast<int64_t>(size);
+        writeReply(reply);
+    });
+}
+
+void Ps3Client::getDirectoryContents()
+{
+    if (!m_Directory)
+    {
+        throw std::logic_error("No directory was opened before listing request");
+    }
+
+    try
+    {
+        DirectoryCache::Contents contents;
+        {
+            PhaseScope scope(m_Meter, Phase::Disk);
+            contents = m_Context.directoryCache.getContents(m_Directory->getPath());
+        }
+
+        m_Transport->write(contents->data(), contents->size());
+    }
+    catch (std::logic_error& e)
+    {
+        LOG_ERROR(e.what());
+
+        writeReply(ReadDirectoryReply());
+    }
+}
+
+void Ps3Client::listDirectoryEntryShort()
+{
+    LOG_DEBUG(__FUNCTION__);
+    
+    if (!m_Directory)
+    {
+        throw std::logic_error("No directory was opened before listing request");
+    }
+
+    try
+    {
+        FileReplyShort reply;
+
+        if (m_DirectoryPosition == m_Directory->getCount())
+        {
+            closeDirectory();
+            reply.size = -1LL;
+            writeReply(reply);
+            return;
+        }
+        else
+        {
+            auto& entry = getDirectoryEntry();
+            reply.isDirectory   = entry.isDirectory ? 1 : 0;
+            reply.size          = reply.isDirectory ? 0 : entry.size;
+            reply.nameLength    = static_cast<uint16_t>(entry.name.size());
+
+            writeReply(reply, entry.name);
+        }
+    }
+    catch (std::logic_error& e)
+    {
+        LOG_ERROR(e.what());
+
+        FileReplyShort reply;
+        reply.size = -1LL;
+        writeReply(reply);
+    }
+
+    ++m_DirectoryPosition;
+    
+    LOG_DEBUG("%s done", __FUNCTION__);
+}
+
+void Ps3Client::listDirectoryEntryLong()
+{
+    if (!m_Directory)
+    {
+        throw std::logic_error("No directory was opened before listing request");
+    }
+
+    try
+    {
+        FileReplyLong reply;
+
+        if (m_DirectoryPosition == m_Directory->getCount())
+        {
+            closeDirectory();
+            reply.size = -1LL;
+            writeReply(reply);
+            return;
+        }
+        else
+        {
+            auto& entry = getDirectoryEntry();
+            reply.isDirectory   = entry.isDirectory ? 1 : 0;
+            reply.size          = reply.isDirectory ? 0 : entry.size;
+            reply.nameLength    = static_cast<uint16_t>(entry.name.size());
+            reply.mtime         = entry.modifyTime;
+            reply.ctime         = entry.createTime;
+            reply.atime         = entry.accessTime;
+
+            writeReply(reply, entry.name);
+        }
+    }
+    catch (std::logic_error& e)
+    {
+        LOG_ERROR(e.what());
+
+        FileReplyLong reply;
+        reply.size = -1LL;
+        writeReply(reply);
+    }
+
+    ++m_DirectoryPosition;
+}
+
+void Ps3Client::run()
+{
+    try
+    {
+        for (;;)
+        {
+            uint8_t data[wire::size<Command>()];
+            if (m_Transport->read(data, sizeof(data)) != sizeof(data))
+            {
+                break;
+            }
+
+            Command command;
+            wire::decode(data, command);
+            handleCommand(command);
+        }
+    }
+    catch (ConnectionTimeout& e)
+    {
+        LOG_INFO("Closing connection of %s: %s", getAddress(), e.what());
+        m_Transport->close();
+        m_Context.admission.addTimeout(e.isIdle());
+    }
+    catch (std::exception& e)
+    {
+        m_Transport->close();
+        LOG_ERROR(e.what());
+    }
+}
+
+void Ps3Client::handleCommand(const Command& command)
+{
+    m_Command = command;
+    m_CommandPath.clear();
+    m_Meter.start();
+
+    try
+    {
+        executeCommand();
+
+        // the reply is complete, every command ends here
+        m_Transport->flush();
+    }
+    catch (std::exception&)
+    {
+        recordCommand(true);
+        throw;
+    }
+
+    recordCommand(false);
+}
+
+void Ps3Client::executeCommand()
+{
+    // the event engine admitted the command before
+    auto grant = m_Grant ? std::move(m_Grant) : scheduleCommand();
+
+    // other commands have to see everything that was written
+    if (m_WriteFile && static_cast<CommandCode>(m_Command.code) != CommandCode::WriteToFile)
+    {
+        PhaseScope scope(m_Meter, Phase::Disk);
+        m_WriteFile->flush();
+        m_Context.statCache.invalidate(m_WritePath);
+    }
+
+    switch (static_cast<CommandCode>(m_Command.code))
+    {
+    case CommandCode::OpenFileForReading:       openFileForReading();           break;
+    case CommandCode::ReadFile:                 readFile();                     break;
+    case CommandCode::CustomReadFile:           customReadFile();               break;
+    case CommandCode::ReadShortFile:            readShortFile();                break;
+    case CommandCode::OpenFileForWriting:       openFileForWriting();           break;
+    case CommandCode::WriteToFile:              writeToFile();                  break;
+    case CommandCode::OpenDirectory:            openDirectory();                break;
+    case CommandCode::ListDirectoryEntryShort:  listDirectoryEntryShort();      break;
+    case CommandCode::DeleteFile:               deleteFile();                   break;
+    case CommandCode::MakeDirectory:            makeDirectory();                break;
+    case CommandCode::RemoveDirectory:          removeDirectory();              break;
+    case CommandCode::ListDirectoryEntryLong:   listDirectoryEntryLong();       break;
+    case CommandCode::GetFileStats:             getFileStats();                 break;
+    case CommandCode::GetDirectorySize:         getDirectorySize();             break;
+    case CommandCode::GetDirectoryContents:     getDirectoryContents();         break;
+    default:
+        throw std::logic_error(stringops::format("Unknown command: %d", m_Command.code));
+        break;
+    }
+}
+
+// Waits for the scheduler, large transfers compete as bulk requests
+IoGrant Ps3Client::scheduleCommand()
+{
+    uint64_t bytes;
+    auto ioClass = getIoClass(m_Command, bytes);
+    return m_Context.ioScheduler.acquire(*m_IoClient, ioClass, bytes);
+}
+
+bool Ps3Client::tryScheduleCommand(const Command& command, std::chrono::steady_clock::time_point& retry)
+{
+    uint64_t bytes;
+    auto ioClass = getIoClass(command, bytes);
+    m_Grant = m_Context.ioScheduler.tryAcquire(*m_IoClient, ioClass, bytes, retry);
+    return static_cast<bool>(m_Grant);
+}
+
+IoClass Ps3Client::getIoClass(const Command& command, uint64_t& bytes)
+{
+    switch (static_cast<CommandCode>(command.code))
+    {
+    case CommandCode::ReadFile:
+    case CommandCode::WriteToFile:
+        bytes = command.count;
+        return IoClass::Bulk;
+    case CommandCode::CustomReadFile:
+        bytes = (command.offset >> 32) * rawsector::SectorSize;
+        return IoClass::Interactive;
+    case CommandCode::ReadShortFile:
+        bytes = command.count;
+        return IoClass::Interactive;
+    default:
+        bytes = 0;
+        return IoClass::Interactive;
+    }
+}
+
+void Ps3Client::recordCommand(bool failed)
+{
+    auto code = static_cast<CommandCode>(m_Command.code);
+    auto sample = m_Meter.finish(failed);
+
+    m_Context.metrics.recordCommand(code, sample);
+    m_ClientMetrics->add(sample);
+
+    if (m_ReadFileMetrics && (code == CommandCode::ReadFile || code == CommandCode::CustomReadFile || code == CommandCode::ReadShortFile))
+    {
+        m_ReadFileMetrics->addBytesSent(sample.bytesSent);
+    }
+
+    if (m_Context.trace)
+    {
+        traceCommand(sample);
+    }
+}
+
+void Ps3Client::traceCommand(const CommandSample& sample)
+{
+    TraceRecord record;
+    record.client       = m_TraceClient;
+    record.code         = m_Command.code;
+    record.count        = m_Command.count;
+    record.offset       = m_Command.offset;
+    record.path         = m_CommandPath;
+    record.replyBytes   = sample.bytesSent;
+    record.duration     = sample.microseconds[static_cast<size_t>(Phase::Total)];
+
+    m_Context.trace->record(m_Meter.getStart(), record);
+}
+
+// The path buffers keep their capacity, so resolving the path of a command does not allocate
+const std::string& Ps3Client::readFilePath()
+{
+    m_CommandPath.resize(m_Command.size);
+    if (m_Command.size > 0 && m_Transport->read(&m_CommandPath[0], m_Command.size) != m_Command.size)
+    {
+        throw std::logic_error("Command payload is shorter than the path");
+    }
+
+    auto& root = m_Context.settings.rootPath;
+    m_FilePath.assign(root);
+    if (!root.empty() && root.back() != '/' && !m_CommandPath.empty() && m_CommandPath.front() != '/')
+    {
+        m_FilePath += '/';
+    }
+
+    m_FilePath.append(m_CommandPath, !root.empty() && root.back() == '/' && !m_CommandPath.empty() && m_CommandPath.front() == '/' ? 1 : 0, std::string::npos);
+    return m_FilePath;
+}
+
+void Ps3Client::writeSuccessReply()
+{
+    writeReply(StatusReply());
+}
+
+void Ps3Client::writeFailureReply()
+{
+    StatusReply reply;
+    reply.result = -1;
+    writeReply(reply);
+}
+
+const DirectoryEntry& Ps3Client::getDirectoryEntry()
+{
+    PhaseScope scope(m_Meter, Phase::Disk);
+    auto& entry = m_Directory->getEntry(m_DirectoryPosition);
+    if (!entry.isValid)
+    {
+        throw std::logic_error(stringops::format("Failed to get file info: %s/%s", m_Directory->getPath(), entry.name));
+    }
+
+    return entry;
+}
+
+void Ps3Client::filesystemOperation(std::function<void()> func)
+{
+    try
+    {
+        PhaseScope scope(m_Meter, Phase::Disk);
+        func();
+    }
+    catch (ConnectionTimeout&)
+    {
+        // the payload of the command did not arrive, the connection is closed
+        throw;
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR(e.what());
+        writeFailureReply();
+    }
+}
+
+size_t Ps3Client::readFromFile(uint64_t offset, void* data, size_t size)
+{
+    PhaseScope scope(m_Meter, Phase::Disk);
+
+    if (m_VirtualIso)
+    {
+        return readFromVirtualIso(offset, data, size);
+    }
+
+    if (m_CompressedImage)
+    {
+        // consecutive reads make the cache decompress the following chunks in advance
+        auto bytesRead = m_Context.compressedImages.read(m_CompressedImage, offset, reinterpret_cast<uint8_t*>(data), size, offset == m_CompressedNextOffset);
+        m_CompressedNextOffset = offset + bytesRead;
+        return bytesRead;
+    }
+
+    if (auto* mapping = m_ReadFile->getMapping())
+    {
+        auto fileSize = m_ReadFile->getSize();
+        size = offset < fileSize ? static_cast<size_t>(std::min<uint64_t>(size, fileSize - offset)) : 0;
+        memcpy(data, mapping + offset, size);
+        return size;
+    }
+
+    if (m_Context.blockCache)
+    {
+        return readFromBlockCache(offset, data, size);
+    }
+
+    return m_Context.storage->read(m_ReadFile->getFd(), offset, data, size);
+}
+
+void Ps3Client::closeReadFile()
+{
+    if (m_ReadAhead)
+    {
+        auto stats = m_ReadAhead->getStats();
+        LOG_DEBUG("Read-ahead: %d hits, %d misses, %d KB prefetched, %d KB served from memory", stats.hits, stats.misses, stats.bytesPrefetched / 1024, stats.bytesServed / 1024);
+        m_Context.metrics.addReadAhead(stats);
+    }
+
+    // pending prefetches use the descriptor so they have to finish first
+    m_ReadAhead.reset();
+    m_ReadFile.reset();
+    m_VirtualIso.reset();
+    m_CompressedImage.reset();
+    m_ReadFileMetrics.reset();
+}
+
+void Ps3Client::closeDirectory()
+{
+    if (m_Directory)
+    {
+        m_Context.metrics.addDirectoryListing(m_Directory->getStats());
+        m_Directory.reset();
+    }
+}
+
+bool Ps3Client::sendFileData(uint64_t offset, uint64_t count)
+{
+    if (m_VirtualIso)
+    {
+        sendVirtualIsoData(offset, count);
+        return true;
+    }
+
+    if (m_CompressedImage || isBlockCached())
+    {
+        // the data only exists after decompression, or is sent from the block cache
+        return false;
+    }
+
+    return sendFile(m_ReadFile->getFd(), offset, count);
+}
+
+bool Ps3Client::sendFile(int32_t fd, uint64_t offset, uint64_t count)
+{
+    if (!m_ZeroCopy)
+    {
+        return false;
+    }
+
+    if (!m_Transport->sendFile(fd, offset, count))
+    {
+        LOG_DEBUG("Zero-copy transfer not available, falling back to buffered reads");
+        m_ZeroCopy = false;
+        return false;
+    }
+
+    return true;
+}
+
+// The storage backend reads the range and sends it without returning in between
+bool Ps3Client::sendStorageData(uint64_t offset, uint64_t count)
+{
+    if (!m_StorageSend || !m_ReadFile || isBlockCached())
+    {
+        return false;
+    }
+
+    if (offset + count > m_ReadFile->getSize())
+    {
+        // short reads are reported by the buffered path
+        return false;
+    }
+
+    if (!m_Transport->sendStorageData(*m_Context.storage, m_ReadFile->getFd(), offset, count))
+    {
+        LOG_DEBUG("Storage backend can not send file data, falling back to buffered reads");
+        m_StorageSend = false;
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t Ps3Client::getReadFileSize() const
+{
+    if (m_VirtualIso)
+    {
+        return m_VirtualIso->getSize();
+    }
+
+    return m_CompressedImage ? m_CompressedImage->getSize() : m_ReadFile->getSize();
+}
+
+// Mapped files are served from the mapping, the page cache already holds their data
+bool Ps3Client::isBlockCached() const
+{
+    return m_Context.blockCache && m_ReadFile && !m_ReadFile->getMapping();
+}
+
+size_t Ps3Client::readFromBlockCache(uint64_t offset, void* data, size_t size)
+{
+    auto* pData = reinterpret_cast<uint8_t*>(data);
+    bool sequential = offset == m_CachedNextOffset;
+
+    size_t bytesRead = 0;
+    while (bytesRead < size)
+    {
+        auto position = offset + bytesRead;
+        auto block = m_Context.blockCache->read(m_CacheReader, *m_ReadFile, position / BlockCache::BlockSize);
+        auto blockOffset = static_cast<size_t>(position % BlockCache::BlockSize);
+        if (blockOffset >= block->size())
+        {
+            break;
+        }
+
+        auto length = std::min(size - bytesRead, block->size() - blockOffset);
+        memcpy(pData + bytesRead, block->data() + blockOffset, length);
+        bytesRead += length;
+    }
+
+    m_CachedNextOffset = offset + bytesRead;
+
+    // streams load the next block while the current one is sent
+    auto nextBlock = m_CachedNextOffset / BlockCache::BlockSize + 1;
+    if (sequential && nextBlock != m_CachePrefetchBlock)
+    {
+        m_CachePrefetchBlock = nextBlock;
+        m_Context.blockCache->prefetch(m_CacheReader, m_ReadFile, nextBlock);
+    }
+
+    return bytesRead;
+}
+
+bool Ps3Client::getVirtualIsoDirectory(std::string& directory, VirtualIsoType& type) const
+{
+    if (!m_Context.virtualIsos || !parseVirtualIsoPath(m_CommandPath, directory, type))
+    {
+        return false;
+    }
+
+    directory = fileops::combinePath(m_Context.settings.rootPath, directory);
+    return true;
+}
+
+std::shared_ptr<OpenFile> Ps3Client::openVirtualIsoFile(const VirtualIsoFile& file)
+{
+    std::shared_ptr<OpenFile> openFile;
+    {
+        PhaseScope scope(m_Meter, Phase::Disk);
+        openFile = m_Context.fileCache.open(file.path);
+    }
+
+    if (!openFile)
+    {
+        throw std::logic_error(stringops::format("Failed to open %s for the image", file.path));
+    }
+
+    return openFile;
+}
+
+// Segments are sent from where they are: metadata from memory, file extents from the files
+void Ps3Client::sendVirtualIsoData(uint64_t offset, uint64_t count)
+{
+    static const std::array<uint8_t, 2048> padding {};
+
+    if (offset + count > m_VirtualIso->getSize())
+    {
+        throw std::logic_error("File is not ok for reading");
+    }
+
+    m_VirtualIso->forEachSegment(offset, count, [this] (const VirtualIsoSegment& segment) {
+        if (segment.data)
+        {
+            m_Transport->write(segment.data, segment.size);
+        }
+        else if (segment.file)
+        {
+            sendVirtualIsoFile(*segment.file, segment.fileOffset, segment.size);
+        }
+        else
+        {
+            for (uint64_t sent = 0; sent < segment.size; sent += padding.size())
+            {
+                m_Transport->write(padding.data(), static_cast<size_t>(std::min<uint64_t>(padding.size(), segment.size - sent)));
+            }
+        }
+    });
+}
+
+void Ps3Client::sendVirtualIsoFile(const VirtualIsoFile& file, uint64_t offset, uint64_t count)
+{
+    auto openFile = openVirtualIsoFile(file);
+    if (sendFile(openFile->getFd(), offset, count))
+    {
+        return;
+    }
+
+    auto buffer = m_BufferPool.acquire(static_cast<size_t>(std::min<uint64_t>(count, m_BufferSize)));
+    while (count > 0)
+    {
+        auto size = static_cast<size_t>(std::min<uint64_t>(count, m_BufferSize));
+        {
+            PhaseScope scope(m_Meter, Phase::Disk);
+            throwOnBadReadFileStatus(m_Context.storage->read(openFile->getFd(), offset, buffer.data(), size), size);
+        }
+
+        m_Transport->write(buffer.data(), size);
+        offset += size;
+        count -= size;
+    }
+}
+
+size_t Ps3Client::readFromVirtualIso(uint64_t offset, void* data, size_t size)
+{
+    auto* pData = reinterpret_cast<uint8_t*>(data);
+    size_t bytesRead = 0;
+
+    m_VirtualIso->forEachSegment(offset, size, [this, pData, &bytesRead] (const VirtualIsoSegment& segment) {
+        auto* pOutput = pData + bytesRead;
+        auto segmentSize = static_cast<size_t>(segment.size);
+
+        if (segment.data)
+        {
+            memcpy(pOutput, segment.data, segmentSize);
+        }
+        else if (segment.file)
+        {
+            auto openFile = openVirtualIsoFile(*segment.file);
+            throwOnBadReadFileStatus(m_Context.storage->read(openFile->getFd(), segment.fileOffset, pOutput, segmentSize), segmentSize);
+        }
+        else
+        {
+            memset(pOutput, 0, segmentSize);
+        }
+
+        bytesRead += segmentSize;
+    });
+
+    return bytesRead;
+}
+
+void Ps3Client::throwOnBadReadFile()
+{
+    if (!m_ReadFile && !m_VirtualIso && !m_CompressedImage)
+    {
+        throw std::logic_error("Invalid file handle for reading");
+    }
+}
+
+void Ps3Client::throwOnBadReadFileStatus(size_t bytesRead, size_t bytesRequested)
+{
+    if (bytesRead != bytesRequested)
+    {
+        throw std::logic_error("File is not ok for reading");
+    }
+}
+
+void Ps3Client::throwOnBadWriteFile()
+{
+    if (!m_WriteFile)
+    {
+        throw std::logic_error("Invalid file handle for writing");
+    }
+}
+
+bool Ps3Client::closeWriteFile()
+{
+    if (!m_WriteFile)
+    {
+        return true;
+    }
+
+    PhaseScope scope(m_Meter, Phase::Disk);
+    auto result = m_WriteFile->close();
+    m_WriteFile.reset();
+    m_Context.statCache.invalidate(m_WritePath);
+    return result;
+}
@@ -0,0 +1,141 @@
+#ifndef PS3_CLIENT_H
+#define PS3_CLIENT_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <functional>
+
+#include "utils/fileoperations.h"
+
+#include "ps3protocol.h"
+#include "transport.h"
+#include "servercontext.h"
+#include "readahead.h"
+#include "directorylisting.h"
+#include "compressedimage.h"
+#include "filecache.h"
+#include "filewriter.h"
+#include "ioscheduler.h"
+#include "virtualiso.h"
+#include "metrics.h"
+
+class Ps3Client
+{
+public:
+    // The client uses the buffer pool of the listener that accepted the connection
+    Ps3Client(ServerContext& context, std::unique_ptr<Transport> transport, uint32_t listener = 0);
+    ~Ps3Client();
+
+    std::string getAddress() const;
+
+    // Blocking command loop, returns when the connection is closed
+    void run();
+
+    // Executes a single decoded command, throws on protocol errors
+    void handleCommand(const Command& command);
+
+    // Admits the command to the io scheduler without blocking, returns false when the client
+    // has to wait until retry (event engine). handleCommand uses the admission, without it
+    // handleCommand waits for the scheduler.
+    bool tryScheduleCommand(const Command& command, std::chrono::steady_clock::time_point& retry);
+
+    void openFileForReading();
+    void getFileStats();
+    void readFile();
+    void customReadFile();
+    void readShortFile();
+    void openFileForWriting();
+    void writeToFile();
+    void deleteFile();
+    void openDirectory();
+    void makeDirectory();
+    void removeDirectory();
+    void getDirectorySize();
+    void getDirectoryContents();
+    void listDirectoryEntryShort();
+    void listDirectoryEntryLong();
+
+private:
+    template <typename Message>
+    void writeReply(const Message& reply)
+    {
+        uint8_t data[wire::size<Message>()];
+        wire::encode(reply, data);
+        m_Transport->write(data, sizeof(data));
+    }
+
+    // The transport sends the reply and the name that follows it together
+    template <typename Message>
+    void writeReply(const Message& reply, const std::string& name)
+    {
+        writeReply(reply);
+        m_Transport->write(name.data(), name.size());
+    }
+
+    void executeCommand();
+    IoGrant scheduleCommand();
+    static IoClass getIoClass(const Command& command, uint64_t& bytes);
+    void recordCommand(bool failed);
+    void traceCommand(const CommandSample& sample);
+
+    const std::string& readFilePath();
+    void writeSuccessReply();
+    void writeFailureReply();
+    const DirectoryEntry& getDirectoryEntry();
+    void filesystemOperation(std::function<void()> func);
+
+    size_t readFromFile(uint64_t offset, void* data, size_t size);
+    bool sendFileData(uint64_t offset, uint64_t count);
+    bool sendFile(int32_t fd, uint64_t offset, uint64_t count);
+    bool sendStorageData(uint64_t offset, uint64_t count);
+    void closeReadFile();
+    void closeDirectory();
+    uint64_t getReadFileSize() const;
+    bool isBlockCached() const;
+    size_t readFromBlockCache(uint64_t offset, void* data, size_t size);
+
+    bool getVirtualIsoDirectory(std::string& directory, VirtualIsoType& type) const;
+    std::shared_ptr<OpenFile> openVirtualIsoFile(const VirtualIsoFile& file);
+    void sendVirtualIsoData(uint64_t offset, uint64_t count);
+    void sendVirtualIsoFile(const VirtualIsoFile& file, uint64_t offset, uint64_t count);
+    size_t readFromVirtualIso(uint64_t offset, void* data, size_t size);
+
+    void throwOnBadReadFile();
+    void throwOnBadReadFileStatus(size_t bytesRead, size_t bytesRequested);
+    void throwOnBadWriteFile();
+    bool closeWriteFile();
+
+    ServerContext&                              m_Context;
+    BufferPool&                                 m_BufferPool;
+    CommandMeter                                m_Meter;
+    std::unique_ptr<Transport>                  m_Transport;
+    std::shared_ptr<ClientMetrics>              m_ClientMetrics;
+    Command                                     m_Command;
+    std::string                                 m_CommandPath;
+    std::string                                 m_FilePath;
+    uint32_t                                    m_TraceClient;
+    std::shared_ptr<IoClient>                   m_IoClient;
+    IoGrant                                     m_Grant;
+
+    std::shared_ptr<OpenFile>                   m_ReadFile;
+    std::shared_ptr<VirtualIso>                 m_VirtualIso;
+    std::shared_ptr<CompressedImage>            m_CompressedImage;
+    uint64_t                                    m_CompressedNextOffset;
+    uint64_t                                    m_CachedNextOffset;
+    uint64_t                                    m_CachePrefetchBlock;
+    uint64_t                                    m_CacheReader;
+    std::unique_ptr<ReadAhead>                  m_ReadAhead;
+    std::shared_ptr<FileMetrics>                m_ReadFileMetrics;
+    bool                                        m_ZeroCopy;
+    bool                                        m_StorageSend;
+    std::unique_ptr<FileWriter>                 m_WriteFile;
+    std::string                                 m_WritePath;
+    std::unique_ptr<DirectoryListing>           m_Directory;
+    size_t                                      m_DirectoryPosition;
+
+    static constexpr uint32_t                   m_BufferSize = BufferPool::MaxBufferSize;
+    static constexpr uint32_t                   m_ChunkSize = 2048;
+};
+
+#endif
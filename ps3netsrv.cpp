@@ -8,628 +8,316 @@
 #include <future>
 #include <algorithm>
 #include <cinttypes>
+#include <climits>
 #include <csignal>
 #include <string>
+#include <vector>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <type_traits>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
-#include "utils/log.h"
 #include "utils/socket.h"
+#include "utils/stringops.h"
 #include "utils/fileoperations.h"
 
+#include "affinity.h"
+#include "asynclog.h"
+#include "filedescriptor.h"
+#include "ps3client.h"
+#include "transport.h"
+#include "reactor.h"
+#include "statsserver.h"
+
 #define DEFAULT_PORT 38008
 #define LOWEST_PORT 1024
 
 static bool setSignalHandlers();
+static int32_t waitForTermination();
 
-using namespace utils;
-
-#ifndef __APPLE__
-uint64_t htonll(uint64_t val)
-{
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    return htonl(val >> 32) | ((uint64_t)htonl((uint32_t)val) << 32);
-#else
-    return val;
-#endif
-}
-#endif
-
-#ifndef __APPLE__
-uint64_t ntohll(uint64_t val)
-{
-    return htonll(val);
-}
-#endif
-
-namespace std
-{
-    template<typename T, typename ...Args>
-    std::unique_ptr<T> make_unique(Args&& ...args)
-    {
-        return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
-    }
-}
-
-enum class CommandCode
-{
-    OpenFileForReading      = 0x1224,
-    ReadFile                = 0x1225,
-    CustomReadFile          = 0x1226,
-    ReadShortFile           = 0x1227,
-    OpenFileForWriting      = 0x1228,
-    WriteToFile             = 0x1229,
-    OpenDirectory           = 0x122a,
-    ListDirectoryEntryShort = 0x122b,
-    DeleteFile              = 0x122c,
-    MakeDirectory           = 0x122d,
-    RemoveDirectory         = 0x122e,
-    ListDirectoryEntryLong  = 0x122f,
-    GetFileStats            = 0x1230,
-    GetDirectorySize        = 0x1231,
-    GetDirectoryContents    = 0x1232,
-};
+// Written by the handler of the termination signals, the main thread waits for it
+static volatile sig_atomic_t s_TerminateFd = -1;
+static int32_t s_TerminateReadFd = -1;
 
-struct Command
-{
-    uint16_t code;
-    uint16_t size;
-    uint32_t count;
-    uint64_t offset;
-} __attribute__((packed));
-
-struct FileReply
-{
-    int64_t  size;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint64_t atime;
-    uint8_t  isDirectory;
-} __attribute__((packed));
-
-struct FileReplyShort
-{
-    int64_t  size;
-    uint16_t nameLength;
-    uint8_t  isDirectory;
-} __attribute__((packed));
-
-struct FileReplyLong
-{
-    int64_t  size;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint64_t atime;
-    uint16_t nameLength;
-    uint8_t  isDirectory;
-} __attribute__((packed));
-
-struct ReadDirectoryReply
-{
-    int64_t  size;
-} __attribute__((packed));
-
-struct ReadDirectoryDataReply
-{
-    int64_t  size = 0;
-    uint64_t mtime = 0;
-    uint8_t  isDirectory = 0;
-    char     name[512];
-} __attribute__((packed));
+using namespace utils;
 
-class Ps3Client
+class Ps3Server
 {
 public:
-    Ps3Client(const std::string& rootPath, Socket&& sock)
-    : m_rootPath(rootPath)
-    , m_Socket(std::move(sock))
+    Ps3Server(const ServerSettings& settings)
+    : m_Context(settings)
+    , m_StatsServer(m_Context, settings.statsPort)
+    , m_Cpus(getAvailableCpus())
+    , m_NextReactor(0)
     {
-        m_Socket.setNoDelayOption();
-    }
-
-    std::string getAddress() const
-    {
-        return m_Socket.getAddress();
-    }
-
-    void openFileForReading()
-    {
-        std::pair<uint64_t, uint64_t> reply {-1, 0};
-
-        try
+        if (settings.listenerThreads == 0)
         {
-            if (m_ReadFile.is_open())
-            {
-                m_ReadFile.close();
-            }
+            m_Socket.setReuseAddressOption();
+            m_Socket.startListening(settings.port);
 
-            auto path = readFilePath();
-            m_ReadFile.open(path);
-            if (m_ReadFile.is_open())
+            for (uint32_t i = 0; i < settings.reactorThreads; ++i)
             {
-                auto info       = fileops::getFileInfo(path);
-                reply.first     = htonll(info.sizeInBytes);
-                reply.second    = htonll(info.modifyTime);
+                m_Reactors.push_back(std::make_unique<Reactor>(m_Context));
+                m_Reactors.back()->start();
             }
-        }
-        catch (std::exception& e)
-        {
-            log::error(e.what());
-        }
-
-        m_Socket.write(&reply, sizeof(reply));
-    }
 
-    void getFileStats()
-    {
-        FileReply reply;
+            return;
+        }
 
-        try
+        // every listener has its own socket on the port, the kernel spreads the incoming
+        // connections over them
+        for (uint32_t i = 0; i < settings.listenerThreads; ++i)
         {
-            auto info = fileops::getFileInfo(readFilePath());
+            m_Listeners.push_back(createListener(settings.port));
 
-            reply.size          = htonll(info.sizeInBytes);
-            reply.atime         = htonll(info.accessTime);
-            reply.ctime         = htonll(info.createTime);
-            reply.mtime         = htonll(info.modifyTime);
-            reply.isDirectory   = info.type == fileops::FileSystemEntryType::Directory;
-        }
-        catch (std::exception& e)
-        {
-            log::error(e.what());
-            reply.size = -1;
+            // the connections of a listener are served by a reactor on the same cpu
+            if (settings.reactorThreads > 0)
+            {
+                m_Reactors.push_back(std::make_unique<Reactor>(m_Context, i, getCpu(i)));
+                m_Reactors.back()->start();
+            }
         }
-        
-        m_Socket.write(&reply, sizeof(reply));
     }
 
-    void readFile()
+    // Accepts connections until the process is terminated, returns the termination signal
+    int32_t run()
     {
-        throwOnBadReadFile();
-
-        m_ReadFile.seekg(m_Command.offset, std::ios::beg);
-
-        uint32_t bytesToRead = m_Command.count;
-        while (bytesToRead > 0)
+        if (m_Listeners.empty())
         {
-            auto bufSize = m_BufferSize;
-            uint32_t size = std::min(bytesToRead, bufSize);
-            m_ReadFile.read(reinterpret_cast<char*>(m_Buffer.data()), size);
-            throwOnBadReadFileStatus();
-            m_Socket.write(m_Buffer.data(), size);
-            bytesToRead -= size;
-        }
-    }
+            LOG_INFO("Waiting for client...");
+            std::thread([this] () {
+                acceptConnections(m_Socket.getFd(), 0);
+            }).detach();
 
-    void customReadFile()
-    {
-        log::debug(__FUNCTION__);
+            return waitForTermination();
+        }
 
-        throwOnBadReadFile();
-        uint64_t offset = 2352 * m_Command.count;
-        uint32_t chunks = m_Command.offset >> 32;
+        LOG_INFO("Waiting for client on %d listeners...", m_Listeners.size());
 
-        if ((chunks * m_ChunkSize) > m_BufferSize)
+        for (uint32_t i = 0; i < m_Listeners.size(); ++i)
         {
-            throw std::logic_error("Too many chunks requested");
-        }
+            std::thread([this, i] () {
+                // the client threads created by the listener inherit its affinity
+                if (!pinThreadToCpu(getCpu(i)))
+                {
+                    LOG_WARN("Failed to pin listener %d to cpu %d", i, getCpu(i));
+                }
 
-        char* pCurrent = reinterpret_cast<char*>(m_Buffer.data());
-        for (uint32_t i = 0; i < chunks; ++i)
-        {
-            m_ReadFile.seekg(offset + 24, std::ios::beg);
-            m_ReadFile.read(pCurrent, m_ChunkSize);
-            pCurrent += m_ChunkSize;
-            offset += 2352;
+                acceptConnections(m_Listeners[i].get(), i);
+            }).detach();
         }
 
-        m_Socket.write(m_Buffer.data(), chunks * m_ChunkSize);
-
-        log::debug("%s done", __FUNCTION__);
+        return waitForTermination();
     }
 
-    void readShortFile()
+    // Saves the state that outlives the process, the clients are served until the process ends
+    void stop()
     {
-        throwOnBadReadFile();
-
-        if (m_Command.count > m_BufferSize)
+        if (m_Context.sizeIndex)
         {
-            throw std::logic_error("Short file size is larger then buffer size");
+            m_Context.sizeIndex->stop();
         }
-        
-        m_ReadFile.seekg(m_Command.offset, std::ios::beg);
-        m_ReadFile.read(reinterpret_cast<char*>(m_Buffer.data()), m_Command.count);
-
-        writeNumeric(static_cast<uint32_t>(htonl(m_ReadFile.gcount())));
-        m_Socket.write(m_Buffer.data(), m_ReadFile.gcount());
     }
 
-    void openFileForWriting()
+private:
+    static FileDescriptor createListener(uint32_t port)
     {
-        if (m_WriteFile.is_open())
+        FileDescriptor fd(::socket(AF_INET, SOCK_STREAM, 0));
+        if (!fd.isValid())
         {
-            m_WriteFile.close();
+            throw std::runtime_error(stringops::format("Failed to create listening socket: %s", strerror(errno)));
         }
-        
-        m_WriteFile.open(readFilePath(), std::ios::binary);
-        m_WriteFile.is_open() ? writeSuccessReply() : writeFailureReply();
-    }
 
-    void writeToFile()
-    {
-        throwOnBadWriteFile();
+        int32_t enable = 1;
+        setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
 
-        if (m_Command.count > m_BufferSize)
+#if defined(SO_REUSEPORT_LB)
+        // FreeBSD only balances the connections between the sockets with this option
+        auto reusePort = SO_REUSEPORT_LB;
+#elif defined(SO_REUSEPORT)
+        auto reusePort = SO_REUSEPORT;
+#else
+        throw std::logic_error("Multiple listeners are not supported on this platform (no SO_REUSEPORT)");
+#endif
+        if (setsockopt(fd.get(), SOL_SOCKET, reusePort, &enable, sizeof(enable)) < 0)
         {
-            throw std::logic_error("Data to write is larger then buffer size");
+            throw std::runtime_error(stringops::format("Failed to share port %d between listeners: %s", port, strerror(errno)));
         }
-        
-        m_Socket.read(m_Buffer.data(), m_Command.count);
-        auto pos = m_WriteFile.tellp();
-        m_WriteFile.write(reinterpret_cast<char*>(m_Buffer.data()), m_Command.count);
-        throwOnBadWriteFileStatus();
 
-        writeNumeric(htonl(static_cast<uint32_t>(m_WriteFile.tellp() - pos)));
-    }
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    void deleteFile()
-    {
-        filesystemOperation([this] () {
-            fileops::deleteFile(readFilePath());
-            writeSuccessReply();
-        });
-    }
-
-    void openDirectory()
-    {
-        log::debug(__FUNCTION__);
-        
-        filesystemOperation([this] () {
-            m_Directory = std::make_unique<fileops::Directory>(readFilePath());
-            m_DirIterator = fileops::FileSystemIterator(*m_Directory);
-            writeSuccessReply();
-        });
-        
-        log::debug("%s done", __FUNCTION__);
-    }
+        if (bind(fd.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd.get(), SOMAXCONN) < 0)
+        {
+            throw std::runtime_error(stringops::format("Failed to listen on port %d: %s", port, strerror(errno)));
+        }
 
-    void makeDirectory()
-    {
-        filesystemOperation([this] () {
-            fileops::createDirectory(readFilePath());
-            writeSuccessReply();    
-        });
+        return fd;
     }
 
-    void removeDirectory()
+    int32_t getCpu(uint32_t listener) const
     {
-        filesystemOperation([this] () {
-            fileops::deleteDirectory(readFilePath());
-            writeSuccessReply();
-        });
+        return m_Cpus[listener % m_Cpus.size()];
     }
 
-    void getDirectorySize()
-    {
-        filesystemOperation([this] () {
-            writeNumeric(htonll(fileops::calculateDirectorySize(readFilePath())));
-        });
-    }
-    
-    void getDirectoryContents()
+    void acceptConnections(int32_t listenFd, uint32_t listener)
     {
-        if (!m_Directory)
-        {
-            throw std::logic_error("No directory was opened before listing request");
-        }
-    
-        try
+        for (;;)
         {
-            ReadDirectoryReply reply;
-            memset(&reply, 0, sizeof(reply));
-            
-            std::vector<ReadDirectoryDataReply> dirItems;
-            
-            for (auto& entry : *m_Directory)
-            {
-                ReadDirectoryDataReply data;
-                data.isDirectory    = (m_DirIterator->type() == fileops::FileSystemEntryType::Directory) ? 1 : 0;
-                data.size           = htonll(data.isDirectory == 1 ? 0 : fileops::getFileSize(entry.path()));
-                
-                auto name = fileops::getFileName(entry.path());
-                strcpy(data.name, name.c_str());
-                
-                dirItems.push_back(data);
-            }
-
-            reply.size = htonll(dirItems.size());
-            m_Socket.write(&reply, sizeof(reply));
-            
-            if (!dirItems.empty())
+            try
             {
-                m_Socket.write(dirItems.data(), dirItems.size() * sizeof(ReadDirectoryDataReply));
-            }
-        }
-        catch (std::logic_error& e)
-        {
-            log::error(e.what());
-
-            ReadDirectoryReply reply;
-            reply.size = htonll(0);
-            m_Socket.write(&reply, sizeof(ReadDirectoryReply));
-        }
-    }
+                int32_t fd;
+                auto slot = accept(listenFd, fd);
+                if (!slot)
+                {
+                    continue;
+                }
 
-    void listDirectoryEntryShort()
-    {
-        log::debug(__FUNCTION__);
-        
-        if (!m_Directory)
-        {
-            throw std::logic_error("No directory was opened before listing request");
-        }
+                Socket socket(fd);
+                auto& admission = m_Context.settings.admission;
+                enableKeepAlive(fd);
 
-        try
-        {
-            FileReplyShort reply;
-            memset(&reply, 0, sizeof(reply));
+                if (!m_Reactors.empty())
+                {
+                    LOG_INFO("Connection from %s", socket.getAddress());
+                    auto& reactor = m_Listeners.empty() ? m_Reactors[m_NextReactor++ % m_Reactors.size()] : m_Reactors[listener];
+                    reactor->addConnection(std::move(socket), std::move(slot));
+                    continue;
+                }
 
-            if (m_DirIterator == end(*m_Directory))
-            {
-                m_Directory.reset();
-                reply.size = htonll(-1LL);
-                m_Socket.write(&reply, sizeof(reply));
-                return;
+                auto transport = std::make_unique<SocketTransport>(std::move(socket));
+                transport->setTimeouts(admission.idleTimeout, admission.commandTimeout);
+
+                auto client = std::make_shared<Ps3Client>(m_Context, std::move(transport), listener);
+                LOG_INFO("Connection from %s", client->getAddress());
+                auto& context = m_Context;
+                auto task = std::thread([client, &context, listener] (AdmissionSlot&& clientSlot) {
+                    client->run();
+                    clientSlot.release();
+                    context.getBufferPool(listener).logStats();
+                }, std::move(slot));
+                task.detach();
             }
-            else
+            catch (std::exception& e)
             {
-                auto name = fileops::getFileName(m_DirIterator->path());
-                reply.isDirectory   = (m_DirIterator->type() == fileops::FileSystemEntryType::Directory) ? 1 : 0;
-                reply.size          = htonll(reply.isDirectory ? 0 : fileops::getFileSize(m_DirIterator->path()));
-                reply.nameLength    = htons(name.size());
-
-                m_Socket.write(&reply, sizeof(FileReplyShort));
-                m_Socket.write(&name[0], name.size());
+                LOG_ERROR("Failed to create client: %s", e.what());
             }
         }
-        catch (std::logic_error& e)
-        {
-            log::error(e.what());
-
-            FileReplyShort reply;
-            reply.size = htonll(-1LL);
-            m_Socket.write(&reply, sizeof(FileReplyShort));
-        }
-
-        ++m_DirIterator;
-        
-        log::debug("%s done", __FUNCTION__);
     }
 
-    void listDirectoryEntryLong()
+    // Connections that are not admitted are closed before anything is allocated for them
+    AdmissionSlot accept(int32_t listenFd, int32_t& fd)
     {
-        if (!m_Directory)
-        {
-            throw std::logic_error("No directory was opened before listing request");
-        }
+        m_Context.admission.waitForSlot();
 
-        try
+        sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        fd = ::accept(listenFd, reinterpret_cast<sockaddr*>(&address), &addressLength);
+        if (fd < 0)
         {
-            FileReplyLong reply;
-            memset(&reply, 0, sizeof(reply));
-
-            if (m_DirIterator == end(*m_Directory))
-            {
-                m_Directory.reset();
-                reply.size = htonll(-1LL);
-                m_Socket.write(&reply, sizeof(reply));
-                return;
-            }
-            else
+            if (errno == EINTR || errno == ECONNABORTED)
             {
-                auto info = fileops::getFileInfo(m_DirIterator->path());
-                
-                auto name = fileops::getFileName(m_DirIterator->path());
-                reply.isDirectory   = (m_DirIterator->type() == fileops::FileSystemEntryType::Directory) ? 1 : 0;
-                reply.size          = htonll(reply.isDirectory ? 0 : info.sizeInBytes);
-                reply.nameLength    = htons(name.size());
-                reply.mtime         = htonll(info.modifyTime);
-                reply.ctime         = htonll(info.createTime);
-                reply.atime         = htonll(info.accessTime);
-
-                m_Socket.write(&reply, sizeof(reply));
-                m_Socket.write(&name[0], name.size());
+                return AdmissionSlot();
             }
-        }
-        catch (std::logic_error& e)
-        {
-            log::error(e.what());
 
-            FileReplyLong reply;
-            reply.size = htonll(-1LL);
-            m_Socket.write(&reply, sizeof(FileReplyLong));
+            throw std::runtime_error(stringops::format("Failed to accept connection: %s", strerror(errno)));
         }
 
-        ++m_DirIterator;
-    }
-
-    void run()
-    {
-        try
+        auto slot = m_Context.admission.admit(ntohl(address.sin_addr.s_addr));
+        if (!slot)
         {
-            for (;;)
-            {
-                if (m_Socket.read(&m_Command, sizeof(m_Command)) != sizeof(m_Command))
-                {
-                    break;
-                }
-                
-                m_Command.code    = ntohs(m_Command.code);
-                m_Command.size    = ntohs(m_Command.size);
-                m_Command.count   = ntohl(m_Command.count);
-                m_Command.offset  = htonll(m_Command.offset);
-
-                switch (static_cast<CommandCode>(m_Command.code))
-                {
-                case CommandCode::OpenFileForReading:       openFileForReading();           break;
-                case CommandCode::ReadFile:                 readFile();                     break;
-                case CommandCode::CustomReadFile:           customReadFile();               break;
-                case CommandCode::ReadShortFile:            readShortFile();                break;
-                case CommandCode::OpenFileForWriting:       openFileForWriting();           break;
-                case CommandCode::WriteToFile:              writeToFile();                  break;
-                case CommandCode::OpenDirectory:            openDirectory();                break;
-                case CommandCode::ListDirectoryEntryShort:  listDirectoryEntryShort();      break;
-                case CommandCode::DeleteFile:               deleteFile();                   break;
-                case CommandCode::MakeDirectory:            makeDirectory();                break;
-                case CommandCode::RemoveDirectory:          removeDirectory();              break;
-                case CommandCode::ListDirectoryEntryLong:   listDirectoryEntryLong();       break;
-                case CommandCode::GetFileStats:             getFileStats();                 break;
-                case CommandCode::GetDirectorySize:         getDirectorySize();             break;
-                case CommandCode::GetDirectoryContents:     getDirectoryContents();         break;
-                default:
-                    throw std::logic_error(stringops::format("Unknown command: %d", m_Command.code));
-                    break;
-                }
-            }
+            ::close(fd);
         }
-        catch (std::exception& e)
-        {
-            m_Socket.close();
-            log::error(e.what());
-        }
-    }
-
-private:
-    template <typename T>
-    void writeNumeric(T value)
-    {
-        m_Socket.write(&value, sizeof(T));
-    }
 
-    std::string readFilePath()
-    {
-        return fileops::combinePath(m_rootPath, m_Socket.readString(m_Command.size));
-    }
-
-    void writeSuccessReply()
-    {
-        writeNumeric<uint32_t>(0);
+        return slot;
     }
 
-    void writeFailureReply()
-    {
-        writeNumeric<uint32_t>(htonl(-1));
-    }
-    
-    void filesystemOperation(std::function<void()> func)
-    {
-        try
-        {
-            func();
-        }
-        catch (std::exception& e)
-        {
-            log::error(e.what());
-            writeFailureReply();
-        }
-    }
+    ServerContext                           m_Context;
+    StatsServer                             m_StatsServer;
+    Socket                                  m_Socket;
+    std::vector<FileDescriptor>             m_Listeners;
+    std::vector<int32_t>                    m_Cpus;
+    std::vector<std::unique_ptr<Reactor>>   m_Reactors;
+    uint32_t                                m_NextReactor;
+};
 
-    void throwOnBadReadFile()
-    {
-        if (!m_ReadFile.is_open())
-        {
-            throw std::logic_error("Invalid file handle for reading");
-        }
-    }
+void usage(const std::string& execName)
+{
+    std::cout << "Usage: " << execName << " [-d] [-e] [-t threads] [-a listeners] [-m megabytes] [-r kilobytes] [-f files] [-M] [-C megabytes] [-i] [-v] [-z megabytes] [-q requests] [-b kilobytes] [-B kilobytes] [-W weights] [-s sync] [-u] [-S port] [-T file] [-l target] [-p port] [-w whitelist] [-c clients] [-Q] [-k seconds] [-K seconds] rootdirectory" << std::endl
+              << "Default port: " << DEFAULT_PORT << std::endl
+              << "Buffer memory: -m limits the memory used for io buffers by all clients together (default: 64 MB, minimum: 4 MB)" << std::endl
+              << "Read-ahead: -r sets the maximum read-ahead window for sequential reads (default: 4096 KB, 0 disables read-ahead)" << std::endl
+              << "Open files: -f sets the number of open files shared between clients (default: 256), -M maps them in memory" << std::endl
+              << "Block cache: -C keeps blocks of the files read by the clients in memory, shared by all clients (default: 0 MB, disabled)" << std::endl
+              << "Size index: -i keeps the size of every directory in an index that is stored next to the root directory" << std::endl
+              << "Virtual images: -v serves game folders as ISO images when they are opened as /***PS3***/path or /***DVD***/path, the image layouts are stored next to the root directory" << std::endl
+              << "Compressed images: .cso files are served as the uncompressed image, -z sets the memory for decompressed blocks (default: 64 MB)" << std::endl
+              << "Scheduling: -q sets the number of requests served at the same time (default: 8), one is kept free for small requests like directory listings and short reads" << std::endl
+              << "Bandwidth: -b and -B cap the bandwidth of every connection and of every address in KB/s, -W 192.168.1.10=4,192.168.1.11=2 gives consoles a larger share of the bandwidth (default weight: 1)" << std::endl
+              << "Write sync: -s never|write|close|periodic selects when written files are synced to disk (default: never)" << std::endl
+              << "Storage: -u submits file io to an io_uring when the kernel supports it, blocking io is used otherwise" << std::endl
+              << "Statistics: -S serves metrics in Prometheus format on http://127.0.0.1:port/metrics, SIGUSR1 writes them to the log" << std::endl
+              << "Trace: -T records every command in file, the trace can be replayed against a server with ps3replay" << std::endl
+              << "Log: -l writes the log to a file, or to syslog when target is syslog (default: console)" << std::endl
+              << "Event engine: -e serves all clients from epoll reactor threads instead of a thread per client, -t sets the number of reactors (default: number of cores)" << std::endl
+              << "Listeners: -a accepts connections on the given number of threads, each pinned to a core with its own socket (SO_REUSEPORT) and buffer pool, the connections of a listener are served on its core (with -e one reactor per listener, -t is ignored)" << std::endl
+              << "Whitelist: x.x.x.x, where x is 0-255 or * (e.g 192.168.1.* to allow only connections from 192.168.1.0-192.168.1.255), or x.x.x.x/bits, several entries are separated by commas" << std::endl
+              << "Clients: -c sets the number of clients served at the same time (default: 64, 0 is unlimited), more connections are refused or with -Q wait until a client disconnects" << std::endl
+              << "Timeouts: -k closes connections without commands for the given seconds (default: 0, disabled), -K closes connections when a command makes no progress for the given seconds (default: 60)" << std::endl;
+}
 
-    void throwOnBadReadFileStatus()
+static bool parseWeights(const std::string& weights, std::unordered_map<std::string, uint32_t>& result)
+{
+    size_t start = 0;
+    while (start < weights.size())
     {
-        if (m_ReadFile.fail())
+        auto end = weights.find(',', start);
+        if (end == std::string::npos)
         {
-            throw std::logic_error("File is not ok for reading");
+            end = weights.size();
         }
-    }
 
-    void throwOnBadWriteFile()
-    {
-        if (!m_WriteFile.is_open())
+        auto entry = weights.substr(start, end - start);
+        auto separator = entry.find('=');
+        if (separator == std::string::npos || separator == 0)
         {
-            throw std::logic_error("Invalid file handle for writing");
+            return false;
         }
-    }
 
-    void throwOnBadWriteFileStatus()
-    {
-        if (m_WriteFile.fail())
+        char* weightEnd = nullptr;
+        auto weight = strtoul(entry.c_str() + separator + 1, &weightEnd, 10);
+        if (*weightEnd != '\0' || weight == 0 || weight > 1000)
         {
-            throw std::logic_error("File is not ok for writing");
+            return false;
         }
-    }
-
-    std::string                                 m_rootPath;
-    Socket                                      m_Socket;
-    Command                                     m_Command;
-    
-    std::ifstream                               m_ReadFile;
-    std::ofstream                               m_WriteFile;
-    std::unique_ptr<fileops::Directory>         m_Directory;
-    fileops::FileSystemIterator                 m_DirIterator;
-
-    static constexpr uint32_t                   m_BufferSize = 4 * 1024 * 1024;
-    static constexpr uint32_t                   m_ChunkSize = 2048;
-    std::array<uint8_t, m_BufferSize>           m_Buffer;
-};
 
-class Ps3Server
-{
-public:
-    Ps3Server(const std::string& rootPath, uint32_t port)
-    : m_rootPath(rootPath)
-    {
-        m_Socket.setReuseAddressOption();
-        m_Socket.startListening(port);
+        result[entry.substr(0, separator)] = static_cast<uint32_t>(weight);
+        start = end + 1;
     }
 
-    void run()
-    {
-        log::info("Waiting for client...");
-        for (;;)
-        {
-            try
-            {
-                auto client = std::make_shared<Ps3Client>(m_rootPath, m_Socket.accept());
-                log::info("Connection from %s", client->getAddress());
-                auto task = std::thread([client] () { client->run(); });
-                task.detach();
-            }
-            catch (std::exception& e)
-            {
-                log::error("Failed to create client: %s", e.what());
-            }
-        }
-    }
-
-private:
-    std::string     m_rootPath;
-    Socket          m_Socket;
-
-};
-
-void usage(const std::string& execName)
-{
-    std::cout << "Usage: " << execName << " [-d] [-p port] [-w whitelist] rootdirectory" << std::endl
-              << "Default port: " << DEFAULT_PORT << std::endl
-              << "Whitelist: x.x.x.x, where x is 0-255 or * (e.g 192.168.1.* to allow only connections from 192.168.1.0-192.168.1.255)" << std::endl;
+    return !result.empty();
 }
 
 int main(int argc, char *argv[])
 {
     uint32_t    port{DEFAULT_PORT};
     bool        daemonize{false};
+    bool        eventDriven{false};
+    uint32_t    reactorThreads{std::max(1u, std::thread::hardware_concurrency())};
+    bool        sizeIndex{false};
+    std::string logTarget;
+
+    ServerSettings settings;
 
     if (argc < 2)
     {
@@ -638,18 +326,159 @@ int main(int argc, char *argv[])
     }
         
     int32_t opt;
-    while ((opt = getopt(argc, argv, "p:w:d")) != -1)
+    while ((opt = getopt(argc, argv, "p:w:det:a:m:r:f:MC:ivz:q:b:B:W:s:uS:T:l:c:Qk:K:")) != -1)
     {
         switch (opt)
         {
         case 'd':
             daemonize = true;
             break;
+        case 'e':
+            eventDriven = true;
+            break;
+        case 't':
+            reactorThreads = std::stoi(optarg);
+            if (reactorThreads == 0)
+            {
+                LOG_ERROR("The number of reactor threads must be at least 1.");
+                return -1;
+            }
+            break;
+        case 'a':
+            settings.listenerThreads = std::stoul(optarg);
+            break;
+        case 'm':
+            settings.bufferPoolLimit = std::stoul(optarg) * 1024 * 1024;
+            if (settings.bufferPoolLimit < BufferPool::MaxBufferSize)
+            {
+                LOG_ERROR("The buffer memory limit must be at least %d MB.", BufferPool::MaxBufferSize / (1024 * 1024));
+                return -1;
+            }
+            break;
+        case 'r':
+            settings.readAheadWindow = std::stoul(optarg) * 1024;
+            break;
+        case 'f':
+            settings.maxOpenFiles = std::stoul(optarg);
+            if (settings.maxOpenFiles == 0)
+            {
+                LOG_ERROR("At least one open file is required.");
+                return -1;
+            }
+            break;
+        case 'M':
+            settings.mapFiles = true;
+            break;
+        case 'C':
+            settings.blockCacheSize = std::stoul(optarg) * 1024 * 1024;
+            break;
+        case 'i':
+            sizeIndex = true;
+            break;
+        case 'v':
+            settings.virtualIso = true;
+            break;
+        case 'z':
+            settings.decompressedCacheSize = std::stoul(optarg) * 1024 * 1024;
+            break;
+        case 'q':
+            settings.ioScheduler.maxActive = std::stoi(optarg);
+            if (settings.ioScheduler.maxActive < 2)
+            {
+                LOG_ERROR("The scheduler needs to serve at least 2 requests at the same time.");
+                return -1;
+            }
+            break;
+        case 'b':
+            settings.ioScheduler.clientRate = std::stoull(optarg) * 1024;
+            break;
+        case 'B':
+            settings.ioScheduler.addressRate = std::stoull(optarg) * 1024;
+            break;
+        case 'W':
+            if (!parseWeights(optarg, settings.ioScheduler.weights))
+            {
+                LOG_ERROR("Invalid weights: %s (expected address=weight,address=weight)", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "never") == 0)
+            {
+                settings.syncPolicy = SyncPolicy::Never;
+            }
+            else if (strcmp(optarg, "write") == 0)
+            {
+                settings.syncPolicy = SyncPolicy::Write;
+            }
+            else if (strcmp(optarg, "close") == 0)
+            {
+                settings.syncPolicy = SyncPolicy::Close;
+            }
+            else if (strcmp(optarg, "periodic") == 0)
+            {
+                settings.syncPolicy = SyncPolicy::Periodic;
+            }
+            else
+            {
+                LOG_ERROR("Unknown sync policy: %s", optarg);
+                return -1;
+            }
+            break;
+        case 'u':
+            settings.ioUring = true;
+            break;
+        case 'S':
+            settings.statsPort = std::stoi(optarg);
+            if (settings.statsPort == 0 || settings.statsPort > 65535)
+            {
+                LOG_ERROR("Statistics port must be in 1-65535 range.");
+                return -1;
+            }
+            break;
+        case 'T':
+            settings.tracePath = optarg;
+            if (settings.tracePath.front() != '/')
+            {
+                // the working directory changes to the root directory
+                char cwd[PATH_MAX];
+                if (getcwd(cwd, sizeof(cwd)))
+                {
+                    settings.tracePath = std::string(cwd) + "/" + settings.tracePath;
+                }
+            }
+            break;
+        case 'l':
+            logTarget = optarg;
+            break;
+        case 'w':
+            try
+            {
+                settings.admission.whitelist = AddressFilter(optarg);
+            }
+            catch (std::exception& e)
+            {
+                LOG_ERROR(e.what());
+                return -1;
+            }
+            break;
+        case 'c':
+            settings.admission.maxClients = std::stoul(optarg);
+            break;
+        case 'Q':
+            settings.admission.policy = AdmissionPolicy::Queue;
+            break;
+        case 'k':
+            settings.admission.idleTimeout = std::stoul(optarg);
+            break;
+        case 'K':
+            settings.admission.commandTimeout = std::stoul(optarg);
+            break;
         case 'p':
             port = std::stoi(optarg);
             if (port < LOWEST_PORT || port > 65535)
             {
-                log::error("Port must be in %d-65535 range.", LOWEST_PORT);
+                LOG_ERROR("Port must be in %d-65535 range.", LOWEST_PORT);
                 return -1;
             }
             break;
@@ -664,7 +493,7 @@ int main(int argc, char *argv[])
         pid_t pid = fork();
         if (pid < 0)
         {
-            log::error("Unable to daemonize.");
+            LOG_ERROR("Unable to daemonize.");
             return -1;
         }
 
@@ -678,7 +507,7 @@ int main(int argc, char *argv[])
         pid_t sid = setsid();
         if (sid < 0)
         {
-            log::error("Failed to get session id");
+            LOG_ERROR("Failed to get session id");
             return -1;   
         }
 
@@ -697,26 +526,109 @@ int main(int argc, char *argv[])
 
     try
     {
+        asynclog::start(logTarget);
         setSignalHandlers();
         utils::fileops::changeDirectory(argv[optind]);
         
-        Ps3Server server(argv[optind], port);
-        server.run();
+        if (eventDriven && !Reactor::isSupported())
+        {
+            LOG_ERROR("The event driven engine is not supported on this platform, using a thread per client");
+            eventDriven = false;
+        }
+
+        auto poolCount = std::max<size_t>(1, settings.bufferPoolLimit / BufferPool::MaxBufferSize);
+        if (settings.listenerThreads > poolCount)
+        {
+            LOG_WARN("%d MB of buffer memory is not enough for a buffer pool per listener, the %d listeners share %d pools", settings.bufferPoolLimit / (1024 * 1024), settings.listenerThreads, poolCount);
+        }
+
+        settings.rootPath = argv[optind];
+        settings.port = port;
+        settings.reactorThreads = eventDriven ? reactorThreads : 0;
+
+        auto rootPath = settings.rootPath;
+        while (rootPath.size() > 1 && rootPath.back() == '/')
+        {
+            rootPath.pop_back();
+        }
+
+        if (sizeIndex)
+        {
+            settings.sizeIndexPath = rootPath + ".sizeindex";
+        }
+
+        if (settings.virtualIso)
+        {
+            settings.virtualIsoLayoutPath = rootPath + ".viso";
+        }
+
+        Ps3Server server(settings);
+        auto signo = server.run();
+
+        // the accept threads still use the server, the process ends without destroying it
+        LOG_INFO("Terminated by signal %d", signo);
+        server.stop();
+        TraceWriter::flushActive();
+        asynclog::stop();
+        exit(1);
     }
     catch (std::exception& e)
     {
-        log::error(e.what());
-    }    
+        LOG_ERROR(e.what());
+    }
+
+    asynclog::stop();
 }
 
+// Only async signal safe calls, the main thread logs and flushes
 static void sigterm(int signo)
 {
-    log::info("Terminated");
-    exit(1);
+    int32_t fd = s_TerminateFd;
+    if (fd >= 0)
+    {
+        auto value = static_cast<uint8_t>(signo);
+        ssize_t result = ::write(fd, &value, 1);
+        (void) result;
+    }
+}
+
+static int32_t waitForTermination()
+{
+    for (;;)
+    {
+        uint8_t signo;
+        auto result = ::read(s_TerminateReadFd, &signo, 1);
+        if (result == 1)
+        {
+            return signo;
+        }
+
+        if (result < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(stringops::format("Failed to wait for termination: %s", strerror(errno)));
+        }
+    }
+}
+
+static void dumpStatistics(int signo)
+{
+    StatsServer::requestDump();
 }
 
 static bool setSignalHandlers()
 {
+    int32_t fds[2];
+    if (pipe(fds) != 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to create termination pipe: %s", strerror(errno)));
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    s_TerminateReadFd = fds[0];
+    s_TerminateFd = fds[1];
+
     struct sigaction sa;
 
     sa.sa_flags = 0;
@@ -752,5 +664,24 @@ static bool setSignalHandlers()
         throw std::logic_error(stringops::format("Can't catch SIGTERM: %", strerror(errno)));
     }
 
+    sa.sa_handler = dumpStatistics;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if (sigaction(SIGUSR1, &sa, nullptr) < 0)
+    {
+        throw std::logic_error(stringops::format("Can't catch SIGUSR1: %", strerror(errno)));
+    }
+
+    // a client disconnecting during sendfile must not terminate the server
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    if (sigaction(SIGPIPE, &sa, nullptr) < 0)
+    {
+        throw std::logic_error(stringops::format("Can't ignore SIGPIPE: %", strerror(errno)));
+    }
+
     return true;
 }
@@ -0,0 +1,187 @@
+#ifndef PS3_PROTOCOL_H
+#define PS3_PROTOCOL_H
+
+#include <cinttypes>
+
+#include "wirecodec.h"
+
+enum class CommandCode
+{
+    OpenFileForReading      = 0x1224,
+    ReadFile                = 0x1225,
+    CustomReadFile          = 0x1226,
+    ReadShortFile           = 0x1227,
+    OpenFileForWriting      = 0x1228,
+    WriteToFile             = 0x1229,
+    OpenDirectory           = 0x122a,
+    ListDirectoryEntryShort = 0x122b,
+    DeleteFile              = 0x122c,
+    MakeDirectory           = 0x122d,
+    RemoveDirectory         = 0x122e,
+    ListDirectoryEntryLong  = 0x122f,
+    GetFileStats            = 0x1230,
+    GetDirectorySize        = 0x1231,
+    GetDirectoryContents    = 0x1232,
+};
+
+static constexpr uint16_t FirstCommandCode = 0x1224;
+static constexpr size_t CommandCodeCount = 15;
+
+// Index of the command in [0, CommandCodeCount), -1 for unknown commands
+inline int32_t commandIndex(uint16_t code)
+{
+    return code >= FirstCommandCode && code < FirstCommandCode + CommandCodeCount ? code - FirstCommandCode : -1;
+}
+
+inline const char* commandName(CommandCode code)
+{
+    switch (code)
+    {
+    case CommandCode::OpenFileForReading:       return "OpenFileForReading";
+    case CommandCode::ReadFile:                 return "ReadFile";
+    case CommandCode::CustomReadFile:           return "CustomReadFile";
+    case CommandCode::ReadShortFile:            return "ReadShortFile";
+    case CommandCode::OpenFileForWriting:       return "OpenFileForWriting";
+    case CommandCode::WriteToFile:              return "WriteToFile";
+    case CommandCode::OpenDirectory:            return "OpenDirectory";
+    case CommandCode::ListDirectoryEntryShort:  return "ListDirectoryEntryShort";
+    case CommandCode::DeleteFile:               return "DeleteFile";
+    case CommandCode::MakeDirectory:            return "MakeDirectory";
+    case CommandCode::RemoveDirectory:          return "RemoveDirectory";
+    case CommandCode::ListDirectoryEntryLong:   return "ListDirectoryEntryLong";
+    case CommandCode::GetFileStats:             return "GetFileStats";
+    case CommandCode::GetDirectorySize:         return "GetDirectorySize";
+    case CommandCode::GetDirectoryContents:     return "GetDirectoryContents";
+    }
+
+    return "Unknown";
+}
+
+// Wire messages in host byte order, see wirecodec.h
+struct Command
+{
+    uint16_t code = 0;
+    uint16_t size = 0;
+    uint32_t count = 0;
+    uint64_t offset = 0;
+
+    typedef wire::Layout<WIRE_FIELD(Command, code), WIRE_FIELD(Command, size), WIRE_FIELD(Command, count), WIRE_FIELD(Command, offset)> Layout;
+};
+
+// Result of commands that only succeed or fail: 0 or -1
+struct StatusReply
+{
+    int32_t  result = 0;
+
+    typedef wire::Layout<WIRE_FIELD(StatusReply, result)> Layout;
+};
+
+// Number of bytes that were written (WriteToFile) or that follow the reply (ReadShortFile)
+struct CountReply
+{
+    uint32_t count = 0;
+
+    typedef wire::Layout<WIRE_FIELD(CountReply, count)> Layout;
+};
+
+struct OpenFileReply
+{
+    int64_t  size = -1;
+    uint64_t mtime = 0;
+
+    typedef wire::Layout<WIRE_FIELD(OpenFileReply, size), WIRE_FIELD(OpenFileReply, mtime)> Layout;
+};
+
+struct DirectorySizeReply
+{
+    int64_t  size = 0;
+
+    typedef wire::Layout<WIRE_FIELD(DirectorySizeReply, size)> Layout;
+};
+
+struct FileReply
+{
+    int64_t  size = 0;
+    uint64_t mtime = 0;
+    uint64_t ctime = 0;
+    uint64_t atime = 0;
+    uint8_t  isDirectory = 0;
+
+    typedef wire::Layout<WIRE_FIELD(FileReply, size), WIRE_FIELD(FileReply, mtime), WIRE_FIELD(FileReply, ctime),
+                         WIRE_FIELD(FileReply, atime), WIRE_FIELD(FileReply, isDirectory)> Layout;
+};
+
+// Followed by nameLength bytes of the name
+struct FileReplyShort
+{
+    int64_t  size = 0;
+    uint16_t nameLength = 0;
+    uint8_t  isDirectory = 0;
+
+    typedef wire::Layout<WIRE_FIELD(FileReplyShort, size), WIRE_FIELD(FileReplyShort, nameLength), WIRE_FIELD(FileReplyShort, isDirectory)> Layout;
+};
+
+// Followed by nameLength bytes of the name
+struct FileReplyLong
+{
+    int64_t  size = 0;
+    uint64_t mtime = 0;
+    uint64_t ctime = 0;
+    uint64_t atime = 0;
+    uint16_t nameLength = 0;
+    uint8_t  isDirectory = 0;
+
+    typedef wire::Layout<WIRE_FIELD(FileReplyLong, size), WIRE_FIELD(FileReplyLong, mtime), WIRE_FIELD(FileReplyLong, ctime),
+                         WIRE_FIELD(FileReplyLong, atime), WIRE_FIELD(FileReplyLong, nameLength), WIRE_FIELD(FileReplyLong, isDirectory)> Layout;
+};
+
+// Followed by size ReadDirectoryDataReply records
+struct ReadDirectoryReply
+{
+    int64_t  size = 0;
+
+    typedef wire::Layout<WIRE_FIELD(ReadDirectoryReply, size)> Layout;
+};
+
+struct ReadDirectoryDataReply
+{
+    int64_t  size = 0;
+    uint64_t mtime = 0;
+    uint8_t  isDirectory = 0;
+    char     name[512];
+
+    typedef wire::Layout<WIRE_FIELD(ReadDirectoryDataReply, size), WIRE_FIELD(ReadDirectoryDataReply, mtime),
+                         WIRE_FIELD(ReadDirectoryDataReply, isDirectory), WIRE_FIELD(ReadDirectoryDataReply, name)> Layout;
+};
+
+inline bool commandHasPath(CommandCode code)
+{
+    switch (code)
+    {
+    case CommandCode::OpenFileForReading:
+    case CommandCode::OpenFileForWriting:
+    case CommandCode::OpenDirectory:
+    case CommandCode::DeleteFile:
+    case CommandCode::MakeDirectory:
+    case CommandCode::RemoveDirectory:
+    case CommandCode::GetFileStats:
+    case CommandCode::GetDirectorySize:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Number of bytes that follow the command header on the wire (decoded command)
+inline uint64_t commandPayloadSize(const Command& command)
+{
+    auto code = static_cast<CommandCode>(command.code);
+    if (code == CommandCode::WriteToFile)
+    {
+        return command.count;
+    }
+
+    return commandHasPath(code) ? command.size : 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#include "rawsector.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace rawsector
+{
+
+static_assert(UserDataSize % 64 == 0, "Compaction kernel copies 64 byte blocks");
+
+// Every 64 byte block is loaded before it is stored, since the source is always
+// ahead of the destination this makes in place compaction safe
+static inline void copyUserData(const uint8_t* source, uint8_t* destination)
+{
+#if defined(__SSE2__)
+    // the user data is never 16 byte aligned in the raw sector, so load unaligned
+    for (size_t i = 0; i < UserDataSize; i += 64)
+    {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 16));
+        auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 32));
+        auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 48));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 16), b);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 32), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 48), d);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (size_t i = 0; i < UserDataSize; i += 64)
+    {
+        auto a = vld1q_u8(source + i);
+        auto b = vld1q_u8(source + i + 16);
+        auto c = vld1q_u8(source + i + 32);
+        auto d = vld1q_u8(source + i + 48);
+        vst1q_u8(destination + i, a);
+        vst1q_u8(destination + i + 16, b);
+        vst1q_u8(destination + i + 32, c);
+        vst1q_u8(destination + i + 48, d);
+    }
+#else
+    memmove(destination, source, UserDataSize);
+#endif
+}
+
+void extractUserData(const uint8_t* sectors, uint32_t count, uint8_t* output)
+{
+    const uint8_t* source = sectors + UserDataOffset;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        copyUserData(source, output);
+        source += SectorSize;
+        output += UserDataSize;
+    }
+}
+
+}
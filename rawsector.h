@@ -0,0 +1,22 @@
+#ifndef RAW_SECTOR_H
+#define RAW_SECTOR_H
+
+#include <cstddef>
+#include <cinttypes>
+
+// Raw (2352 byte) CD sectors as found in PS1/PS2 BIN images
+namespace rawsector
+{
+
+constexpr size_t SectorSize = 2352;
+constexpr size_t UserDataOffset = 24;     // sync, header and subheader
+constexpr size_t UserDataSize = 2048;     // followed by 280 bytes of EDC/ECC
+
+// Copies the user data of consecutive raw sectors into a contiguous output buffer
+// The output may overlap the input as long as it does not start after it,
+// this allows compacting a buffer of raw sectors in place
+void extractUserData(const uint8_t* sectors, uint32_t count, uint8_t* output);
+
+}
+
+#endif
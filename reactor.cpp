@@ -0,0 +1,1072 @@
+#include "reactor.h"
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "utils/stringops.h"
+
+#include "affinity.h"
+#include "asynclog.h"
+#include "ps3client.h"
+#include "transport.h"
+#include "zerocopy.h"
+
+using namespace utils;
+using namespace std::chrono;
+
+#ifdef __linux__
+
+namespace
+{
+
+// Largest payload that can follow a command header (WriteToFile data)
+constexpr uint64_t MaxPayloadSize = BufferPool::MaxBufferSize;
+constexpr size_t ReceiveSize = 64 * 1024;
+constexpr size_t FileChunkSize = 256 * 1024;
+
+// Delay before a connection retries reading when the buffer pool has no memory left
+constexpr milliseconds MemoryRetryDelay(10);
+
+// File segments own a duplicate of the descriptor, the file cache may close the original
+// before the segment has been sent
+struct OutputSegment
+{
+    std::vector<uint8_t>    data;
+    size_t                  position = 0;
+    FileDescriptor          file;
+    uint64_t                offset = 0;
+    uint64_t                remaining = 0;
+};
+
+}
+
+// Transport that buffers the replies of a command, they are sent when the socket is writable
+// Consecutive writes end up in one segment, a segment in front of file data is sent with
+// MSG_MORE so the reply header leaves in the same packet as the start of the file data
+class EventTransport : public Transport
+{
+public:
+    explicit EventTransport(Socket&& socket)
+    : m_Socket(std::move(socket))
+    , m_Input(nullptr)
+    , m_InputSize(0)
+    , m_InputPosition(0)
+    , m_ZeroCopy(true)
+    {
+        m_Socket.setNoDelayOption();
+
+        int flags = fcntl(m_Socket.getFd(), F_GETFL, 0);
+        if (flags < 0 || fcntl(m_Socket.getFd(), F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            throw std::runtime_error(stringops::format("Failed to make socket non blocking: %s", strerror(errno)));
+        }
+    }
+
+    int32_t getFd() const
+    {
+        return m_Socket.getFd();
+    }
+
+    std::string getAddress() const override
+    {
+        return m_Socket.getAddress();
+    }
+
+    void setInput(const uint8_t* data, size_t size)
+    {
+        m_Input = data;
+        m_InputSize = size;
+        m_InputPosition = 0;
+    }
+
+    size_t read(void* data, size_t size) override
+    {
+        size = std::min(size, m_InputSize - m_InputPosition);
+        memcpy(data, m_Input + m_InputPosition, size);
+        m_InputPosition += size;
+        return size;
+    }
+
+    std::string readString(size_t size) override
+    {
+        if (m_InputSize - m_InputPosition < size)
+        {
+            throw std::logic_error("Command payload is shorter than requested string");
+        }
+
+        std::string result(reinterpret_cast<const char*>(m_Input + m_InputPosition), size);
+        m_InputPosition += size;
+        return result;
+    }
+
+    void write(const void* data, size_t size) override
+    {
+        if (m_Output.empty() || m_Output.back().file.isValid())
+        {
+            m_Output.emplace_back();
+        }
+
+        auto& buffer = m_Output.back().data;
+        auto* pData = reinterpret_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), pData, pData + size);
+    }
+
+    bool sendFile(int32_t fd, uint64_t offset, uint64_t count) override
+    {
+        if (!m_ZeroCopy)
+        {
+            return false;
+        }
+
+        if (count > 0)
+        {
+            FileDescriptor file(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+            if (!file.isValid())
+            {
+                return false;
+            }
+
+            m_Output.emplace_back();
+            m_Output.back().file = std::move(file);
+            m_Output.back().offset = offset;
+            m_Output.back().remaining = count;
+        }
+
+        return true;
+    }
+
+    bool sendStorageData(StorageBackend&, int32_t, uint64_t, uint64_t) override
+    {
+        // the socket is non blocking, file data is sent from the event loop
+        return false;
+    }
+
+    void close() override
+    {
+        m_Socket.close();
+    }
+
+    bool hasPendingOutput() const
+    {
+        return !m_Output.empty();
+    }
+
+    size_t getBufferedBytes() const
+    {
+        size_t bytes = 0;
+        for (auto& segment : m_Output)
+        {
+            bytes += segment.data.capacity();
+        }
+
+        return bytes;
+    }
+
+    // Called by the client at the end of a command on a worker thread, the reply is sent by the
+    // reactor. Reads the next chunk of file data that can not be sent zero-copy.
+    void flush() override
+    {
+        if (needsFileRead())
+        {
+            readFileChunk(m_Output.front());
+        }
+    }
+
+    bool needsFileRead() const
+    {
+        return !m_ZeroCopy && !m_Output.empty() && m_Output.front().file.isValid();
+    }
+
+    // Sends as much of the pending output as the socket accepts, stops in front of file data
+    // that has to be read first
+    void send()
+    {
+        while (!m_Output.empty())
+        {
+            auto& segment = m_Output.front();
+            if (!segment.file.isValid())
+            {
+                int32_t flags = MSG_NOSIGNAL;
+                if (m_ZeroCopy && m_Output.size() > 1 && m_Output[1].file.isValid())
+                {
+                    flags |= MSG_MORE;
+                }
+
+                ssize_t result = ::send(m_Socket.getFd(), segment.data.data() + segment.position, segment.data.size() - segment.position, flags);
+                if (result < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        return;
+                    }
+
+                    throw std::runtime_error(stringops::format("Failed to write to socket: %s", strerror(errno)));
+                }
+
+                segment.position += result;
+                if (segment.position == segment.data.size())
+                {
+                    m_Output.pop_front();
+                }
+            }
+            else if (m_ZeroCopy)
+            {
+                auto result = zerocopy::trySendFile(m_Socket.getFd(), segment.file.get(), segment.offset, segment.remaining);
+                if (result < 0)
+                {
+                    LOG_DEBUG("Zero-copy transfer not available, falling back to buffered reads");
+                    m_ZeroCopy = false;
+                    continue;
+                }
+
+                if (result == 0)
+                {
+                    return;
+                }
+
+                segment.offset += result;
+                segment.remaining -= result;
+                if (segment.remaining == 0)
+                {
+                    m_Output.pop_front();
+                }
+            }
+            else
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    // Replaces the head of a file segment by a data segment containing the file contents
+    void readFileChunk(OutputSegment& segment)
+    {
+        OutputSegment chunk;
+        chunk.data.resize(static_cast<size_t>(std::min<uint64_t>(segment.remaining, FileChunkSize)));
+
+        size_t bytesRead = 0;
+        while (bytesRead < chunk.data.size())
+        {
+            ssize_t result = pread(segment.file.get(), chunk.data.data() + bytesRead, chunk.data.size() - bytesRead, segment.offset + bytesRead);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (result <= 0)
+            {
+                throw std::logic_error("File is not ok for reading");
+            }
+
+            bytesRead += result;
+        }
+
+        segment.offset += bytesRead;
+        segment.remaining -= bytesRead;
+        if (segment.remaining == 0)
+        {
+            m_Output.pop_front();
+        }
+
+        m_Output.push_front(std::move(chunk));
+    }
+
+    Socket                      m_Socket;
+    const uint8_t*              m_Input;
+    size_t                      m_InputSize;
+    size_t                      m_InputPosition;
+    bool                        m_ZeroCopy;
+    std::deque<OutputSegment>   m_Output;
+};
+
+// The input and output buffers of a connection are counted against the buffer pool of the
+// listener, a connection stops reading when the pool has no memory left for its input
+// Commands and file reads may block on the disk, they are handed to the reactor as work for
+// the command threads. The connection takes no events until the reactor completes the work.
+class EventConnection
+{
+public:
+    EventConnection(ServerContext& context, uint32_t listener, Socket&& socket, AdmissionSlot&& slot)
+    : m_Slot(std::move(slot))
+    , m_BufferPool(context.getBufferPool(listener))
+    , m_Transport(new EventTransport(std::move(socket)))
+    , m_Client(context, std::unique_ptr<Transport>(m_Transport), listener)
+    , m_InputPosition(0)
+    , m_CommandSize(0)
+    , m_OutputReserved(0)
+    , m_Events(0)
+    , m_LastActivity(steady_clock::now())
+    , m_Throttled(false)
+    , m_WaitingForMemory(false)
+    , m_Working(false)
+    {
+    }
+
+    ~EventConnection()
+    {
+        m_BufferPool.unreserve(m_Input.capacity() + m_OutputReserved);
+    }
+
+    int32_t getFd() const
+    {
+        return m_Transport->getFd();
+    }
+
+    std::string getAddress() const
+    {
+        return m_Client.getAddress();
+    }
+
+    uint32_t getEvents() const
+    {
+        return m_Events;
+    }
+
+    void setEvents(uint32_t events)
+    {
+        m_Events = events;
+    }
+
+    bool wantsWrite() const
+    {
+        return m_Transport->hasPendingOutput();
+    }
+
+    // The io scheduler did not admit the next command yet or the buffer pool has no memory
+    // for more input, it is retried at the resume time
+    bool isThrottled() const
+    {
+        return m_Throttled || m_WaitingForMemory;
+    }
+
+    steady_clock::time_point getResumeTime() const
+    {
+        return m_ResumeTime;
+    }
+
+    // Work was handed out and is not completed yet, the input and output must not be touched
+    bool isWorking() const
+    {
+        return m_Working;
+    }
+
+    std::function<void()> takeWork()
+    {
+        std::function<void()> work;
+        work.swap(m_Work);
+        return work;
+    }
+
+    // A connection is busy with a command while a reply or part of a command is pending
+    bool isBusy() const
+    {
+        return m_Working || m_Transport->hasPendingOutput() || m_Input.size() > m_InputPosition;
+    }
+
+    steady_clock::time_point getLastActivity() const
+    {
+        return m_LastActivity;
+    }
+
+    // Returns false when the peer closed the connection
+    bool onReadable()
+    {
+        bool open = true;
+        while (m_Input.size() < m_Input.capacity() || growInput())
+        {
+            auto size = m_Input.size();
+            m_Input.resize(m_Input.capacity());
+
+            ssize_t result = ::recv(getFd(), m_Input.data() + size, m_Input.size() - size, 0);
+            m_Input.resize(size + std::max<ssize_t>(result, 0));
+
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+
+                throw std::runtime_error(stringops::format("Failed to read from socket: %s", strerror(errno)));
+            }
+
+            if (result == 0)
+            {
+                open = false;
+                break;
+            }
+
+            m_LastActivity = steady_clock::now();
+        }
+
+        processCommands();
+        return open;
+    }
+
+    void onWritable()
+    {
+        m_Transport->send();
+        if (m_Transport->needsFileRead())
+        {
+            setWork([this] () {
+                m_Transport->flush();
+            });
+            return;
+        }
+
+        processCommands();
+        m_LastActivity = steady_clock::now();
+    }
+
+    // Called by the reactor when the command threads finished the work, rethrows its error
+    void onWorkComplete()
+    {
+        m_Working = false;
+        m_LastActivity = steady_clock::now();
+
+        if (m_Error)
+        {
+            std::exception_ptr error;
+            std::swap(error, m_Error);
+            std::rethrow_exception(error);
+        }
+
+        if (m_CommandSize > 0)
+        {
+            m_Transport->setInput(nullptr, 0);
+            m_InputPosition += m_CommandSize;
+            m_CommandSize = 0;
+        }
+
+        onWritable();
+    }
+
+    void onResume()
+    {
+        m_Throttled = false;
+        m_WaitingForMemory = false;
+        processCommands();
+        m_LastActivity = steady_clock::now();
+    }
+
+private:
+    void setWork(std::function<void()> work)
+    {
+        m_Working = true;
+        m_Work = [this, work] () {
+            try
+            {
+                work();
+            }
+            catch (std::exception&)
+            {
+                m_Error = std::current_exception();
+            }
+        };
+    }
+
+    // Input is read in small chunks, the buffer only grows to the size of a command with a
+    // larger payload. Returns false when the buffered commands have to be executed first or
+    // the buffer pool has no memory left.
+    bool growInput()
+    {
+        auto available = m_Input.size() - m_InputPosition;
+        size_t required = ReceiveSize;
+        if (available >= wire::size<Command>())
+        {
+            Command command;
+            wire::decode(m_Input.data() + m_InputPosition, command);
+
+            auto payloadSize = commandPayloadSize(command);
+            if (payloadSize > MaxPayloadSize)
+            {
+                return false;
+            }
+
+            required = std::max(required, wire::size<Command>() + static_cast<size_t>(payloadSize));
+        }
+
+        if (available >= required)
+        {
+            return false;
+        }
+
+        auto capacity = m_InputPosition + required;
+        if (!m_BufferPool.tryReserve(capacity - m_Input.capacity(), m_Input.capacity() + m_OutputReserved))
+        {
+            if (!m_Throttled)
+            {
+                m_ResumeTime = steady_clock::now() + MemoryRetryDelay;
+            }
+
+            m_WaitingForMemory = true;
+            return false;
+        }
+
+        m_Input.reserve(capacity);
+        if (m_Input.capacity() > capacity)
+        {
+            m_BufferPool.reserve(m_Input.capacity() - capacity);
+        }
+
+        return true;
+    }
+
+    // Replies are produced by the commands, they are counted once they are buffered
+    void updateOutputReserved()
+    {
+        auto bytes = m_Transport->getBufferedBytes();
+        if (bytes > m_OutputReserved)
+        {
+            m_BufferPool.reserve(bytes - m_OutputReserved);
+        }
+        else if (bytes < m_OutputReserved)
+        {
+            m_BufferPool.unreserve(m_OutputReserved - bytes);
+        }
+
+        m_OutputReserved = bytes;
+    }
+
+    // Executes the buffered commands, the next command is only started when the reply of the
+    // previous one has been sent completely
+    void processCommands()
+    {
+        while (!m_Throttled && !m_Working && !m_Transport->hasPendingOutput())
+        {
+            auto available = m_Input.size() - m_InputPosition;
+            if (available < wire::size<Command>())
+            {
+                break;
+            }
+
+            Command command;
+            wire::decode(m_Input.data() + m_InputPosition, command);
+
+            auto payloadSize = commandPayloadSize(command);
+            if (payloadSize > MaxPayloadSize)
+            {
+                throw std::logic_error(stringops::format("Command payload too large: %d", payloadSize));
+            }
+
+            if (available < wire::size<Command>() + payloadSize)
+            {
+                break;
+            }
+
+            m_Transport->setInput(m_Input.data() + m_InputPosition + wire::size<Command>(), static_cast<size_t>(payloadSize));
+            // a client over its bandwidth cap must not stall the other connections of the reactor
+            if (!m_Client.tryScheduleCommand(command, m_ResumeTime))
+            {
+                m_Throttled = true;
+                break;
+            }
+
+            // the input stays in place until the command completed on the command threads
+            m_CommandSize = wire::size<Command>() + static_cast<size_t>(payloadSize);
+            setWork([this, command] () {
+                m_Client.handleCommand(command);
+            });
+
+            m_LastActivity = steady_clock::now();
+        }
+
+        if (m_Working)
+        {
+            return;
+        }
+
+        if (m_InputPosition > 0)
+        {
+            m_Input.erase(m_Input.begin(), m_Input.begin() + m_InputPosition);
+            m_InputPosition = 0;
+        }
+
+        // idle connections hold no input buffer, large payload buffers are shrunk after the command
+        auto capacity = m_Input.empty() ? 0 : ReceiveSize;
+        if (m_Input.size() <= capacity)
+        {
+            shrinkInput(capacity);
+        }
+
+        updateOutputReserved();
+    }
+
+    void shrinkInput(size_t capacity)
+    {
+        if (m_Input.capacity() <= capacity)
+        {
+            return;
+        }
+
+        std::vector<uint8_t> input;
+        input.reserve(capacity);
+        input.assign(m_Input.begin(), m_Input.end());
+
+        m_BufferPool.unreserve(m_Input.capacity() - input.capacity());
+        m_Input.swap(input);
+    }
+
+    // released after the client
+    AdmissionSlot               m_Slot;
+    BufferPool&                 m_BufferPool;
+    EventTransport*             m_Transport;
+    Ps3Client                   m_Client;
+    std::vector<uint8_t>        m_Input;
+    size_t                      m_InputPosition;
+    size_t                      m_CommandSize;
+    size_t                      m_OutputReserved;
+    uint32_t                    m_Events;
+    steady_clock::time_point    m_LastActivity;
+    bool                        m_Throttled;
+    bool                        m_WaitingForMemory;
+    steady_clock::time_point    m_ResumeTime;
+    bool                        m_Working;
+    std::function<void()>       m_Work;
+    std::exception_ptr          m_Error;
+};
+
+Reactor::Reactor(ServerContext& context, uint32_t listener, int32_t cpu)
+: m_Context(context)
+, m_Listener(listener)
+, m_Cpu(cpu)
+, m_EpollFd(epoll_create1(EPOLL_CLOEXEC))
+, m_WakeupFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+, m_Stop(false)
+, m_RunningWork(0)
+{
+    if (!m_EpollFd.isValid() || !m_WakeupFd.isValid())
+    {
+        throw std::runtime_error(stringops::format("Failed to create reactor: %s", strerror(errno)));
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = m_WakeupFd.get();
+    if (epoll_ctl(m_EpollFd.get(), EPOLL_CTL_ADD, m_WakeupFd.get(), &event) < 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to register reactor wakeup: %s", strerror(errno)));
+    }
+}
+
+Reactor::~Reactor()
+{
+    if (m_Thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stop = true;
+        }
+
+        wakeup();
+        m_Thread.join();
+
+        // the work refers to the connections
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_WorkFinished.wait(lock, [this] () { return m_RunningWork == 0; });
+    }
+}
+
+bool Reactor::isSupported()
+{
+    return true;
+}
+
+void Reactor::start()
+{
+    m_Thread = std::thread(&Reactor::run, this);
+}
+
+void Reactor::addConnection(Socket&& socket, AdmissionSlot&& slot)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_PendingConnections.push_back(PendingConnection { std::move(socket), std::move(slot) });
+    }
+
+    wakeup();
+}
+
+void Reactor::wakeup()
+{
+    uint64_t value = 1;
+    if (::write(m_WakeupFd.get(), &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        LOG_ERROR("Failed to wake up reactor: %s", strerror(errno));
+    }
+}
+
+void Reactor::acceptPendingConnections()
+{
+    uint64_t value;
+    while (::read(m_WakeupFd.get(), &value, sizeof(value)) > 0) {}
+
+    std::deque<PendingConnection> pending;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        pending.swap(m_PendingConnections);
+    }
+
+    for (auto& entry : pending)
+    {
+        try
+        {
+            auto connection = std::make_unique<EventConnection>(m_Context, m_Listener, std::move(entry.socket), std::move(entry.slot));
+            auto fd = connection->getFd();
+            auto& conn = *connection;
+            m_Connections.emplace(fd, std::move(connection));
+
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.fd = fd;
+            if (epoll_ctl(m_EpollFd.get(), EPOLL_CTL_ADD, fd, &event) < 0)
+            {
+                m_Connections.erase(fd);
+                throw std::runtime_error(stringops::format("Failed to register connection: %s", strerror(errno)));
+            }
+
+            conn.setEvents(event.events);
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR("Failed to create client: %s", e.what());
+        }
+    }
+}
+
+void Reactor::updateEvents(EventConnection& connection)
+{
+    // stop reading while a reply is pending or the next command is throttled, so a client can
+    // not queue unbounded work. A working connection only reports a hang up or an error once,
+    // it is handled when the work completed.
+    uint32_t events = EPOLLRDHUP;
+    if (connection.isWorking())
+    {
+        events = EPOLLONESHOT;
+    }
+    else if (connection.wantsWrite())
+    {
+        events |= EPOLLOUT;
+    }
+    else if (!connection.isThrottled())
+    {
+        events |= EPOLLIN;
+    }
+
+    if (events == connection.getEvents())
+    {
+        return;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = connection.getFd();
+    if (epoll_ctl(m_EpollFd.get(), EPOLL_CTL_MOD, connection.getFd(), &event) < 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to update connection events: %s", strerror(errno)));
+    }
+
+    connection.setEvents(events);
+}
+
+// Hands out the work of the connection and parks it, or starts the throttling
+void Reactor::updateConnection(int32_t fd, EventConnection& connection, bool wasThrottled)
+{
+    executeWork(fd, connection);
+    updateEvents(connection);
+    if (!wasThrottled && connection.isThrottled())
+    {
+        throttleConnection(fd, connection);
+    }
+}
+
+void Reactor::executeWork(int32_t fd, EventConnection& connection)
+{
+    auto work = connection.takeWork();
+    if (!work)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        ++m_RunningWork;
+    }
+
+    m_Context.commandThreads->post([this, fd, work] () {
+        work();
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_CompletedWork.push_back(fd);
+        --m_RunningWork;
+        m_WorkFinished.notify_all();
+        wakeup();
+    });
+}
+
+// Continues the connections whose work the command threads finished, a working connection is
+// never closed so all of them still exist
+void Reactor::completeWork()
+{
+    std::vector<int32_t> completed;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        completed.swap(m_CompletedWork);
+    }
+
+    for (auto fd : completed)
+    {
+        auto& connection = *m_Connections[fd];
+        try
+        {
+            connection.onWorkComplete();
+            updateConnection(fd, connection, false);
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR(e.what());
+            closeConnection(fd);
+        }
+    }
+}
+
+void Reactor::closeConnection(int32_t fd)
+{
+    epoll_ctl(m_EpollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+    m_Connections.erase(fd);
+    m_Context.getBufferPool(m_Listener).logStats();
+}
+
+void Reactor::throttleConnection(int32_t fd, EventConnection& connection)
+{
+    m_ThrottledConnections.emplace(connection.getResumeTime(), fd);
+}
+
+// Continues the throttled connections whose resume time passed, entries of connections that
+// were closed in the meantime are skipped
+void Reactor::resumeConnections()
+{
+    auto now = steady_clock::now();
+    while (!m_ThrottledConnections.empty() && m_ThrottledConnections.begin()->first <= now)
+    {
+        auto fd = m_ThrottledConnections.begin()->second;
+        m_ThrottledConnections.erase(m_ThrottledConnections.begin());
+
+        auto iter = m_Connections.find(fd);
+        if (iter == m_Connections.end() || !iter->second->isThrottled())
+        {
+            continue;
+        }
+
+        auto& connection = *iter->second;
+        try
+        {
+            connection.onResume();
+            updateConnection(fd, connection, false);
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR(e.what());
+            closeConnection(fd);
+        }
+    }
+}
+
+// Milliseconds until the reactor has to check its connections, -1 waits for events only
+int32_t Reactor::getWaitTimeout(bool expiryChecks) const
+{
+    int32_t timeout = expiryChecks ? 1000 : -1;
+    if (!m_ThrottledConnections.empty())
+    {
+        auto wait = m_ThrottledConnections.begin()->first - steady_clock::now();
+        auto resume = static_cast<int32_t>(std::max<int64_t>(0, duration_cast<milliseconds>(wait + milliseconds(1) - nanoseconds(1)).count()));
+        timeout = timeout < 0 ? resume : std::min(timeout, resume);
+    }
+
+    return timeout;
+}
+
+// Closes the connections that were idle or made no progress with a command for too long
+void Reactor::closeExpiredConnections()
+{
+    auto& settings = m_Context.settings.admission;
+    auto now = steady_clock::now();
+
+    for (auto iter = m_Connections.begin(); iter != m_Connections.end();)
+    {
+        auto current = iter++;
+        auto& connection = *current->second;
+        if (connection.isWorking())
+        {
+            // the command threads still use the connection, the activity is updated when they finish
+            continue;
+        }
+
+        bool idle = !connection.isBusy();
+        auto timeout = seconds(idle ? settings.idleTimeout : settings.commandTimeout);
+        if (timeout.count() == 0 || now - connection.getLastActivity() < timeout)
+        {
+            continue;
+        }
+
+        LOG_INFO("Closing connection of %s: %s", connection.getAddress(), idle ? "Connection idle for too long" : "Command made no progress for too long");
+        m_Context.admission.addTimeout(idle);
+        closeConnection(current->first);
+    }
+}
+
+void Reactor::run()
+{
+    if (m_Cpu >= 0 && !pinThreadToCpu(m_Cpu))
+    {
+        LOG_WARN("Failed to pin reactor thread to cpu %d", m_Cpu);
+    }
+
+    std::array<epoll_event, 64> events;
+
+    // connections with timeouts are checked every second
+    auto& admission = m_Context.settings.admission;
+    bool expiryChecks = admission.idleTimeout > 0 || admission.commandTimeout > 0;
+    m_NextExpiryCheck = steady_clock::now() + seconds(1);
+
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Stop)
+            {
+                break;
+            }
+        }
+
+        int count = epoll_wait(m_EpollFd.get(), events.data(), events.size(), getWaitTimeout(expiryChecks));
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            LOG_ERROR("Reactor wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            auto fd = events[i].data.fd;
+            if (fd == m_WakeupFd.get())
+            {
+                acceptPendingConnections();
+                completeWork();
+                continue;
+            }
+
+            // the events of a working connection are handled when its work completed
+            auto iter = m_Connections.find(fd);
+            if (iter == m_Connections.end() || iter->second->isWorking())
+            {
+                continue;
+            }
+
+            auto& connection = *iter->second;
+            try
+            {
+                bool throttled = connection.isThrottled();
+                bool open = (events[i].events & EPOLLERR) == 0;
+                if (open && (events[i].events & EPOLLOUT))
+                {
+                    connection.onWritable();
+                }
+
+                if (open && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                {
+                    open = connection.onReadable();
+                }
+
+                // the commands the peer sent before closing the connection are still executed
+                if (open || connection.isWorking())
+                {
+                    updateConnection(fd, connection, throttled);
+                }
+                else
+                {
+                    closeConnection(fd);
+                }
+            }
+            catch (std::exception& e)
+            {
+                LOG_ERROR(e.what());
+                closeConnection(fd);
+            }
+        }
+
+        resumeConnections();
+
+        if (expiryChecks && steady_clock::now() >= m_NextExpiryCheck)
+        {
+            closeExpiredConnections();
+            m_NextExpiryCheck = steady_clock::now() + seconds(1);
+        }
+    }
+}
+
+#else
+
+class EventConnection
+{
+};
+
+Reactor::Reactor(ServerContext& context, uint32_t listener, int32_t cpu)
+: m_Context(context)
+, m_Listener(listener)
+, m_Cpu(cpu)
+, m_Stop(false)
+{
+    throw std::runtime_error("The event driven engine is not supported on this platform");
+}
+
+Reactor::~Reactor()
+{
+}
+
+bool Reactor::isSupported()
+{
+    return false;
+}
+
+void Reactor::start()
+{
+}
+
+void Reactor::addConnection(Socket&&, AdmissionSlot&&)
+{
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "utils/socket.h"
+
+#include "admission.h"
+#include "filedescriptor.h"
+#include "servercontext.h"
+
+class EventConnection;
+
+// Event driven connection engine: a single thread multiplexes many clients using
+// epoll, commands are parsed without blocking and replies are sent as the socket drains
+// The commands are executed by the command threads of the context, so a command waiting for
+// the disk does not stall the other connections of the reactor
+class Reactor
+{
+public:
+    // The connections use the buffer pool of the listener, the thread is pinned to the cpu
+    // unless it is negative
+    Reactor(ServerContext& context, uint32_t listener = 0, int32_t cpu = -1);
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    void start();
+
+    // Hands over an accepted connection, can be called from any thread
+    void addConnection(utils::Socket&& socket, AdmissionSlot&& slot);
+
+    static bool isSupported();
+
+private:
+    void run();
+    void wakeup();
+    void acceptPendingConnections();
+    void updateEvents(EventConnection& connection);
+    void updateConnection(int32_t fd, EventConnection& connection, bool wasThrottled);
+    void executeWork(int32_t fd, EventConnection& connection);
+    void completeWork();
+    void closeConnection(int32_t fd);
+    void throttleConnection(int32_t fd, EventConnection& connection);
+    void resumeConnections();
+    int32_t getWaitTimeout(bool expiryChecks) const;
+    void closeExpiredConnections();
+
+    struct PendingConnection
+    {
+        utils::Socket   socket;
+        AdmissionSlot   slot;
+    };
+
+    ServerContext&                                              m_Context;
+    uint32_t                                                    m_Listener;
+    int32_t                                                     m_Cpu;
+    FileDescriptor                                              m_EpollFd;
+    FileDescriptor                                              m_WakeupFd;
+    std::thread                                                 m_Thread;
+    bool                                                        m_Stop;
+    std::chrono::steady_clock::time_point                       m_NextExpiryCheck;
+
+    std::mutex                                                  m_Mutex;
+    std::deque<PendingConnection>                               m_PendingConnections;
+    std::vector<int32_t>                                        m_CompletedWork;
+    uint32_t                                                    m_RunningWork;
+    std::condition_variable                                     m_WorkFinished;
+    std::unordered_map<int32_t, std::unique_ptr<EventConnection>> m_Connections;
+    std::multimap<std::chrono::steady_clock::time_point, int32_t> m_ThrottledConnections;
+};
+
+#endif
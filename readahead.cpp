@@ -0,0 +1,263 @@
+#include "readahead.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+constexpr size_t ReadAhead::MinWindow;
+constexpr size_t ReadAhead::MaxPrefetches;
+
+static void adviseSequential(int32_t fd)
+{
+#if defined(__APPLE__)
+    fcntl(fd, F_RDAHEAD, 1);
+#else
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+static void adviseWillNeed(int32_t fd, uint64_t offset, uint64_t length)
+{
+#if defined(__APPLE__)
+    radvisory advisory;
+    advisory.ra_offset = offset;
+    advisory.ra_count = static_cast<int>(length);
+    fcntl(fd, F_RDADVISE, &advisory);
+#else
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+ReadAhead::ReadAhead(ThreadPool& ioThreads, BufferPool& bufferPool, StorageBackend& storage, int32_t fd, uint64_t fileSize, size_t maxWindow)
+: m_IoThreads(ioThreads)
+, m_BufferPool(bufferPool)
+, m_Storage(storage)
+, m_Fd(fd)
+, m_FileSize(fileSize)
+, m_MaxWindow(std::min(std::max(maxWindow, MinWindow), BufferPool::MaxBufferSize))
+, m_Window(MinWindow)
+, m_LastOffset(0)
+, m_LastSize(0)
+, m_Stride(0)
+, m_Streak(0)
+, m_NextOffset(0)
+, m_PrefetchOffset(0)
+, m_HintedUntil(0)
+, m_InFlight(0)
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    // the io threads use the file descriptor, which is closed after this
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_PrefetchDone.wait(lock, [this] () { return m_InFlight == 0; });
+}
+
+size_t ReadAhead::read(uint64_t offset, uint8_t* data, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    bool predicted = updatePattern(offset, size);
+    auto served = copyPrefetched(lock, offset, data, size);
+
+    served == size ? ++m_Stats.hits : ++m_Stats.misses;
+    m_Stats.bytesServed += served;
+    adaptWindow(predicted && served > 0);
+
+    if (predicted)
+    {
+        discardPrefetches(offset + size);
+    }
+    else
+    {
+        m_Prefetches.clear();
+    }
+
+    schedulePrefetches();
+    return served;
+}
+
+void ReadAhead::hint(uint64_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    bool predicted = updatePattern(offset, size);
+    bool hit = predicted && offset + size <= m_HintedUntil;
+
+    hit ? ++m_Stats.hits : ++m_Stats.misses;
+    adaptWindow(predicted);
+
+    if (m_Streak == 0)
+    {
+        m_HintedUntil = 0;
+        return;
+    }
+
+    if (m_Streak == 1)
+    {
+        adviseSequential(m_Fd);
+    }
+
+    if (isStrided())
+    {
+        auto length = std::min<uint64_t>(m_LastSize, m_FileSize - std::min(m_NextOffset, m_FileSize));
+        adviseWillNeed(m_Fd, m_NextOffset, length);
+        m_Stats.bytesPrefetched += length;
+        return;
+    }
+
+    // only advise again when the client consumed half of the advised window
+    if (m_HintedUntil < m_NextOffset + m_Window / 2)
+    {
+        auto start = std::max(m_NextOffset, m_HintedUntil);
+        auto end = std::min<uint64_t>(m_NextOffset + m_Window, m_FileSize);
+        if (start < end)
+        {
+            adviseWillNeed(m_Fd, start, end - start);
+            m_Stats.bytesPrefetched += end - start;
+            m_HintedUntil = end;
+        }
+    }
+}
+
+ReadAheadStats ReadAhead::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Stats;
+}
+
+bool ReadAhead::updatePattern(uint64_t offset, size_t size)
+{
+    bool predicted = offset == m_NextOffset;
+    auto delta = static_cast<int64_t>(offset - m_LastOffset);
+
+    bool sequential = offset == m_LastOffset + m_LastSize;
+    bool strided = delta > 0 && delta == m_Stride;
+    m_Streak = (sequential || strided) ? m_Streak + 1 : 0;
+
+    m_Stride = std::max<int64_t>(delta, 0);
+    m_LastOffset = offset;
+    m_LastSize = size;
+    m_NextOffset = (sequential || m_Stride == 0) ? offset + size : offset + m_Stride;
+
+    return predicted;
+}
+
+bool ReadAhead::isStrided() const
+{
+    return m_Stride > static_cast<int64_t>(m_LastSize);
+}
+
+void ReadAhead::adaptWindow(bool hit)
+{
+    m_Window = hit ? std::min(m_Window * 2, m_MaxWindow) : std::max(m_Window / 2, MinWindow);
+}
+
+size_t ReadAhead::copyPrefetched(std::unique_lock<std::mutex>& lock, uint64_t offset, uint8_t* data, size_t size)
+{
+    size_t served = 0;
+
+    while (served < size)
+    {
+        auto position = offset + served;
+        auto iter = std::find_if(m_Prefetches.begin(), m_Prefetches.end(), [position] (const std::shared_ptr<Prefetch>& prefetch) {
+            return position >= prefetch->offset && position < prefetch->offset + prefetch->size;
+        });
+
+        if (iter == m_Prefetches.end())
+        {
+            break;
+        }
+
+        auto prefetch = *iter;
+        m_PrefetchDone.wait(lock, [&prefetch] () { return prefetch->ready; });
+
+        if (position >= prefetch->offset + prefetch->bytesRead)
+        {
+            break;
+        }
+
+        auto prefetchOffset = static_cast<size_t>(position - prefetch->offset);
+        auto length = std::min(size - served, prefetch->bytesRead - prefetchOffset);
+        memcpy(data + served, prefetch->buffer.data() + prefetchOffset, length);
+        served += length;
+    }
+
+    return served;
+}
+
+void ReadAhead::discardPrefetches(uint64_t offset)
+{
+    while (!m_Prefetches.empty() && m_Prefetches.front()->offset + m_Prefetches.front()->size <= offset)
+    {
+        m_Prefetches.pop_front();
+    }
+}
+
+void ReadAhead::schedulePrefetches()
+{
+    if (m_Streak == 0)
+    {
+        return;
+    }
+
+    if (m_Prefetches.empty())
+    {
+        m_PrefetchOffset = m_NextOffset;
+    }
+
+    while (m_Prefetches.size() < MaxPrefetches && m_PrefetchOffset < m_FileSize)
+    {
+        auto size = static_cast<size_t>(std::min<uint64_t>(isStrided() ? m_LastSize : m_Window, m_FileSize - m_PrefetchOffset));
+        if (size == 0)
+        {
+            break;
+        }
+
+        // prefetching must never hold up the regular reads of other clients
+        auto buffer = m_BufferPool.tryAcquire(size);
+        if (!buffer.isValid())
+        {
+            break;
+        }
+
+        auto prefetch = std::make_shared<Prefetch>();
+        prefetch->offset = m_PrefetchOffset;
+        prefetch->size = size;
+        prefetch->buffer = std::move(buffer);
+        m_Prefetches.push_back(prefetch);
+        m_PrefetchOffset += isStrided() ? m_Stride : size;
+
+        ++m_InFlight;
+        m_IoThreads.post([this, prefetch] () { executePrefetch(prefetch); });
+    }
+}
+
+void ReadAhead::executePrefetch(std::shared_ptr<Prefetch> prefetch)
+{
+    size_t bytesRead = 0;
+    try
+    {
+        bytesRead = m_Storage.read(m_Fd, prefetch->offset, prefetch->buffer.data(), prefetch->size);
+    }
+    catch (std::exception&)
+    {
+        // the client reads the range itself and reports the error
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        prefetch->bytesRead = bytesRead;
+        prefetch->ready = true;
+        m_Stats.bytesPrefetched += bytesRead;
+        --m_InFlight;
+
+        // notify while locked, the owner may be waiting to destroy this object
+        m_PrefetchDone.notify_all();
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <cinttypes>
+#include <condition_variable>
+
+#include "bufferpool.h"
+#include "threadpool.h"
+
+class StorageBackend;
+
+struct ReadAheadStats
+{
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+    uint64_t    bytesPrefetched = 0;
+    uint64_t    bytesServed = 0;
+};
+
+// Detects sequential and strided access patterns in the read requests of an open
+// file and prefetches the next window before it is requested.
+// The window grows while predictions hit and shrinks when they miss.
+class ReadAhead
+{
+public:
+    static constexpr size_t MinWindow = 256 * 1024;
+
+    ReadAhead(ThreadPool& ioThreads, BufferPool& bufferPool, StorageBackend& storage, int32_t fd, uint64_t fileSize, size_t maxWindow);
+    ~ReadAhead();
+
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    // Buffered reads: copies the start of the requested range from the prefetched data
+    // and schedules the next prefetches on the io threads.
+    // Returns the number of bytes that were served, the caller reads the remainder.
+    size_t read(uint64_t offset, uint8_t* data, size_t size);
+
+    // Zero-copy reads: the data does not pass through user space so the
+    // kernel is advised to bring the predicted range in the page cache instead
+    void hint(uint64_t offset, size_t size);
+
+    ReadAheadStats getStats() const;
+
+private:
+    struct Prefetch
+    {
+        uint64_t        offset = 0;
+        size_t          size = 0;
+        size_t          bytesRead = 0;
+        PooledBuffer    buffer;
+        bool            ready = false;
+    };
+
+    // Returns true if the request was predicted by the previous requests
+    bool updatePattern(uint64_t offset, size_t size);
+    bool isStrided() const;
+    void adaptWindow(bool hit);
+    size_t copyPrefetched(std::unique_lock<std::mutex>& lock, uint64_t offset, uint8_t* data, size_t size);
+    void discardPrefetches(uint64_t offset);
+    void schedulePrefetches();
+    void executePrefetch(std::shared_ptr<Prefetch> prefetch);
+
+    static constexpr size_t MaxPrefetches = 3;
+
+    ThreadPool&                             m_IoThreads;
+    BufferPool&                             m_BufferPool;
+    StorageBackend&                         m_Storage;
+    int32_t                                 m_Fd;
+    uint64_t                                m_FileSize;
+    size_t                                  m_MaxWindow;
+    size_t                                  m_Window;
+
+    uint64_t                                m_LastOffset;
+    size_t                                  m_LastSize;
+    int64_t                                 m_Stride;
+    uint32_t                                m_Streak;
+    uint64_t                                m_NextOffset;
+    uint64_t                                m_PrefetchOffset;
+    uint64_t                                m_HintedUntil;
+
+    mutable std::mutex                      m_Mutex;
+    std::condition_variable                 m_PrefetchDone;
+    std::deque<std::shared_ptr<Prefetch>>   m_Prefetches;
+    uint32_t                                m_InFlight;
+    ReadAheadStats                          m_Stats;
+};
+
+#endif
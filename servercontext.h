@@ -0,0 +1,156 @@
+#ifndef SERVER_CONTEXT_H
+#define SERVER_CONTEXT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cinttypes>
+
+#include "compat.h"
+#include "admission.h"
+#include "blockcache.h"
+#include "bufferpool.h"
+#include "compressedimage.h"
+#include "directorycache.h"
+#include "filecache.h"
+#include "filewatcher.h"
+#include "filewriter.h"
+#include "ioscheduler.h"
+#include "metrics.h"
+#include "sizeindex.h"
+#include "statcache.h"
+#include "storage.h"
+#include "threadpool.h"
+#include "tracewriter.h"
+#include "virtualiso.h"
+
+struct ServerSettings
+{
+    std::string rootPath;
+    uint32_t    port = 0;
+    uint32_t    reactorThreads = 0;
+    uint32_t    listenerThreads = 0;
+    size_t      bufferPoolLimit = 64 * 1024 * 1024;
+    size_t      readAheadWindow = 4 * 1024 * 1024;
+    uint32_t    ioThreads = 4;
+    uint32_t    metadataThreads = 8;
+    uint32_t    writeThreads = 2;
+    uint32_t    commandThreads = 16;
+    SyncPolicy  syncPolicy = SyncPolicy::Never;
+    size_t      maxOpenFiles = 256;
+    bool        mapFiles = false;
+    size_t      maxCachedDirectories = 128;
+    size_t      maxCachedStats = 4096;
+    std::string sizeIndexPath;
+    bool        ioUring = false;
+    uint32_t    statsPort = 0;
+    std::string tracePath;
+    bool        virtualIso = false;
+    std::string virtualIsoLayoutPath;
+    uint32_t    decompressThreads = 4;
+    size_t      decompressedCacheSize = 64 * 1024 * 1024;
+    IoSchedulerSettings ioScheduler;
+    size_t      blockCacheSize = 0;
+    AdmissionSettings admission;
+};
+
+// State shared by all clients of a server
+struct ServerContext
+{
+    explicit ServerContext(const ServerSettings& serverSettings)
+    : ServerContext(serverSettings, createStorageBackend(serverSettings.ioUring))
+    {
+    }
+
+    // Serves the file data through the given backend, e.g. a MemoryStorage
+    ServerContext(const ServerSettings& serverSettings, std::unique_ptr<StorageBackend> storageBackend)
+    : settings(serverSettings)
+    , admission(serverSettings.admission)
+    , ioScheduler(serverSettings.ioScheduler)
+    , ioThreads(serverSettings.ioThreads)
+    , metadataThreads(serverSettings.metadataThreads)
+    , writeThreads(serverSettings.writeThreads)
+    , storage(std::move(storageBackend))
+    , fileCache(*storage, serverSettings.maxOpenFiles, serverSettings.mapFiles)
+    , directoryCache(fileWatcher, metadataThreads, serverSettings.maxCachedDirectories)
+    , statCache(fileWatcher, serverSettings.maxCachedStats)
+    , compressedImages(*storage, serverSettings.decompressThreads, serverSettings.decompressedCacheSize)
+    {
+        // every listener has its own pool, the memory limit is divided between them. Listeners
+        // share pools when the limit is too small for a pool per listener, so the total stays
+        // within the limit.
+        auto poolCount = std::max<size_t>(1, std::min<size_t>(settings.listenerThreads, settings.bufferPoolLimit / BufferPool::MaxBufferSize));
+        for (size_t i = 0; i < poolCount; ++i)
+        {
+            bufferPools.push_back(std::make_unique<BufferPool>(settings.bufferPoolLimit / poolCount));
+        }
+
+        // the event engine executes the commands off the reactor threads
+        if (settings.reactorThreads > 0)
+        {
+            commandThreads = std::make_unique<ThreadPool>(settings.commandThreads);
+        }
+
+        if (settings.blockCacheSize > 0)
+        {
+            blockCache = std::make_unique<BlockCache>(*storage, settings.blockCacheSize);
+        }
+
+        if (!settings.sizeIndexPath.empty())
+        {
+            // a rebuild reads the whole tree, on its own threads so the directory listings of
+            // the clients do not wait behind it
+            sizeIndexThreads = std::make_unique<ThreadPool>(settings.metadataThreads);
+            sizeIndex = std::make_unique<SizeIndex>(settings.rootPath, settings.sizeIndexPath, fileWatcher, *sizeIndexThreads);
+        }
+
+        if (settings.virtualIso)
+        {
+            virtualIsos = std::make_unique<VirtualIsoCache>(settings.virtualIsoLayoutPath);
+        }
+
+        if (!settings.tracePath.empty())
+        {
+            trace = std::make_unique<TraceWriter>(settings.tracePath);
+        }
+    }
+
+    ~ServerContext()
+    {
+        // the watcher thread calls into the caches
+        fileWatcher.stop();
+    }
+
+    ServerContext(const ServerContext&) = delete;
+    ServerContext& operator=(const ServerContext&) = delete;
+
+    // Buffer pool of the connections accepted by the listener
+    BufferPool& getBufferPool(uint32_t listener)
+    {
+        return *bufferPools[listener % bufferPools.size()];
+    }
+
+    const ServerSettings           settings;
+    AdmissionControl               admission;
+    std::vector<std::unique_ptr<BufferPool>> bufferPools;
+    IoScheduler                    ioScheduler;
+    ThreadPool                     ioThreads;
+    ThreadPool                     metadataThreads;
+    ThreadPool                     writeThreads;
+    std::unique_ptr<ThreadPool>    commandThreads;
+    std::unique_ptr<StorageBackend> storage;
+    FileCache                      fileCache;
+    FileWatcher                    fileWatcher;
+    DirectoryCache                 directoryCache;
+    StatCache                      statCache;
+    Metrics                        metrics;
+    CompressedImageCache           compressedImages;
+    std::unique_ptr<BlockCache>    blockCache;
+    std::unique_ptr<ThreadPool>    sizeIndexThreads;
+    std::unique_ptr<SizeIndex>     sizeIndex;
+    std::unique_ptr<VirtualIsoCache> virtualIsos;
+    std::unique_ptr<TraceWriter>   trace;
+};
+
+#endif
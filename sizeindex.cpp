@@ -0,0 +1,708 @@
+#include "sizeindex.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "asynclog.h"
+#include "filewatcher.h"
+#include "threadpool.h"
+
+const std::chrono::seconds SizeIndex::s_SaveInterval(60);
+
+static const char s_Magic[8] = { 'P', 'S', '3', 'S', 'I', 'D', 'X', '2' };
+
+static std::string normalizePath(const std::string& path)
+{
+    std::string result;
+    result.reserve(path.size());
+
+    for (auto c : path)
+    {
+        if (c != '/' || result.empty() || result.back() != '/')
+        {
+            result += c;
+        }
+    }
+
+    if (result.size() > 1 && result.back() == '/')
+    {
+        result.pop_back();
+    }
+
+    return result;
+}
+
+static std::string joinPath(const std::string& directory, const std::string& name)
+{
+    return directory.empty() ? name : directory + '/' + name;
+}
+
+static std::string getParentPath(const std::string& path)
+{
+    auto pos = path.rfind('/');
+    return pos == std::string::npos ? std::string() : path.substr(0, pos);
+}
+
+static uint64_t getModifyTime(const std::string& path)
+{
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0)
+    {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return info.st_mtimespec.tv_sec * 1000000000ull + info.st_mtimespec.tv_nsec;
+#else
+    return info.st_mtim.tv_sec * 1000000000ull + info.st_mtim.tv_nsec;
+#endif
+}
+
+// Symbolic links to files are counted, links to directories are not followed to avoid cycles
+static bool getEntryInfo(const std::string& path, struct stat& info, bool& isDirectory)
+{
+    if (::lstat(path.c_str(), &info) != 0)
+    {
+        return false;
+    }
+
+    isDirectory = S_ISDIR(info.st_mode);
+    if (S_ISLNK(info.st_mode) && (::stat(path.c_str(), &info) != 0 || S_ISDIR(info.st_mode)))
+    {
+        return false;
+    }
+
+    return isDirectory || S_ISREG(info.st_mode);
+}
+
+template <typename T>
+static void writeValue(std::string& data, T value)
+{
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void writeString(std::string& data, const std::string& value)
+{
+    writeValue<uint16_t>(data, value.size());
+    data.append(value);
+}
+
+template <typename T>
+static bool readValue(std::istream& stream, T& value)
+{
+    return static_cast<bool>(stream.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static bool readString(std::istream& stream, std::string& value)
+{
+    uint16_t size;
+    if (!readValue(stream, size))
+    {
+        return false;
+    }
+
+    value.resize(size);
+    return size == 0 || stream.read(&value[0], size);
+}
+
+SizeIndex::SizeIndex(const std::string& rootPath, const std::string& indexPath, FileWatcher& watcher, ThreadPool& threadPool)
+: m_RootPath(normalizePath(rootPath))
+, m_IndexPath(indexPath)
+, m_Watcher(watcher)
+, m_ThreadPool(threadPool)
+, m_Ready(false)
+, m_Verified(false)
+, m_Dirty(false)
+, m_RebuildRequested(false)
+, m_Stop(false)
+{
+    m_Watcher.addListener([this] (const std::string& directory, const std::string& name) {
+        onChange(directory, name);
+    });
+
+    m_Thread = std::thread(&SizeIndex::run, this);
+}
+
+SizeIndex::~SizeIndex()
+{
+    stop();
+}
+
+void SizeIndex::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        m_Stop = true;
+        m_Condition.notify_all();
+    }
+
+    if (m_Thread.joinable())
+    {
+        m_Thread.join();
+    }
+}
+
+bool SizeIndex::getSize(const std::string& path, uint64_t& size)
+{
+    std::string relativePath;
+    bool isInRoot = getRelativePath(normalizePath(path), relativePath);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto iter = m_Ready && isInRoot ? m_Tree.find(relativePath) : m_Tree.end();
+    if (iter == m_Tree.end() || (m_Verified && iter->second.unwatched > 0))
+    {
+        ++m_Stats.fallbacks;
+        return false;
+    }
+
+    ++m_Stats.hits;
+    size = iter->second.totalSize;
+    return true;
+}
+
+SizeIndexStats SizeIndex::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    SizeIndexStats stats = m_Stats;
+    stats.directories = m_Tree.size();
+    for (auto& directory : m_Tree)
+    {
+        stats.files += directory.second.files.size();
+    }
+
+    return stats;
+}
+
+void SizeIndex::run()
+{
+    if (load())
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Ready = true;
+        LOG_INFO("Loaded size index of %d directories from %s", m_Tree.size(), m_IndexPath);
+    }
+
+    rebuild();
+    save();
+
+    auto lastSave = std::chrono::steady_clock::now();
+
+    while (!m_Stop)
+    {
+        std::deque<std::pair<std::string, std::string>> queue;
+        bool rebuildRequested;
+
+        {
+            std::unique_lock<std::mutex> lock(m_QueueMutex);
+            m_Condition.wait_for(lock, s_SaveInterval, [this] () {
+                return m_Stop || m_RebuildRequested || !m_Queue.empty();
+            });
+
+            queue.swap(m_Queue);
+            m_Queued.clear();
+            rebuildRequested = m_RebuildRequested;
+            m_RebuildRequested = false;
+        }
+
+        if (rebuildRequested)
+        {
+            rebuild();
+        }
+
+        for (auto& change : queue)
+        {
+            if (m_Stop)
+            {
+                break;
+            }
+
+            update(change.first, change.second);
+        }
+
+        if (std::chrono::steady_clock::now() - lastSave >= s_SaveInterval)
+        {
+            save();
+            lastSave = std::chrono::steady_clock::now();
+        }
+    }
+
+    save();
+}
+
+void SizeIndex::onChange(const std::string& directory, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_QueueMutex);
+
+    if (directory.empty())
+    {
+        m_RebuildRequested = true;
+    }
+    else if (!name.empty() && m_Queued.insert(directory + '/' + name).second)
+    {
+        m_Queue.emplace_back(directory, name);
+    }
+
+    m_Condition.notify_all();
+}
+
+// Changes are applied by looking at the current state of the entry, so it does not matter
+// if events were merged or if the entry changed again after the event was sent
+void SizeIndex::update(const std::string& directory, const std::string& name)
+{
+    std::string parentPath;
+    if (!getRelativePath(directory, parentPath))
+    {
+        return;
+    }
+
+    auto path = joinPath(parentPath, name);
+
+    struct stat info;
+    bool isDirectory = false;
+    bool exists = getEntryInfo(getAbsolutePath(path), info, isDirectory);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto iter = m_Tree.find(parentPath);
+        if (iter == m_Tree.end() || (exists && isDirectory && iter->second.directories.count(name) > 0))
+        {
+            // unknown parent, or a known directory whose contents are watched separately
+            return;
+        }
+    }
+
+    // only this thread modifies the tree, so it can be scanned without holding the lock
+    Tree subtree;
+    uint64_t reused = 0;
+    if (exists && isDirectory)
+    {
+        if (!scan(path, subtree, nullptr, reused))
+        {
+            return;
+        }
+
+        calculateTotals(subtree, path);
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto& parent = m_Tree[parentPath];
+
+    int64_t sizeDelta = 0;
+    int32_t unwatchedDelta = 0;
+
+    auto fileIter = parent.files.find(name);
+    if (fileIter != parent.files.end())
+    {
+        sizeDelta -= fileIter->second;
+        parent.files.erase(fileIter);
+    }
+
+    if (parent.directories.erase(name) > 0)
+    {
+        auto& removed = m_Tree[path];
+        sizeDelta -= removed.totalSize;
+        unwatchedDelta -= removed.unwatched;
+        removeSubtree(path);
+    }
+
+    if (exists && isDirectory)
+    {
+        sizeDelta += subtree[path].totalSize;
+        unwatchedDelta += subtree[path].unwatched;
+        parent.directories.insert(name);
+
+        for (auto& added : subtree)
+        {
+            m_Tree[added.first] = std::move(added.second);
+        }
+    }
+    else if (exists)
+    {
+        sizeDelta += info.st_size;
+        parent.files[name] = info.st_size;
+    }
+
+    addToParents(parentPath, sizeDelta, unwatchedDelta);
+
+    ++m_Stats.updates;
+    m_Dirty = true;
+}
+
+void SizeIndex::rebuild()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // only this thread modifies the tree, the scan threads can read it without the lock
+    Tree tree;
+    uint64_t reused = 0;
+    if (!scan(std::string(), tree, m_Ready ? &m_Tree : nullptr, reused))
+    {
+        return;
+    }
+
+    calculateTotals(tree, std::string());
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    uint64_t mismatches = 0;
+    if (m_Ready)
+    {
+        for (auto& directory : tree)
+        {
+            auto iter = m_Tree.find(directory.first);
+            if (iter == m_Tree.end() || iter->second.totalSize != directory.second.totalSize)
+            {
+                ++mismatches;
+            }
+        }
+
+        for (auto& directory : m_Tree)
+        {
+            if (tree.find(directory.first) == tree.end())
+            {
+                ++mismatches;
+            }
+        }
+    }
+
+    m_Tree.swap(tree);
+
+    // the scan watched every directory again
+    for (auto& directory : tree)
+    {
+        if (directory.second.watched)
+        {
+            m_Watcher.unwatch(getAbsolutePath(directory.first));
+        }
+    }
+
+    m_Ready = true;
+    m_Verified = true;
+    m_Dirty = true;
+    m_Stats.verifiedDirectories = m_Tree.size();
+    m_Stats.reusedDirectories = reused;
+    m_Stats.mismatches = mismatches;
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    LOG_INFO("Size index of %d directories built in %d ms, %d directories were unchanged and not read again, %d directories differed from the previous index", m_Tree.size(), duration.count(), reused, mismatches);
+    if (m_Tree[std::string()].unwatched > 0)
+    {
+        LOG_INFO("%d directories can not be watched for changes, their size is calculated on request", m_Tree[std::string()].unwatched);
+    }
+}
+
+// Scans the directory and all its subdirectories in parallel, returns false when the index is stopped
+// Directories of the previous tree with the same modification time have the same entries, they
+// are not read again but their files are stat'ed, the other directories are read and every
+// entry is stat'ed
+bool SizeIndex::scan(const std::string& relativePath, Tree& tree, const Tree* previous, uint64_t& reused)
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    uint32_t pending = 1;
+
+    std::function<void(const std::string&)> scanDirectory;
+    scanDirectory = [&] (const std::string& path) {
+        Directory directory;
+
+        if (!m_Stop)
+        {
+            auto absolutePath = getAbsolutePath(path);
+
+            // start watching before reading so no changes are missed, the modification time is
+            // taken before reading so a change during the read makes the next rebuild read it again
+            directory.watched = m_Watcher.watch(absolutePath);
+            directory.modifyTime = getModifyTime(absolutePath);
+
+            const Directory* pIndexed = nullptr;
+            if (previous)
+            {
+                auto iter = previous->find(path);
+                pIndexed = iter == previous->end() ? nullptr : &iter->second;
+            }
+
+            DIR* handle = nullptr;
+            if (pIndexed && directory.modifyTime != 0 && pIndexed->modifyTime == directory.modifyTime)
+            {
+                directory.directories = pIndexed->directories;
+
+                // rewriting a file does not change the modification time of its directory
+                for (auto& file : pIndexed->files)
+                {
+                    struct stat info;
+                    bool isDirectory;
+                    if (getEntryInfo(absolutePath + '/' + file.first, info, isDirectory) && !isDirectory)
+                    {
+                        directory.files[file.first] = info.st_size;
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                ++reused;
+            }
+            else if ((handle = opendir(absolutePath.c_str())) != nullptr)
+            {
+                while (auto* entry = readdir(handle))
+                {
+                    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                    {
+                        continue;
+                    }
+
+                    struct stat info;
+                    bool isDirectory;
+                    if (getEntryInfo(absolutePath + '/' + entry->d_name, info, isDirectory))
+                    {
+                        if (isDirectory)
+                        {
+                            directory.directories.insert(entry->d_name);
+                        }
+                        else
+                        {
+                            directory.files[entry->d_name] = info.st_size;
+                        }
+                    }
+                }
+
+                closedir(handle);
+            }
+            else
+            {
+                LOG_DEBUG("Failed to read directory %s: %s", absolutePath, strerror(errno));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& name : directory.directories)
+        {
+            ++pending;
+            auto subdirectory = joinPath(path, name);
+            m_ThreadPool.post([&scanDirectory, subdirectory] () {
+                scanDirectory(subdirectory);
+            });
+        }
+
+        tree[path] = std::move(directory);
+        if (--pending == 0)
+        {
+            condition.notify_all();
+        }
+    };
+
+    m_ThreadPool.post([&scanDirectory, &relativePath] () {
+        scanDirectory(relativePath);
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&pending] () { return pending == 0; });
+
+    return !m_Stop;
+}
+
+void SizeIndex::removeSubtree(const std::string& relativePath)
+{
+    auto iter = m_Tree.find(relativePath);
+    if (iter == m_Tree.end())
+    {
+        return;
+    }
+
+    for (auto& name : iter->second.directories)
+    {
+        removeSubtree(joinPath(relativePath, name));
+    }
+
+    if (iter->second.watched)
+    {
+        m_Watcher.unwatch(getAbsolutePath(relativePath));
+    }
+
+    m_Tree.erase(iter);
+}
+
+void SizeIndex::addToParents(const std::string& relativePath, int64_t sizeDelta, int32_t unwatchedDelta)
+{
+    auto path = relativePath;
+    for (;;)
+    {
+        auto& directory = m_Tree[path];
+        directory.totalSize += sizeDelta;
+        directory.unwatched += unwatchedDelta;
+
+        if (path.empty())
+        {
+            break;
+        }
+
+        path = getParentPath(path);
+    }
+}
+
+// Index file layout (native byte order): magic, root path, directory count and per directory
+// its relative path, modification time, file count and the name and size of every file
+bool SizeIndex::load()
+{
+    std::ifstream file(m_IndexPath.c_str(), std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    char magic[sizeof(s_Magic)];
+    std::string rootPath;
+    uint64_t directoryCount;
+
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, s_Magic, sizeof(magic)) != 0
+     || !readString(file, rootPath) || rootPath != m_RootPath
+     || !readValue(file, directoryCount))
+    {
+        LOG_INFO("Ignoring size index %s, it was not created for this root or by an older version", m_IndexPath);
+        return false;
+    }
+
+    Tree tree;
+    for (uint64_t i = 0; i < directoryCount; ++i)
+    {
+        std::string path;
+        uint64_t modifyTime;
+        uint32_t fileCount;
+        if (!readString(file, path) || !readValue(file, modifyTime) || !readValue(file, fileCount))
+        {
+            LOG_ERROR("Size index %s is corrupt", m_IndexPath);
+            return false;
+        }
+
+        auto& directory = tree[path];
+        directory.modifyTime = modifyTime;
+        for (uint32_t j = 0; j < fileCount; ++j)
+        {
+            std::string name;
+            uint64_t size;
+            if (!readString(file, name) || !readValue(file, size))
+            {
+                LOG_ERROR("Size index %s is corrupt", m_IndexPath);
+                return false;
+            }
+
+            directory.files[name] = size;
+        }
+    }
+
+    std::vector<std::string> paths;
+    for (auto& directory : tree)
+    {
+        paths.push_back(directory.first);
+    }
+
+    for (auto& path : paths)
+    {
+        if (!path.empty())
+        {
+            tree[getParentPath(path)].directories.insert(path.substr(path.rfind('/') + 1));
+        }
+    }
+
+    calculateTotals(tree, std::string());
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Tree.swap(tree);
+    return true;
+}
+
+void SizeIndex::save()
+{
+    std::string data;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_Dirty)
+        {
+            return;
+        }
+
+        data.append(s_Magic, sizeof(s_Magic));
+        writeString(data, m_RootPath);
+        writeValue<uint64_t>(data, m_Tree.size());
+
+        for (auto& directory : m_Tree)
+        {
+            writeString(data, directory.first);
+            writeValue<uint64_t>(data, directory.second.modifyTime);
+            writeValue<uint32_t>(data, directory.second.files.size());
+            for (auto& file : directory.second.files)
+            {
+                writeString(data, file.first);
+                writeValue<uint64_t>(data, file.second);
+            }
+        }
+
+        m_Dirty = false;
+    }
+
+    // replace the index atomically so a crash never leaves a partial index
+    auto temporaryPath = m_IndexPath + ".tmp";
+    std::ofstream file(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    file.close();
+
+    if (!file || rename(temporaryPath.c_str(), m_IndexPath.c_str()) != 0)
+    {
+        LOG_ERROR("Failed to save size index to %s", m_IndexPath);
+        return;
+    }
+
+    LOG_DEBUG("Saved size index to %s (%d bytes)", m_IndexPath, data.size());
+}
+
+std::string SizeIndex::getAbsolutePath(const std::string& relativePath) const
+{
+    return relativePath.empty() ? m_RootPath : m_RootPath + '/' + relativePath;
+}
+
+bool SizeIndex::getRelativePath(const std::string& absolutePath, std::string& relativePath) const
+{
+    if (absolutePath == m_RootPath)
+    {
+        relativePath.clear();
+        return true;
+    }
+
+    if (absolutePath.size() > m_RootPath.size() + 1
+     && absolutePath.compare(0, m_RootPath.size(), m_RootPath) == 0
+     && absolutePath[m_RootPath.size()] == '/')
+    {
+        relativePath = absolutePath.substr(m_RootPath.size() + 1);
+        return true;
+    }
+
+    return false;
+}
+
+void SizeIndex::calculateTotals(Tree& tree, const std::string& relativePath)
+{
+    auto& directory = tree[relativePath];
+    directory.totalSize = 0;
+    directory.unwatched = directory.watched ? 0 : 1;
+
+    for (auto& file : directory.files)
+    {
+        directory.totalSize += file.second;
+    }
+
+    for (auto& name : directory.directories)
+    {
+        auto path = joinPath(relativePath, name);
+        calculateTotals(tree, path);
+
+        auto& subdirectory = tree[path];
+        directory.totalSize += subdirectory.totalSize;
+        directory.unwatched += subdirectory.unwatched;
+    }
+}
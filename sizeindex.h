@@ -0,0 +1,109 @@
+#ifndef SIZE_INDEX_H
+#define SIZE_INDEX_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <cinttypes>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+class FileWatcher;
+class ThreadPool;
+
+struct SizeIndexStats
+{
+    uint64_t    directories = 0;
+    uint64_t    files = 0;
+    uint64_t    hits = 0;
+    uint64_t    fallbacks = 0;
+    uint64_t    updates = 0;
+    uint64_t    verifiedDirectories = 0;
+    uint64_t    reusedDirectories = 0;
+    uint64_t    mismatches = 0;
+};
+
+// Aggregate size of every directory below the root
+// The index is loaded from disk or built using the thread pool at startup, kept up to date
+// using file system notifications and stored in the index file when it changed. Every
+// (re)build compares the existing index with the file system and reports the differences.
+// A rebuild only reads the directories whose modification time differs from the index, the
+// files of the other directories are stat'ed to notice files that were rewritten in place
+// while the server was not running.
+class SizeIndex
+{
+public:
+    SizeIndex(const std::string& rootPath, const std::string& indexPath, FileWatcher& watcher, ThreadPool& threadPool);
+    ~SizeIndex();
+
+    SizeIndex(const SizeIndex&) = delete;
+    SizeIndex& operator=(const SizeIndex&) = delete;
+
+    // Stops updating the index and saves it, the index can still be queried
+    void stop();
+
+    // Returns false if the size is not known, callers have to calculate it themselves
+    bool getSize(const std::string& path, uint64_t& size);
+
+    SizeIndexStats getStats() const;
+
+private:
+    struct Directory
+    {
+        std::unordered_map<std::string, uint64_t>   files;
+        std::unordered_set<std::string>             directories;
+        uint64_t                                    totalSize = 0;
+        uint64_t                                    modifyTime = 0;
+        uint32_t                                    unwatched = 0;
+        bool                                        watched = false;
+    };
+
+    // keyed by the path relative to the root, the root itself is the empty path
+    typedef std::unordered_map<std::string, Directory> Tree;
+
+    void run();
+    void onChange(const std::string& directory, const std::string& name);
+    void update(const std::string& directory, const std::string& name);
+    void rebuild();
+
+    bool scan(const std::string& relativePath, Tree& tree, const Tree* previous, uint64_t& reused);
+    void removeSubtree(const std::string& relativePath);
+    void addToParents(const std::string& relativePath, int64_t sizeDelta, int32_t unwatchedDelta);
+
+    bool load();
+    void save();
+
+    std::string getAbsolutePath(const std::string& relativePath) const;
+    bool getRelativePath(const std::string& absolutePath, std::string& relativePath) const;
+
+    static void calculateTotals(Tree& tree, const std::string& relativePath);
+
+    static const std::chrono::seconds s_SaveInterval;
+
+    std::string                                 m_RootPath;
+    std::string                                 m_IndexPath;
+    FileWatcher&                                m_Watcher;
+    ThreadPool&                                 m_ThreadPool;
+
+    mutable std::mutex                          m_Mutex;
+    Tree                                        m_Tree;
+    bool                                        m_Ready;
+    bool                                        m_Verified;
+    bool                                        m_Dirty;
+    SizeIndexStats                              m_Stats;
+
+    std::mutex                                  m_QueueMutex;
+    std::condition_variable                     m_Condition;
+    std::deque<std::pair<std::string, std::string>> m_Queue;
+    std::unordered_set<std::string>             m_Queued;
+    bool                                        m_RebuildRequested;
+    std::atomic<bool>                           m_Stop;
+
+    std::thread                                 m_Thread;
+};
+
+#endif
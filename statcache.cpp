@@ -0,0 +1,229 @@
+#include "statcache.h"
+
+#include <sys/stat.h>
+
+#include "filewatcher.h"
+
+const std::chrono::seconds StatCache::s_UnwatchedMaxAge(1);
+
+static FileStatus readStatus(const std::string& path)
+{
+    FileStatus status;
+
+    struct stat info;
+    if (::stat(path.c_str(), &info) == 0)
+    {
+        status.exists       = true;
+        status.isDirectory  = S_ISDIR(info.st_mode);
+        status.size         = info.st_size;
+        status.accessTime   = info.st_atime;
+        status.modifyTime   = info.st_mtime;
+        status.createTime   = info.st_ctime;
+    }
+
+    return status;
+}
+
+static std::string getParent(const std::string& path)
+{
+    auto separator = path.rfind('/');
+    return separator == 0 ? std::string("/") : path.substr(0, separator);
+}
+
+static std::string combine(const std::string& directory, const std::string& name)
+{
+    return directory.back() == '/' ? directory + name : directory + '/' + name;
+}
+
+StatCache::StatCache(FileWatcher& watcher, size_t maxEntries)
+: m_Watcher(watcher)
+, m_MaxEntries(maxEntries)
+{
+    m_Watcher.addListener([this] (const std::string& directory, const std::string& name) {
+        if (directory.empty())
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            for (auto& read : m_Reads)
+            {
+                read.second.changed = true;
+            }
+
+            m_Stats.invalidations += m_Entries.size();
+            for (auto& entry : m_Entries)
+            {
+                if (entry.second.watched)
+                {
+                    m_Watcher.unwatch(getParent(entry.first));
+                }
+            }
+
+            m_Entries.clear();
+            m_Lru.clear();
+            m_Ancestors.clear();
+            return;
+        }
+
+        onChange(name.empty() ? directory : combine(directory, name));
+    });
+}
+
+FileStatus StatCache::stat(const std::string& path)
+{
+    // trailing separators would give the same file another key the watcher does not know about
+    if (m_MaxEntries == 0 || path.empty() || path.back() == '/')
+    {
+        return readStatus(path);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        auto iter = m_Entries.find(path);
+        if (iter != m_Entries.end())
+        {
+            auto& entry = iter->second;
+            if (entry.watched || std::chrono::steady_clock::now() - entry.created < s_UnwatchedMaxAge)
+            {
+                ++(entry.status.exists ? m_Stats.hits : m_Stats.negativeHits);
+                m_Lru.splice(m_Lru.begin(), m_Lru, entry.lruPosition);
+                return entry.status;
+            }
+
+            ++m_Stats.invalidations;
+            erase(iter);
+        }
+
+        ++m_Stats.misses;
+        ++m_Reads[path].readers;
+    }
+
+    // watch the parent before reading so changes made while reading are not missed
+    bool watched = path.find('/') != std::string::npos && m_Watcher.watch(getParent(path));
+
+    auto status = readStatus(path);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto readIter = m_Reads.find(path);
+    bool changed = readIter->second.changed;
+    if (--readIter->second.readers == 0)
+    {
+        m_Reads.erase(readIter);
+    }
+
+    if (!changed && m_Entries.find(path) == m_Entries.end())
+    {
+        insert(path, status, watched);
+    }
+    else if (watched)
+    {
+        m_Watcher.unwatch(getParent(path));
+    }
+
+    return status;
+}
+
+void StatCache::invalidate(const std::string& path)
+{
+    onChange(path);
+}
+
+StatCacheStats StatCache::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    StatCacheStats stats = m_Stats;
+    stats.cachedPaths = m_Entries.size();
+    return stats;
+}
+
+void StatCache::onChange(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // reads of the path or of paths below it that started before the change do not insert their result
+    auto prefix = path + '/';
+    for (auto& read : m_Reads)
+    {
+        if (read.first == path || read.first.compare(0, prefix.size(), prefix) == 0)
+        {
+            read.second.changed = true;
+        }
+    }
+
+    auto iter = m_Entries.find(path);
+    if (iter != m_Entries.end())
+    {
+        ++m_Stats.invalidations;
+        erase(iter);
+    }
+
+    // a removed or renamed directory takes the cached paths below it with it
+    if (m_Ancestors.find(path) == m_Ancestors.end())
+    {
+        return;
+    }
+
+    for (auto entry = m_Entries.begin(); entry != m_Entries.end();)
+    {
+        auto current = entry++;
+        if (current->first.compare(0, prefix.size(), prefix) == 0)
+        {
+            ++m_Stats.invalidations;
+            erase(current);
+        }
+    }
+}
+
+void StatCache::insert(const std::string& path, const FileStatus& status, bool watched)
+{
+    m_Lru.push_front(path);
+
+    Entry& entry = m_Entries[path];
+    entry.status        = status;
+    entry.lruPosition   = m_Lru.begin();
+    entry.watched       = watched;
+    entry.created       = std::chrono::steady_clock::now();
+
+    updateAncestors(path, 1);
+
+    while (m_Entries.size() > m_MaxEntries)
+    {
+        ++m_Stats.evictions;
+        erase(m_Entries.find(m_Lru.back()));
+    }
+}
+
+void StatCache::erase(std::unordered_map<std::string, Entry>::iterator iter)
+{
+    if (iter->second.watched)
+    {
+        m_Watcher.unwatch(getParent(iter->first));
+    }
+
+    updateAncestors(iter->first, -1);
+    m_Lru.erase(iter->second.lruPosition);
+    m_Entries.erase(iter);
+}
+
+// Counts the cached paths below every directory, so only changes of directories with cached
+// paths below them have to search the entries
+void StatCache::updateAncestors(const std::string& path, int32_t change)
+{
+    for (auto separator = path.find('/', 1); separator != std::string::npos; separator = path.find('/', separator + 1))
+    {
+        auto ancestor = path.substr(0, separator);
+        if (change > 0)
+        {
+            ++m_Ancestors[ancestor];
+        }
+        else
+        {
+            auto iter = m_Ancestors.find(ancestor);
+            if (iter != m_Ancestors.end() && --iter->second == 0)
+            {
+                m_Ancestors.erase(iter);
+            }
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cinttypes>
+#include <unordered_map>
+
+class FileWatcher;
+
+struct FileStatus
+{
+    bool        exists = false;
+    bool        isDirectory = false;
+    uint64_t    size = 0;
+    uint64_t    accessTime = 0;
+    uint64_t    modifyTime = 0;
+    uint64_t    createTime = 0;
+};
+
+struct StatCacheStats
+{
+    uint64_t    hits = 0;
+    uint64_t    negativeHits = 0;
+    uint64_t    misses = 0;
+    uint64_t    invalidations = 0;
+    uint64_t    evictions = 0;
+    uint64_t    cachedPaths = 0;
+};
+
+// Server wide cache of file metadata keyed by path, missing files are cached as well
+// The parent directory of a cached path is watched, entries stay valid until the file watcher
+// reports a change of the entry. Entries of directories that can not be watched (including
+// missing files in missing directories) expire after a short time.
+class StatCache
+{
+public:
+    StatCache(FileWatcher& watcher, size_t maxEntries);
+
+    StatCache(const StatCache&) = delete;
+    StatCache& operator=(const StatCache&) = delete;
+
+    // Lookups of cached paths do not allocate
+    FileStatus stat(const std::string& path);
+
+    // Called for changes made by the server itself, the watcher reports them asynchronously
+    void invalidate(const std::string& path);
+
+    StatCacheStats getStats() const;
+
+private:
+    struct Entry
+    {
+        FileStatus                              status;
+        std::list<std::string>::iterator        lruPosition;
+        bool                                    watched;
+        std::chrono::steady_clock::time_point   created;
+    };
+
+    // Reads of a path that are in progress, a change during the read keeps the result out of the cache
+    struct Read
+    {
+        uint32_t    readers = 0;
+        bool        changed = false;
+    };
+
+    void onChange(const std::string& path);
+    void insert(const std::string& path, const FileStatus& status, bool watched);
+    void erase(std::unordered_map<std::string, Entry>::iterator iter);
+    void updateAncestors(const std::string& path, int32_t change);
+
+    static const std::chrono::seconds s_UnwatchedMaxAge;
+
+    FileWatcher&                            m_Watcher;
+    size_t                                  m_MaxEntries;
+
+    mutable std::mutex                      m_Mutex;
+    std::unordered_map<std::string, Entry>  m_Entries;
+    std::list<std::string>                  m_Lru;
+    std::unordered_map<std::string, uint32_t> m_Ancestors;
+    std::unordered_map<std::string, Read>   m_Reads;
+    StatCacheStats                          m_Stats;
+};
+
+#endif
@@ -0,0 +1,496 @@
+#include "statsserver.h"
+
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "servercontext.h"
+
+using namespace utils;
+
+volatile sig_atomic_t StatsServer::s_DumpFd = -1;
+
+static const char s_DumpRequest = 'd';
+static const char s_StopRequest = 'q';
+
+static std::string formatSeconds(uint64_t microseconds)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 ".%06" PRIu64, microseconds / 1000000, microseconds % 1000000);
+    return buffer;
+}
+
+static std::string escapeLabel(const std::string& value)
+{
+    std::string result;
+    for (auto c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            result += '\\';
+            result += c;
+        }
+        else if (c == '\n')
+        {
+            result += "\\n";
+        }
+        else
+        {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+static void addHeader(std::string& output, const char* name, const char* type, const char* help)
+{
+    output += stringops::format("# HELP ps3netsrv_%s %s\n# TYPE ps3netsrv_%s %s\n", name, help, name, type);
+}
+
+static void addValue(std::string& output, const char* name, const std::string& labels, uint64_t value)
+{
+    output += stringops::format("ps3netsrv_%s%s %d\n", name, labels.empty() ? std::string() : "{" + labels + "}", value);
+}
+
+static void addMetric(std::string& output, const char* name, const char* type, const char* help, uint64_t value)
+{
+    addHeader(output, name, type, help);
+    addValue(output, name, std::string(), value);
+}
+
+static std::string commandLabel(size_t index)
+{
+    return stringops::format("command=\"%s\"", commandName(static_cast<CommandCode>(FirstCommandCode + index)));
+}
+
+static void addCommandMetrics(std::string& output, const MetricsSnapshot& snapshot)
+{
+    static const std::array<const char*, PhaseCount> phaseNames {{ "total", "disk", "socket" }};
+
+    addHeader(output, "commands_total", "counter", "Executed commands");
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        addValue(output, "commands_total", commandLabel(i), snapshot.commands[i].count);
+    }
+
+    addHeader(output, "command_errors_total", "counter", "Commands that failed with a protocol or io error");
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        addValue(output, "command_errors_total", commandLabel(i), snapshot.commands[i].errors);
+    }
+
+    addHeader(output, "command_sent_bytes_total", "counter", "Bytes sent in replies");
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        addValue(output, "command_sent_bytes_total", commandLabel(i), snapshot.commands[i].bytesSent);
+    }
+
+    addHeader(output, "command_received_bytes_total", "counter", "Bytes received as command payload");
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        addValue(output, "command_received_bytes_total", commandLabel(i), snapshot.commands[i].bytesReceived);
+    }
+
+    addHeader(output, "command_duration_seconds", "histogram", "Command latency, split in time spent on disk and on the socket");
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        auto& command = snapshot.commands[i];
+        if (command.count == 0)
+        {
+            continue;
+        }
+
+        for (size_t phase = 0; phase < PhaseCount; ++phase)
+        {
+            auto labels = stringops::format("%s,phase=\"%s\"", commandLabel(i), phaseNames[phase]);
+
+            uint64_t cumulative = 0;
+            for (size_t bucket = 0; bucket < HistogramBuckets; ++bucket)
+            {
+                cumulative += command.histograms[phase][bucket];
+                auto bound = bucket == HistogramBuckets - 1 ? std::string("+Inf") : formatSeconds(uint64_t(1) << bucket);
+                addValue(output, "command_duration_seconds_bucket", stringops::format("%s,le=\"%s\"", labels, bound), cumulative);
+            }
+
+            output += stringops::format("ps3netsrv_command_duration_seconds_sum{%s} %s\n", labels, formatSeconds(command.microseconds[phase]));
+            addValue(output, "command_duration_seconds_count", labels, command.count);
+        }
+    }
+}
+
+static void addClientMetrics(std::string& output, const MetricsSnapshot& snapshot)
+{
+    addMetric(output, "connections", "gauge", "Connected clients", snapshot.clients.size());
+    addMetric(output, "connections_total", "counter", "Accepted connections", snapshot.connectionsTotal);
+
+    addHeader(output, "client_sent_bytes_total", "counter", "Bytes sent to a connected client");
+    for (auto& client : snapshot.clients)
+    {
+        addValue(output, "client_sent_bytes_total", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.bytesSent);
+    }
+
+    addHeader(output, "client_received_bytes_total", "counter", "Bytes received from a connected client");
+    for (auto& client : snapshot.clients)
+    {
+        addValue(output, "client_received_bytes_total", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.bytesReceived);
+    }
+
+    addHeader(output, "client_commands_total", "counter", "Commands executed for a connected client");
+    for (auto& client : snapshot.clients)
+    {
+        addValue(output, "client_commands_total", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.commands);
+    }
+
+    addHeader(output, "file_sent_bytes_total", "counter", "File data sent per file");
+    for (auto& file : snapshot.files)
+    {
+        addValue(output, "file_sent_bytes_total", stringops::format("file=\"%s\"", escapeLabel(file.path)), file.bytesSent);
+    }
+
+    addHeader(output, "file_opens_total", "counter", "Opens for reading per file");
+    for (auto& file : snapshot.files)
+    {
+        addValue(output, "file_opens_total", stringops::format("file=\"%s\"", escapeLabel(file.path)), file.opens);
+    }
+}
+
+static void addAdmissionMetrics(std::string& output, const AdmissionStats& stats)
+{
+    addMetric(output, "connections_admitted", "gauge", "Connections holding a client slot", stats.active);
+    addMetric(output, "connections_queued_total", "counter", "Times the server waited for a free client slot before accepting", stats.queued);
+
+    addHeader(output, "connections_refused_total", "counter", "Connections closed right after they were accepted");
+    addValue(output, "connections_refused_total", "reason=\"whitelist\"", stats.rejectedAddress);
+    addValue(output, "connections_refused_total", "reason=\"limit\"", stats.rejectedLimit);
+
+    addHeader(output, "connections_timed_out_total", "counter", "Connections closed because they made no progress");
+    addValue(output, "connections_timed_out_total", "reason=\"idle\"", stats.idleTimeouts);
+    addValue(output, "connections_timed_out_total", "reason=\"command\"", stats.commandTimeouts);
+}
+
+static void addSchedulerMetrics(std::string& output, const IoSchedulerStats& stats)
+{
+    static const std::array<const char*, IoClassCount> classNames {{ "interactive", "bulk" }};
+
+    addMetric(output, "io_scheduler_active_requests", "gauge", "Requests admitted by the scheduler", stats.active);
+    addMetric(output, "io_scheduler_throttled_total", "counter", "Requests delayed by a bandwidth cap", stats.throttled);
+
+    addHeader(output, "io_scheduler_queued_requests", "gauge", "Requests waiting for the scheduler");
+    for (size_t i = 0; i < IoClassCount; ++i)
+    {
+        addValue(output, "io_scheduler_queued_requests", stringops::format("class=\"%s\"", classNames[i]), stats.classes[i].queued);
+    }
+
+    addHeader(output, "io_scheduler_requests_total", "counter", "Requests admitted by the scheduler");
+    for (size_t i = 0; i < IoClassCount; ++i)
+    {
+        addValue(output, "io_scheduler_requests_total", stringops::format("class=\"%s\"", classNames[i]), stats.classes[i].requests);
+    }
+
+    addHeader(output, "io_scheduler_bytes_total", "counter", "Bytes requested by admitted requests");
+    for (size_t i = 0; i < IoClassCount; ++i)
+    {
+        addValue(output, "io_scheduler_bytes_total", stringops::format("class=\"%s\"", classNames[i]), stats.classes[i].bytes);
+    }
+
+    addHeader(output, "io_scheduler_wait_seconds_total", "counter", "Time requests waited for the scheduler");
+    for (size_t i = 0; i < IoClassCount; ++i)
+    {
+        output += stringops::format("ps3netsrv_io_scheduler_wait_seconds_total{class=\"%s\"} %s\n", classNames[i], formatSeconds(stats.classes[i].waitMicroseconds));
+    }
+
+    addHeader(output, "client_io_weight", "gauge", "Scheduler weight of a connected client");
+    for (auto& client : stats.clients)
+    {
+        addValue(output, "client_io_weight", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.weight);
+    }
+
+    addHeader(output, "client_io_queued_requests", "gauge", "Requests of a connected client waiting for the scheduler");
+    for (auto& client : stats.clients)
+    {
+        addValue(output, "client_io_queued_requests", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.queued);
+    }
+
+    addHeader(output, "client_io_bytes_total", "counter", "Bytes admitted by the scheduler for a connected client");
+    for (auto& client : stats.clients)
+    {
+        addValue(output, "client_io_bytes_total", stringops::format("client=\"%s\"", escapeLabel(client.address)), client.bytes);
+    }
+
+    addHeader(output, "client_io_wait_seconds_total", "counter", "Time the requests of a connected client waited for the scheduler");
+    for (auto& client : stats.clients)
+    {
+        output += stringops::format("ps3netsrv_client_io_wait_seconds_total{client=\"%s\"} %s\n", escapeLabel(client.address), formatSeconds(client.waitMicroseconds));
+    }
+}
+
+StatsServer::StatsServer(const ServerContext& context, uint32_t port)
+: m_Context(context)
+{
+    int32_t fds[2];
+    if (pipe(fds) != 0)
+    {
+        throw std::runtime_error(stringops::format("Failed to create stats pipe: %s", strerror(errno)));
+    }
+
+    m_WakeupReadFd = FileDescriptor(fds[0]);
+    m_WakeupWriteFd = FileDescriptor(fds[1]);
+    fcntl(m_WakeupWriteFd.get(), F_SETFL, O_NONBLOCK);
+
+    if (port != 0)
+    {
+        m_ListenFd = FileDescriptor(socket(AF_INET, SOCK_STREAM, 0));
+        if (!m_ListenFd.isValid())
+        {
+            throw std::runtime_error(stringops::format("Failed to create stats socket: %s", strerror(errno)));
+        }
+
+        int32_t reuse = 1;
+        setsockopt(m_ListenFd.get(), SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(m_ListenFd.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(m_ListenFd.get(), 8) != 0)
+        {
+            throw std::runtime_error(stringops::format("Failed to listen for stats requests on port %d: %s", port, strerror(errno)));
+        }
+
+        LOG_INFO("Serving statistics on http://127.0.0.1:%d/metrics", port);
+    }
+
+    s_DumpFd = m_WakeupWriteFd.get();
+    m_Thread = std::thread(&StatsServer::run, this);
+}
+
+StatsServer::~StatsServer()
+{
+    s_DumpFd = -1;
+
+    if (::write(m_WakeupWriteFd.get(), &s_StopRequest, 1) == 1)
+    {
+        m_Thread.join();
+    }
+    else
+    {
+        m_Thread.detach();
+    }
+}
+
+void StatsServer::requestDump()
+{
+    int32_t fd = s_DumpFd;
+    if (fd >= 0)
+    {
+        ssize_t result = ::write(fd, &s_DumpRequest, 1);
+        (void) result;
+    }
+}
+
+std::string StatsServer::formatMetrics() const
+{
+    auto snapshot = m_Context.metrics.getSnapshot();
+
+    std::string output;
+    output += stringops::format("# HELP ps3netsrv_info Server configuration\n# TYPE ps3netsrv_info gauge\nps3netsrv_info{storage=\"%s\"} 1\n", m_Context.storage->getName());
+
+    addCommandMetrics(output, snapshot);
+    addClientMetrics(output, snapshot);
+    addAdmissionMetrics(output, m_Context.admission.getStats());
+
+    addMetric(output, "readahead_hits_total", "counter", "Read requests served completely by read-ahead, added when a file is closed", snapshot.readAheadHits);
+    addMetric(output, "readahead_misses_total", "counter", "Read requests not served completely by read-ahead, added when a file is closed", snapshot.readAheadMisses);
+    addMetric(output, "readahead_prefetched_bytes_total", "counter", "Bytes prefetched by read-ahead, added when a file is closed", snapshot.readAheadBytesPrefetched);
+    addMetric(output, "readahead_served_bytes_total", "counter", "Bytes served from prefetched data, added when a file is closed", snapshot.readAheadBytesServed);
+
+    addMetric(output, "directory_listing_entries_total", "counter", "Entries of directories opened by clients, added when the listing is closed", snapshot.listingEntries);
+    addMetric(output, "directory_listing_resolved_entries_total", "counter", "Entries whose metadata was read, added when the listing is closed", snapshot.listingResolvedEntries);
+    addHeader(output, "directory_listing_stat_seconds_total", "counter", "Time spent reading entry metadata, added when the listing is closed");
+    output += stringops::format("ps3netsrv_directory_listing_stat_seconds_total %s\n", formatSeconds(snapshot.listingStatMicroseconds));
+    addHeader(output, "directory_listing_wait_seconds_total", "counter", "Time clients waited for entry metadata, added when the listing is closed");
+    output += stringops::format("ps3netsrv_directory_listing_wait_seconds_total %s\n", formatSeconds(snapshot.listingWaitMicroseconds));
+
+    addSchedulerMetrics(output, m_Context.ioScheduler.getStats());
+
+    auto fileCache = m_Context.fileCache.getStats();
+    addMetric(output, "file_cache_hits_total", "counter", "Opens served by the file cache", fileCache.hits);
+    addMetric(output, "file_cache_misses_total", "counter", "Opens that opened the file", fileCache.misses);
+    addMetric(output, "file_cache_invalidations_total", "counter", "Cached files that changed on disk", fileCache.invalidations);
+    addMetric(output, "file_cache_evictions_total", "counter", "Cached files closed to stay within the limit", fileCache.evictions);
+    addMetric(output, "file_cache_open_files", "gauge", "Files held open by the file cache", fileCache.openFiles);
+
+    auto directoryCache = m_Context.directoryCache.getStats();
+    addMetric(output, "directory_cache_hits_total", "counter", "Directory listings served from the cache", directoryCache.hits);
+    addMetric(output, "directory_cache_misses_total", "counter", "Directory listings read from disk", directoryCache.misses);
+    addMetric(output, "directory_cache_invalidations_total", "counter", "Cached listings invalidated by changes", directoryCache.invalidations);
+    addMetric(output, "directory_cache_directories", "gauge", "Cached directory listings", directoryCache.cachedDirectories);
+
+    auto statCache = m_Context.statCache.getStats();
+    addMetric(output, "stat_cache_hits_total", "counter", "File stats served from the cache", statCache.hits);
+    addMetric(output, "stat_cache_negative_hits_total", "counter", "Missing files answered from the cache", statCache.negativeHits);
+    addMetric(output, "stat_cache_misses_total", "counter", "File stats read from disk", statCache.misses);
+    addMetric(output, "stat_cache_invalidations_total", "counter", "Cached file stats invalidated by changes", statCache.invalidations);
+    addMetric(output, "stat_cache_evictions_total", "counter", "Cached file stats removed to stay within the limit", statCache.evictions);
+    addMetric(output, "stat_cache_paths", "gauge", "Cached file stats", statCache.cachedPaths);
+
+    if (m_Context.sizeIndex)
+    {
+        auto sizeIndex = m_Context.sizeIndex->getStats();
+        addMetric(output, "size_index_hits_total", "counter", "Directory sizes served by the size index", sizeIndex.hits);
+        addMetric(output, "size_index_fallbacks_total", "counter", "Directory sizes calculated on disk", sizeIndex.fallbacks);
+        addMetric(output, "size_index_directories", "gauge", "Directories in the size index", sizeIndex.directories);
+        addMetric(output, "size_index_reused_directories", "gauge", "Unchanged directories the last rebuild took from the index without reading them", sizeIndex.reusedDirectories);
+    }
+
+    if (m_Context.blockCache)
+    {
+        auto blockCache = m_Context.blockCache->getStats();
+        addMetric(output, "block_cache_hits_total", "counter", "Block reads served from the block cache", blockCache.hits);
+        addMetric(output, "block_cache_misses_total", "counter", "Block reads that read from storage", blockCache.misses);
+        addMetric(output, "block_cache_promotions_total", "counter", "Blocks that were used again and moved to the frequent queue", blockCache.promotions);
+        addMetric(output, "block_cache_evictions_total", "counter", "Blocks removed from the cache to stay within the memory limit", blockCache.evictions);
+        addMetric(output, "block_cache_prefetches_total", "counter", "Blocks loaded ahead of sequential reads", blockCache.prefetches);
+        addMetric(output, "block_cache_recent_bytes", "gauge", "Memory used by blocks that were read once", blockCache.recentBytes);
+        addMetric(output, "block_cache_frequent_bytes", "gauge", "Memory used by blocks that were read again", blockCache.frequentBytes);
+    }
+
+    auto compressedImages = m_Context.compressedImages.getStats();
+    addMetric(output, "compressed_image_hits_total", "counter", "Compressed image chunks found in the cache", compressedImages.hits);
+    addMetric(output, "compressed_image_misses_total", "counter", "Compressed image chunks decompressed for a read", compressedImages.misses);
+    addMetric(output, "compressed_image_readaheads_total", "counter", "Compressed image chunks decompressed ahead of sequential reads", compressedImages.readAheads);
+    addMetric(output, "compressed_image_decompressed_bytes_total", "counter", "Bytes produced by decompression", compressedImages.bytesDecompressed);
+    addMetric(output, "compressed_image_cached_bytes", "gauge", "Decompressed bytes held in the cache", compressedImages.cachedBytes);
+
+    BufferPoolStats bufferPool;
+    for (auto& pool : m_Context.bufferPools)
+    {
+        auto stats = pool->getStats();
+        bufferPool.bytesInUse += stats.bytesInUse;
+        bufferPool.bytesAllocated += stats.bytesAllocated;
+        bufferPool.bytesReserved += stats.bytesReserved;
+        bufferPool.waits += stats.waits;
+    }
+
+    addMetric(output, "buffer_pool_used_bytes", "gauge", "Buffer memory in use", bufferPool.bytesInUse);
+    addMetric(output, "buffer_pool_allocated_bytes", "gauge", "Buffer memory allocated", bufferPool.bytesAllocated);
+    addMetric(output, "buffer_pool_reserved_bytes", "gauge", "Connection buffers of the event engine counted against the memory limit", bufferPool.bytesReserved);
+    addMetric(output, "buffer_pool_waits_total", "counter", "Buffer requests that waited for the memory limit", bufferPool.waits);
+
+    return output;
+}
+
+void StatsServer::run()
+{
+    std::array<pollfd, 2> fds;
+    fds[0].fd = m_WakeupReadFd.get();
+    fds[0].events = POLLIN;
+    fds[1].fd = m_ListenFd.get();
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds.data(), m_ListenFd.isValid() ? 2 : 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            LOG_ERROR("Stats server failed: %s", strerror(errno));
+            return;
+        }
+
+        if (fds[0].revents)
+        {
+            char request;
+            if (::read(m_WakeupReadFd.get(), &request, 1) != 1 || request == s_StopRequest)
+            {
+                return;
+            }
+
+            // one message per line, a message is limited in size and the log buffer is written
+            // regularly so a large dump does not fill it
+            auto metrics = formatMetrics();
+            LOG_INFO("Statistics:");
+            for (size_t start = 0, lines = 1; start < metrics.size(); ++lines)
+            {
+                if (lines % 100 == 0)
+                {
+                    asynclog::sync();
+                }
+
+                auto end = metrics.find('\n', start);
+                if (end == std::string::npos)
+                {
+                    end = metrics.size();
+                }
+
+                LOG_INFO("%s", metrics.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+
+        if (m_ListenFd.isValid() && fds[1].revents)
+        {
+            FileDescriptor client(accept(m_ListenFd.get(), nullptr, nullptr));
+            if (client.isValid())
+            {
+                serveRequest(client.get());
+            }
+        }
+    }
+}
+
+// Every request is answered with the metrics, the connection is closed afterwards
+void StatsServer::serveRequest(int32_t fd)
+{
+    timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+    {
+        auto result = recv(fd, buffer, sizeof(buffer), 0);
+        if (result <= 0)
+        {
+            return;
+        }
+
+        request.append(buffer, result);
+    }
+
+    auto body = formatMetrics();
+    auto response = stringops::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", body.size()) + body;
+
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        auto result = send(fd, response.data() + sent, response.size() - sent, 0);
+        if (result <= 0)
+        {
+            return;
+        }
+
+        sent += result;
+    }
+}
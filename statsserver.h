@@ -0,0 +1,44 @@
+#ifndef STATS_SERVER_H
+#define STATS_SERVER_H
+
+#include <string>
+#include <thread>
+#include <csignal>
+#include <cinttypes>
+
+#include "filedescriptor.h"
+
+struct ServerContext;
+
+// Exposes the server statistics in the Prometheus text format
+// The statistics are served over http on the loopback interface when a port is given
+// and written to the log when requestDump is called (from the SIGUSR1 handler).
+class StatsServer
+{
+public:
+    // Throws if the port can not be bound
+    StatsServer(const ServerContext& context, uint32_t port);
+    ~StatsServer();
+
+    StatsServer(const StatsServer&) = delete;
+    StatsServer& operator=(const StatsServer&) = delete;
+
+    // Async signal safe
+    static void requestDump();
+
+    std::string formatMetrics() const;
+
+private:
+    void run();
+    void serveRequest(int32_t fd);
+
+    static volatile sig_atomic_t s_DumpFd;
+
+    const ServerContext&    m_Context;
+    FileDescriptor          m_ListenFd;
+    FileDescriptor          m_WakeupReadFd;
+    FileDescriptor          m_WakeupWriteFd;
+    std::thread             m_Thread;
+};
+
+#endif
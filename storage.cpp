@@ -0,0 +1,96 @@
+#include "storage.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+#include "compat.h"
+#include "iouringstorage.h"
+
+using namespace utils;
+
+void StorageBackend::registerFile(int32_t)
+{
+}
+
+void StorageBackend::unregisterFile(int32_t)
+{
+}
+
+bool StorageBackend::readAndSend(int32_t, uint64_t, size_t, int32_t)
+{
+    return false;
+}
+
+const char* PosixStorage::getName() const
+{
+    return "posix";
+}
+
+size_t PosixStorage::read(int32_t fd, uint64_t offset, void* data, size_t size)
+{
+    auto* pCurrent = reinterpret_cast<uint8_t*>(data);
+    size_t bytesRead = 0;
+    while (bytesRead < size)
+    {
+        ssize_t result = pread(fd, pCurrent + bytesRead, size - bytesRead, offset + bytesRead);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::runtime_error(stringops::format("Failed to read file: %s", strerror(errno)));
+        }
+
+        if (result == 0)
+        {
+            break;
+        }
+
+        bytesRead += result;
+    }
+
+    return bytesRead;
+}
+
+ssize_t PosixStorage::write(int32_t fd, uint64_t offset, const iovec* iov, size_t count)
+{
+    ssize_t result;
+    do
+    {
+        result = pwritev(fd, iov, count, offset);
+    }
+    while (result < 0 && errno == EINTR);
+
+    return result;
+}
+
+std::unique_ptr<StorageBackend> createStorageBackend(bool ioUring)
+{
+#ifdef HAVE_IO_URING
+    if (ioUring)
+    {
+        try
+        {
+            return std::make_unique<IoUringStorage>();
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR("io_uring is not available, using blocking io: %s", e.what());
+        }
+    }
+#else
+    if (ioUring)
+    {
+        LOG_ERROR("io_uring is not supported on this platform, using blocking io");
+    }
+#endif
+
+    return std::make_unique<PosixStorage>();
+}
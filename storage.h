@@ -0,0 +1,46 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <memory>
+#include <cinttypes>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+// Positional file io used by the command handlers, read-ahead and write-behind
+class StorageBackend
+{
+public:
+    virtual ~StorageBackend() = default;
+
+    virtual const char* getName() const = 0;
+
+    // Files that are read often can be registered with the backend while they are open
+    virtual void registerFile(int32_t fd);
+    virtual void unregisterFile(int32_t fd);
+
+    // Reads until size bytes are read or the end of the file is reached, throws on errors
+    virtual size_t read(int32_t fd, uint64_t offset, void* data, size_t size) = 0;
+
+    // Returns the number of bytes written or -1 with errno set
+    virtual ssize_t write(int32_t fd, uint64_t offset, const iovec* iov, size_t count) = 0;
+
+    // Reads the range and sends it to the (blocking) socket as a single request
+    // The range has to be inside the file. Returns false if this is not supported,
+    // nothing has been sent in that case. Throws on errors.
+    virtual bool readAndSend(int32_t fd, uint64_t offset, size_t size, int32_t socket);
+};
+
+// Blocking pread/pwritev, available everywhere
+class PosixStorage : public StorageBackend
+{
+public:
+    const char* getName() const override;
+
+    size_t read(int32_t fd, uint64_t offset, void* data, size_t size) override;
+    ssize_t write(int32_t fd, uint64_t offset, const iovec* iov, size_t count) override;
+};
+
+// Returns the io_uring backend if requested and available, the posix backend otherwise
+std::unique_ptr<StorageBackend> createStorageBackend(bool ioUring);
+
+#endif
@@ -0,0 +1,72 @@
+#include "threadpool.h"
+
+#include "asynclog.h"
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+: m_Stop(false)
+{
+    for (uint32_t i = 0; i < threadCount; ++i)
+    {
+        m_Threads.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+
+    m_Condition.notify_all();
+    for (auto& thread : m_Threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::post(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Jobs.push_back(std::move(job));
+    }
+
+    m_Condition.notify_one();
+}
+
+size_t ThreadPool::getThreadCount() const
+{
+    return m_Threads.size();
+}
+
+void ThreadPool::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Condition.wait(lock, [this] () { return m_Stop || !m_Jobs.empty(); });
+
+            // pending jobs are still executed on shutdown, their owners may be waiting for them
+            if (m_Jobs.empty())
+            {
+                return;
+            }
+
+            job = std::move(m_Jobs.front());
+            m_Jobs.pop_front();
+        }
+
+        try
+        {
+            job();
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR("Thread pool job failed: %s", e.what());
+        }
+    }
+}
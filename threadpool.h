@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// Fixed set of worker threads executing posted jobs in order of arrival
+class ThreadPool
+{
+public:
+    explicit ThreadPool(uint32_t threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void post(std::function<void()> job);
+
+    size_t getThreadCount() const;
+
+private:
+    void run();
+
+    std::mutex                              m_Mutex;
+    std::condition_variable                 m_Condition;
+    std::deque<std::function<void()>>       m_Jobs;
+    std::vector<std::thread>                m_Threads;
+    bool                                    m_Stop;
+};
+
+#endif
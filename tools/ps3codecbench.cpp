@@ -0,0 +1,329 @@
+/*
+    Wire codec check and benchmark for ps3netsrv++
+    Round trips every command and reply through the codec, compares the encoding with the
+    hand written packed structs it replaced and measures both
+*/
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include "compat.h"
+#include "ps3protocol.h"
+
+// The marshaling the codec replaced, used as the reference encoding
+namespace packed
+{
+
+struct Command
+{
+    uint16_t code;
+    uint16_t size;
+    uint32_t count;
+    uint64_t offset;
+} __attribute__((packed));
+
+struct FileReplyLong
+{
+    int64_t  size;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint64_t atime;
+    uint16_t nameLength;
+    uint8_t  isDirectory;
+} __attribute__((packed));
+
+struct ReadDirectoryDataReply
+{
+    int64_t  size;
+    uint64_t mtime;
+    uint8_t  isDirectory;
+    char     name[512];
+} __attribute__((packed));
+
+}
+
+static const size_t s_Records = 4096;
+static const uint32_t s_Iterations = 200;
+
+static std::mt19937_64 s_Random(0x1224);
+
+template <typename Message>
+static std::vector<uint8_t> encoded(const Message& message)
+{
+    std::vector<uint8_t> data(wire::size<Message>());
+    wire::encode(message, data.data());
+    return data;
+}
+
+template <typename Packed>
+static bool matches(const std::vector<uint8_t>& data, const Packed& reference)
+{
+    return data.size() == sizeof(reference) && memcmp(data.data(), &reference, sizeof(reference)) == 0;
+}
+
+// Decoding and encoding again has to give the same bytes
+template <typename Message>
+static bool roundTrips(const Message& message)
+{
+    auto data = encoded(message);
+
+    Message decoded;
+    return wire::decode(data.data(), decoded) == data.data() + data.size() && encoded(decoded) == data;
+}
+
+static bool checkCommands()
+{
+    bool ok = true;
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        auto code = static_cast<CommandCode>(FirstCommandCode + i);
+
+        Command command;
+        command.code    = static_cast<uint16_t>(code);
+        command.size    = static_cast<uint16_t>(s_Random());
+        command.count   = static_cast<uint32_t>(s_Random());
+        command.offset  = s_Random();
+
+        packed::Command reference;
+        reference.code      = htons(command.code);
+        reference.size      = htons(command.size);
+        reference.count     = htonl(command.count);
+        reference.offset    = htonll(command.offset);
+
+        auto data = encoded(command);
+
+        Command decoded;
+        wire::decode(data.data(), decoded);
+
+        bool valid = matches(data, reference) && roundTrips(command) &&
+                     decoded.code == command.code && decoded.size == command.size &&
+                     decoded.count == command.count && decoded.offset == command.offset &&
+                     commandPayloadSize(decoded) == commandPayloadSize(command);
+        if (!valid)
+        {
+            std::cerr << "Command " << commandName(code) << " does not round trip" << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static ReadDirectoryDataReply makeRecord(size_t index)
+{
+    ReadDirectoryDataReply record;
+    record.size         = static_cast<int64_t>(s_Random() >> 1);
+    record.mtime        = s_Random();
+    record.isDirectory  = index % 8 == 0 ? 1 : 0;
+
+    auto name = "entry" + std::to_string(index) + ".iso";
+    memset(record.name, 0, sizeof(record.name));
+    memcpy(record.name, name.c_str(), name.size());
+    return record;
+}
+
+static packed::ReadDirectoryDataReply makeReference(const ReadDirectoryDataReply& record)
+{
+    packed::ReadDirectoryDataReply reference;
+    reference.size          = htonll(record.size);
+    reference.mtime         = htonll(record.mtime);
+    reference.isDirectory   = record.isDirectory;
+    memcpy(reference.name, record.name, sizeof(reference.name));
+    return reference;
+}
+
+static bool checkReplies()
+{
+    StatusReply status;
+    status.result = -1;
+
+    CountReply count;
+    count.count = static_cast<uint32_t>(s_Random());
+
+    OpenFileReply openFile;
+    openFile.size   = static_cast<int64_t>(s_Random() >> 1);
+    openFile.mtime  = s_Random();
+
+    DirectorySizeReply directorySize;
+    directorySize.size = static_cast<int64_t>(s_Random() >> 1);
+
+    FileReply file;
+    file.size           = -1;
+    file.mtime          = s_Random();
+    file.ctime          = s_Random();
+    file.atime          = s_Random();
+    file.isDirectory    = 1;
+
+    FileReplyShort entryShort;
+    entryShort.size         = static_cast<int64_t>(s_Random() >> 1);
+    entryShort.nameLength   = static_cast<uint16_t>(s_Random());
+
+    FileReplyLong entryLong;
+    entryLong.size          = static_cast<int64_t>(s_Random() >> 1);
+    entryLong.mtime         = s_Random();
+    entryLong.ctime         = s_Random();
+    entryLong.atime         = s_Random();
+    entryLong.nameLength    = static_cast<uint16_t>(s_Random());
+    entryLong.isDirectory   = 1;
+
+    packed::FileReplyLong entryLongReference;
+    entryLongReference.size         = htonll(entryLong.size);
+    entryLongReference.mtime        = htonll(entryLong.mtime);
+    entryLongReference.ctime        = htonll(entryLong.ctime);
+    entryLongReference.atime        = htonll(entryLong.atime);
+    entryLongReference.nameLength   = htons(entryLong.nameLength);
+    entryLongReference.isDirectory  = entryLong.isDirectory;
+
+    ReadDirectoryReply directory;
+    directory.size = s_Records;
+
+    std::vector<ReadDirectoryDataReply> records;
+    std::vector<packed::ReadDirectoryDataReply> references;
+    for (size_t i = 0; i < s_Records; ++i)
+    {
+        records.push_back(makeRecord(i));
+        references.push_back(makeReference(records.back()));
+    }
+
+    std::vector<uint8_t> array(s_Records * wire::size<ReadDirectoryDataReply>());
+    wire::encodeArray(records.data(), records.size(), array.data());
+
+    bool ok = true;
+    auto check = [&ok] (bool valid, const char* name) {
+        if (!valid)
+        {
+            std::cerr << name << " does not round trip" << std::endl;
+            ok = false;
+        }
+    };
+
+    check(roundTrips(status) && encoded(status) == std::vector<uint8_t>(4, 0xFF), "StatusReply");
+    check(roundTrips(count), "CountReply");
+    check(roundTrips(openFile), "OpenFileReply");
+    check(roundTrips(directorySize), "DirectorySizeReply");
+    check(roundTrips(file) && wire::size<FileReply>() == 33, "FileReply");
+    check(roundTrips(entryShort) && wire::size<FileReplyShort>() == 11, "FileReplyShort");
+    check(roundTrips(entryLong) && matches(encoded(entryLong), entryLongReference), "FileReplyLong");
+    check(roundTrips(directory), "ReadDirectoryReply");
+    check(roundTrips(records.front()) && array.size() == references.size() * sizeof(packed::ReadDirectoryDataReply) &&
+          memcmp(array.data(), references.data(), array.size()) == 0, "ReadDirectoryDataReply");
+
+    return ok;
+}
+
+template <typename Function>
+static double nanosecondsPerRecord(Function function)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < s_Iterations; ++i)
+    {
+        function();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<double>(elapsed) / (s_Iterations * s_Records);
+}
+
+static void report(const char* name, double nanoseconds)
+{
+    std::cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << nanoseconds << " ns" << std::endl;
+}
+
+static void benchmark()
+{
+    std::vector<ReadDirectoryDataReply> records;
+    std::vector<Command> commands;
+    for (size_t i = 0; i < s_Records; ++i)
+    {
+        records.push_back(makeRecord(i));
+
+        Command command;
+        command.code    = static_cast<uint16_t>(FirstCommandCode + i % CommandCodeCount);
+        command.size    = static_cast<uint16_t>(i);
+        command.count   = static_cast<uint32_t>(s_Random());
+        command.offset  = s_Random();
+        commands.push_back(command);
+    }
+
+    std::vector<uint8_t> output(s_Records * wire::size<ReadDirectoryDataReply>());
+    std::vector<uint8_t> input(s_Records * wire::size<Command>());
+    wire::encodeArray(commands.data(), commands.size(), input.data());
+
+    volatile uint64_t sink = 0;
+
+    report("directory records, packed structs", nanosecondsPerRecord([&] () {
+        auto* pOutput = output.data();
+        for (auto& record : records)
+        {
+            auto reference = makeReference(record);
+            memcpy(pOutput, &reference, sizeof(reference));
+            pOutput += sizeof(reference);
+        }
+        sink = sink + output[s_Records];
+    }));
+
+    report("directory records, codec", nanosecondsPerRecord([&] () {
+        auto* pOutput = output.data();
+        for (auto& record : records)
+        {
+            pOutput = wire::encode(record, pOutput);
+        }
+        sink = sink + output[s_Records];
+    }));
+
+    report("directory records, codec array", nanosecondsPerRecord([&] () {
+        wire::encodeArray(records.data(), records.size(), output.data());
+        sink = sink + output[s_Records];
+    }));
+
+    report("commands, packed structs", nanosecondsPerRecord([&] () {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < s_Records; ++i)
+        {
+            packed::Command command;
+            memcpy(&command, input.data() + i * sizeof(command), sizeof(command));
+            sum += ntohs(command.code) + ntohs(command.size) + ntohl(command.count) + ntohll(command.offset);
+        }
+        sink = sink + sum;
+    }));
+
+    report("commands, codec", nanosecondsPerRecord([&] () {
+        uint64_t sum = 0;
+        const auto* pInput = input.data();
+        for (size_t i = 0; i < s_Records; ++i)
+        {
+            Command command;
+            pInput = wire::decode(pInput, command);
+            sum += command.code + command.size + command.count + command.offset;
+        }
+        sink = sink + sum;
+    }));
+}
+
+int main(int argc, char* argv[])
+{
+    bool ok = checkCommands();
+    ok = checkReplies() && ok;
+    if (!ok)
+    {
+        return -1;
+    }
+
+    std::cout << "All " << CommandCodeCount << " commands and the replies round trip" << std::endl;
+
+    if (argc > 1 && std::string(argv[1]) == "-c")
+    {
+        // check only
+        return 0;
+    }
+
+    benchmark();
+    return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef PS3_CONNECTION_H
+#define PS3_CONNECTION_H
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ps3protocol.h"
+
+// Blocking client connection used by the tools to talk to a server like a console does
+class Connection
+{
+public:
+    Connection(const std::string& host, uint32_t port)
+    : m_Fd(-1)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || !result)
+        {
+            throw std::runtime_error("Failed to resolve " + host);
+        }
+
+        for (auto* address = result; address && m_Fd < 0; address = address->ai_next)
+        {
+            m_Fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (m_Fd >= 0 && connect(m_Fd, address->ai_addr, address->ai_addrlen) != 0)
+            {
+                ::close(m_Fd);
+                m_Fd = -1;
+            }
+        }
+
+        freeaddrinfo(result);
+
+        if (m_Fd < 0)
+        {
+            throw std::runtime_error("Failed to connect to " + host + ": " + strerror(errno));
+        }
+
+        int32_t noDelay = 1;
+        setsockopt(m_Fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+
+    ~Connection()
+    {
+        ::close(m_Fd);
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    void sendCommand(CommandCode code, uint32_t count, uint64_t offset, const void* payload, uint16_t payloadSize)
+    {
+        Command command;
+        command.code    = static_cast<uint16_t>(code);
+        command.size    = code == CommandCode::WriteToFile ? 0 : payloadSize;
+        command.count   = count;
+        command.offset  = offset;
+
+        // the header and a path are sent together like the console does
+        std::vector<uint8_t> data(wire::size<Command>() + payloadSize);
+        auto* pPayload = wire::encode(command, data.data());
+        if (payloadSize > 0)
+        {
+            memcpy(pPayload, payload, payloadSize);
+        }
+
+        sendData(data.data(), data.size());
+    }
+
+    void sendData(const void* data, size_t size)
+    {
+        auto* pData = reinterpret_cast<const uint8_t*>(data);
+        while (size > 0)
+        {
+            auto result = ::send(m_Fd, pData, size, 0);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (result <= 0)
+            {
+                throw std::runtime_error(std::string("Failed to send: ") + strerror(errno));
+            }
+
+            pData += result;
+            size -= result;
+        }
+    }
+
+    void receive(void* data, size_t size)
+    {
+        auto* pData = reinterpret_cast<uint8_t*>(data);
+        while (size > 0)
+        {
+            auto result = ::recv(m_Fd, pData, size, 0);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (result <= 0)
+            {
+                throw std::runtime_error(result == 0 ? std::string("Connection closed by server") : std::string("Failed to receive: ") + strerror(errno));
+            }
+
+            pData += result;
+            size -= result;
+        }
+    }
+
+private:
+    int32_t m_Fd;
+};
+
+#endif
@@ -0,0 +1,441 @@
+/*
+    Command handler benchmark for ps3netsrv++
+    Runs the command handlers in process against a data set in memory, without a network or
+    disk, and reports the time and the heap allocations per command
+*/
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "memorystorage.h"
+#include "ps3client.h"
+#include "ps3protocol.h"
+#include "rawsector.h"
+#include "servercontext.h"
+#include "transport.h"
+
+// Allocations of the benchmark thread, the work a handler hands to the thread pools is not counted
+static thread_local uint64_t t_Allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++t_Allocations;
+    if (void* data = malloc(size > 0 ? size : 1))
+    {
+        return data;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* data) noexcept
+{
+    free(data);
+}
+
+void operator delete[](void* data) noexcept
+{
+    free(data);
+}
+
+static const uint64_t s_ImageSize = 64 * 1024 * 1024;
+static const uint32_t s_RawSectors = 4096;
+static const uint32_t s_DirectoryEntries = 256;
+static const uint32_t s_ReadSize = 64 * 1024;
+static const uint32_t s_SectorsPerRead = 16;
+static const uint32_t s_WriteSize = 4096;
+static const uint32_t s_WritesPerFile = 4096;
+static const uint32_t s_Warmup = 16;
+
+struct Options
+{
+    uint32_t    iterations = 2000;
+    std::string datasetParent;
+};
+
+struct Result
+{
+    uint64_t    operations = 0;
+    uint64_t    nanoseconds = 0;
+    uint64_t    allocations = 0;
+    uint64_t    replyBytes = 0;
+    uint64_t    errors = 0;
+};
+
+static void writeFile(const std::string& path, uint64_t size, uint8_t seed)
+{
+    std::vector<char> data(1024 * 1024);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = static_cast<char>(i * 31 + seed);
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    for (uint64_t written = 0; written < size; written += data.size())
+    {
+        file.write(data.data(), static_cast<std::streamsize>(std::min<uint64_t>(data.size(), size - written)));
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Failed to create " + path);
+    }
+}
+
+static void makeDirectory(const std::string& path)
+{
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw std::runtime_error("Failed to create " + path + ": " + strerror(errno));
+    }
+}
+
+static void removeTree(const std::string& path)
+{
+    nftw(path.c_str(), [] (const char* entry, const struct stat*, int, struct FTW*) { return ::remove(entry); }, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// tmpfs keeps the metadata in memory as well, the file data is served by the memory storage
+static std::string createDataset(const Options& options)
+{
+    auto parent = options.datasetParent;
+    if (parent.empty())
+    {
+        struct stat info;
+        parent = stat("/dev/shm", &info) == 0 && S_ISDIR(info.st_mode) ? "/dev/shm" : "/tmp";
+    }
+
+    auto root = parent + "/ps3handlerbench." + std::to_string(getpid());
+    makeDirectory(root);
+    makeDirectory(root + "/dir");
+    makeDirectory(root + "/write");
+    makeDirectory(root + "/delete");
+    makeDirectory(root + "/mkdir");
+
+    writeFile(root + "/game.iso", s_ImageSize, 1);
+    writeFile(root + "/raw.bin", uint64_t(s_RawSectors) * rawsector::SectorSize, 2);
+    for (uint32_t i = 0; i < s_DirectoryEntries; ++i)
+    {
+        if (i % 16 == 0)
+        {
+            makeDirectory(root + "/dir/folder" + std::to_string(i));
+        }
+        else
+        {
+            writeFile(root + "/dir/file" + std::to_string(i) + ".bin", 1024 * (i + 1), static_cast<uint8_t>(i));
+        }
+    }
+
+    return root;
+}
+
+// Drives a client the way the event engine does: every command is handled with its payload
+// in memory and the reply is collected in memory
+class HandlerBench
+{
+public:
+    HandlerBench(ServerContext& context, const Options& options, const std::string& root)
+    : m_Options(options)
+    , m_Root(root)
+    , m_Transport(new MemoryTransport())
+    , m_Client(context, std::unique_ptr<Transport>(m_Transport))
+    , m_Random(0x1224)
+    , m_WriteData(s_WriteSize, 0x5A)
+    {
+    }
+
+    void run()
+    {
+        const std::string image = "/game.iso";
+        const std::string raw = "/raw.bin";
+        const std::string directory = "/dir";
+
+        benchmark(CommandCode::OpenFileForReading, [&] (uint32_t) { return request(image); });
+
+        execute(CommandCode::OpenFileForReading, image);
+        benchmark(CommandCode::ReadFile, [&] (uint32_t) { return request(std::string(), s_ReadSize, random(s_ImageSize / s_ReadSize) * s_ReadSize); });
+        benchmark(CommandCode::ReadShortFile, [&] (uint32_t) { return request(std::string(), 4096, random(s_ImageSize / 4096) * 4096); });
+
+        execute(CommandCode::OpenFileForReading, raw);
+        benchmark(CommandCode::CustomReadFile, [&] (uint32_t) {
+            return request(std::string(), static_cast<uint32_t>(random(s_RawSectors - s_SectorsPerRead)), uint64_t(s_SectorsPerRead) << 32);
+        });
+
+        benchmark(CommandCode::GetFileStats, [&] (uint32_t) { return request(image); });
+        benchmark(CommandCode::OpenDirectory, [&] (uint32_t) { return request(directory); });
+        benchmark(CommandCode::GetDirectorySize, [&] (uint32_t) { return request(directory); });
+
+        execute(CommandCode::OpenDirectory, directory);
+        benchmark(CommandCode::GetDirectoryContents, [&] (uint32_t) { return request(std::string()); });
+
+        // a listing ends with an end marker, after that the directory is opened again
+        for (auto code : { CommandCode::ListDirectoryEntryShort, CommandCode::ListDirectoryEntryLong })
+        {
+            benchmark(code, [&] (uint32_t i) {
+                if (i % (s_DirectoryEntries + 1) == 0)
+                {
+                    execute(CommandCode::OpenDirectory, directory);
+                }
+
+                return request(std::string());
+            });
+        }
+
+        benchmark(CommandCode::OpenFileForWriting, [&] (uint32_t i) { return request("/write/open" + std::to_string(i % 16) + ".bin"); });
+
+        benchmark(CommandCode::WriteToFile, [&] (uint32_t i) {
+            if (i % s_WritesPerFile == 0)
+            {
+                execute(CommandCode::OpenFileForWriting, "/write/data.bin");
+            }
+
+            Request writeRequest;
+            writeRequest.count = s_WriteSize;
+            writeRequest.payload.assign(m_WriteData.begin(), m_WriteData.end());
+            return writeRequest;
+        });
+
+        // the next command finishes the writes
+        execute(CommandCode::GetFileStats, image);
+
+        benchmark(CommandCode::MakeDirectory, [&] (uint32_t i) { return request("/mkdir/folder" + std::to_string(i)); });
+        benchmark(CommandCode::RemoveDirectory, [&] (uint32_t i) { return request("/mkdir/folder" + std::to_string(i)); });
+
+        benchmark(CommandCode::DeleteFile, [&] (uint32_t i) {
+            auto path = "/delete/file" + std::to_string(i);
+            writeFile(m_Root + path, 0, 0);
+            return request(path);
+        });
+    }
+
+    void report() const
+    {
+        std::cout << std::left << std::setw(26) << "Command" << std::right
+                  << std::setw(10) << "Count" << std::setw(8) << "Errors"
+                  << std::setw(12) << "ns/op" << std::setw(12) << "allocs/op" << std::setw(14) << "reply B/op" << std::endl;
+
+        for (size_t i = 0; i < CommandCodeCount; ++i)
+        {
+            auto& result = m_Results[i];
+            if (result.operations == 0)
+            {
+                continue;
+            }
+
+            auto operations = static_cast<double>(result.operations);
+            std::cout << std::left << std::setw(26) << commandName(static_cast<CommandCode>(FirstCommandCode + i)) << std::right
+                      << std::setw(10) << result.operations << std::setw(8) << result.errors << std::fixed
+                      << std::setw(12) << std::setprecision(0) << result.nanoseconds / operations
+                      << std::setw(12) << std::setprecision(2) << result.allocations / operations
+                      << std::setw(14) << std::setprecision(0) << result.replyBytes / operations << std::endl;
+        }
+    }
+
+private:
+    struct Request
+    {
+        uint32_t            count = 0;
+        uint64_t            offset = 0;
+        std::vector<uint8_t> payload;
+    };
+
+    Request request(const std::string& path, uint32_t count = 0, uint64_t offset = 0)
+    {
+        Request result;
+        result.count = count;
+        result.offset = offset;
+        result.payload.assign(path.begin(), path.end());
+        return result;
+    }
+
+    uint64_t random(uint64_t count)
+    {
+        return std::uniform_int_distribution<uint64_t>(0, count - 1)(m_Random);
+    }
+
+    // Runs a command that prepares the next measurements
+    void execute(CommandCode code, const std::string& path)
+    {
+        Result ignored;
+        handle(code, request(path), ignored);
+    }
+
+    // The requests are created before the clock starts, only the handler is measured
+    template <typename MakeRequest>
+    void benchmark(CommandCode code, MakeRequest makeRequest)
+    {
+        auto& result = m_Results[static_cast<size_t>(commandIndex(static_cast<uint16_t>(code)))];
+
+        Result warmup;
+        for (uint32_t i = 0; i < m_Options.iterations + s_Warmup; ++i)
+        {
+            auto nextRequest = makeRequest(i);
+            handle(code, nextRequest, i < s_Warmup ? warmup : result);
+        }
+    }
+
+    void handle(CommandCode code, const Request& nextRequest, Result& result)
+    {
+        Command command;
+        command.code    = static_cast<uint16_t>(code);
+        command.size    = code == CommandCode::WriteToFile ? 0 : static_cast<uint16_t>(nextRequest.payload.size());
+        command.count   = nextRequest.count;
+        command.offset  = nextRequest.offset;
+
+        m_Transport->clearOutput();
+        m_Transport->setInput(nextRequest.payload.data(), nextRequest.payload.size());
+
+        bool failed = false;
+        auto allocations = t_Allocations;
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            m_Client.handleCommand(command);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << commandName(code) << ": " << e.what() << std::endl;
+            failed = true;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        result.allocations += t_Allocations - allocations;
+        result.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        result.replyBytes += m_Transport->getOutput().size();
+        result.errors += failed || isFailure(code) ? 1 : 0;
+        ++result.operations;
+        m_Transport->setInput(nullptr, 0);
+    }
+
+    template <typename Message>
+    static bool decodeReply(const std::vector<uint8_t>& output, Message& reply)
+    {
+        if (output.size() < wire::size<Message>())
+        {
+            return false;
+        }
+
+        wire::decode(output.data(), reply);
+        return true;
+    }
+
+    bool isFailure(CommandCode code) const
+    {
+        auto& output = m_Transport->getOutput();
+        switch (code)
+        {
+        case CommandCode::OpenFileForReading:
+        {
+            OpenFileReply reply;
+            return !decodeReply(output, reply) || reply.size < 0;
+        }
+        case CommandCode::GetFileStats:
+        {
+            FileReply reply;
+            return !decodeReply(output, reply) || reply.size < 0;
+        }
+        case CommandCode::OpenFileForWriting:
+        case CommandCode::OpenDirectory:
+        case CommandCode::DeleteFile:
+        case CommandCode::MakeDirectory:
+        case CommandCode::RemoveDirectory:
+        {
+            StatusReply reply;
+            return !decodeReply(output, reply) || reply.result != 0;
+        }
+        default:
+            return output.empty();
+        }
+    }
+
+    const Options&                          m_Options;
+    std::string                             m_Root;
+    MemoryTransport*                        m_Transport;
+    Ps3Client                               m_Client;
+    std::mt19937_64                         m_Random;
+    std::vector<uint8_t>                    m_WriteData;
+    std::array<Result, CommandCodeCount>    m_Results;
+};
+
+static void usage(const std::string& execName)
+{
+    std::cout << "Usage: " << execName << " [-n iterations] [-d directory]" << std::endl
+              << "Iterations: -n sets the number of measured commands per command code (default: 2000)" << std::endl
+              << "Dataset: -d sets the directory the data set is created in (default: /dev/shm or /tmp), it is removed afterwards" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+
+    int32_t opt;
+    while ((opt = getopt(argc, argv, "n:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            options.iterations = std::max(1, std::stoi(optarg));
+            break;
+        case 'd':
+            options.datasetParent = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    std::string root;
+    try
+    {
+        root = createDataset(options);
+
+        // read-ahead and the size index would move work to other threads
+        ServerSettings settings;
+        settings.rootPath = root;
+        settings.readAheadWindow = 0;
+
+        {
+            ServerContext context(settings, std::make_unique<MemoryStorage>());
+            HandlerBench bench(context, options, root);
+            bench.run();
+            bench.report();
+        }
+
+        removeTree(root);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        if (!root.empty())
+        {
+            removeTree(root);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,663 @@
+/*
+    Load generator for ps3netsrv++
+    Simulates consoles that use the server concurrently and reports latency per command
+*/
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ps3protocol.h"
+#include "ps3connection.h"
+
+static const uint32_t s_IsoCount = 4;
+static const uint64_t s_IsoSize = 4ULL * 1024 * 1024 * 1024;
+static const uint32_t s_RawSectorSize = 2352;
+static const uint32_t s_RawSectorCount = 64 * 1024;
+static const uint32_t s_TreeDirectories = 16;
+static const uint32_t s_TreeFiles = 64;
+static const uint32_t s_StreamReadSize = 64 * 1024;
+static const uint32_t s_DumpWriteSize = 64 * 1024;
+
+enum class Scenario
+{
+    Stream,
+    Random,
+    Sectors,
+    Scan,
+    DirSize,
+    Dump
+};
+
+static const std::array<const char*, 6> s_ScenarioNames {{ "stream", "random", "sectors", "scan", "dirsize", "dump" }};
+
+struct Options
+{
+    std::string                 host = "127.0.0.1";
+    uint32_t                    port = 38008;
+    uint32_t                    consoles = 8;
+    uint32_t                    duration = 10;
+    std::array<uint32_t, 6>     weights {{ 40, 20, 15, 10, 5, 10 }};
+    std::string                 datasetRoot;
+    int32_t                     serverPid = -1;
+};
+
+// Latencies and transferred bytes per command of a single console
+struct Recording
+{
+    std::array<std::vector<uint32_t>, CommandCodeCount>    microseconds;
+    std::array<uint64_t, CommandCodeCount>                 errors {};
+    uint64_t                                               bytesReceived = 0;
+    uint64_t                                               bytesSent = 0;
+    uint64_t                                               reconnects = 0;
+
+    void merge(const Recording& other)
+    {
+        for (size_t i = 0; i < CommandCodeCount; ++i)
+        {
+            microseconds[i].insert(microseconds[i].end(), other.microseconds[i].begin(), other.microseconds[i].end());
+            errors[i] += other.errors[i];
+        }
+
+        bytesReceived += other.bytesReceived;
+        bytesSent += other.bytesSent;
+        reconnects += other.reconnects;
+    }
+};
+
+struct ProcessUsage
+{
+    bool        valid = false;
+    uint64_t    cpuTicks = 0;
+    uint64_t    rssKilobytes = 0;
+    uint64_t    peakRssKilobytes = 0;
+};
+
+// A simulated console, executes randomly selected scenarios until the deadline
+class Console
+{
+public:
+    Console(const Options& options, uint32_t id)
+    : m_Options(options)
+    , m_Id(id)
+    , m_Random(id * 7919 + 1)
+    , m_Buffer(BufferSize)
+    {
+    }
+
+    void run(std::chrono::steady_clock::time_point deadline)
+    {
+        m_Deadline = deadline;
+        while (std::chrono::steady_clock::now() < m_Deadline)
+        {
+            try
+            {
+                if (!m_Connection)
+                {
+                    m_Connection.reset(new Connection(m_Options.host, m_Options.port));
+                }
+
+                runScenario(selectScenario());
+            }
+            catch (std::exception& e)
+            {
+                // the server dropped the connection, the next scenario reconnects
+                std::cerr << "Console " << m_Id << ": " << e.what() << std::endl;
+                m_Connection.reset();
+                ++m_Recording.reconnects;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+    }
+
+    const Recording& getRecording() const
+    {
+        return m_Recording;
+    }
+
+private:
+    static constexpr size_t BufferSize = 4 * 1024 * 1024;
+
+    Scenario selectScenario()
+    {
+        uint32_t total = 0;
+        for (auto weight : m_Options.weights)
+        {
+            total += weight;
+        }
+
+        auto value = std::uniform_int_distribution<uint32_t>(0, total - 1)(m_Random);
+        for (size_t i = 0; i < m_Options.weights.size(); ++i)
+        {
+            if (value < m_Options.weights[i])
+            {
+                return static_cast<Scenario>(i);
+            }
+
+            value -= m_Options.weights[i];
+        }
+
+        return Scenario::Stream;
+    }
+
+    uint64_t random(uint64_t min, uint64_t max)
+    {
+        return std::uniform_int_distribution<uint64_t>(min, max)(m_Random);
+    }
+
+    bool expired() const
+    {
+        return std::chrono::steady_clock::now() >= m_Deadline;
+    }
+
+    void runScenario(Scenario scenario)
+    {
+        switch (scenario)
+        {
+        case Scenario::Stream:      streamIso();            break;
+        case Scenario::Random:      readRandom();           break;
+        case Scenario::Sectors:     readSectors();          break;
+        case Scenario::Scan:        scanDirectory();        break;
+        case Scenario::DirSize:     getDirectorySize();     break;
+        case Scenario::Dump:        dumpFile();             break;
+        }
+    }
+
+    // Executes a command and records its latency, the reply handler receives the complete reply
+    template <typename ReplyHandler>
+    bool execute(CommandCode code, uint32_t count, uint64_t offset, const std::string& payload, ReplyHandler handleReply)
+    {
+        auto start = std::chrono::steady_clock::now();
+        m_Connection->sendCommand(code, count, offset, payload.data(), static_cast<uint16_t>(payload.size()));
+        m_Recording.bytesSent += wire::size<Command>() + payload.size();
+
+        bool ok = handleReply();
+
+        auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        auto index = commandIndex(static_cast<uint16_t>(code));
+        m_Recording.microseconds[index].push_back(static_cast<uint32_t>(std::min<int64_t>(microseconds, UINT32_MAX)));
+        if (!ok)
+        {
+            ++m_Recording.errors[index];
+        }
+
+        return ok;
+    }
+
+    template <typename Message>
+    Message receive()
+    {
+        uint8_t data[wire::size<Message>()];
+        m_Connection->receive(data, sizeof(data));
+        m_Recording.bytesReceived += sizeof(data);
+
+        Message message;
+        wire::decode(data, message);
+        return message;
+    }
+
+    void receiveData(size_t size)
+    {
+        m_Connection->receive(m_Buffer.data(), size);
+        m_Recording.bytesReceived += size;
+    }
+
+    bool receiveStatus()
+    {
+        return receive<StatusReply>().result == 0;
+    }
+
+    // Returns the size of the file, -1 if it could not be opened
+    int64_t openFile(const std::string& path)
+    {
+        int64_t size = -1;
+        execute(CommandCode::OpenFileForReading, 0, 0, path, [this, &size] () {
+            size = receive<OpenFileReply>().size;
+            return size >= 0;
+        });
+
+        return size;
+    }
+
+    std::string isoPath()
+    {
+        return "/loadgen/iso/game" + std::to_string(random(0, s_IsoCount - 1)) + ".iso";
+    }
+
+    void streamIso()
+    {
+        auto size = openFile(isoPath());
+        if (size <= 0)
+        {
+            return;
+        }
+
+        // a few seconds of video or level data
+        uint64_t offset = random(0, (size - 1) / s_StreamReadSize) * s_StreamReadSize;
+        for (uint32_t i = 0; i < 256 && offset < uint64_t(size) && !expired(); ++i)
+        {
+            auto count = static_cast<uint32_t>(std::min<uint64_t>(s_StreamReadSize, size - offset));
+            execute(CommandCode::ReadFile, count, offset, std::string(), [this, count] () {
+                receiveData(count);
+                return true;
+            });
+
+            offset += count;
+        }
+    }
+
+    void readRandom()
+    {
+        auto size = openFile(isoPath());
+        if (size <= 0)
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < 64 && !expired(); ++i)
+        {
+            auto count = static_cast<uint32_t>(random(1, 32) * 2048);
+            auto offset = random(0, (uint64_t(size) - count) / 2048) * 2048;
+            execute(CommandCode::ReadFile, count, offset, std::string(), [this, count] () {
+                receiveData(count);
+                return true;
+            });
+        }
+
+        // small files like param.sfo are read with ReadShortFile
+        execute(CommandCode::ReadShortFile, 4096, 0, std::string(), [this] () {
+            receiveData(receive<CountReply>().count);
+            return true;
+        });
+    }
+
+    void readSectors()
+    {
+        if (openFile("/loadgen/cd/disc.bin") <= 0)
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < 32 && !expired(); ++i)
+        {
+            auto chunks = static_cast<uint32_t>(random(1, 16));
+            auto sector = static_cast<uint32_t>(random(0, s_RawSectorCount - chunks));
+            execute(CommandCode::CustomReadFile, sector, uint64_t(chunks) << 32, std::string(), [this, chunks] () {
+                receiveData(chunks * 2048);
+                return true;
+            });
+        }
+    }
+
+    void scanDirectory()
+    {
+        auto path = "/loadgen/tree/dir" + std::to_string(random(0, s_TreeDirectories - 1));
+        if (!execute(CommandCode::OpenDirectory, 0, 0, path, [this] () { return receiveStatus(); }))
+        {
+            return;
+        }
+
+        bool done = false;
+        while (!done)
+        {
+            execute(CommandCode::ListDirectoryEntryLong, 0, 0, std::string(), [this, &done] () {
+                auto reply = receive<FileReplyLong>();
+                done = reply.size == -1;
+                if (!done)
+                {
+                    receiveData(reply.nameLength);
+                }
+
+                return true;
+            });
+        }
+    }
+
+    void getDirectorySize()
+    {
+        execute(CommandCode::GetDirectorySize, 0, 0, "/loadgen/tree", [this] () {
+            return receive<DirectorySizeReply>().size >= 0;
+        });
+    }
+
+    void dumpFile()
+    {
+        auto path = "/loadgen/dump/console" + std::to_string(m_Id) + ".bin";
+        if (!execute(CommandCode::OpenFileForWriting, 0, 0, path, [this] () { return receiveStatus(); }))
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < 64 && !expired(); ++i)
+        {
+            // the payload follows the header, like save data dumped by the console
+            auto start = std::chrono::steady_clock::now();
+            m_Connection->sendCommand(CommandCode::WriteToFile, s_DumpWriteSize, 0, nullptr, 0);
+            m_Connection->sendData(m_Buffer.data(), s_DumpWriteSize);
+            m_Recording.bytesSent += wire::size<Command>() + s_DumpWriteSize;
+
+            bool ok = receive<CountReply>().count == s_DumpWriteSize;
+
+            auto index = commandIndex(static_cast<uint16_t>(CommandCode::WriteToFile));
+            auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            m_Recording.microseconds[index].push_back(static_cast<uint32_t>(std::min<int64_t>(microseconds, UINT32_MAX)));
+            if (!ok)
+            {
+                ++m_Recording.errors[index];
+            }
+        }
+
+        execute(CommandCode::DeleteFile, 0, 0, path, [this] () { return receiveStatus(); });
+    }
+
+    const Options&                          m_Options;
+    uint32_t                                m_Id;
+    std::mt19937_64                         m_Random;
+    std::vector<uint8_t>                    m_Buffer;
+    std::unique_ptr<Connection>             m_Connection;
+    std::chrono::steady_clock::time_point   m_Deadline;
+    Recording                               m_Recording;
+};
+
+static void createDirectory(const std::string& path)
+{
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw std::runtime_error("Failed to create " + path + ": " + strerror(errno));
+    }
+}
+
+// Sparse files read as zeros without touching the disk, so the dataset is cheap to generate
+static void createSparseFile(const std::string& path, uint64_t size)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && static_cast<uint64_t>(info.st_size) == size)
+    {
+        return;
+    }
+
+    int32_t fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        auto error = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        throw std::runtime_error("Failed to create " + path + ": " + strerror(error));
+    }
+
+    close(fd);
+}
+
+static void generateDataset(const std::string& root)
+{
+    auto base = root + "/loadgen";
+    createDirectory(base);
+    createDirectory(base + "/iso");
+    createDirectory(base + "/cd");
+    createDirectory(base + "/tree");
+    createDirectory(base + "/dump");
+
+    for (uint32_t i = 0; i < s_IsoCount; ++i)
+    {
+        createSparseFile(base + "/iso/game" + std::to_string(i) + ".iso", s_IsoSize);
+    }
+
+    createSparseFile(base + "/cd/disc.bin", uint64_t(s_RawSectorSize) * s_RawSectorCount);
+
+    for (uint32_t dir = 0; dir < s_TreeDirectories; ++dir)
+    {
+        auto path = base + "/tree/dir" + std::to_string(dir);
+        createDirectory(path);
+        for (uint32_t file = 0; file < s_TreeFiles; ++file)
+        {
+            createSparseFile(path + "/file" + std::to_string(file) + ".dat", (file + 1) * 4096 + dir);
+        }
+    }
+
+    std::cout << "Dataset generated in " << base << std::endl;
+}
+
+static ProcessUsage getProcessUsage(int32_t pid)
+{
+    ProcessUsage usage;
+
+#ifdef __linux__
+    std::ifstream statFile("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (pid <= 0 || !std::getline(statFile, stat))
+    {
+        return usage;
+    }
+
+    // the fields after the command name, utime and stime are the 12th and 13th
+    auto position = stat.rfind(')');
+    if (position == std::string::npos)
+    {
+        return usage;
+    }
+
+    std::istringstream fields(stat.substr(position + 2));
+    std::string field;
+    uint64_t utime = 0, stime = 0;
+    for (int32_t i = 0; i < 13 && fields >> field; ++i)
+    {
+        if (i == 11) utime = std::stoull(field);
+        if (i == 12) stime = std::stoull(field);
+    }
+
+    usage.cpuTicks = utime + stime;
+
+    std::ifstream statusFile("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(statusFile, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+        {
+            usage.rssKilobytes = std::stoull(line.substr(6));
+        }
+        else if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            usage.peakRssKilobytes = std::stoull(line.substr(6));
+        }
+    }
+
+    usage.valid = true;
+#else
+    (void) pid;
+#endif
+
+    return usage;
+}
+
+static double percentile(const std::vector<uint32_t>& sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+
+    auto index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+static void report(Recording& recording, double seconds, const ProcessUsage& before, const ProcessUsage& after)
+{
+    uint64_t operations = 0;
+    for (auto& latencies : recording.microseconds)
+    {
+        operations += latencies.size();
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Duration:   " << seconds << " s" << std::endl
+              << "Operations: " << operations << " (" << operations / seconds << " ops/s)" << std::endl
+              << "Received:   " << recording.bytesReceived / (1024.0 * 1024.0) / seconds << " MB/s" << std::endl
+              << "Sent:       " << recording.bytesSent / (1024.0 * 1024.0) / seconds << " MB/s" << std::endl
+              << "Reconnects: " << recording.reconnects << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(26) << "Command" << std::right
+              << std::setw(10) << "Count" << std::setw(8) << "Errors"
+              << std::setw(11) << "p50 ms" << std::setw(11) << "p99 ms" << std::setw(11) << "p999 ms" << std::setw(11) << "max ms" << std::endl;
+
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        auto& latencies = recording.microseconds[i];
+        if (latencies.empty())
+        {
+            continue;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::left << std::setw(26) << commandName(static_cast<CommandCode>(FirstCommandCode + i)) << std::right
+                  << std::setw(10) << latencies.size() << std::setw(8) << recording.errors[i]
+                  << std::setw(11) << percentile(latencies, 0.5)
+                  << std::setw(11) << percentile(latencies, 0.99)
+                  << std::setw(11) << percentile(latencies, 0.999)
+                  << std::setw(11) << latencies.back() / 1000.0 << std::endl;
+    }
+
+    if (before.valid && after.valid)
+    {
+        auto cpuSeconds = static_cast<double>(after.cpuTicks - before.cpuTicks) / sysconf(_SC_CLK_TCK);
+        std::cout << std::endl
+                  << "Server CPU: " << cpuSeconds / seconds * 100.0 << " % of a core" << std::endl
+                  << "Server RSS: " << after.rssKilobytes / 1024.0 << " MB (peak " << after.peakRssKilobytes / 1024.0 << " MB)" << std::endl;
+    }
+}
+
+static bool parseMix(const std::string& mix, std::array<uint32_t, 6>& weights)
+{
+    weights.fill(0);
+
+    std::istringstream stream(mix);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        auto separator = item.find('=');
+        auto iter = std::find(s_ScenarioNames.begin(), s_ScenarioNames.end(), item.substr(0, separator));
+        if (separator == std::string::npos || iter == s_ScenarioNames.end())
+        {
+            return false;
+        }
+
+        weights[iter - s_ScenarioNames.begin()] = std::stoul(item.substr(separator + 1));
+    }
+
+    return std::any_of(weights.begin(), weights.end(), [] (uint32_t weight) { return weight > 0; });
+}
+
+static void usage(const std::string& execName)
+{
+    std::cout << "Usage: " << execName << " [-h host] [-p port] [-c consoles] [-t seconds] [-m mix] [-g rootdirectory] [-P pid]" << std::endl
+              << "Consoles: -c sets the number of simulated consoles (default: 8), -t the duration of the run (default: 10 s)" << std::endl
+              << "Mix: -m sets the scenario weights (default: stream=40,random=20,sectors=15,scan=10,dirsize=5,dump=10)" << std::endl
+              << "Dataset: -g creates the sparse files used by the scenarios in the root directory of the server" << std::endl
+              << "Server usage: -P reports the cpu time and memory usage of the server process (Linux only)" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+
+    int32_t opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:m:g:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = std::stoi(optarg);
+            break;
+        case 'c':
+            options.consoles = std::max(1, std::stoi(optarg));
+            break;
+        case 't':
+            options.duration = std::max(1, std::stoi(optarg));
+            break;
+        case 'm':
+            if (!parseMix(optarg, options.weights))
+            {
+                std::cerr << "Invalid scenario mix: " << optarg << std::endl;
+                return -1;
+            }
+            break;
+        case 'g':
+            options.datasetRoot = optarg;
+            break;
+        case 'P':
+            options.serverPid = std::stoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    try
+    {
+        if (!options.datasetRoot.empty())
+        {
+            generateDataset(options.datasetRoot);
+        }
+
+        std::vector<std::unique_ptr<Console>> consoles;
+        for (uint32_t i = 0; i < options.consoles; ++i)
+        {
+            consoles.emplace_back(new Console(options, i));
+        }
+
+        auto before = getProcessUsage(options.serverPid);
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::seconds(options.duration);
+
+        std::vector<std::thread> threads;
+        for (auto& console : consoles)
+        {
+            auto* pConsole = console.get();
+            threads.emplace_back([pConsole, deadline] () { pConsole->run(deadline); });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto after = getProcessUsage(options.serverPid);
+
+        Recording recording;
+        for (auto& console : consoles)
+        {
+            recording.merge(console->getRecording());
+        }
+
+        report(recording, seconds, before, after);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,406 @@
+/*
+    Trace replay for ps3netsrv++
+    Replays a trace recorded with ps3netsrv -T against a server and compares the latencies
+*/
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "ps3protocol.h"
+#include "ps3connection.h"
+#include "traceformat.h"
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    uint32_t    port = 38008;
+    double      speed = 1.0;
+    std::string tracePath;
+};
+
+struct Recording
+{
+    std::array<std::vector<uint32_t>, CommandCodeCount>    recorded;
+    std::array<std::vector<uint32_t>, CommandCodeCount>    replayed;
+    std::array<uint64_t, CommandCodeCount>                 errors {};
+    uint64_t                                               replyMismatches = 0;
+    uint64_t                                               maxLag = 0;
+
+    void merge(const Recording& other)
+    {
+        for (size_t i = 0; i < CommandCodeCount; ++i)
+        {
+            recorded[i].insert(recorded[i].end(), other.recorded[i].begin(), other.recorded[i].end());
+            replayed[i].insert(replayed[i].end(), other.replayed[i].begin(), other.replayed[i].end());
+            errors[i] += other.errors[i];
+        }
+
+        replyMismatches += other.replyMismatches;
+        maxLag = std::max(maxLag, other.maxLag);
+    }
+};
+
+static uint32_t toLatency(uint64_t microseconds)
+{
+    return static_cast<uint32_t>(std::min<uint64_t>(microseconds, UINT32_MAX));
+}
+
+// Replays the commands of one recorded connection in order
+class Session
+{
+public:
+    explicit Session(const Options& options)
+    : m_Options(options)
+    , m_Buffer(BufferSize)
+    {
+    }
+
+    void add(const TraceRecord& record)
+    {
+        m_Records.push_back(record);
+    }
+
+    // The timestamps of the records are relative to start
+    void run(std::chrono::steady_clock::time_point start)
+    {
+        m_Start = start;
+        std::this_thread::sleep_until(m_Start);
+
+        for (auto& record : m_Records)
+        {
+            waitUntil(record.timestamp);
+
+            if (record.code == TraceDisconnect)
+            {
+                m_Connection.reset();
+                continue;
+            }
+
+            auto index = commandIndex(record.code);
+            if (index < 0)
+            {
+                continue;
+            }
+
+            try
+            {
+                if (!m_Connection)
+                {
+                    m_Connection.reset(new Connection(m_Options.host, m_Options.port));
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                auto replyBytes = execute(record);
+                auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+                m_Recording.recorded[index].push_back(toLatency(record.duration));
+                m_Recording.replayed[index].push_back(toLatency(microseconds));
+                if (replyBytes != record.replyBytes)
+                {
+                    ++m_Recording.replyMismatches;
+                }
+            }
+            catch (std::exception& e)
+            {
+                // the server closes the connection on protocol errors, like it did for the console
+                std::cerr << "Client " << record.client << ": " << e.what() << std::endl;
+                ++m_Recording.errors[index];
+                m_Connection.reset();
+            }
+        }
+
+        m_Connection.reset();
+    }
+
+    const Recording& getRecording() const
+    {
+        return m_Recording;
+    }
+
+private:
+    static constexpr size_t BufferSize = 4 * 1024 * 1024;
+
+    void waitUntil(uint64_t timestamp)
+    {
+        if (m_Options.speed <= 0.0)
+        {
+            return;
+        }
+
+        auto due = m_Start + std::chrono::microseconds(static_cast<uint64_t>(timestamp / m_Options.speed));
+        auto now = std::chrono::steady_clock::now();
+        if (due > now)
+        {
+            std::this_thread::sleep_until(due);
+        }
+        else
+        {
+            m_Recording.maxLag = std::max<uint64_t>(m_Recording.maxLag, std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+        }
+    }
+
+    // Sends the command and receives its reply, returns the size of the reply
+    uint64_t execute(const TraceRecord& record)
+    {
+        auto code = static_cast<CommandCode>(record.code);
+        m_Received = 0;
+
+        if (code == CommandCode::WriteToFile)
+        {
+            if (record.count > m_Buffer.size())
+            {
+                throw std::runtime_error("Write size exceeds the replay buffer");
+            }
+
+            m_Connection->sendCommand(code, record.count, record.offset, nullptr, 0);
+            m_Connection->sendData(m_Buffer.data(), record.count);
+        }
+        else
+        {
+            m_Connection->sendCommand(code, record.count, record.offset, record.path.data(), static_cast<uint16_t>(record.path.size()));
+        }
+
+        switch (code)
+        {
+        case CommandCode::OpenFileForReading:
+            receive<OpenFileReply>();
+            break;
+        case CommandCode::ReadFile:
+            receiveData(record.count);
+            break;
+        case CommandCode::CustomReadFile:
+            receiveData((record.offset >> 32) * 2048);
+            break;
+        case CommandCode::ReadShortFile:
+            receiveData(receive<CountReply>().count);
+            break;
+        case CommandCode::GetFileStats:
+            receive<FileReply>();
+            break;
+        case CommandCode::GetDirectorySize:
+            receive<DirectorySizeReply>();
+            break;
+        case CommandCode::GetDirectoryContents:
+            receiveData(static_cast<size_t>(receive<ReadDirectoryReply>().size) * wire::size<ReadDirectoryDataReply>());
+            break;
+        case CommandCode::ListDirectoryEntryShort:
+        {
+            auto reply = receive<FileReplyShort>();
+            if (reply.size != -1)
+            {
+                receiveData(reply.nameLength);
+            }
+            break;
+        }
+        case CommandCode::ListDirectoryEntryLong:
+        {
+            auto reply = receive<FileReplyLong>();
+            if (reply.size != -1)
+            {
+                receiveData(reply.nameLength);
+            }
+            break;
+        }
+        default:
+            // status replies
+            receive<StatusReply>();
+            break;
+        }
+
+        return m_Received;
+    }
+
+    template <typename Message>
+    Message receive()
+    {
+        uint8_t data[wire::size<Message>()];
+        m_Connection->receive(data, sizeof(data));
+        m_Received += sizeof(data);
+
+        Message message;
+        wire::decode(data, message);
+        return message;
+    }
+
+    void receiveData(size_t size)
+    {
+        while (size > 0)
+        {
+            auto chunk = std::min(size, m_Buffer.size());
+            m_Connection->receive(m_Buffer.data(), chunk);
+            m_Received += chunk;
+            size -= chunk;
+        }
+    }
+
+    const Options&                          m_Options;
+    std::chrono::steady_clock::time_point   m_Start;
+    std::vector<TraceRecord>                m_Records;
+    std::vector<uint8_t>                    m_Buffer;
+    std::unique_ptr<Connection>             m_Connection;
+    uint64_t                                m_Received = 0;
+    Recording                               m_Recording;
+};
+
+static double percentile(const std::vector<uint32_t>& sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+
+    auto index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+static void report(Recording& recording, uint64_t traceDuration, double seconds, size_t sessions)
+{
+    uint64_t operations = 0;
+    for (auto& latencies : recording.replayed)
+    {
+        operations += latencies.size();
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Sessions:   " << sessions << std::endl
+              << "Recorded:   " << traceDuration / 1000000.0 << " s" << std::endl
+              << "Replayed:   " << seconds << " s" << std::endl
+              << "Operations: " << operations << " (" << operations / seconds << " ops/s)" << std::endl
+              << "Max lag:    " << recording.maxLag / 1000.0 << " ms" << std::endl
+              << "Mismatched replies: " << recording.replyMismatches << std::endl << std::endl;
+
+    // the recorded latency was measured by the server, the replayed latency includes the network round trip
+    std::cout << std::left << std::setw(26) << "Command" << std::right
+              << std::setw(10) << "Count" << std::setw(8) << "Errors"
+              << std::setw(13) << "rec p50 ms" << std::setw(13) << "rec p99 ms"
+              << std::setw(11) << "p50 ms" << std::setw(11) << "p99 ms" << std::setw(11) << "p999 ms" << std::endl;
+
+    for (size_t i = 0; i < CommandCodeCount; ++i)
+    {
+        auto& recorded = recording.recorded[i];
+        auto& replayed = recording.replayed[i];
+        if (replayed.empty() && recording.errors[i] == 0)
+        {
+            continue;
+        }
+
+        std::sort(recorded.begin(), recorded.end());
+        std::sort(replayed.begin(), replayed.end());
+        std::cout << std::left << std::setw(26) << commandName(static_cast<CommandCode>(FirstCommandCode + i)) << std::right
+                  << std::setw(10) << replayed.size() << std::setw(8) << recording.errors[i]
+                  << std::setw(13) << percentile(recorded, 0.5)
+                  << std::setw(13) << percentile(recorded, 0.99)
+                  << std::setw(11) << percentile(replayed, 0.5)
+                  << std::setw(11) << percentile(replayed, 0.99)
+                  << std::setw(11) << percentile(replayed, 0.999) << std::endl;
+    }
+}
+
+static void usage(const std::string& execName)
+{
+    std::cout << "Usage: " << execName << " [-h host] [-p port] [-s speed] tracefile" << std::endl
+              << "Speed: -s scales the recorded timing, 2 replays twice as fast (default: 1, 0 sends every command as soon as the previous one completed)" << std::endl
+              << "The server must serve a root directory with the same contents as the one the trace was recorded from" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+
+    int32_t opt;
+    while ((opt = getopt(argc, argv, "h:p:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = std::stoi(optarg);
+            break;
+        case 's':
+            options.speed = std::max(0.0, std::stod(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    options.tracePath = argv[optind];
+
+    try
+    {
+        std::vector<std::unique_ptr<Session>> sessions;
+        uint64_t traceDuration = 0;
+
+        TraceReader reader(options.tracePath);
+        TraceRecord record;
+
+        try
+        {
+            while (reader.read(record))
+            {
+                while (record.client >= sessions.size())
+                {
+                    sessions.emplace_back(new Session(options));
+                }
+
+                sessions[record.client]->add(record);
+                traceDuration = std::max(traceDuration, record.timestamp + record.duration);
+            }
+        }
+        catch (std::runtime_error& e)
+        {
+            // the last records are lost when the server was killed
+            std::cerr << options.tracePath << ": " << e.what() << ", replaying the complete records" << std::endl;
+        }
+
+        // give all threads the time to start before the first command is due
+        auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+
+        std::vector<std::thread> threads;
+        for (auto& session : sessions)
+        {
+            auto* pSession = session.get();
+            threads.emplace_back([pSession, start] () { pSession->run(start); });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        Recording recording;
+        for (auto& session : sessions)
+        {
+            recording.merge(session->getRecording());
+        }
+
+        report(recording, traceDuration, seconds, sessions.size());
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
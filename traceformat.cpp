@@ -0,0 +1,107 @@
+#include "traceformat.h"
+
+#include <cstring>
+#include <stdexcept>
+
+static const char s_Magic[8] = { 'P', 'S', '3', 'T', 'R', 'C', '0', '1' };
+static const size_t s_MaxPathLength = 0xFFFF;
+
+static void appendVarint(std::vector<uint8_t>& output, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        output.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+
+    output.push_back(static_cast<uint8_t>(value));
+}
+
+void appendTraceHeader(std::vector<uint8_t>& output)
+{
+    output.insert(output.end(), s_Magic, s_Magic + sizeof(s_Magic));
+}
+
+void appendTraceRecord(std::vector<uint8_t>& output, const TraceRecord& record)
+{
+    appendVarint(output, record.timestamp);
+    appendVarint(output, record.client);
+    appendVarint(output, record.code);
+    appendVarint(output, record.count);
+    appendVarint(output, record.offset);
+    appendVarint(output, record.replyBytes);
+    appendVarint(output, record.duration);
+    appendVarint(output, record.path.size());
+    output.insert(output.end(), record.path.begin(), record.path.end());
+}
+
+TraceReader::TraceReader(const std::string& path)
+: m_Stream(path, std::ios::binary)
+{
+    char magic[sizeof(s_Magic)];
+    if (!m_Stream.read(magic, sizeof(magic)))
+    {
+        throw std::runtime_error("Failed to read trace " + path);
+    }
+
+    if (memcmp(magic, s_Magic, sizeof(magic)) != 0)
+    {
+        throw std::runtime_error(path + " is not a ps3netsrv trace");
+    }
+}
+
+bool TraceReader::read(TraceRecord& record)
+{
+    uint64_t timestamp;
+    if (!readVarint(timestamp))
+    {
+        return false;
+    }
+
+    uint64_t client, code, count, pathLength;
+    if (!readVarint(client) || !readVarint(code) || !readVarint(count) || !readVarint(record.offset)
+     || !readVarint(record.replyBytes) || !readVarint(record.duration) || !readVarint(pathLength) || pathLength > s_MaxPathLength)
+    {
+        // a trace of a server that was killed ends with a partial record
+        throw std::runtime_error("Truncated trace record");
+    }
+
+    record.timestamp    = timestamp;
+    record.client       = static_cast<uint32_t>(client);
+    record.code         = static_cast<uint16_t>(code);
+    record.count        = static_cast<uint32_t>(count);
+    record.path.resize(static_cast<size_t>(pathLength));
+
+    if (pathLength > 0 && !m_Stream.read(&record.path[0], pathLength))
+    {
+        throw std::runtime_error("Truncated trace record");
+    }
+
+    return true;
+}
+
+bool TraceReader::readVarint(uint64_t& value)
+{
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7)
+    {
+        auto byte = m_Stream.get();
+        if (byte == std::char_traits<char>::eof())
+        {
+            if (shift > 0)
+            {
+                throw std::runtime_error("Truncated trace record");
+            }
+
+            return false;
+        }
+
+        value |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+
+    throw std::runtime_error("Invalid varint in trace");
+}
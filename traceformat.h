@@ -0,0 +1,45 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cinttypes>
+
+// Command code of the record that marks the end of a connection
+static constexpr uint16_t TraceDisconnect = 0;
+
+// A decoded command as seen by the server
+struct TraceRecord
+{
+    uint64_t    timestamp = 0;      // start of the command in microseconds since the start of the trace
+    uint32_t    client = 0;
+    uint16_t    code = TraceDisconnect;
+    uint32_t    count = 0;
+    uint64_t    offset = 0;
+    std::string path;
+    uint64_t    replyBytes = 0;
+    uint64_t    duration = 0;       // microseconds
+};
+
+// The trace file is a magic followed by a stream of records, all integers are
+// stored as LEB128 varints so a typical read command takes about 16 bytes
+void appendTraceHeader(std::vector<uint8_t>& output);
+void appendTraceRecord(std::vector<uint8_t>& output, const TraceRecord& record);
+
+class TraceReader
+{
+public:
+    // Throws if the file can not be opened or is not a trace
+    explicit TraceReader(const std::string& path);
+
+    // Returns false at the end of the trace, throws if the trace is corrupt
+    bool read(TraceRecord& record);
+
+private:
+    bool readVarint(uint64_t& value);
+
+    std::ifstream   m_Stream;
+};
+
+#endif
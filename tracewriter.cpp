@@ -0,0 +1,135 @@
+#include "tracewriter.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+
+using namespace utils;
+
+const size_t TraceWriter::s_FlushSize = 256 * 1024;
+const std::chrono::seconds TraceWriter::s_FlushInterval(1);
+std::atomic<TraceWriter*> TraceWriter::s_Active(nullptr);
+
+TraceWriter::TraceWriter(const std::string& path)
+: m_Path(path)
+, m_Fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+, m_Start(std::chrono::steady_clock::now())
+, m_NextClient(0)
+, m_Records(0)
+, m_Stop(false)
+{
+    if (!m_Fd.isValid())
+    {
+        throw std::runtime_error(stringops::format("Failed to create trace file %s: %s", path, strerror(errno)));
+    }
+
+    appendTraceHeader(m_Buffer);
+    m_Thread = std::thread(&TraceWriter::run, this);
+    s_Active = this;
+
+    LOG_INFO("Recording protocol trace in %s", path);
+}
+
+TraceWriter::~TraceWriter()
+{
+    s_Active = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+        m_Condition.notify_all();
+    }
+
+    m_Thread.join();
+    LOG_INFO("Protocol trace %s: %d records", m_Path, m_Records);
+}
+
+uint32_t TraceWriter::addClient()
+{
+    return m_NextClient++;
+}
+
+void TraceWriter::record(std::chrono::steady_clock::time_point start, TraceRecord& record)
+{
+    record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(start - m_Start).count();
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    appendTraceRecord(m_Buffer, record);
+    ++m_Records;
+
+    if (m_Buffer.size() >= s_FlushSize)
+    {
+        m_Condition.notify_all();
+    }
+}
+
+void TraceWriter::flushActive()
+{
+    auto* writer = s_Active.load();
+    if (!writer)
+    {
+        return;
+    }
+
+    // same order as the writer thread
+    std::lock_guard<std::mutex> lock(writer->m_Mutex);
+    std::lock_guard<std::mutex> writeLock(writer->m_WriteMutex);
+    writer->writeBuffer(writer->m_Buffer);
+    writer->m_Buffer.clear();
+}
+
+void TraceWriter::run()
+{
+    std::vector<uint8_t> buffer;
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;)
+    {
+        m_Condition.wait_for(lock, s_FlushInterval, [this] () { return m_Stop || m_Buffer.size() >= s_FlushSize; });
+
+        auto stop = m_Stop;
+        buffer.swap(m_Buffer);
+
+        // the clients keep recording while the data is written
+        std::unique_lock<std::mutex> writeLock(m_WriteMutex);
+        lock.unlock();
+        writeBuffer(buffer);
+        writeLock.unlock();
+
+        buffer.clear();
+        lock.lock();
+
+        if (stop)
+        {
+            return;
+        }
+    }
+}
+
+void TraceWriter::writeBuffer(const std::vector<uint8_t>& buffer)
+{
+    size_t written = 0;
+    while (written < buffer.size() && m_Fd.isValid())
+    {
+        auto result = ::write(m_Fd.get(), buffer.data() + written, buffer.size() - written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            LOG_ERROR("Failed to write trace %s, recording stopped: %s", m_Path, strerror(errno));
+            m_Fd.close();
+            return;
+        }
+
+        written += result;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cinttypes>
+#include <condition_variable>
+
+#include "filedescriptor.h"
+#include "traceformat.h"
+
+// Records the commands of all clients in a trace file
+// Records are encoded in memory by the client threads, a background thread appends
+// them to the file once a second or when enough data is buffered.
+class TraceWriter
+{
+public:
+    // Throws if the trace file can not be created
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    uint32_t addClient();
+
+    void record(std::chrono::steady_clock::time_point start, TraceRecord& record);
+
+    // Writes the buffered records of the active trace, called when the process is terminated
+    static void flushActive();
+
+private:
+    void run();
+    void writeBuffer(const std::vector<uint8_t>& buffer);
+
+    static const size_t s_FlushSize;
+    static const std::chrono::seconds s_FlushInterval;
+    static std::atomic<TraceWriter*> s_Active;
+
+    std::string                             m_Path;
+    FileDescriptor                          m_Fd;
+    std::chrono::steady_clock::time_point   m_Start;
+    std::atomic<uint32_t>                   m_NextClient;
+
+    std::mutex                              m_Mutex;
+    std::mutex                              m_WriteMutex;
+    std::condition_variable                 m_Condition;
+    std::vector<uint8_t>                    m_Buffer;
+    uint64_t                                m_Records;
+    bool                                    m_Stop;
+    std::thread                             m_Thread;
+};
+
+#endif
@@ -0,0 +1,382 @@
+#include "transport.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "utils/stringops.h"
+
+#include "storage.h"
+#include "zerocopy.h"
+
+using namespace utils;
+using namespace std::chrono;
+
+namespace
+{
+
+// Writes up to this size are staged, a larger write is sent right away behind the staged data
+constexpr size_t StagingSize = 16 * 1024;
+
+#ifdef MSG_MORE
+constexpr int32_t MoreData = MSG_MORE;
+#else
+constexpr int32_t MoreData = 0;
+#endif
+
+}
+
+SocketTransport::SocketTransport(Socket&& socket)
+: m_Socket(std::move(socket))
+, m_IdleTimeout(0)
+, m_CommandTimeout(0)
+, m_CommandActive(false)
+, m_Corked(false)
+{
+    m_Socket.setNoDelayOption();
+}
+
+void SocketTransport::setTimeouts(uint32_t idleTimeout, uint32_t commandTimeout)
+{
+    m_IdleTimeout = seconds(idleTimeout);
+    m_CommandTimeout = seconds(commandTimeout);
+
+    // reads wake up after the shortest timeout to check which one applies
+    struct timeval timeout;
+    timeout.tv_usec = 0;
+
+    timeout.tv_sec = idleTimeout == 0 || commandTimeout == 0 ? std::max(idleTimeout, commandTimeout) : std::min(idleTimeout, commandTimeout);
+    setsockopt(m_Socket.getFd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    timeout.tv_sec = commandTimeout;
+    setsockopt(m_Socket.getFd(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+std::string SocketTransport::getAddress() const
+{
+    return m_Socket.getAddress();
+}
+
+// The socket is read and written directly so an expired timeout can be told apart from errors
+// Only waiting for the first byte of a command is idle, once it arrived the command is in
+// progress until its reply is flushed, the reads of its payload use the command timeout
+size_t SocketTransport::read(void* data, size_t size)
+{
+    auto* pData = reinterpret_cast<uint8_t*>(data);
+    auto lastProgress = steady_clock::now();
+
+    size_t bytesRead = 0;
+    while (bytesRead < size)
+    {
+        ssize_t result = ::recv(m_Socket.getFd(), pData + bytesRead, size - bytesRead, 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            bool idle = !m_CommandActive && bytesRead == 0;
+            auto timeout = idle ? m_IdleTimeout : m_CommandTimeout;
+            if (timeout.count() > 0 && steady_clock::now() - lastProgress >= timeout)
+            {
+                throw ConnectionTimeout(idle);
+            }
+
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            break;
+        }
+
+        bytesRead += result;
+        lastProgress = steady_clock::now();
+        m_CommandActive = true;
+    }
+
+    return bytesRead;
+}
+
+std::string SocketTransport::readString(size_t size)
+{
+    std::string result(size, '\0');
+    if (read(&result[0], size) != size)
+    {
+        throw std::runtime_error("Failed to read string from socket");
+    }
+
+    return result;
+}
+
+void SocketTransport::write(const void* data, size_t size)
+{
+    auto* pData = reinterpret_cast<const uint8_t*>(data);
+    if (m_Staged.size() + size <= StagingSize)
+    {
+        m_Staged.insert(m_Staged.end(), pData, pData + size);
+        return;
+    }
+
+    // the staged data is gathered in front of the data instead of copying the data
+    iovec parts[2];
+    parts[0].iov_base = m_Staged.data();
+    parts[0].iov_len = m_Staged.size();
+    parts[1].iov_base = const_cast<uint8_t*>(pData);
+    parts[1].iov_len = size;
+
+    auto* pFirst = m_Staged.empty() ? &parts[1] : &parts[0];
+    send(pFirst, static_cast<size_t>(&parts[2] - pFirst), 0);
+    m_Staged.clear();
+    m_Corked = false;
+}
+
+// The staged reply header is held back by the kernel until the file data follows it
+bool SocketTransport::sendFile(int32_t fd, uint64_t offset, uint64_t count)
+{
+    sendStaged(MoreData);
+    if (!zerocopy::sendFile(m_Socket.getFd(), fd, offset, count))
+    {
+        return false;
+    }
+
+    m_Corked = m_Corked && count == 0;
+    return true;
+}
+
+bool SocketTransport::sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count)
+{
+    sendStaged(MoreData);
+    if (!storage.readAndSend(fd, offset, static_cast<size_t>(count), m_Socket.getFd()))
+    {
+        return false;
+    }
+
+    m_Corked = m_Corked && count == 0;
+    return true;
+}
+
+void SocketTransport::flush()
+{
+    m_CommandActive = false;
+
+    if (!m_Staged.empty())
+    {
+        sendStaged(0);
+    }
+    else if (m_Corked)
+    {
+        // nothing was sent behind the held back data, setting the option again pushes it out
+        m_Socket.setNoDelayOption();
+        m_Corked = false;
+    }
+}
+
+void SocketTransport::sendStaged(int32_t flags)
+{
+    if (m_Staged.empty())
+    {
+        return;
+    }
+
+    iovec part;
+    part.iov_base = m_Staged.data();
+    part.iov_len = m_Staged.size();
+
+    send(&part, 1, flags);
+    m_Staged.clear();
+    m_Corked = (flags & MoreData) != 0;
+}
+
+void SocketTransport::send(iovec* parts, size_t count, int32_t flags)
+{
+    while (count > 0)
+    {
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = parts;
+        message.msg_iovlen = count;
+
+        ssize_t result = ::sendmsg(m_Socket.getFd(), &message, flags);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            throw ConnectionTimeout(false);
+        }
+
+        if (result < 0)
+        {
+            throw std::runtime_error(stringops::format("Failed to write to socket: %s", strerror(errno)));
+        }
+
+        // skip the parts that were sent completely
+        auto sent = static_cast<size_t>(result);
+        while (count > 0 && sent >= parts->iov_len)
+        {
+            sent -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+
+        if (count > 0)
+        {
+            parts->iov_base = reinterpret_cast<uint8_t*>(parts->iov_base) + sent;
+            parts->iov_len -= sent;
+        }
+    }
+}
+
+void SocketTransport::close()
+{
+    m_Socket.close();
+}
+
+MemoryTransport::MemoryTransport()
+: m_Input(nullptr)
+, m_InputSize(0)
+, m_InputPosition(0)
+{
+}
+
+void MemoryTransport::setInput(const void* data, size_t size)
+{
+    m_Input = reinterpret_cast<const uint8_t*>(data);
+    m_InputSize = size;
+    m_InputPosition = 0;
+}
+
+const std::vector<uint8_t>& MemoryTransport::getOutput() const
+{
+    return m_Output;
+}
+
+void MemoryTransport::clearOutput()
+{
+    m_Output.clear();
+}
+
+std::string MemoryTransport::getAddress() const
+{
+    return "memory";
+}
+
+size_t MemoryTransport::read(void* data, size_t size)
+{
+    size = std::min(size, m_InputSize - m_InputPosition);
+    memcpy(data, m_Input + m_InputPosition, size);
+    m_InputPosition += size;
+    return size;
+}
+
+std::string MemoryTransport::readString(size_t size)
+{
+    if (m_InputSize - m_InputPosition < size)
+    {
+        throw std::logic_error("Command payload is shorter than requested string");
+    }
+
+    std::string result(reinterpret_cast<const char*>(m_Input + m_InputPosition), size);
+    m_InputPosition += size;
+    return result;
+}
+
+void MemoryTransport::write(const void* data, size_t size)
+{
+    auto* pData = reinterpret_cast<const uint8_t*>(data);
+    m_Output.insert(m_Output.end(), pData, pData + size);
+}
+
+bool MemoryTransport::sendFile(int32_t, uint64_t, uint64_t)
+{
+    return false;
+}
+
+bool MemoryTransport::sendStorageData(StorageBackend&, int32_t, uint64_t, uint64_t)
+{
+    return false;
+}
+
+void MemoryTransport::flush()
+{
+}
+
+void MemoryTransport::close()
+{
+}
+
+MeteredTransport::MeteredTransport(std::unique_ptr<Transport> transport, CommandMeter& meter)
+: m_Transport(std::move(transport))
+, m_Meter(meter)
+{
+}
+
+std::string MeteredTransport::getAddress() const
+{
+    return m_Transport->getAddress();
+}
+
+size_t MeteredTransport::read(void* data, size_t size)
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    auto bytesRead = m_Transport->read(data, size);
+    m_Meter.addBytesReceived(bytesRead);
+    return bytesRead;
+}
+
+std::string MeteredTransport::readString(size_t size)
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    auto result = m_Transport->readString(size);
+    m_Meter.addBytesReceived(result.size());
+    return result;
+}
+
+void MeteredTransport::write(const void* data, size_t size)
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    m_Transport->write(data, size);
+    m_Meter.addBytesSent(size);
+}
+
+// Zero-copy transfers read the file while sending, the time counts as socket time
+bool MeteredTransport::sendFile(int32_t fd, uint64_t offset, uint64_t count)
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    if (!m_Transport->sendFile(fd, offset, count))
+    {
+        return false;
+    }
+
+    m_Meter.addBytesSent(count);
+    return true;
+}
+
+bool MeteredTransport::sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count)
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    if (!m_Transport->sendStorageData(storage, fd, offset, count))
+    {
+        return false;
+    }
+
+    m_Meter.addBytesSent(count);
+    return true;
+}
+
+void MeteredTransport::flush()
+{
+    PhaseScope scope(m_Meter, Phase::Socket);
+    m_Transport->flush();
+}
+
+void MeteredTransport::close()
+{
+    m_Transport->close();
+}
@@ -0,0 +1,155 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <stdexcept>
+#include <sys/uio.h>
+
+#include "utils/socket.h"
+
+#include "metrics.h"
+
+class StorageBackend;
+
+// Thrown when a connection made no progress within its timeout, idle connections were
+// waiting for the next command
+class ConnectionTimeout : public std::runtime_error
+{
+public:
+    explicit ConnectionTimeout(bool idle)
+    : std::runtime_error(idle ? "Connection idle for too long" : "Command made no progress for too long")
+    , m_Idle(idle)
+    {
+    }
+
+    bool isIdle() const
+    {
+        return m_Idle;
+    }
+
+private:
+    bool    m_Idle;
+};
+
+// Connection to a ps3 as seen by the command handlers
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    virtual std::string getAddress() const = 0;
+
+    virtual size_t read(void* data, size_t size) = 0;
+    virtual std::string readString(size_t size) = 0;
+    virtual void write(const void* data, size_t size) = 0;
+
+    // Sends file data without copying it through user space
+    // returns false if zero-copy is not available, nothing has been sent in that case
+    virtual bool sendFile(int32_t fd, uint64_t offset, uint64_t count) = 0;
+
+    // Lets the storage backend read and send file data as a single request
+    // returns false if the transport or the backend does not support this, nothing has been sent in that case
+    virtual bool sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count) = 0;
+
+    // Transports may hold back written data to send a reply in as few packets as possible,
+    // called when the reply of a command is complete
+    virtual void flush() = 0;
+
+    virtual void close() = 0;
+};
+
+// Blocking transport used by the thread per client engine
+// Small writes are staged and sent together with the next large write or at the end of the
+// command, so a reply header and the data behind it leave in one system call and packet
+class SocketTransport : public Transport
+{
+public:
+    explicit SocketTransport(utils::Socket&& socket);
+
+    // Waiting for a command fails after the idle timeout, receiving the rest of a command or
+    // sending a reply fails when it makes no progress for the command timeout (seconds, 0 disables)
+    void setTimeouts(uint32_t idleTimeout, uint32_t commandTimeout);
+
+    std::string getAddress() const override;
+
+    size_t read(void* data, size_t size) override;
+    std::string readString(size_t size) override;
+    void write(const void* data, size_t size) override;
+    bool sendFile(int32_t fd, uint64_t offset, uint64_t count) override;
+    bool sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count) override;
+    void flush() override;
+
+    void close() override;
+
+private:
+    void send(iovec* parts, size_t count, int32_t flags);
+    void sendStaged(int32_t flags);
+
+    utils::Socket               m_Socket;
+    std::chrono::seconds        m_IdleTimeout;
+    std::chrono::seconds        m_CommandTimeout;
+    std::vector<uint8_t>        m_Staged;
+    bool                        m_CommandActive;
+    bool                        m_Corked;
+};
+
+// Transport without a connection: commands read their payload from a buffer and the replies
+// are collected in memory, used to run the command handlers without a network
+class MemoryTransport : public Transport
+{
+public:
+    MemoryTransport();
+
+    // The data has to stay valid until the next call
+    void setInput(const void* data, size_t size);
+
+    const std::vector<uint8_t>& getOutput() const;
+
+    // Keeps the capacity of the output buffer
+    void clearOutput();
+
+    std::string getAddress() const override;
+
+    size_t read(void* data, size_t size) override;
+    std::string readString(size_t size) override;
+    void write(const void* data, size_t size) override;
+    bool sendFile(int32_t fd, uint64_t offset, uint64_t count) override;
+    bool sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count) override;
+    void flush() override;
+
+    void close() override;
+
+private:
+    const uint8_t*              m_Input;
+    size_t                      m_InputSize;
+    size_t                      m_InputPosition;
+    std::vector<uint8_t>        m_Output;
+};
+
+// Adds the socket time and the transferred bytes of a client to the meter of its current command
+class MeteredTransport : public Transport
+{
+public:
+    MeteredTransport(std::unique_ptr<Transport> transport, CommandMeter& meter);
+
+    std::string getAddress() const override;
+
+    size_t read(void* data, size_t size) override;
+    std::string readString(size_t size) override;
+    void write(const void* data, size_t size) override;
+    bool sendFile(int32_t fd, uint64_t offset, uint64_t count) override;
+    bool sendStorageData(StorageBackend& storage, int32_t fd, uint64_t offset, uint64_t count) override;
+    void flush() override;
+
+    void close() override;
+
+private:
+    std::unique_ptr<Transport>  m_Transport;
+    CommandMeter&               m_Meter;
+};
+
+#endif
@@ -0,0 +1,847 @@
+#include "virtualiso.h"
+
+#include <ctime>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "utils/stringops.h"
+
+#include "asynclog.h"
+
+using namespace utils;
+
+const std::chrono::milliseconds VirtualIsoCache::s_RevalidateInterval(5000);
+const size_t VirtualIsoCache::s_MaxCachedImages = 32;
+
+static const uint32_t s_SectorSize = 2048;
+static const uint32_t s_FirstDescriptorSector = 16;
+static const uint32_t s_MaxNameLength = 200;
+// largest extent that is a multiple of the sector size, bigger files are stored in multiple extents
+static const uint64_t s_MaxExtentSize = 0xFFFFF800;
+
+static const uint8_t s_DirectoryFlag = 0x02;
+static const uint8_t s_MultiExtentFlag = 0x80;
+
+static const char s_Ps3Prefix[] = "/***PS3***";
+static const char s_DvdPrefix[] = "/***DVD***";
+static const char s_Magic[8] = { 'P', 'S', '3', 'V', 'I', 'S', 'O', '1' };
+
+namespace
+{
+
+struct IsoNode
+{
+    std::string         name;
+    std::string         path;
+    bool                isDirectory = false;
+    uint64_t            size = 0;
+    uint64_t            modifyTime = 0;
+    size_t              parent = 0;
+    std::vector<size_t> children;
+    uint32_t            sector = 0;
+    uint32_t            sectors = 0;
+    uint16_t            number = 0;
+};
+
+}
+
+bool parseVirtualIsoPath(const std::string& path, std::string& directory, VirtualIsoType& type)
+{
+    auto prefixLength = sizeof(s_Ps3Prefix) - 1;
+    if (path.size() <= prefixLength + 1 || path[prefixLength] != '/')
+    {
+        return false;
+    }
+
+    if (path.compare(0, prefixLength, s_Ps3Prefix) == 0)
+    {
+        type = VirtualIsoType::Ps3;
+    }
+    else if (path.compare(0, prefixLength, s_DvdPrefix) == 0)
+    {
+        type = VirtualIsoType::Dvd;
+    }
+    else
+    {
+        return false;
+    }
+
+    directory = path.substr(prefixLength);
+    return true;
+}
+
+static uint64_t roundToSectors(uint64_t size)
+{
+    return (size + s_SectorSize - 1) / s_SectorSize;
+}
+
+static void writeLittleEndian32(uint8_t* data, uint32_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = (value >> 24) & 0xFF;
+}
+
+static void writeBigEndian32(uint8_t* data, uint32_t value)
+{
+    data[0] = (value >> 24) & 0xFF;
+    data[1] = (value >> 16) & 0xFF;
+    data[2] = (value >> 8) & 0xFF;
+    data[3] = value & 0xFF;
+}
+
+static void writeLittleEndian16(uint8_t* data, uint16_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+}
+
+static void writeBigEndian16(uint8_t* data, uint16_t value)
+{
+    data[0] = (value >> 8) & 0xFF;
+    data[1] = value & 0xFF;
+}
+
+// ISO 9660 stores most numbers in both byte orders
+static void writeBothEndian32(uint8_t* data, uint32_t value)
+{
+    writeLittleEndian32(data, value);
+    writeBigEndian32(data + 4, value);
+}
+
+static void writeBothEndian16(uint8_t* data, uint16_t value)
+{
+    writeLittleEndian16(data, value);
+    writeBigEndian16(data + 2, value);
+}
+
+static void writePadded(uint8_t* data, size_t size, const std::string& value)
+{
+    memset(data, ' ', size);
+    memcpy(data, value.data(), std::min(size, value.size()));
+}
+
+static void writeRecordingDate(uint8_t* data, uint64_t time)
+{
+    time_t value = static_cast<time_t>(time);
+    struct tm date;
+    gmtime_r(&value, &date);
+
+    data[0] = date.tm_year;
+    data[1] = date.tm_mon + 1;
+    data[2] = date.tm_mday;
+    data[3] = date.tm_hour;
+    data[4] = date.tm_min;
+    data[5] = date.tm_sec;
+    data[6] = 0;
+}
+
+static void writeVolumeDate(uint8_t* data, uint64_t time)
+{
+    time_t value = static_cast<time_t>(time);
+    struct tm date;
+    gmtime_r(&value, &date);
+
+    char text[17];
+    memset(text, '0', sizeof(text));
+    strftime(text, sizeof(text), "%Y%m%d%H%M%S00", &date);
+    memcpy(data, text, 16);
+    data[16] = 0;
+}
+
+static uint32_t getRecordLength(size_t nameLength)
+{
+    // records start at even positions
+    return static_cast<uint32_t>(33 + nameLength + (nameLength % 2 == 0 ? 1 : 0));
+}
+
+static void writeDirectoryRecord(uint8_t* data, const std::string& name, uint32_t sector, uint32_t size, uint64_t modifyTime, uint8_t flags)
+{
+    data[0] = getRecordLength(name.size());
+    writeBothEndian32(data + 2, sector);
+    writeBothEndian32(data + 10, size);
+    writeRecordingDate(data + 18, modifyTime);
+    data[25] = flags;
+    writeBothEndian16(data + 28, 1);
+    data[32] = name.size();
+    memcpy(data + 33, name.data(), name.size());
+}
+
+static uint32_t getExtentCount(const IsoNode& node)
+{
+    return node.isDirectory || node.size == 0 ? 1 : static_cast<uint32_t>((node.size + s_MaxExtentSize - 1) / s_MaxExtentSize);
+}
+
+// Lays out the records of a directory, records do not cross sector boundaries
+// Returns the size of the directory, the records are only written when data is not nullptr
+static uint32_t encodeDirectory(const std::vector<IsoNode>& nodes, size_t index, uint8_t* data)
+{
+    uint32_t position = 0;
+    auto place = [&position] (uint32_t length) {
+        if (position % s_SectorSize + length > s_SectorSize)
+        {
+            position = static_cast<uint32_t>(roundToSectors(position) * s_SectorSize);
+        }
+
+        auto result = position;
+        position += length;
+        return result;
+    };
+
+    auto& directory = nodes[index];
+    auto& parent = nodes[directory.parent];
+
+    auto self = place(getRecordLength(1));
+    auto up = place(getRecordLength(1));
+    if (data)
+    {
+        writeDirectoryRecord(data + self, std::string(1, '\0'), directory.sector, directory.sectors * s_SectorSize, directory.modifyTime, s_DirectoryFlag);
+        writeDirectoryRecord(data + up, std::string(1, '\1'), parent.sector, parent.sectors * s_SectorSize, parent.modifyTime, s_DirectoryFlag);
+    }
+
+    for (auto child : directory.children)
+    {
+        auto& node = nodes[child];
+        auto name = node.isDirectory ? node.name : node.name + ";1";
+        auto extents = getExtentCount(node);
+
+        for (uint32_t extent = 0; extent < extents; ++extent)
+        {
+            auto recordPosition = place(getRecordLength(name.size()));
+            if (!data)
+            {
+                continue;
+            }
+
+            if (node.isDirectory)
+            {
+                writeDirectoryRecord(data + recordPosition, name, node.sector, node.sectors * s_SectorSize, node.modifyTime, s_DirectoryFlag);
+            }
+            else
+            {
+                auto extentOffset = extent * s_MaxExtentSize;
+                auto extentSize = static_cast<uint32_t>(std::min(s_MaxExtentSize, node.size - extentOffset));
+                auto sector = node.sector + static_cast<uint32_t>(extentOffset / s_SectorSize);
+                writeDirectoryRecord(data + recordPosition, name, sector, extentSize, node.modifyTime, extent + 1 < extents ? s_MultiExtentFlag : 0);
+            }
+        }
+    }
+
+    return position;
+}
+
+// Links to directories are not followed to avoid cycles
+static bool getEntryInfo(const std::string& path, struct stat& info, bool& isDirectory)
+{
+    if (::lstat(path.c_str(), &info) != 0)
+    {
+        return false;
+    }
+
+    isDirectory = S_ISDIR(info.st_mode);
+    if (S_ISLNK(info.st_mode) && (::stat(path.c_str(), &info) != 0 || S_ISDIR(info.st_mode)))
+    {
+        return false;
+    }
+
+    return isDirectory || S_ISREG(info.st_mode);
+}
+
+static void scanDirectory(std::vector<IsoNode>& nodes, size_t index)
+{
+    auto path = nodes[index].path;
+
+    DIR* handle = opendir(path.c_str());
+    if (!handle)
+    {
+        throw std::runtime_error(stringops::format("Failed to read directory %s: %s", path, strerror(errno)));
+    }
+
+    std::vector<IsoNode> children;
+    while (auto* entry = readdir(handle))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        IsoNode node;
+        node.name = entry->d_name;
+        node.path = path + '/' + node.name;
+        node.parent = index;
+
+        struct stat info;
+        if (!getEntryInfo(node.path, info, node.isDirectory))
+        {
+            continue;
+        }
+
+        if (node.name.size() > s_MaxNameLength)
+        {
+            LOG_ERROR("Leaving %s out of the image, the name is too long", node.path);
+            continue;
+        }
+
+        node.size = node.isDirectory ? 0 : info.st_size;
+        node.modifyTime = info.st_mtime;
+        children.push_back(std::move(node));
+    }
+
+    closedir(handle);
+
+    // directory records are sorted by name
+    std::sort(children.begin(), children.end(), [] (const IsoNode& lhs, const IsoNode& rhs) {
+        return lhs.name < rhs.name;
+    });
+
+    for (auto& child : children)
+    {
+        nodes[index].children.push_back(nodes.size());
+        nodes.push_back(std::move(child));
+    }
+
+    auto childIndices = nodes[index].children;
+    for (auto child : childIndices)
+    {
+        if (nodes[child].isDirectory)
+        {
+            scanDirectory(nodes, child);
+        }
+    }
+}
+
+// Returns the title id from PS3_GAME/PARAM.SFO formatted like on a disc (ABCD-12345), empty if there is none
+static std::string readTitleId(const std::string& directory)
+{
+    std::ifstream file((directory + "/PS3_GAME/PARAM.SFO").c_str(), std::ios::binary);
+    std::vector<char> sfo((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    auto readLittleEndian32 = [&sfo] (size_t offset) -> uint32_t {
+        auto* data = reinterpret_cast<const uint8_t*>(sfo.data()) + offset;
+        return data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+    };
+
+    if (sfo.size() < 20 || memcmp(sfo.data(), "\0PSF", 4) != 0)
+    {
+        return std::string();
+    }
+
+    auto keyTable = readLittleEndian32(8);
+    auto dataTable = readLittleEndian32(12);
+    auto entries = readLittleEndian32(16);
+
+    for (uint32_t i = 0; i < entries && 20 + (i + 1) * 16 <= sfo.size(); ++i)
+    {
+        auto entry = 20 + i * 16;
+        auto keyOffset = keyTable + (readLittleEndian32(entry) & 0xFFFF);
+        auto dataOffset = dataTable + readLittleEndian32(entry + 12);
+
+        if (keyOffset + 9 <= sfo.size() && memcmp(sfo.data() + keyOffset, "TITLE_ID", 9) == 0 && dataOffset + 9 <= sfo.size())
+        {
+            std::string id(sfo.data() + dataOffset, 9);
+            return id.substr(0, 4) + '-' + id.substr(4);
+        }
+    }
+
+    return std::string();
+}
+
+static std::string getVolumeId(const std::string& directory)
+{
+    std::string id;
+    for (auto c : directory.substr(directory.rfind('/') + 1))
+    {
+        id += isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(toupper(static_cast<unsigned char>(c))) : '_';
+    }
+
+    return id.substr(0, 32);
+}
+
+template <typename T>
+static void writeValue(std::string& data, T value)
+{
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void writeString(std::string& data, const std::string& value)
+{
+    writeValue<uint16_t>(data, value.size());
+    data.append(value);
+}
+
+template <typename T>
+static bool readValue(std::istream& stream, T& value)
+{
+    return static_cast<bool>(stream.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static bool readString(std::istream& stream, std::string& value)
+{
+    uint16_t size;
+    if (!readValue(stream, size))
+    {
+        return false;
+    }
+
+    value.resize(size);
+    return size == 0 || stream.read(&value[0], size);
+}
+
+VirtualIso::VirtualIso()
+: m_Type(VirtualIsoType::Dvd)
+, m_Size(0)
+{
+}
+
+VirtualIso::VirtualIso(const std::string& directory, VirtualIsoType type)
+: m_Directory(directory)
+, m_Type(type)
+, m_Size(0)
+{
+    struct stat info;
+    if (::stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+    {
+        throw std::runtime_error(stringops::format("%s is not a directory", directory));
+    }
+
+    std::vector<IsoNode> nodes(1);
+    nodes[0].path = directory;
+    nodes[0].isDirectory = true;
+    nodes[0].modifyTime = info.st_mtime;
+    scanDirectory(nodes, 0);
+
+    // path table order: by level, then by parent and name
+    std::vector<size_t> directories(1, 0);
+    for (size_t i = 0; i < directories.size(); ++i)
+    {
+        for (auto child : nodes[directories[i]].children)
+        {
+            if (nodes[child].isDirectory)
+            {
+                directories.push_back(child);
+            }
+        }
+    }
+
+    if (directories.size() > 0xFFFF)
+    {
+        throw std::runtime_error(stringops::format("%s has too many directories for an image", directory));
+    }
+
+    uint32_t pathTableSize = 0;
+    for (size_t i = 0; i < directories.size(); ++i)
+    {
+        auto& node = nodes[directories[i]];
+        node.number = static_cast<uint16_t>(i + 1);
+
+        auto nameLength = i == 0 ? 1 : node.name.size();
+        pathTableSize += 8 + nameLength + (nameLength % 2);
+    }
+
+    // system area, volume descriptor, terminator, both path tables and the directories
+    uint64_t sector = s_FirstDescriptorSector + 2;
+    auto littleEndianPathTable = sector;
+    sector += roundToSectors(pathTableSize);
+    auto bigEndianPathTable = sector;
+    sector += roundToSectors(pathTableSize);
+
+    for (auto index : directories)
+    {
+        nodes[index].sector = static_cast<uint32_t>(sector);
+        nodes[index].sectors = static_cast<uint32_t>(roundToSectors(encodeDirectory(nodes, index, nullptr)));
+        sector += nodes[index].sectors;
+    }
+
+    auto headerSectors = sector;
+    for (auto index : directories)
+    {
+        for (auto child : nodes[index].children)
+        {
+            auto& node = nodes[child];
+            if (node.isDirectory)
+            {
+                continue;
+            }
+
+            node.sector = static_cast<uint32_t>(sector);
+            sector += roundToSectors(node.size);
+
+            VirtualIsoFile file;
+            file.path           = node.path;
+            file.size           = node.size;
+            file.modifyTime     = node.modifyTime;
+            file.imageOffset    = uint64_t(node.sector) * s_SectorSize;
+            m_Files.push_back(file);
+        }
+
+        Directory entry;
+        entry.path = nodes[index].path;
+        entry.modifyTime = nodes[index].modifyTime;
+        m_Directories.push_back(entry);
+    }
+
+    if (sector > UINT32_MAX)
+    {
+        throw std::runtime_error(stringops::format("%s is too large for an image", directory));
+    }
+
+    m_Size = sector * s_SectorSize;
+    m_Header.resize(headerSectors * s_SectorSize);
+    auto* header = m_Header.data();
+
+    if (type == VirtualIsoType::Ps3)
+    {
+        // the disc starts with the list of unencrypted regions, the whole image is one region
+        writeBigEndian32(header, 1);
+        writeBigEndian32(header + 12, static_cast<uint32_t>(sector - 1));
+
+        memcpy(header + s_SectorSize, "PlayStation3", 12);
+        writePadded(header + s_SectorSize + 0x10, 0x20, readTitleId(directory));
+    }
+
+    auto& root = nodes[0];
+    auto* descriptor = header + s_FirstDescriptorSector * s_SectorSize;
+    descriptor[0] = 1;
+    memcpy(descriptor + 1, "CD001", 5);
+    descriptor[6] = 1;
+    writePadded(descriptor + 8, 32, type == VirtualIsoType::Ps3 ? "PS3VOLUME" : "");
+    writePadded(descriptor + 40, 32, type == VirtualIsoType::Ps3 ? "PS3VOLUME" : getVolumeId(directory));
+    writeBothEndian32(descriptor + 80, static_cast<uint32_t>(sector));
+    writeBothEndian16(descriptor + 120, 1);
+    writeBothEndian16(descriptor + 124, 1);
+    writeBothEndian16(descriptor + 128, s_SectorSize);
+    writeBothEndian32(descriptor + 132, pathTableSize);
+    writeLittleEndian32(descriptor + 140, static_cast<uint32_t>(littleEndianPathTable));
+    writeBigEndian32(descriptor + 148, static_cast<uint32_t>(bigEndianPathTable));
+    writeDirectoryRecord(descriptor + 156, std::string(1, '\0'), root.sector, root.sectors * s_SectorSize, root.modifyTime, s_DirectoryFlag);
+    writePadded(descriptor + 190, 623, "");
+    writeVolumeDate(descriptor + 813, root.modifyTime);
+    writeVolumeDate(descriptor + 830, root.modifyTime);
+    memset(descriptor + 847, '0', 16);
+    memset(descriptor + 864, '0', 16);
+    descriptor[881] = 1;
+
+    auto* terminator = descriptor + s_SectorSize;
+    terminator[0] = 0xFF;
+    memcpy(terminator + 1, "CD001", 5);
+    terminator[6] = 1;
+
+    auto* littleEndianEntry = header + littleEndianPathTable * s_SectorSize;
+    auto* bigEndianEntry = header + bigEndianPathTable * s_SectorSize;
+    for (size_t i = 0; i < directories.size(); ++i)
+    {
+        auto& node = nodes[directories[i]];
+        auto name = i == 0 ? std::string(1, '\0') : node.name;
+        auto entrySize = 8 + name.size() + (name.size() % 2);
+
+        for (auto* entry : { littleEndianEntry, bigEndianEntry })
+        {
+            entry[0] = name.size();
+            memcpy(entry + 8, name.data(), name.size());
+        }
+
+        writeLittleEndian32(littleEndianEntry + 2, node.sector);
+        writeLittleEndian16(littleEndianEntry + 6, nodes[node.parent].number);
+        writeBigEndian32(bigEndianEntry + 2, node.sector);
+        writeBigEndian16(bigEndianEntry + 6, nodes[node.parent].number);
+
+        littleEndianEntry += entrySize;
+        bigEndianEntry += entrySize;
+    }
+
+    for (auto index : directories)
+    {
+        encodeDirectory(nodes, index, header + uint64_t(nodes[index].sector) * s_SectorSize);
+    }
+}
+
+// Layout file (native byte order): magic, folder, type, image size, metadata, the directories
+// with their modification time and the files with their size, modification time and image offset
+std::unique_ptr<VirtualIso> VirtualIso::load(const std::string& layoutPath, const std::string& directory, VirtualIsoType type)
+{
+    std::ifstream file(layoutPath.c_str(), std::ios::binary);
+    if (!file.is_open())
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<VirtualIso> image(new VirtualIso());
+
+    char magic[sizeof(s_Magic)];
+    uint8_t storedType;
+    uint64_t headerSize;
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, s_Magic, sizeof(magic)) != 0
+     || !readString(file, image->m_Directory) || image->m_Directory != directory
+     || !readValue(file, storedType) || storedType != static_cast<uint8_t>(type)
+     || !readValue(file, image->m_Size) || !readValue(file, headerSize) || headerSize > image->m_Size)
+    {
+        return nullptr;
+    }
+
+    image->m_Type = type;
+    image->m_Header.resize(static_cast<size_t>(headerSize));
+
+    uint32_t directoryCount;
+    if (!file.read(reinterpret_cast<char*>(image->m_Header.data()), headerSize) || !readValue(file, directoryCount))
+    {
+        LOG_ERROR("Image layout %s is corrupt", layoutPath);
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < directoryCount; ++i)
+    {
+        Directory entry;
+        if (!readString(file, entry.path) || !readValue(file, entry.modifyTime))
+        {
+            LOG_ERROR("Image layout %s is corrupt", layoutPath);
+            return nullptr;
+        }
+
+        image->m_Directories.push_back(std::move(entry));
+    }
+
+    uint32_t fileCount;
+    if (!readValue(file, fileCount))
+    {
+        LOG_ERROR("Image layout %s is corrupt", layoutPath);
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < fileCount; ++i)
+    {
+        VirtualIsoFile entry;
+        if (!readString(file, entry.path) || !readValue(file, entry.size) || !readValue(file, entry.modifyTime) || !readValue(file, entry.imageOffset)
+         || entry.imageOffset < headerSize || entry.imageOffset + entry.size > image->m_Size
+         || (!image->m_Files.empty() && entry.imageOffset < image->m_Files.back().imageOffset))
+        {
+            LOG_ERROR("Image layout %s is corrupt", layoutPath);
+            return nullptr;
+        }
+
+        image->m_Files.push_back(std::move(entry));
+    }
+
+    return image;
+}
+
+void VirtualIso::save(const std::string& layoutPath) const
+{
+    std::string data;
+    data.append(s_Magic, sizeof(s_Magic));
+    writeString(data, m_Directory);
+    writeValue<uint8_t>(data, static_cast<uint8_t>(m_Type));
+    writeValue<uint64_t>(data, m_Size);
+    writeValue<uint64_t>(data, m_Header.size());
+    data.append(reinterpret_cast<const char*>(m_Header.data()), m_Header.size());
+
+    writeValue<uint32_t>(data, m_Directories.size());
+    for (auto& directory : m_Directories)
+    {
+        writeString(data, directory.path);
+        writeValue<uint64_t>(data, directory.modifyTime);
+    }
+
+    writeValue<uint32_t>(data, m_Files.size());
+    for (auto& file : m_Files)
+    {
+        writeString(data, file.path);
+        writeValue<uint64_t>(data, file.size);
+        writeValue<uint64_t>(data, file.modifyTime);
+        writeValue<uint64_t>(data, file.imageOffset);
+    }
+
+    // replace the layout atomically so a crash never leaves a partial layout
+    auto temporaryPath = layoutPath + ".tmp";
+    std::ofstream file(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    file.close();
+
+    if (!file || rename(temporaryPath.c_str(), layoutPath.c_str()) != 0)
+    {
+        LOG_ERROR("Failed to save image layout to %s", layoutPath);
+    }
+}
+
+// Entries that are added or removed change the modification time of their directory
+bool VirtualIso::isUpToDate() const
+{
+    struct stat info;
+    for (auto& directory : m_Directories)
+    {
+        if (::stat(directory.path.c_str(), &info) != 0 || uint64_t(info.st_mtime) != directory.modifyTime)
+        {
+            return false;
+        }
+    }
+
+    for (auto& file : m_Files)
+    {
+        if (::stat(file.path.c_str(), &info) != 0 || uint64_t(info.st_size) != file.size || uint64_t(info.st_mtime) != file.modifyTime)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint64_t VirtualIso::getSize() const
+{
+    return m_Size;
+}
+
+uint64_t VirtualIso::getModifyTime() const
+{
+    return m_Directories.empty() ? 0 : m_Directories.front().modifyTime;
+}
+
+size_t VirtualIso::getFileCount() const
+{
+    return m_Files.size();
+}
+
+void VirtualIso::forEachSegment(uint64_t offset, uint64_t size, const std::function<void(const VirtualIsoSegment&)>& visitor) const
+{
+    auto end = offset + std::min(size, offset < m_Size ? m_Size - offset : 0);
+
+    while (offset < end)
+    {
+        VirtualIsoSegment segment;
+
+        if (offset < m_Header.size())
+        {
+            segment.data = m_Header.data() + offset;
+            segment.size = std::min<uint64_t>(end, m_Header.size()) - offset;
+        }
+        else
+        {
+            // the last file that starts at or before the offset, empty files share their offset with the next file
+            auto iter = std::upper_bound(m_Files.begin(), m_Files.end(), offset, [] (uint64_t value, const VirtualIsoFile& file) {
+                return value < file.imageOffset;
+            });
+
+            auto* file = iter == m_Files.begin() ? nullptr : &*(iter - 1);
+            if (file && offset < file->imageOffset + file->size)
+            {
+                segment.file = file;
+                segment.fileOffset = offset - file->imageOffset;
+                segment.size = std::min(end, file->imageOffset + file->size) - offset;
+            }
+            else
+            {
+                // padding up to the next sector
+                segment.size = std::min(end, iter == m_Files.end() ? m_Size : iter->imageOffset) - offset;
+            }
+        }
+
+        visitor(segment);
+        offset += segment.size;
+    }
+}
+
+VirtualIsoCache::VirtualIsoCache(const std::string& layoutDirectory)
+: m_LayoutDirectory(layoutDirectory)
+{
+    if (!m_LayoutDirectory.empty() && ::mkdir(m_LayoutDirectory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw std::runtime_error(stringops::format("Failed to create image layout directory %s: %s", m_LayoutDirectory, strerror(errno)));
+    }
+}
+
+std::shared_ptr<VirtualIso> VirtualIsoCache::open(const std::string& directory, VirtualIsoType type)
+{
+    auto key = std::string(1, type == VirtualIsoType::Ps3 ? 'P' : 'D') + directory;
+    auto now = std::chrono::steady_clock::now();
+
+    std::shared_ptr<VirtualIso> image;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto iter = m_Entries.find(key);
+        if (iter != m_Entries.end())
+        {
+            if (now - iter->second.validated < s_RevalidateInterval)
+            {
+                return iter->second.image;
+            }
+
+            image = iter->second.image;
+        }
+    }
+
+    // checking and laying out a folder touches every file, the cache is not locked meanwhile
+    if (image && !image->isUpToDate())
+    {
+        LOG_INFO("Game folder %s changed, laying out the image again", directory);
+        image.reset();
+    }
+
+    auto layoutPath = getLayoutPath(directory, type);
+    if (!image && !layoutPath.empty())
+    {
+        image = VirtualIso::load(layoutPath, directory, type);
+        if (image && !image->isUpToDate())
+        {
+            image.reset();
+        }
+    }
+
+    if (!image)
+    {
+        try
+        {
+            image = std::make_shared<VirtualIso>(directory, type);
+            LOG_INFO("Laid out image of %s: %d files, %d MB", directory, image->getFileCount(), image->getSize() / (1024 * 1024));
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR(e.what());
+            return nullptr;
+        }
+
+        if (!layoutPath.empty())
+        {
+            image->save(layoutPath);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Entries[key] = Entry { image, now };
+
+    if (m_Entries.size() > s_MaxCachedImages)
+    {
+        auto oldest = std::min_element(m_Entries.begin(), m_Entries.end(), [] (const std::pair<const std::string, Entry>& lhs, const std::pair<const std::string, Entry>& rhs) {
+            return lhs.second.validated < rhs.second.validated;
+        });
+
+        m_Entries.erase(oldest);
+    }
+
+    return image;
+}
+
+// FNV-1a keeps the names of the layout files stable between builds
+std::string VirtualIsoCache::getLayoutPath(const std::string& directory, VirtualIsoType type) const
+{
+    if (m_LayoutDirectory.empty())
+    {
+        return std::string();
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto c : directory)
+    {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.%s", static_cast<unsigned long long>(hash), type == VirtualIsoType::Ps3 ? "ps3" : "dvd");
+    return m_LayoutDirectory + '/' + name;
+}
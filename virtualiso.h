@@ -0,0 +1,116 @@
+#ifndef VIRTUAL_ISO_H
+#define VIRTUAL_ISO_H
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <functional>
+#include <unordered_map>
+
+enum class VirtualIsoType
+{
+    Ps3,
+    Dvd
+};
+
+// Returns true if the path requests a game folder as an image (/***PS3***/path or /***DVD***/path),
+// directory receives the path of the game folder
+bool parseVirtualIsoPath(const std::string& path, std::string& directory, VirtualIsoType& type);
+
+struct VirtualIsoFile
+{
+    std::string path;
+    uint64_t    size = 0;
+    uint64_t    modifyTime = 0;
+    uint64_t    imageOffset = 0;
+};
+
+// Part of a read from the image, either image metadata, file data or zero padding
+struct VirtualIsoSegment
+{
+    const uint8_t*          data = nullptr;
+    const VirtualIsoFile*   file = nullptr;
+    uint64_t                fileOffset = 0;
+    uint64_t                size = 0;
+};
+
+// ISO 9660 image of a game folder, the image is not stored anywhere
+// The layout places the volume descriptors, path tables and directory records in front of
+// the file extents. Only the metadata is kept in memory, reads of file extents are mapped
+// to the files in the folder.
+class VirtualIso
+{
+public:
+    // Throws if the folder can not be read
+    VirtualIso(const std::string& directory, VirtualIsoType type);
+
+    VirtualIso(const VirtualIso&) = delete;
+    VirtualIso& operator=(const VirtualIso&) = delete;
+
+    // Returns nullptr if the layout file is missing or was created for another folder
+    static std::unique_ptr<VirtualIso> load(const std::string& layoutPath, const std::string& directory, VirtualIsoType type);
+    void save(const std::string& layoutPath) const;
+
+    // Checks the folder still matches the layout
+    bool isUpToDate() const;
+
+    uint64_t getSize() const;
+    uint64_t getModifyTime() const;
+    size_t getFileCount() const;
+
+    // Calls visitor for the consecutive segments of the range, the range is clipped to the image size
+    void forEachSegment(uint64_t offset, uint64_t size, const std::function<void(const VirtualIsoSegment&)>& visitor) const;
+
+private:
+    struct Directory
+    {
+        std::string path;
+        uint64_t    modifyTime = 0;
+    };
+
+    VirtualIso();
+
+    std::string             m_Directory;
+    VirtualIsoType          m_Type;
+    std::vector<uint8_t>    m_Header;
+    std::vector<VirtualIsoFile> m_Files;
+    std::vector<Directory>  m_Directories;
+    uint64_t                m_Size;
+};
+
+// Server wide cache of image layouts keyed by folder
+// Layouts are stored in the layout directory so a restart does not have to lay out the
+// folders again, cached layouts are checked against the folder before they are used.
+class VirtualIsoCache
+{
+public:
+    // An empty layout directory keeps the layouts in memory only
+    explicit VirtualIsoCache(const std::string& layoutDirectory);
+
+    VirtualIsoCache(const VirtualIsoCache&) = delete;
+    VirtualIsoCache& operator=(const VirtualIsoCache&) = delete;
+
+    // Returns nullptr if the folder can not be read
+    std::shared_ptr<VirtualIso> open(const std::string& directory, VirtualIsoType type);
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<VirtualIso>             image;
+        std::chrono::steady_clock::time_point   validated;
+    };
+
+    std::string getLayoutPath(const std::string& directory, VirtualIsoType type) const;
+
+    static const std::chrono::milliseconds s_RevalidateInterval;
+    static const size_t s_MaxCachedImages;
+
+    std::string                                 m_LayoutDirectory;
+    std::mutex                                  m_Mutex;
+    std::unordered_map<std::string, Entry>      m_Entries;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef WIRE_CODEC_H
+#define WIRE_CODEC_H
+
+#include <vector>
+#include <cstring>
+#include <cinttypes>
+#include <type_traits>
+
+// Messages are plain structs in host byte order that describe their wire layout once:
+//
+//     struct Reply
+//     {
+//         int64_t  size = 0;
+//         uint8_t  isDirectory = 0;
+//
+//         typedef wire::Layout<WIRE_FIELD(Reply, size), WIRE_FIELD(Reply, isDirectory)> Layout;
+//     };
+//
+// The fields are encoded in the order of the layout without padding, integers are big endian
+// and char arrays are copied as they are. The layout is resolved at compile time, encoding a
+// message is a sequence of byte swapping stores.
+namespace wire
+{
+
+inline uint8_t byteSwap(uint8_t value)     { return value; }
+inline uint16_t byteSwap(uint16_t value)   { return __builtin_bswap16(value); }
+inline uint32_t byteSwap(uint32_t value)   { return __builtin_bswap32(value); }
+inline uint64_t byteSwap(uint64_t value)   { return __builtin_bswap64(value); }
+
+template <typename T>
+inline T toBigEndian(T value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return byteSwap(value);
+#else
+    return value;
+#endif
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value>::type store(uint8_t* output, T value)
+{
+    auto bits = toBigEndian(static_cast<typename std::make_unsigned<T>::type>(value));
+    memcpy(output, &bits, sizeof(bits));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value>::type load(const uint8_t* input, T& value)
+{
+    typename std::make_unsigned<T>::type bits;
+    memcpy(&bits, input, sizeof(bits));
+    value = static_cast<T>(toBigEndian(bits));
+}
+
+template <size_t N>
+inline void store(uint8_t* output, const char (&value)[N])
+{
+    memcpy(output, value, N);
+}
+
+template <size_t N>
+inline void load(const uint8_t* input, char (&value)[N])
+{
+    memcpy(value, input, N);
+}
+
+template <typename Message, typename T, T Message::*Member>
+struct Field
+{
+    static constexpr size_t Size = sizeof(T);
+
+    static void encode(const Message& message, uint8_t* output)
+    {
+        store(output, message.*Member);
+    }
+
+    static void decode(const uint8_t* input, Message& message)
+    {
+        load(input, message.*Member);
+    }
+
+    // The field of every message in one loop, the iterations are independent so the
+    // compiler can unroll and vectorize the byte swapping
+    static void encodeArray(const Message* messages, size_t count, uint8_t* output, size_t stride)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            store(output + i * stride, messages[i].*Member);
+        }
+    }
+};
+
+template <typename Message, typename T, T Message::*Member>
+constexpr size_t Field<Message, T, Member>::Size;
+
+template <typename... Fields>
+struct Layout;
+
+template <>
+struct Layout<>
+{
+    static constexpr size_t Size = 0;
+
+    template <typename Message>
+    static void encode(const Message&, uint8_t*)
+    {
+    }
+
+    template <typename Message>
+    static void decode(const uint8_t*, Message&)
+    {
+    }
+
+    template <typename Message>
+    static void encodeArray(const Message*, size_t, uint8_t*, size_t)
+    {
+    }
+};
+
+template <typename First, typename... Rest>
+struct Layout<First, Rest...>
+{
+    static constexpr size_t Size = First::Size + Layout<Rest...>::Size;
+
+    template <typename Message>
+    static void encode(const Message& message, uint8_t* output)
+    {
+        First::encode(message, output);
+        Layout<Rest...>::encode(message, output + First::Size);
+    }
+
+    template <typename Message>
+    static void decode(const uint8_t* input, Message& message)
+    {
+        First::decode(input, message);
+        Layout<Rest...>::decode(input + First::Size, message);
+    }
+
+    template <typename Message>
+    static void encodeArray(const Message* messages, size_t count, uint8_t* output, size_t stride)
+    {
+        First::encodeArray(messages, count, output, stride);
+        Layout<Rest...>::encodeArray(messages, count, output + First::Size, stride);
+    }
+};
+
+template <typename First, typename... Rest>
+constexpr size_t Layout<First, Rest...>::Size;
+
+#define WIRE_FIELD(Message, member) wire::Field<Message, decltype(Message::member), &Message::member>
+
+// Number of bytes of the message on the wire
+template <typename Message>
+constexpr size_t size()
+{
+    return Message::Layout::Size;
+}
+
+// Returns the end of the encoded message
+template <typename Message>
+uint8_t* encode(const Message& message, uint8_t* output)
+{
+    Message::Layout::encode(message, output);
+    return output + Message::Layout::Size;
+}
+
+// Returns the end of the decoded message, the input has to hold size<Message>() bytes
+template <typename Message>
+const uint8_t* decode(const uint8_t* input, Message& message)
+{
+    Message::Layout::decode(input, message);
+    return input + Message::Layout::Size;
+}
+
+// Encodes the messages back to back, field by field instead of message by message
+template <typename Message>
+uint8_t* encodeArray(const Message* messages, size_t count, uint8_t* output)
+{
+    Message::Layout::encodeArray(messages, count, output, Message::Layout::Size);
+    return output + count * Message::Layout::Size;
+}
+
+template <typename Message>
+void append(std::vector<uint8_t>& output, const Message& message)
+{
+    auto offset = output.size();
+    output.resize(offset + Message::Layout::Size);
+    encode(message, output.data() + offset);
+}
+
+}
+
+#endif
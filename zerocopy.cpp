@@ -0,0 +1,134 @@
+#include "zerocopy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#include "utils/stringops.h"
+
+using namespace utils;
+
+namespace zerocopy
+{
+
+static bool isUnsupportedError(int error)
+{
+    return error == EINVAL || error == ENOSYS || error == ENOTSOCK || error == EOPNOTSUPP;
+}
+
+static bool isWouldBlockError(int error)
+{
+    return error == EAGAIN || error == EWOULDBLOCK || error == EBUSY;
+}
+
+// Performs a single sendfile call, returns the errno value of the call (0 on success)
+#if defined(__linux__)
+
+static int sendSome(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count, uint64_t& sent)
+{
+    // sendfile transfers at most 0x7ffff000 bytes per call
+    off_t fileOffset = offset;
+    ssize_t result = ::sendfile(socketFd, fileFd, &fileOffset, static_cast<size_t>(std::min<uint64_t>(count, 0x7ffff000)));
+    sent = result > 0 ? result : 0;
+    return result < 0 ? errno : 0;
+}
+
+#elif defined(__FreeBSD__)
+
+static int sendSome(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count, uint64_t& sent)
+{
+    off_t bytesSent = 0;
+    int result = ::sendfile(fileFd, socketFd, offset, count, nullptr, &bytesSent, 0);
+    sent = bytesSent;
+    return result < 0 ? errno : 0;
+}
+
+#elif defined(__APPLE__)
+
+static int sendSome(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count, uint64_t& sent)
+{
+    off_t length = count;
+    int result = ::sendfile(fileFd, socketFd, offset, &length, nullptr, 0);
+    sent = length;
+    return result < 0 ? errno : 0;
+}
+
+#else
+
+static int sendSome(int32_t, int32_t, uint64_t, uint64_t, uint64_t& sent)
+{
+    sent = 0;
+    return ENOSYS;
+}
+
+#endif
+
+int64_t trySendFile(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count)
+{
+    uint64_t sent = 0;
+
+    while (sent < count)
+    {
+        uint64_t bytesSent = 0;
+        int error = sendSome(socketFd, fileFd, offset + sent, count - sent, bytesSent);
+        sent += bytesSent;
+
+        if (error == 0 && bytesSent == 0)
+        {
+            throw std::logic_error("File is not ok for reading");
+        }
+
+        if (error == 0 || error == EINTR)
+        {
+            continue;
+        }
+
+        if (isWouldBlockError(error))
+        {
+            break;
+        }
+
+        if (sent == 0 && isUnsupportedError(error))
+        {
+            return -1;
+        }
+
+        throw std::runtime_error(stringops::format("Failed to send file data: %s", strerror(error)));
+    }
+
+    return sent;
+}
+
+bool sendFile(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count)
+{
+    uint64_t sent = 0;
+
+    while (sent < count)
+    {
+        auto result = trySendFile(socketFd, fileFd, offset + sent, count - sent);
+        if (result < 0 && sent == 0)
+        {
+            return false;
+        }
+
+        if (result <= 0)
+        {
+            // a blocking socket only reports would block when its send timeout expired
+            throw std::runtime_error("Failed to send file data: timeout");
+        }
+
+        sent += result;
+    }
+
+    return true;
+}
+
+}
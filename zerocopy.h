@@ -0,0 +1,22 @@
+#ifndef ZERO_COPY_H
+#define ZERO_COPY_H
+
+#include <cinttypes>
+
+namespace zerocopy
+{
+
+// Transfers count bytes starting at offset from the file straight to the socket
+// without passing through user space.
+// Returns false if the platform or the descriptor pair does not support it, nothing
+// has been sent in that case and the caller should fall back to buffered io.
+bool sendFile(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count);
+
+// Sends as much as the socket accepts without blocking.
+// Returns the number of bytes sent (0 if the socket would block) or -1 if zero-copy
+// is not supported for the descriptor pair.
+int64_t trySendFile(int32_t socketFd, int32_t fileFd, uint64_t offset, uint64_t count);
+
+}
+
+#endif